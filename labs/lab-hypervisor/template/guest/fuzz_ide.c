@@ -0,0 +1,45 @@
+#include <stdint.h>
+#include "pmio.h"
+#include "snapshot.h"
+#include "ide.h"
+
+// Each 2 bytes of the input are an access to a register of the primary IDE
+// channel: the first byte has the register in bits 0-2 and the access in bits
+// 6-7, the second one is the value written
+#define ACCESS_INB 0
+#define ACCESS_OUTB 1
+#define ACCESS_OUTW 2
+#define ACCESS_OUTD 3
+
+static uint8_t input[4096];
+
+// Fuzzes the IDE channel's state machine (vmm -iterations): every iteration
+// makes the register accesses of its input.
+void guest_main()
+{
+    int length = snapshot_take(input, sizeof(input));
+
+    for (int i = 0; i + 1 < length; i += 2)
+    {
+        uint16_t port = IDE_PRIMARY_BASE + (input[i] & 7);
+        uint8_t value = input[i + 1];
+
+        switch (input[i] >> 6)
+        {
+        case ACCESS_INB:
+            inb(port);
+            break;
+        case ACCESS_OUTB:
+            outb(port, value);
+            break;
+        case ACCESS_OUTW:
+            outw(port, value | value << 8);
+            break;
+        case ACCESS_OUTD:
+            outd(port, value * 0x01010101);
+            break;
+        }
+    }
+
+    snapshot_done(0);
+}
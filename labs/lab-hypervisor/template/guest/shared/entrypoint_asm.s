@@ -1,6 +1,9 @@
 CODE_SELECTOR  equ  0x08
 DATA_SELECTOR  equ  0x10
 
+BOOT_MAGIC           equ  0x424D4D56  ; see shared/boot.h
+BOOT_FLAG_PROTECTED  equ  0x1
+
 extern guest_main
 
 section .entrypoint
@@ -24,7 +27,43 @@ mov     ds,ax
 mov     ss,ax
 mov     es,ax
 
+protected_entry:             ; with -boot protected, the VMM starts here, with the same GDT and segments
+
+; enable SSE, and AVX (and AVX-512) when the vCPU has them, so that guest code can use vector instructions
+mov     eax,cr0
+and     eax,~(1 << 2)        ; clear EM: the x87 FPU isn't emulated
+or      eax,1 << 1           ; set MP: monitor the coprocessor
+mov     cr0,eax
+mov     eax,cr4
+or      eax,3 << 9           ; set OSFXSR and OSXMMEXCPT: SSE instructions and exceptions are supported
+mov     cr4,eax
+
+mov     eax,1
+cpuid
+test    ecx,1 << 26          ; XSAVE?
+jz      vector_done
+mov     eax,cr4
+or      eax,1 << 18          ; set OSXSAVE: XCR0 says which state components are enabled
+mov     cr4,eax
+mov     esi,3                ; x87 and SSE state
+test    ecx,1 << 28          ; AVX?
+jz      set_xcr0
+or      esi,1 << 2           ; AVX state
+mov     eax,7
+xor     ecx,ecx
+cpuid
+test    ebx,1 << 16          ; AVX-512F?
+jz      set_xcr0
+or      esi,7 << 5           ; opmask, ZMM_Hi256 and Hi16_ZMM states
+set_xcr0:
+mov     eax,esi
+xor     ecx,ecx              ; XCR0
+xor     edx,edx
+xsetbv
+vector_done:
+
 call    guest_main           ; call guest C code entrypoint
+out     0xF4,al              ; tell the VMM we are done (hlt doesn't exit with an in-kernel irqchip)
 hlt                          ; halt the CPU
 
 ; Setup a GDT table to identity map the full 4GB address space (32 bits)
@@ -71,3 +110,11 @@ gdt_end:
 gdt_descriptor:                  ; descriptor pointing to the GDT (required by the lgdt instruction)
     dw gdt_end - gdt_start - 1   ; GDT size minus 1
     dd gdt_start                 ; address of the GDT table
+
+align 4
+boot_header:                     ; lets the VMM start the guest directly at protected_entry
+        dd BOOT_MAGIC
+        dd BOOT_FLAG_PROTECTED       ; no long mode entry point
+        dd -(BOOT_MAGIC + BOOT_FLAG_PROTECTED)
+        dd protected_entry
+        dq 0
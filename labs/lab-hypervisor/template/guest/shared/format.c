@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include "format.h"
+
+typedef struct output
+{
+    char *buf;
+    size_t size;
+    size_t len;
+} output_t;
+
+static void put(output_t *out, char c)
+{
+    if (out->len + 1 < out->size)
+        out->buf[out->len] = c;
+    out->len++;
+}
+
+// Divides *n by 10 and returns the remainder, with two 32-bit divl: 64-bit
+// divisions would need libgcc
+static uint32_t div10(uint64_t *n)
+{
+    uint32_t hi = *n >> 32, lo = (uint32_t)*n, rem;
+
+    uint32_t qhi = hi / 10;
+    hi %= 10;
+    __asm__("divl %4" : "=a"(lo), "=d"(rem) : "a"(lo), "d"(hi), "rm"(10));
+    *n = (uint64_t)qhi << 32 | lo;
+    return rem;
+}
+
+static void put_number(output_t *out, uint64_t n, int base, int upper, int negative, int width, char pad, int left)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[24];
+    int len = 0;
+
+    do
+    {
+        if (base == 16)
+        {
+            tmp[len++] = digits[n & 15];
+            n >>= 4;
+        }
+        else
+        {
+            tmp[len++] = digits[div10(&n)];
+        }
+    } while (n);
+
+    int padding = width - len - negative;
+
+    if (negative && pad == '0')
+        put(out, '-');
+    for (int i = 0; !left && i < padding; i++)
+        put(out, pad);
+    if (negative && pad != '0')
+        put(out, '-');
+    while (len)
+        put(out, tmp[--len]);
+    for (int i = 0; left && i < padding; i++)
+        put(out, ' ');
+}
+
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
+{
+    output_t out = {.buf = buf, .size = size};
+
+    for (; *fmt; fmt++)
+    {
+        if (*fmt != '%')
+        {
+            put(&out, *fmt);
+            continue;
+        }
+
+        int left = 0, width = 0, longs = 0;
+        char pad = ' ';
+
+        for (fmt++; *fmt == '0' || *fmt == '-'; fmt++)
+        {
+            if (*fmt == '0')
+                pad = '0';
+            else
+                left = 1;
+        }
+        for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+            width = width * 10 + *fmt - '0';
+        for (; *fmt == 'l' || *fmt == 'z'; fmt++)
+            longs += *fmt == 'l' ? 1 : 0;
+        if (left)
+            pad = ' ';
+
+        uint64_t n;
+        int64_t i;
+
+        switch (*fmt)
+        {
+        case 'd':
+        case 'i':
+            i = longs > 1 ? va_arg(args, int64_t) : va_arg(args, int32_t);
+            put_number(&out, i < 0 ? -(uint64_t)i : (uint64_t)i, 10, 0, i < 0, width, pad, left);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+            n = longs > 1 ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+            put_number(&out, n, *fmt == 'u' ? 10 : 16, *fmt == 'X', 0, width, pad, left);
+            break;
+        case 'p':
+            put(&out, '0');
+            put(&out, 'x');
+            put_number(&out, (uintptr_t)va_arg(args, void *), 16, 0, 0, 8, '0', 0);
+            break;
+        case 'c':
+            put(&out, (char)va_arg(args, int));
+            break;
+        case 's':
+        {
+            const char *s = va_arg(args, const char *);
+            int len = 0;
+            while (s[len])
+                len++;
+            for (int k = len; !left && k < width; k++)
+                put(&out, ' ');
+            for (int k = 0; k < len; k++)
+                put(&out, s[k]);
+            for (int k = len; left && k < width; k++)
+                put(&out, ' ');
+            break;
+        }
+        case '%':
+            put(&out, '%');
+            break;
+        default: // unknown conversion, or a % at the end
+            put(&out, '%');
+            if (!*fmt)
+                fmt--;
+            else
+                put(&out, *fmt);
+        }
+    }
+
+    if (size)
+        buf[out.len < size ? out.len : size - 1] = '\0';
+    return out.len;
+}
+
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return len;
+}
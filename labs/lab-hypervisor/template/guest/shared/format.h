@@ -0,0 +1,13 @@
+#ifndef _FORMAT_H_
+#define _FORMAT_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// printf-style formatting into a buffer, always null-terminated. Supports
+// %d %i %u %x %X %p %s %c %%, the 0 and - flags, a width, and the l, ll and z
+// length modifiers. Returns the length of the output, as if it was not truncated.
+extern int vsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+extern int snprintf(char *buf, size_t size, const char *fmt, ...);
+
+#endif
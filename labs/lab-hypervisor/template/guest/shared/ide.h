@@ -3,6 +3,12 @@
 
 #include "../../shared/ide.h"
 
+// Select the IDE channel used by the *_emul functions: 0 (primary) or 1.
+extern void ide_select_channel(int channel);
+
+// Select the queue used by the *_pv functions.
+extern void ide_select_queue_pv(int queue);
+
 // Write a sector.
 // Real hardware emulated version.
 extern void ide_write_sector_emul(int sector_idx, void *src);
@@ -11,4 +17,24 @@ extern void ide_write_sector_emul(int sector_idx, void *src);
 // Paravirtualized version.
 extern void ide_write_sector_pv(int sector_idx, void *src);
 
+// Read a sector, returns 0 on success.
+// Paravirtualized version.
+extern int ide_read_sector_pv(int sector_idx, void *dst);
+
+// Flush the disk's write cache.
+// Real hardware emulated version.
+extern void ide_flush_emul();
+
+// Flush the disk's write cache.
+// Paravirtualized version.
+extern void ide_flush_pv();
+
+// Tell the disk a range of sectors is no longer used (TRIM).
+// Real hardware emulated version.
+extern void ide_discard_emul(int sector_idx, int sector_count);
+
+// Tell the disk a range of sectors is no longer used.
+// Paravirtualized version.
+extern void ide_discard_pv(int sector_idx, int sector_count);
+
 #endif
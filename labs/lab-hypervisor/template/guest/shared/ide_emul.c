@@ -2,8 +2,17 @@
 #include "ide.h"
 #include "pmio.h"
 
-#define STATUS_PORT 0x1F7
-#define DATA_PORT 0x1F0
+// Base port of the channel the functions below use
+static uint16_t base = IDE_PRIMARY_BASE;
+
+/**
+ * Select the IDE channel the other functions use.
+ * @param channel 0 for the primary channel (the default), 1 for the secondary one.
+ */
+void ide_select_channel(int channel)
+{
+    base = channel ? IDE_SECONDARY_BASE : IDE_PRIMARY_BASE;
+}
 
 /**
  * Write a sector.
@@ -12,23 +21,73 @@
  */
 void ide_write_sector_emul(int sector_idx, void *src)
 {
-    while ((inb(STATUS_PORT) & 0xC0) != 0x40)
+    while ((inb(base + ATA_REG_STATUS) & 0xC0) != 0x40)
         ; // wait for drive to be ready
 
-    outb(0x1F2, 1);                                  // write 1 sector
-    outb(0x1F3, sector_idx & 0xFF);                  // send bits 0-7 of LBA
-    outb(0x1F4, (sector_idx >> 8) & 0xFF);           // send bits 8-15 of LBA
-    outb(0x1F5, (sector_idx >> 16) & 0xFF);          // send bits 16-23 of LBA
-    outb(0x1F6, ((sector_idx >> 24) & 0x0F) | 0xE0); // send bits 24-27 of LBA + set LBA mode
+    outb(base + ATA_REG_COUNT, 1);                                   // write 1 sector
+    outb(base + ATA_REG_LBA0, sector_idx & 0xFF);                    // send bits 0-7 of LBA
+    outb(base + ATA_REG_LBA1, (sector_idx >> 8) & 0xFF);             // send bits 8-15 of LBA
+    outb(base + ATA_REG_LBA2, (sector_idx >> 16) & 0xFF);            // send bits 16-23 of LBA
+    outb(base + ATA_REG_DEVICE, ((sector_idx >> 24) & 0x0F) | 0xE0); // send bits 24-27 of LBA + set LBA mode
 
-    outb(STATUS_PORT, 0x30); // write with retry
-    while ((inb(STATUS_PORT) & 0xC0) != 0x40)
+    outb(base + ATA_REG_STATUS, 0x30); // write with retry
+    while ((inb(base + ATA_REG_STATUS) & 0xC0) != 0x40)
         ; // wait for drive to be ready
 
     uint16_t *data = (uint16_t *)src;
     for (int i = 0; i < SECTOR_SIZE / 2; i++)
     { // write sector
-        outw(DATA_PORT, *data);
+        outw(base + ATA_REG_DATA, *data);
         data++;
     }
 }
+
+/**
+ * Flush the disk's write cache (ATA FLUSH CACHE).
+ */
+void ide_flush_emul()
+{
+    while ((inb(base + ATA_REG_STATUS) & 0xC0) != 0x40)
+        ; // wait for drive to be ready
+
+    outb(base + ATA_REG_STATUS, ATA_CMD_FLUSH_CACHE);
+    while ((inb(base + ATA_REG_STATUS) & 0xC0) != 0x40)
+        ; // wait for the flush to complete
+}
+
+/**
+ * Discard sectors with ATA DATA SET MANAGEMENT (TRIM).
+ * @param sector_idx first sector to discard (0-indexed).
+ * @param sector_count number of sectors to discard (at most 65535).
+ */
+void ide_discard_emul(int sector_idx, int sector_count)
+{
+    // One range entry: 48-bit LBA + 16-bit count, the rest of the block is unused
+    uint16_t range[SECTOR_SIZE / 2];
+    for (int i = 0; i < SECTOR_SIZE / 2; i++)
+    {
+        range[i] = 0;
+    }
+    range[0] = sector_idx & 0xFFFF;
+    range[1] = (sector_idx >> 16) & 0xFFFF;
+    range[3] = sector_count & 0xFFFF;
+
+    while ((inb(base + ATA_REG_STATUS) & 0xC0) != 0x40)
+        ; // wait for drive to be ready
+
+    outb(base + ATA_REG_FEATURES, ATA_DSM_TRIM);
+    outb(base + ATA_REG_COUNT, 1); // 1 block of range entries
+    outb(base + ATA_REG_LBA0, 0);
+    outb(base + ATA_REG_LBA1, 0);
+    outb(base + ATA_REG_LBA2, 0);
+    outb(base + ATA_REG_DEVICE, 0xE0); // LBA mode
+
+    outb(base + ATA_REG_STATUS, ATA_CMD_DATA_SET_MANAGEMENT);
+    while ((inb(base + ATA_REG_STATUS) & 0xC0) != 0x40)
+        ; // wait for drive to be ready
+
+    for (int i = 0; i < SECTOR_SIZE / 2; i++)
+    { // send the range entries
+        outw(base + ATA_REG_DATA, range[i]);
+    }
+}
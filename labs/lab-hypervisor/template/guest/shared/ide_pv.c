@@ -1,10 +1,69 @@
 #include <stdint.h>
-#include <string.h>
 
 #include "ide.h"
 #include "pmio.h"
 #include "../../shared/ide_pv.h"
 
+// Queue the functions below use
+static int queue;
+
+/**
+ * Select the paravirtualized queue the other functions use.
+ * @param q queue number, 0 (the default) to HYPERCALL_MAX_QUEUES - 1.
+ */
+void ide_select_queue_pv(int q)
+{
+    queue = q;
+}
+
+// Request through the ring of a polled queue, see pv_ring_t. Waits for the
+// request to be done, since the VMM accesses the caller's buffer.
+static int ring_request_pv(volatile pv_ring_t *ring, int op, int sector_idx, int sector_count, void *buf)
+{
+    uint32_t idx = ring->producer;
+
+    while (idx - ring->consumer >= PV_RING_SIZE)
+        __asm__ volatile("pause");
+
+    volatile pv_request_t *req = &ring->requests[idx % PV_RING_SIZE];
+    req->op = op;
+    req->sector_idx = sector_idx;
+    req->sector_count = sector_count;
+    req->gpa = (uint32_t)buf;
+
+    ring->producer = idx + 1;
+    // The poller may have gone to sleep before seeing the request
+    __asm__ volatile("mfence" ::: "memory");
+    if (ring->poller_sleeping)
+    {
+        outb(HYPERCALL_QUEUE_PORT(queue), HYPERCALL_DOORBELL);
+    }
+
+    while ((int32_t)(ring->consumer - idx) <= 0)
+        __asm__ volatile("pause");
+
+    return req->status;
+}
+
+// Zero-copy request: the VMM accesses the buffer itself (guest addresses are
+// physical ones). Without a polled ring, it is a register hypercall.
+static int request_pv(int op, int sector_idx, int sector_count, void *buf)
+{
+    volatile pv_ring_t *ring = (pv_ring_t *)(HYPERCALL_QUEUE_ADDR(queue) + PV_RING_OFFSET);
+    if (ring->enabled)
+    {
+        return ring_request_pv(ring, op, sector_idx, sector_count, buf);
+    }
+
+    int status;
+    __asm__ volatile("outl %%eax, %1"
+                     : "=a"(status)
+                     : "N"(HYPERCALL_REG_PORT), "a"(HYPERCALL_REG_OP(op, queue)), "b"(sector_idx), "c"(sector_count),
+                       "d"(buf)
+                     : "memory");
+    return status;
+}
+
 /**
  * Write a sector using paravirtualization.
  * @param sector_idx sector to write (0-indexed).
@@ -12,14 +71,34 @@
  */
 void ide_write_sector_pv(int sector_idx, void *src)
 {
-    hypercall_t *addr = (hypercall_t *)HYPERCALL_ADDR;
-    addr->sector_idx = sector_idx;
+    request_pv(HYPERCALL_WRITE, sector_idx, 1, src);
+}
 
-    char *data = (char *)src;
-    for (int i = 0; i < SECTOR_SIZE; i++)
-    {
-        addr->data[i] = (char)data[i];
-    }
+/**
+ * Read a sector using paravirtualization.
+ * @param sector_idx sector to read (0-indexed).
+ * @param dst where to store the sector's data.
+ * @return 0 on success, -1 on failure.
+ */
+int ide_read_sector_pv(int sector_idx, void *dst)
+{
+    return request_pv(HYPERCALL_READ, sector_idx, 1, dst);
+}
 
-    outb(HYPERCALL_PORT, HYPERCALL_MAGIC);
+/**
+ * Flush the disk's write cache using paravirtualization.
+ */
+void ide_flush_pv()
+{
+    request_pv(HYPERCALL_FLUSH, 0, 0, 0);
+}
+
+/**
+ * Discard sectors using paravirtualization.
+ * @param sector_idx first sector to discard (0-indexed).
+ * @param sector_count number of sectors to discard.
+ */
+void ide_discard_pv(int sector_idx, int sector_count)
+{
+    request_pv(HYPERCALL_DISCARD, sector_idx, sector_count, 0);
 }
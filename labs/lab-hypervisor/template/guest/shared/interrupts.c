@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include "interrupts.h"
+#include "pmio.h"
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI 0x20
+#define PIC_CASCADE_IRQ 2
+
+#define CODE_SELECTOR 0x08 // see entrypoint_asm.s
+#define INTERRUPT_GATE 0x8E // present, ring 0, 32-bit interrupt gate
+
+typedef struct idt_entry
+{
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type;
+    uint16_t offset_high;
+} __attribute__((packed)) idt_entry_t;
+
+typedef struct idt_descriptor
+{
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) idt_descriptor_t;
+
+extern const uint32_t irq_stubs[IRQ_COUNT]; // interrupts_asm.s
+
+static idt_entry_t idt[IRQ_BASE_VECTOR + IRQ_COUNT] __attribute__((aligned(8)));
+static irq_handler_t handlers[IRQ_COUNT];
+
+// Called by interrupts_asm.s
+void irq_handler(int irq)
+{
+    if (handlers[irq])
+        handlers[irq](irq);
+
+    if (irq >= 8)
+        outb(PIC2_COMMAND, PIC_EOI);
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+/**
+ * Load the IDT and remap the PICs: IRQs 0 to 15 are vectors IRQ_BASE_VECTOR
+ * to IRQ_BASE_VECTOR + 15, masked until an handler is installed.
+ */
+void interrupts_init()
+{
+    for (int i = 0; i < IRQ_COUNT; i++)
+    {
+        idt_entry_t *entry = &idt[IRQ_BASE_VECTOR + i];
+        entry->offset_low = irq_stubs[i] & 0xFFFF;
+        entry->offset_high = irq_stubs[i] >> 16;
+        entry->selector = CODE_SELECTOR;
+        entry->type = INTERRUPT_GATE;
+    }
+
+    idt_descriptor_t descriptor = {.limit = sizeof(idt) - 1, .base = (uint32_t)idt};
+    __asm__ volatile("lidt %0" : : "m"(descriptor));
+
+    // ICW1: initialization, ICW4 follows; ICW2: vector base; ICW3: cascade
+    // on IRQ 2; ICW4: 8086 mode
+    outb(PIC1_COMMAND, 0x11);
+    outb(PIC2_COMMAND, 0x11);
+    outb(PIC1_DATA, IRQ_BASE_VECTOR);
+    outb(PIC2_DATA, IRQ_BASE_VECTOR + 8);
+    outb(PIC1_DATA, 1 << PIC_CASCADE_IRQ);
+    outb(PIC2_DATA, PIC_CASCADE_IRQ);
+    outb(PIC1_DATA, 0x01);
+    outb(PIC2_DATA, 0x01);
+
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
+
+/**
+ * Install an IRQ's handler and unmask the IRQ.
+ * @param irq IRQ number, 0 to 15.
+ * @param handler called for each interrupt, with the IRQ number.
+ */
+void irq_install(int irq, irq_handler_t handler)
+{
+    handlers[irq] = handler;
+
+    if (irq >= 8)
+    {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = PIC_CASCADE_IRQ;
+    }
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+void enable_interrupts()
+{
+    __asm__ volatile("sti" ::: "memory");
+}
+
+void disable_interrupts()
+{
+    __asm__ volatile("cli" ::: "memory");
+}
+
+// sti only takes effect after the next instruction: an interrupt can't come in
+// between and leave hlt waiting for another one
+void wait_for_interrupt()
+{
+    __asm__ volatile("sti\n\thlt" ::: "memory");
+}
@@ -0,0 +1,23 @@
+#ifndef _INTERRUPTS_H_
+#define _INTERRUPTS_H_
+
+#define IRQ_COUNT 16
+#define IRQ_BASE_VECTOR 0x20 // IRQs are remapped above the CPU exceptions
+
+typedef void (*irq_handler_t)(int irq);
+
+// Load an IDT for the 16 IRQs and remap the PICs, all IRQs masked.
+// Interrupts stay disabled until enable_interrupts().
+extern void interrupts_init();
+
+// Unmask an IRQ, which then calls handler (the PIC is acknowledged for it).
+extern void irq_install(int irq, irq_handler_t handler);
+
+extern void enable_interrupts();
+extern void disable_interrupts();
+
+// Sleep until an interrupt came, without any VM exit: the in-kernel irqchip
+// wakes the vCPU up. Interrupts are enabled.
+extern void wait_for_interrupt();
+
+#endif
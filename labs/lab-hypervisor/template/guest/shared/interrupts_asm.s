@@ -0,0 +1,47 @@
+global irq_stubs
+
+extern irq_handler
+
+section .text                      ; start of the text (code) section
+align 4                            ; the code must be 4 byte aligned
+
+; Entry points of IRQs 0 to 15: push the IRQ number and go to irq_common
+%macro IRQ_STUB 1
+irq_stub_%1:
+    push    dword %1
+    jmp     irq_common
+%endmacro
+
+%assign irq 0
+%rep 16
+IRQ_STUB irq
+%assign irq irq + 1
+%endrep
+
+; Calls irq_handler(irq) with every register saved, the SSE ones included:
+; guest code is compiled with SSE, the handlers too.
+irq_common:
+    pushad
+    cld                            ; the C calling convention expects DF clear
+    mov     ebp,esp
+    sub     esp,512
+    and     esp,~15                ; fxsave needs a 16-byte aligned area
+    fxsave  [esp]
+    sub     esp,12                 ; keep the stack 16-byte aligned for the call
+    push    dword [ebp+32]         ; IRQ number, pushed by the stub before pushad
+    call    irq_handler
+    add     esp,16
+    fxrstor [esp]
+    mov     esp,ebp
+    popad
+    add     esp,4                  ; IRQ number
+    iret
+
+section .rodata
+align 4
+irq_stubs:                         ; addresses of the 16 stubs, for the IDT
+%assign irq 0
+%rep 16
+    dd      irq_stub_ %+ irq
+%assign irq irq + 1
+%endrep
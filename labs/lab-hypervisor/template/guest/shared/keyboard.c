@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include "interrupts.h"
+#include "keyboard.h"
+#include "pmio.h"
+
+#define QUEUE_SIZE 64
+
+// Filled by the interrupt handler, emptied with interrupts disabled
+static volatile uint8_t queue[QUEUE_SIZE];
+static volatile uint32_t head;
+static volatile uint32_t tail;
+
+static void keyboard_irq(int irq)
+{
+    (void)irq;
+
+    while (inb(PS2_STATUS_PORT) & PS2_STATUS_OBF)
+    {
+        uint8_t scancode = inb(PS2_DATA_PORT);
+        if (tail - head < QUEUE_SIZE)
+        {
+            queue[tail % QUEUE_SIZE] = scancode;
+            tail++;
+        }
+    }
+}
+
+/**
+ * Enable the keyboard and its interrupt, after dropping what it sent so far.
+ */
+void keyboard_init()
+{
+    outb(PS2_STATUS_PORT, PS2_CMD_READ_CONFIG);
+    uint8_t config = inb(PS2_DATA_PORT);
+
+    outb(PS2_STATUS_PORT, PS2_CMD_WRITE_CONFIG);
+    outb(PS2_DATA_PORT, (config | PS2_CONFIG_KEYBOARD_IRQ | PS2_CONFIG_TRANSLATE) & ~PS2_CONFIG_KEYBOARD_DISABLED);
+
+    while (inb(PS2_STATUS_PORT) & PS2_STATUS_OBF)
+        inb(PS2_DATA_PORT);
+
+    irq_install(PS2_KEYBOARD_IRQ, keyboard_irq);
+}
+
+/**
+ * Get the next scancode byte the keyboard sent.
+ * @return the byte, or -1 if there is none.
+ */
+int keyboard_get_scancode()
+{
+    int scancode = -1;
+
+    disable_interrupts();
+    if (head != tail)
+    {
+        scancode = queue[head % QUEUE_SIZE];
+        head++;
+    }
+    enable_interrupts();
+
+    return scancode;
+}
+
+/**
+ * Wait for the next scancode byte. The vCPU sleeps in the kernel until the
+ * keyboard interrupt: no polling of the controller.
+ * @return the byte.
+ */
+int keyboard_wait_scancode()
+{
+    for (;;)
+    {
+        disable_interrupts();
+        if (head != tail)
+        {
+            int scancode = queue[head % QUEUE_SIZE];
+            head++;
+            enable_interrupts();
+            return scancode;
+        }
+        wait_for_interrupt(); // enables interrupts, atomically with sleeping
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef _KEYBOARD_H_
+#define _KEYBOARD_H_
+
+#include "../../shared/ps2.h"
+
+// Set the PS/2 keyboard up, with its interrupt: scancodes are queued by the
+// IRQ1 handler. Needs interrupts_init().
+extern void keyboard_init();
+
+// Next scancode byte (set 1), or -1 if none was received.
+extern int keyboard_get_scancode();
+
+// Wait for the next scancode byte, asleep until the keyboard interrupt.
+extern int keyboard_wait_scancode();
+
+#endif
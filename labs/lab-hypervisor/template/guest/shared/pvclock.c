@@ -0,0 +1,61 @@
+#include <stdint.h>
+#include "pvclock.h"
+
+#define barrier() __asm__ volatile("" ::: "memory")
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Computes (delta * mul) >> 32 without needing a 128-bit product.
+static uint64_t scale_delta(uint64_t delta, uint32_t mul)
+{
+    uint64_t lo = ((delta & 0xFFFFFFFF) * mul) >> 32;
+    uint64_t hi = (delta >> 32) * mul;
+    return lo + hi;
+}
+
+/**
+ * Read the paravirtual clock.
+ * The host bumps version to an odd value while updating the page, so retry
+ * until a stable, even version was observed on both sides of the read.
+ * @return nanoseconds since the VM was created.
+ */
+uint64_t pvclock_ns()
+{
+    volatile pvclock_t *clock = (pvclock_t *)PVCLOCK_ADDR;
+    uint32_t version;
+    uint64_t ns;
+
+    do
+    {
+        version = clock->version;
+        barrier();
+
+        uint64_t delta = rdtsc() - clock->tsc_timestamp;
+        int8_t shift = clock->tsc_shift;
+        if (shift < 0)
+            delta >>= -shift;
+        else
+            delta <<= shift;
+
+        ns = clock->system_time + scale_delta(delta, clock->tsc_to_system_mul);
+        barrier();
+    } while ((version & 1) || version != clock->version);
+
+    return ns;
+}
+
+/**
+ * Busy-wait without leaving the guest.
+ * @param ns number of nanoseconds to wait.
+ */
+void pvclock_delay_ns(uint64_t ns)
+{
+    uint64_t end = pvclock_ns() + ns;
+    while (pvclock_ns() < end)
+        ;
+}
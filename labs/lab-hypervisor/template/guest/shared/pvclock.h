@@ -0,0 +1,17 @@
+#ifndef _PVCLOCK_H_
+#define _PVCLOCK_H_
+
+#include <stdint.h>
+#include "../../shared/pvclock.h"
+
+// Read the time stamp counter.
+extern uint64_t rdtsc();
+
+// Nanoseconds elapsed since the VM was created, read from the kvmclock page.
+// Does not cause any VM exit.
+extern uint64_t pvclock_ns();
+
+// Busy-wait for the given number of nanoseconds.
+extern void pvclock_delay_ns(uint64_t ns);
+
+#endif
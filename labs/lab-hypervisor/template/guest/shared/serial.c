@@ -0,0 +1,80 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include "format.h"
+#include "pmio.h"
+#include "serial.h"
+
+#define COM1(reg) (SERIAL_COM1_BASE + (reg))
+
+/**
+ * Set COM1 up: 115200 baud, 8 data bits, no parity, 1 stop bit, FIFOs enabled
+ * and cleared, no interrupts.
+ */
+void serial_init()
+{
+    uint16_t divisor = SERIAL_CLOCK / 115200;
+
+    outb(COM1(UART_IER), 0);
+    outb(COM1(UART_LCR), UART_LCR_DLAB);
+    outb(COM1(UART_DLL), divisor & 0xFF);
+    outb(COM1(UART_DLM), divisor >> 8);
+    outb(COM1(UART_LCR), UART_LCR_8N1);
+    outb(COM1(UART_FCR), UART_FCR_ENABLE | UART_FCR_CLEAR_RCVR);
+    outb(COM1(UART_MCR), 0);
+}
+
+/**
+ * Send a character, once the transmit holding register is empty.
+ * @param c character to send.
+ */
+void serial_putc(char c)
+{
+    while (!(inb(COM1(UART_LSR)) & UART_LSR_THRE))
+        ;
+    outb(COM1(UART_THR), c);
+}
+
+/**
+ * Receive a character.
+ * @return the character, or -1 if none was received.
+ */
+int serial_getc()
+{
+    if (!(inb(COM1(UART_LSR)) & UART_LSR_DR))
+        return -1;
+    return inb(COM1(UART_RBR));
+}
+
+/**
+ * Send a buffer with a single hypercall: the VMM reads it from guest memory.
+ * @param buf data to send.
+ * @param length number of bytes to send.
+ * @return the number of bytes sent, or -1 on failure.
+ */
+int serial_write(const void *buf, size_t length)
+{
+    int sent;
+    __asm__ volatile("outl %%eax, %1"
+                     : "=a"(sent)
+                     : "N"(SERIAL_PV_PORT), "a"(0), "b"(buf), "c"(length)
+                     : "memory");
+    return sent;
+}
+
+/**
+ * printf to the serial port, see format.h.
+ * @return the number of bytes sent, or -1 on failure.
+ */
+int serial_printf(const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    return serial_write(buf, len);
+}
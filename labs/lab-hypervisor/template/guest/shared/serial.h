@@ -0,0 +1,23 @@
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+#include <stddef.h>
+#include "../../shared/serial.h"
+
+// Set COM1 up: 115200 baud, 8N1, FIFOs enabled.
+extern void serial_init();
+
+// Send a character through the UART's transmit register.
+extern void serial_putc(char c);
+
+// Receive a character, or -1 if none is available.
+extern int serial_getc();
+
+// Send a whole buffer in a single VM exit (paravirtualized).
+extern int serial_write(const void *buf, size_t length);
+
+// printf to the serial port, sent with serial_write(). Lines longer than
+// 256 characters are truncated.
+extern int serial_printf(const char *fmt, ...);
+
+#endif
@@ -0,0 +1,26 @@
+#include "snapshot.h"
+
+/**
+ * Snapshot the VM, see SNAPSHOT_PORT.
+ * @param buf where the VMM puts each iteration's input.
+ * @param size size of buf.
+ * @return the length of the input.
+ */
+int snapshot_take(void *buf, size_t size)
+{
+    int length;
+    __asm__ volatile("outl %%eax, %1"
+                     : "=a"(length)
+                     : "N"(SNAPSHOT_PORT), "a"(SNAPSHOT_TAKE), "b"(buf), "c"(size)
+                     : "memory");
+    return length;
+}
+
+/**
+ * End the iteration.
+ * @param result 0 if the guest found nothing wrong.
+ */
+void snapshot_done(int result)
+{
+    __asm__ volatile("outl %%eax, %0" : : "N"(SNAPSHOT_PORT), "a"(SNAPSHOT_DONE), "b"(result) : "memory");
+}
@@ -0,0 +1,15 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stddef.h>
+#include "../../shared/snapshot.h"
+
+// Have the VMM snapshot the VM here (vmm -iterations). Returns once per
+// iteration, with the length of the input the VMM put in buf; 0, once,
+// without -iterations.
+extern int snapshot_take(void *buf, size_t size);
+
+// End the iteration: the VMM resets the VM to the snapshot, with the next input.
+extern void snapshot_done(int result);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include "test_disk.h"
 #include "ide.h"
+#include "utils.h"
 
 void test_write_sect(write_sector_func_t func, int sector_index)
 {
@@ -13,15 +14,29 @@ void test_write_sect(write_sector_func_t func, int sector_index)
     func(sector_index, sector);
 }
 
+static const int test_sectors[] = {307, 71, 511, 17, 147, 31, 219, 0};
+#define TEST_SECTORS (sizeof(test_sectors) / sizeof(test_sectors[0]))
+
 // void test_disk(void (*write_sector)(int sector)) {
 void test_disk(write_sector_func_t func)
 {
-    test_write_sect(func, 307);
-    test_write_sect(func, 71);
-    test_write_sect(func, 511);
-    test_write_sect(func, 17);
-    test_write_sect(func, 147);
-    test_write_sect(func, 31);
-    test_write_sect(func, 219);
-    test_write_sect(func, 0);
+    for (u_int i = 0; i < TEST_SECTORS; i++)
+    {
+        test_write_sect(func, test_sectors[i]);
+    }
+}
+
+// Reads the sectors test_disk() wrote and writes them again: if a read fails
+// or returns wrong data, the disk no longer matches its reference.
+void test_disk_read_back(read_sector_func_t read, write_sector_func_t write)
+{
+    uint8_t sector[SECTOR_SIZE];
+
+    for (u_int i = 0; i < TEST_SECTORS; i++)
+    {
+        memset(sector, 0xFF, SECTOR_SIZE);
+        if (read(test_sectors[i], sector) < 0)
+            memset(sector, 0xFF, SECTOR_SIZE);
+        write(test_sectors[i], sector);
+    }
 }
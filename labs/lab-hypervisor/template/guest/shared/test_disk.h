@@ -2,7 +2,9 @@
 #define _TEST_DISK_H_
 
 typedef void (*write_sector_func_t)(int sector_idx, void *src);
+typedef int (*read_sector_func_t)(int sector_idx, void *dst);
 
 void test_disk(write_sector_func_t func);
+void test_disk_read_back(read_sector_func_t read, write_sector_func_t write);
 
 #endif
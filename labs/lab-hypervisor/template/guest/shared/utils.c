@@ -1,10 +1,165 @@
 #include "utils.h"
 
-void memset(void *dst, uint8_t value, u_int count)
+typedef uint32_t u32_alias __attribute__((may_alias, aligned(1)));
+
+// Below this size, rep's startup cost dominates; above it, fast strings beat SSE
+#define SSE_MIN_SIZE 16
+#define REP_MIN_SIZE 2048
+
+void *memset_rep(void *dst, int value, size_t count)
+{
+    void *d = dst;
+    size_t dwords = count / 4;
+    size_t bytes = count % 4;
+    uint32_t pattern = (uint8_t)value * 0x01010101U;
+
+    __asm__ volatile("rep stosl" : "+D"(d), "+c"(dwords) : "a"(pattern) : "memory");
+    __asm__ volatile("rep stosb" : "+D"(d), "+c"(bytes) : "a"(pattern) : "memory");
+    return dst;
+}
+
+void *memcpy_rep(void *dst, const void *src, size_t count)
 {
+    void *d = dst;
+    size_t dwords = count / 4;
+    size_t bytes = count % 4;
+
+    __asm__ volatile("rep movsl" : "+D"(d), "+S"(src), "+c"(dwords) : : "memory");
+    __asm__ volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(bytes) : : "memory");
+    return dst;
+}
+
+// Compares 4 bytes at a time, and only looks at bytes in the word that differs
+int memcmp_words(const void *a, const void *b, size_t count)
+{
+    const uint8_t *p = a, *q = b;
+
+    for (; count >= 4; p += 4, q += 4, count -= 4)
+    {
+        if (*(const u32_alias *)p != *(const u32_alias *)q)
+            break;
+    }
+
+    for (; count; p++, q++, count--)
+    {
+        if (*p != *q)
+            return *p - *q;
+    }
+
+    return 0;
+}
+
+#ifdef __SSE2__
+typedef char v16 __attribute__((vector_size(16)));
+typedef char v16u __attribute__((vector_size(16), aligned(1), may_alias)); // unaligned
+
+// Stores from the first 16-byte boundary of dst are aligned: one unaligned
+// store covers the head, and another one, overlapping, the tail.
+void *memset_sse(void *dst, int value, size_t count)
+{
+    if (count < SSE_MIN_SIZE)
+        return memset_rep(dst, value, count);
+
+    v16 v = (v16){0} + (char)value;
     uint8_t *d = dst;
-    while (count--)
+    uint8_t *end = d + count;
+
+    *(v16u *)d = v;
+    d = (uint8_t *)(((uintptr_t)d + 16) & ~15);
+
+    for (; end - d >= 64; d += 64)
     {
-        *d++ = value;
+        ((v16 *)d)[0] = v;
+        ((v16 *)d)[1] = v;
+        ((v16 *)d)[2] = v;
+        ((v16 *)d)[3] = v;
     }
+
+    for (; end - d >= 16; d += 16)
+    {
+        *(v16 *)d = v;
+    }
+
+    *(v16u *)(end - 16) = v;
+    return dst;
+}
+
+void *memcpy_sse(void *dst, const void *src, size_t count)
+{
+    if (count < SSE_MIN_SIZE)
+        return memcpy_rep(dst, src, count);
+
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    v16 head = *(const v16u *)s;
+    v16 tail = *(const v16u *)(s + count - 16);
+    size_t skip = 16 - ((uintptr_t)d & 15);
+
+    *(v16u *)d = head;
+    d += skip;
+    s += skip;
+    count -= skip;
+
+    for (; count >= 64; d += 64, s += 64, count -= 64)
+    {
+        v16 x0 = ((const v16u *)s)[0];
+        v16 x1 = ((const v16u *)s)[1];
+        v16 x2 = ((const v16u *)s)[2];
+        v16 x3 = ((const v16u *)s)[3];
+        ((v16 *)d)[0] = x0;
+        ((v16 *)d)[1] = x1;
+        ((v16 *)d)[2] = x2;
+        ((v16 *)d)[3] = x3;
+    }
+
+    for (; count >= 16; d += 16, s += 16, count -= 16)
+    {
+        *(v16 *)d = *(const v16u *)s;
+    }
+
+    *(v16u *)(d + count - 16) = tail;
+    return dst;
+}
+
+// pcmpeqb/pmovmskb find a block that differs, then memcmp_words the byte
+int memcmp_sse(const void *a, const void *b, size_t count)
+{
+    const uint8_t *p = a, *q = b;
+
+    for (; count >= 16; p += 16, q += 16, count -= 16)
+    {
+        v16 eq = __builtin_ia32_pcmpeqb128(*(const v16u *)p, *(const v16u *)q);
+        if (__builtin_ia32_pmovmskb128(eq) != 0xFFFF)
+            return memcmp_words(p, q, 16);
+    }
+
+    return memcmp_words(p, q, count);
+}
+#endif
+
+void *memset(void *dst, int value, size_t count)
+{
+#ifdef __SSE2__
+    if (count < REP_MIN_SIZE)
+        return memset_sse(dst, value, count);
+#endif
+    return memset_rep(dst, value, count);
+}
+
+void *memcpy(void *dst, const void *src, size_t count)
+{
+#ifdef __SSE2__
+    if (count < REP_MIN_SIZE)
+        return memcpy_sse(dst, src, count);
+#endif
+    return memcpy_rep(dst, src, count);
+}
+
+int memcmp(const void *a, const void *b, size_t count)
+{
+#ifdef __SSE2__
+    return memcmp_sse(a, b, count);
+#else
+    return memcmp_words(a, b, count);
+#endif
 }
@@ -1,9 +1,26 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
-extern void memset(void *dst, uint8_t value, u_int count);
+// Memory functions, picking the fastest variant below for the size.
+extern void *memset(void *dst, int value, size_t count);
+extern void *memcpy(void *dst, const void *src, size_t count);
+extern int memcmp(const void *a, const void *b, size_t count);
 
-#endif
\ No newline at end of file
+// rep stosd/movsd variants: 4 bytes per iteration, and the CPU's fast string
+// microcode, which gets the best of large blocks.
+extern void *memset_rep(void *dst, int value, size_t count);
+extern void *memcpy_rep(void *dst, const void *src, size_t count);
+extern int memcmp_words(const void *a, const void *b, size_t count);
+
+#ifdef __SSE2__
+// SSE variants: 16 bytes per instruction, 64 per iteration.
+extern void *memset_sse(void *dst, int value, size_t count);
+extern void *memcpy_sse(void *dst, const void *src, size_t count);
+extern int memcmp_sse(const void *a, const void *b, size_t count);
+#endif
+
+#endif
@@ -7,4 +7,8 @@
 // Real hardware emulated version.
 extern void putchar(int x, int y, char ch, color_t fg, color_t bg);
 
+// Display a formatted string (see format.h) starting at a character cell,
+// clipped at the end of the screen. Returns the number of characters shown.
+extern int print_emul(int x, int y, color_t fg, color_t bg, const char *fmt, ...);
+
 #endif
@@ -1,4 +1,6 @@
+#include <stdarg.h>
 #include <stdint.h>
+#include "format.h"
 #include "vga.h"
 
 static volatile uint16_t *const fb = (uint16_t *)VGA_FB_ADDR;
@@ -10,3 +12,27 @@ void putchar_emul(int x, int y, char ch, color_t fg, color_t bg)
     if (offset < VGA_XRES * VGA_YRES)
         fb[offset] = (uint8_t)ch | ((fg | (bg << 4)) << 8);
 }
+
+// Formats the whole string first, then stores each cell with a single 16-bit
+// write: no per-character calls or bounds checks
+int print_emul(int x, int y, color_t fg, color_t bg, const char *fmt, ...)
+{
+    char buf[VGA_XRES * VGA_YRES + 1];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    int offset = y * VGA_XRES + x;
+    if (offset >= VGA_XRES * VGA_YRES)
+        return 0;
+    if (len > VGA_XRES * VGA_YRES - offset)
+        len = VGA_XRES * VGA_YRES - offset;
+
+    uint16_t attr = (fg | (bg << 4)) << 8;
+    for (int i = 0; i < len; i++)
+        fb[offset + i] = (uint8_t)buf[i] | attr;
+
+    return len;
+}
@@ -0,0 +1,72 @@
+; Minimal guest for vmm -boot long, a flat binary without the C runtime of the
+; other guests (they are 32-bit): checks that it runs in 64-bit mode, with a
+; stack and RAM above 1 MB mapped by the VMM's page tables, and says so on the
+; serial port. Started any other way, it halts right away.
+
+BOOT_MAGIC      equ  0x424D4D56  ; see shared/boot.h
+BOOT_FLAG_LONG  equ  0x2
+HIGH_RAM_START  equ  0x100000
+HALT_PORT       equ  0xF4
+COM1            equ  0x3F8
+UART_LSR        equ  5
+UART_LSR_THRE   equ  0x20
+
+org 0
+
+[BITS 16]
+out     HALT_PORT,al         ; not a long mode boot: nothing to check
+hlt
+
+align 4
+boot_header:                     ; lets the VMM start the guest directly at long_entry
+        dd BOOT_MAGIC
+        dd BOOT_FLAG_LONG        ; no protected mode entry point
+        dd -(BOOT_MAGIC + BOOT_FLAG_LONG)
+        dd 0
+        dq long_entry
+
+[BITS 64]
+long_entry:
+mov     rax,0x123456789      ; only long mode has 64-bit registers
+shr     rax,32
+cmp     rax,1
+jne     failed
+
+mov     rdi,HIGH_RAM_START   ; a page fault there would shut the VM down
+mov     rax,0x0123456789ABCDEF
+mov     [rdi],rax
+cmp     [rdi],rax
+jne     failed
+
+lea     rsi,[rel ok_msg]
+call    print                ; and so would a fault on the stack
+jmp     done
+
+failed:
+lea     rsi,[rel failed_msg]
+call    print
+
+done:
+out     HALT_PORT,al         ; tell the VMM we are done (hlt doesn't exit with an in-kernel irqchip)
+hlt
+
+; Sends the NUL-terminated string at rsi through the UART's transmit register
+print:
+        lodsb
+        test    al,al
+        jz      .done
+        mov     ah,al
+        mov     dx,COM1 + UART_LSR
+.wait:
+        in      al,dx
+        test    al,UART_LSR_THRE
+        jz      .wait
+        mov     al,ah
+        mov     dx,COM1
+        out     dx,al
+        jmp     print
+.done:
+        ret
+
+ok_msg:     db "long mode OK", 10, 0
+failed_msg: db "long mode FAILED", 10, 0
@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include "pvclock.h"
+#include "serial.h"
+
+// Checkpoint test (vmm -checkpoint, then -restore): for a few seconds, every
+// round rewrites one eighth of a table, then checks all of it against what
+// the rounds so far must have left there. A VM restored from a checkpoint
+// carries on from that round: memory or registers a checkpoint missed make
+// the checks fail.
+
+#define TABLE_WORDS (16 * 1024)
+#define RUN_NS 3000000000ULL
+
+static uint32_t table[TABLE_WORDS];
+
+/** @param round the round that last wrote the word */
+static uint32_t value(uint32_t round, int i)
+{
+    uint32_t x = round * 2654435761u ^ i;
+    return x ^ x >> 15;
+}
+
+/** @return the words that aren't what round left */
+static int check(uint32_t round)
+{
+    int wrong = 0;
+
+    for (int i = 0; i < TABLE_WORDS; i++)
+    {
+        // The last round up to this one that wrote word i, if any
+        uint32_t lag = (round - i) % 8;
+        uint32_t expected = lag <= round ? value(round - lag, i) : 0;
+        wrong += table[i] != expected;
+    }
+
+    return wrong;
+}
+
+void guest_main()
+{
+    serial_init();
+
+    uint32_t round = 0;
+    uint32_t failures = 0;
+
+    while (pvclock_ns() < RUN_NS)
+    {
+        for (int i = round % 8; i < TABLE_WORDS; i += 8)
+            table[i] = value(round, i);
+
+        if (check(round) != 0)
+        {
+            serial_printf("checkpoint: round %u FAILED\n", round);
+            failures++;
+        }
+
+        if (round % 1024 == 0)
+            serial_printf("checkpoint: round %u at %u ms\n", round, (uint32_t)pvclock_ns() / 1000000);
+
+        round++;
+    }
+
+    serial_printf("checkpoint: %s after %u rounds\n", failures ? "FAILED" : "OK", round);
+}
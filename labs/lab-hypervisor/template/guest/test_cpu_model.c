@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include "serial.h"
+
+// CPU model test (vmm -cpu x86-64-v2): nothing the later levels add may show
+// in CPUID, neither the feature flags nor the XSAVE state components of AVX,
+// AVX-512 and AMX or the XSAVE instructions that come with XSAVE.
+
+#define XCR0_LATER (1 << 2 | 7 << 5 | 3 << 17) // AVX, AVX-512, AMX
+
+static int failures;
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    __asm__ volatile("cpuid" : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3]) : "a"(leaf), "c"(subleaf));
+}
+
+static void check(const char *what, uint32_t value, uint32_t later)
+{
+    if (value & later)
+    {
+        serial_printf("cpu: %s has %08x FAILED\n", what, value & later);
+        failures++;
+    }
+}
+
+void guest_main()
+{
+    serial_init();
+
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+
+    // FMA, MOVBE, XSAVE, AVX, F16C
+    cpuid(1, 0, regs);
+    check("leaf 1 ecx", regs[2], 1 << 12 | 1 << 22 | 1 << 26 | 1 << 28 | 1 << 29);
+
+    // BMI1, AVX2, BMI2, AVX-512F
+    if (max_leaf >= 7)
+    {
+        cpuid(7, 0, regs);
+        check("leaf 7 ebx", regs[1], 1 << 3 | 1 << 5 | 1 << 8 | 1 << 16);
+    }
+
+    if (max_leaf >= 0xD)
+    {
+        cpuid(0xD, 0, regs);
+        check("leaf 0xD.0 eax", regs[0], XCR0_LATER);
+
+        // XSAVEOPT, XSAVEC, XGETBV with ECX = 1, XSAVES, XFD and the supervisor components
+        cpuid(0xD, 1, regs);
+        check("leaf 0xD.1 eax", regs[0], 0x1F);
+        check("leaf 0xD.1 ecx", regs[2], ~0u);
+        check("leaf 0xD.1 edx", regs[3], ~0u);
+
+        for (int component = 2; component < 32; component++)
+        {
+            if (!(XCR0_LATER >> component & 1))
+                continue;
+
+            cpuid(0xD, component, regs);
+            check("leaf 0xD component size", regs[0], ~0u);
+            check("leaf 0xD component offset", regs[1], ~0u);
+        }
+    }
+
+    // LZCNT
+    cpuid(0x80000001, 0, regs);
+    check("leaf 0x80000001 ecx", regs[2], 1 << 5);
+
+    if (!failures)
+        serial_printf("cpu model OK\n");
+}
@@ -0,0 +1,40 @@
+#include <stdint.h>
+#include "test_disk.h"
+#include "ide.h"
+#include "utils.h"
+
+// Sectors the disk tests don't write: zeroes in the reference
+#define SCRATCH_SECTOR 384
+#define SCRATCH_SECTORS 16
+
+// Fills the scratch sectors, trims them, then reads them back: they must be
+// zeroes again. What was read is written back, so -verify sees it.
+static void test_discard(void)
+{
+    uint8_t sector[SECTOR_SIZE];
+
+    memset(sector, 0xA5, SECTOR_SIZE);
+    for (int i = 0; i < SCRATCH_SECTORS; i++)
+    {
+        ide_write_sector_pv(SCRATCH_SECTOR + i, sector);
+    }
+    ide_flush_pv();
+
+    ide_discard_emul(SCRATCH_SECTOR, SCRATCH_SECTORS);
+
+    for (int i = 0; i < SCRATCH_SECTORS; i++)
+    {
+        memset(sector, 0xFF, SECTOR_SIZE);
+        if (ide_read_sector_pv(SCRATCH_SECTOR + i, sector) < 0)
+            memset(sector, 0xFF, SECTOR_SIZE);
+        ide_write_sector_pv(SCRATCH_SECTOR + i, sector);
+    }
+}
+
+// Runs on a clone of the reference disk: the test sectors are already there
+void guest_main()
+{
+    test_disk_read_back(ide_read_sector_pv, ide_write_sector_pv);
+    test_discard();
+    ide_flush_pv();
+}
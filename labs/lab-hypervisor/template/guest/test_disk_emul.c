@@ -140,4 +140,5 @@ void guest_main()
     test_disk(write_sector_wrong3);
     test_disk(write_sector_wrong4);
     test_disk(write_sector_wrong5);
+    ide_flush_emul();
 }
@@ -0,0 +1,14 @@
+#include "test_disk.h"
+#include "ide.h"
+
+// Runs with a second drive on the secondary IDE channel and a third on PV queue 1
+void guest_main()
+{
+    ide_select_channel(1);
+    test_disk(ide_write_sector_emul);
+    ide_flush_emul();
+
+    ide_select_queue_pv(1);
+    test_disk(ide_write_sector_pv);
+    ide_flush_pv();
+}
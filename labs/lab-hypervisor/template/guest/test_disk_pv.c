@@ -4,4 +4,6 @@
 void guest_main()
 {
     test_disk(ide_write_sector_pv);
+    test_disk_read_back(ide_read_sector_pv, ide_write_sector_pv);
+    ide_flush_pv();
 }
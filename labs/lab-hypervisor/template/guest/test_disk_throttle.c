@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include "ide.h"
+#include "pvclock.h"
+#include "serial.h"
+#include "utils.h"
+
+// Throttling test (vmm -bps, -io-group-bps): times writing SECTORS sectors.
+// In the default writeback mode the writes are posted to the disk's I/O
+// thread, so they only take long if they are throttled before being posted.
+// The flush, which waits for them, isn't timed.
+
+#define SECTORS 64
+
+void guest_main()
+{
+    serial_init();
+
+    uint8_t sector[SECTOR_SIZE];
+    memset(sector, 0x5A, SECTOR_SIZE);
+
+    uint64_t start = pvclock_ns();
+
+    for (int i = 0; i < SECTORS; i++)
+    {
+        ide_write_sector_pv(i, sector);
+    }
+
+    uint32_t ms = (uint32_t)(pvclock_ns() - start) / 1000000;
+    serial_printf("throttle: %u bytes in %u ms\n", SECTORS * SECTOR_SIZE, ms);
+    ide_flush_pv();
+}
@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include "interrupts.h"
+#include "keyboard.h"
+#include "serial.h"
+#include "vga.h"
+
+// Set 1 scancodes of the main block's keys, unshifted
+static const char keymap[0x3A] = {
+    0,   0,   '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t',
+    'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', 0,  'a', 's',
+    'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`', 0,  '\\', 'z', 'x', 'c', 'v',
+    'b', 'n', 'm', ',', '.', '/', 0,   '*', 0,   ' ',
+};
+
+// Shows each scancode the keyboard sends, and the text typed. The vCPU sleeps
+// between keys: input comes with the keyboard's interrupt.
+void guest_main()
+{
+    serial_init();
+    interrupts_init();
+    keyboard_init();
+    enable_interrupts();
+
+    print_emul(0, 0, COL_WHITE, COL_BLUE, "PS/2 keyboard test: type in the window, Escape quits");
+    serial_printf("keyboard: ready\n");
+
+    int events = 0;
+    int column = 0;
+    int extended = 0;
+
+    for (;;)
+    {
+        int scancode = keyboard_wait_scancode();
+
+        if (scancode == KBD_EXTENDED)
+        {
+            extended = 1;
+            continue;
+        }
+
+        int released = scancode & KBD_RELEASE;
+        int code = scancode & ~KBD_RELEASE;
+        char ch = !extended && code < (int)sizeof(keymap) ? keymap[code] : 0;
+
+        events++;
+        print_emul(0, 2 + (events - 1) % 20, COL_LIGHT_GREY, COL_BLACK, "%5d: %s%02x %-8s", events,
+                   extended ? "e0 " : "", scancode, released ? "release" : "press");
+        serial_printf("keyboard: %s%02x %s\n", extended ? "e0 " : "", scancode, released ? "release" : "press");
+
+        if (ch >= ' ' && !released && column < 80)
+            print_emul(column++, 23, COL_YELLOW, COL_BLACK, "%c", ch);
+
+        extended = 0;
+    }
+}
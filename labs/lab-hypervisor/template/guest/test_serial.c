@@ -0,0 +1,45 @@
+#include "serial.h"
+#include "pmio.h"
+
+// Checks the UART's registers and its receive path with the loopback mode,
+// then logs through the transmit register and through the PV fast path.
+static int test_loopback()
+{
+    outb(SERIAL_COM1_BASE + UART_SCR, 0x5A);
+    if (inb(SERIAL_COM1_BASE + UART_SCR) != 0x5A)
+        return -1;
+
+    // With the receive interrupt enabled, IIR reports the data (interrupts
+    // are disabled in the CPU, so the IRQ isn't delivered)
+    outb(SERIAL_COM1_BASE + UART_MCR, UART_MCR_LOOP);
+    outb(SERIAL_COM1_BASE + UART_IER, UART_IER_RDI);
+    const char *msg = "loop";
+    for (const char *p = msg; *p; p++)
+        serial_putc(*p);
+
+    int failed = (inb(SERIAL_COM1_BASE + UART_IIR) & 0x0F) != UART_IIR_RDI;
+    for (const char *p = msg; *p; p++)
+        failed |= serial_getc() != *p;
+    failed |= serial_getc() != -1;
+    failed |= (inb(SERIAL_COM1_BASE + UART_IIR) & 0x0F) != UART_IIR_NO_INT;
+
+    outb(SERIAL_COM1_BASE + UART_IER, 0);
+    outb(SERIAL_COM1_BASE + UART_MCR, 0);
+    return failed ? -1 : 0;
+}
+
+void guest_main()
+{
+    serial_init();
+
+    int loopback = test_loopback();
+
+    for (const char *p = "serial: hello through THR\n"; *p; p++)
+        serial_putc(*p);
+
+    for (int i = 0; i < 100; i++)
+        serial_printf("serial: log line %3d of %d, %08x\n", i + 1, 100, i * 0x01010101);
+
+    serial_printf("serial: loopback %s\n", loopback < 0 ? "FAILED" : "OK");
+    serial_printf("serial: test done\n");
+}
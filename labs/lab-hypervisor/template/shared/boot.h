@@ -0,0 +1,37 @@
+#ifndef _BOOT_SHARED_H_
+#define _BOOT_SHARED_H_
+
+#include <stdint.h>
+
+// Boot header: a guest that can be started directly in protected or long mode
+// (vmm -boot protected|long) has one, 4-byte aligned, in the first
+// BOOT_HEADER_SEARCH bytes of its image. The VMM then sets up the GDT, page
+// tables and control registers itself and starts the vCPU at the entry point,
+// with flat segments and the stack at the top of RAM.
+#define BOOT_MAGIC 0x424D4D56 // "VMMB"
+#define BOOT_HEADER_SEARCH 8192
+
+#define BOOT_FLAG_PROTECTED 0x1 // entry32 is valid
+#define BOOT_FLAG_LONG 0x2      // entry64 is valid
+
+typedef struct boot_header
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t checksum; // magic + flags + checksum == 0
+    uint32_t entry32;
+    uint64_t entry64;
+} __attribute__((packed)) boot_header_t;
+
+// Flat segments of the GDT the VMM sets up
+#define BOOT_CODE32_SELECTOR 0x08
+#define BOOT_DATA_SELECTOR 0x10
+#define BOOT_CODE64_SELECTOR 0x18
+
+// Guest physical memory between the end of low RAM and 1 MB is for devices
+// (VGA, VMM boot structures, pvclock, hypercall areas): with more RAM than
+// fits below it, the rest starts at 1 MB.
+#define LOW_RAM_END 0xA0000
+#define HIGH_RAM_START 0x100000
+
+#endif
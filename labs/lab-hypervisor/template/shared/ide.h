@@ -1,8 +1,35 @@
 #ifndef _IDE_SHARED_H_
 #define _IDE_SHARED_H_
 
+#define IDE_PRIMARY_BASE 0x1F0
+#define IDE_SECONDARY_BASE 0x170
+#define IDE_CHANNELS 2
+
+// Command block registers, relative to the channel's base port
+#define ATA_REG_DATA 0
+#define ATA_REG_FEATURES 1
+#define ATA_REG_COUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_DEVICE 6
+#define ATA_REG_STATUS 7 // command when written
+#define ATA_REGS 8
+
+// Primary channel
 #define STATUS_PORT 0x1F7
 #define DATA_PORT 0x1F0
 #define SECTOR_SIZE 512
 
+#define FEATURES_PORT 0x1F1
+
+#define ATA_CMD_DATA_SET_MANAGEMENT 0x06
+#define ATA_CMD_WRITE_SECTORS 0x30
+#define ATA_CMD_FLUSH_CACHE 0xE7
+
+// DATA SET MANAGEMENT feature and range entries (48-bit LBA, 16-bit sector count)
+#define ATA_DSM_TRIM 0x01
+#define ATA_DSM_RANGE_LBA(entry) ((entry) & 0xFFFFFFFFFFFFULL)
+#define ATA_DSM_RANGE_COUNT(entry) ((entry) >> 48)
+
 #endif
\ No newline at end of file
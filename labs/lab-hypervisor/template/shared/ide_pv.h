@@ -1,16 +1,75 @@
 #ifndef _IDEPV_SHARED_H_
 #define _IDEPV_SHARED_H_
 
+#include <stdint.h>
 #include "ide.h"
 
 #define HYPERCALL_ADDR 0xFA000
 #define HYPERCALL_PORT 0xABBA
+
+// Queue i has its own hypercall area and port
+#define HYPERCALL_MAX_QUEUES 4
+#define HYPERCALL_AREA_SIZE 4096
+#define HYPERCALL_QUEUE_ADDR(i) (HYPERCALL_ADDR + (i) * HYPERCALL_AREA_SIZE)
+#define HYPERCALL_QUEUE_PORT(i) (HYPERCALL_PORT + (i))
+
 #define HYPERCALL_MAGIC 1
+#define HYPERCALL_FLUSH 2
+#define HYPERCALL_DISCARD 3
+// Zero-copy requests: the VMM reads or writes sector_count sectors directly
+// from or to the guest buffer at guest-physical address gpa, then sets status.
+#define HYPERCALL_WRITE 4
+#define HYPERCALL_READ 5
+// Polled queues: wakes up the VMM's poller, see pv_ring_t
+#define HYPERCALL_DOORBELL 6
+
+// Register hypercalls, for requests that don't need the hypercall area:
+// `out %eax, $HYPERCALL_REG_PORT` with HYPERCALL_REG_OP(op, queue) in eax and
+// the arguments in ebx, ecx and edx. The VMM returns the status in eax.
+//   HYPERCALL_WRITE, _READ: ebx = first sector, ecx = sector count, edx = buffer GPA
+//   HYPERCALL_DISCARD: ebx = first sector, ecx = sector count
+//   HYPERCALL_FLUSH: no arguments
+#define HYPERCALL_REG_PORT 0xE0
+#define HYPERCALL_REG_OP(op, queue) ((op) | (queue) << 8)
+#define HYPERCALL_REG_OPCODE(eax) ((eax) & 0xFF)
+#define HYPERCALL_REG_QUEUE(eax) (((eax) >> 8) & 0xFF)
 
 typedef struct hypercall
 {
     int sector_idx;
     char data[SECTOR_SIZE];
+    int sector_count;
+    uint32_t gpa;
+    int status; // 0 if the request succeeded, -1 otherwise
 } hypercall_t;
 
+// Request ring of a polled queue, in its hypercall area after the hypercall_t.
+// The VMM sets `enabled` when a host thread polls the ring: the guest then
+// fills the request at `producer` (modulo PV_RING_SIZE) and increments
+// `producer`, without exiting. The host processes requests in order, sets
+// their status and increments `consumer`. After being idle for a while the
+// poller sets `poller_sleeping`: a guest that sees it after publishing a
+// request rings the doorbell.
+#define PV_RING_OFFSET 1024
+#define PV_RING_SIZE 32
+
+typedef struct pv_request
+{
+    uint32_t op; // HYPERCALL_WRITE, _READ, _FLUSH or _DISCARD
+    int sector_idx;
+    int sector_count;
+    uint32_t gpa;
+    int status;
+    uint32_t reserved[3];
+} pv_request_t;
+
+typedef struct pv_ring
+{
+    uint32_t enabled;
+    uint32_t producer;
+    uint32_t consumer;
+    uint32_t poller_sleeping;
+    pv_request_t requests[PV_RING_SIZE];
+} pv_ring_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef _PS2_SHARED_H_
+#define _PS2_SHARED_H_
+
+// i8042 PS/2 controller, with a keyboard on its first port
+#define PS2_DATA_PORT 0x60
+#define PS2_STATUS_PORT 0x64 // command when written
+#define PS2_KEYBOARD_IRQ 1
+
+#define PS2_STATUS_OBF 0x01    // output buffer full: data to read on PS2_DATA_PORT
+#define PS2_STATUS_SYS 0x04    // system flag, set by the self-test
+#define PS2_STATUS_CMD 0x08    // the last write was to PS2_STATUS_PORT
+#define PS2_STATUS_UNLOCK 0x10 // keyboard not inhibited
+
+// Controller commands
+#define PS2_CMD_READ_CONFIG 0x20
+#define PS2_CMD_WRITE_CONFIG 0x60
+#define PS2_CMD_DISABLE_AUX 0xA7
+#define PS2_CMD_ENABLE_AUX 0xA8
+#define PS2_CMD_SELF_TEST 0xAA // replies 0x55
+#define PS2_CMD_TEST_KEYBOARD 0xAB // replies 0x00
+#define PS2_CMD_DISABLE_KEYBOARD 0xAD
+#define PS2_CMD_ENABLE_KEYBOARD 0xAE
+#define PS2_CMD_READ_OUTPUT 0xD0
+#define PS2_CMD_WRITE_OUTPUT 0xD1
+
+// Configuration byte
+#define PS2_CONFIG_KEYBOARD_IRQ 0x01
+#define PS2_CONFIG_SYS 0x04
+#define PS2_CONFIG_KEYBOARD_DISABLED 0x10
+#define PS2_CONFIG_TRANSLATE 0x40 // scancode set 1
+
+// Keyboard commands, and its replies
+#define KBD_CMD_SET_LEDS 0xED
+#define KBD_CMD_ECHO 0xEE
+#define KBD_CMD_SCANCODE_SET 0xF0
+#define KBD_CMD_IDENTIFY 0xF2
+#define KBD_CMD_TYPEMATIC 0xF3
+#define KBD_CMD_ENABLE 0xF4
+#define KBD_CMD_DISABLE 0xF5
+#define KBD_CMD_RESET 0xFF
+#define KBD_REPLY_ACK 0xFA
+#define KBD_REPLY_RESEND 0xFE
+#define KBD_REPLY_SELF_TEST_OK 0xAA
+
+// Scancodes (set 1): a key's release is its code | KBD_RELEASE, extended keys
+// are prefixed by KBD_EXTENDED
+#define KBD_RELEASE 0x80
+#define KBD_EXTENDED 0xE0
+
+#endif
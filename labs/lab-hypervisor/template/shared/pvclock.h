@@ -0,0 +1,22 @@
+#ifndef _PVCLOCK_SHARED_H_
+#define _PVCLOCK_SHARED_H_
+
+#include <stdint.h>
+
+#define PVCLOCK_ADDR 0xF9000
+
+// Layout of the kvmclock page (struct pvclock_vcpu_time_info in Linux),
+// kept up to date by KVM itself.
+typedef struct pvclock
+{
+    uint32_t version;
+    uint32_t pad0;
+    uint64_t tsc_timestamp;
+    uint64_t system_time;
+    uint32_t tsc_to_system_mul;
+    int8_t tsc_shift;
+    uint8_t flags;
+    uint8_t pad[2];
+} __attribute__((packed)) pvclock_t;
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _SERIAL_SHARED_H_
+#define _SERIAL_SHARED_H_
+
+// 16550 UART on COM1
+#define SERIAL_COM1_BASE 0x3F8
+#define SERIAL_COM1_IRQ 4
+#define SERIAL_CLOCK 115200 // baud rate with a divisor of 1
+
+// Registers, relative to the base port
+#define UART_RBR 0 // receive buffer (read, DLAB = 0)
+#define UART_THR 0 // transmit holding (write, DLAB = 0)
+#define UART_DLL 0 // divisor latch, low byte (DLAB = 1)
+#define UART_IER 1 // interrupt enable (DLAB = 0)
+#define UART_DLM 1 // divisor latch, high byte (DLAB = 1)
+#define UART_IIR 2 // interrupt identification (read)
+#define UART_FCR 2 // FIFO control (write)
+#define UART_LCR 3 // line control
+#define UART_MCR 4 // modem control
+#define UART_LSR 5 // line status
+#define UART_MSR 6 // modem status
+#define UART_SCR 7 // scratch
+#define UART_REGS 8
+
+#define UART_IER_RDI 0x01  // received data available
+#define UART_IER_THRI 0x02 // transmit holding register empty
+#define UART_IIR_NO_INT 0x01
+#define UART_IIR_THRI 0x02
+#define UART_IIR_RDI 0x04
+#define UART_IIR_FIFO 0xC0 // FIFOs enabled
+#define UART_FCR_ENABLE 0x01
+#define UART_FCR_CLEAR_RCVR 0x02
+#define UART_LCR_8N1 0x03
+#define UART_LCR_DLAB 0x80
+#define UART_MCR_LOOP 0x10
+#define UART_LSR_DR 0x01   // data ready
+#define UART_LSR_THRE 0x20 // transmit holding register empty
+#define UART_LSR_TEMT 0x40 // transmitter empty
+
+// Paravirtual write: `out %eax, $SERIAL_PV_PORT` with the guest-physical
+// address of a buffer in ebx and its length in ecx sends the whole buffer in a
+// single exit. The VMM returns the number of bytes sent in eax, -1 on error.
+#define SERIAL_PV_PORT 0xE1
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _SNAPSHOT_SHARED_H_
+#define _SNAPSHOT_SHARED_H_
+
+// Snapshot-reset iterations (vmm -iterations): the guest does its setup, then
+// `out %eax, $SNAPSHOT_PORT` with SNAPSHOT_TAKE in eax, and the guest-physical
+// address and size of an input buffer in ebx and ecx. The VMM snapshots the VM
+// right after the out, and every iteration starts from there with a new input
+// in the buffer and its length in eax. An iteration ends with SNAPSHOT_DONE in
+// eax (and a result in ebx), when the guest halts or when it crashes; the VM
+// is then reset to the snapshot for the next one.
+//
+// With -fork-server, SNAPSHOT_TAKE is the guest's ready point instead: the
+// buffer is not used, and every clone returns from it with 0 in eax.
+//
+// Without either, SNAPSHOT_TAKE returns 0 (an empty input) and SNAPSHOT_DONE
+// does nothing: the guest runs once.
+#define SNAPSHOT_PORT 0xE2
+
+#define SNAPSHOT_TAKE 1
+#define SNAPSHOT_DONE 2
+
+#endif
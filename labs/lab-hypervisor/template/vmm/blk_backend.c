@@ -0,0 +1,343 @@
+// Out-of-process PV block backend, in the spirit of vhost-user.
+//
+// `vmm -blk-server <socket> -disk <image> [disk options]` opens the disk once
+// and serves it to any number of VMMs connecting to the Unix socket, which all
+// share its backend stack and thus its cache. A VMM with a
+// `-drive if=pv,socket=<socket>` sends its guest RAM and hypercall areas as
+// memfds and the queue's doorbell as an eventfd (the doorbell is a KVM
+// ioeventfd, so kicking the backend doesn't even exit to the VMM). The backend
+// polls the queue's request ring (see pv_ring_t) and does the I/O straight to
+// and from guest RAM: no copies, and the disk work stays out of the VMM.
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blk_backend.h"
+#include "ide_pv.h"
+#include "unixsock.h"
+#include "verify.h"
+
+typedef struct connection
+{
+    int fd;
+    pthread_t thread;
+    bool done;
+    struct connection *next;
+} connection_t;
+
+static disk_t *server_disk;
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static connection_t *connections;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t stopping;
+
+static int send_msg(int sock, blk_msg_t *msg, int *fds, int nr_fds)
+{
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(blk_msg_t)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr hdr = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    msg->version = BLK_BACKEND_VERSION;
+
+    if (nr_fds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(nr_fds * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nr_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nr_fds * sizeof(int));
+    }
+
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL) == sizeof(blk_msg_t) ? 0 : -1;
+}
+
+// Receives a message of the given type with exactly nr_fds file descriptors
+static int recv_msg(int sock, blk_msg_t *msg, blk_msg_type_t type, int *fds, int nr_fds)
+{
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(blk_msg_t)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr hdr = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    int received = 0;
+
+    ssize_t len = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (received < nr_fds)
+                fds[received++] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    if (len != sizeof(blk_msg_t) || msg->type != type || msg->version != BLK_BACKEND_VERSION ||
+        received != nr_fds || (hdr.msg_flags & MSG_CTRUNC))
+    {
+        for (int i = 0; i < received; i++)
+        {
+            close(fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+// The VMM says how large the memfd is: it must be, and stay so, or
+// accessing the mapping past its end would kill the backend with SIGBUS
+static void *map_fd(int fd, uint64_t size)
+{
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    void *mem = MAP_FAILED;
+
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &st) == 0 && (uint64_t)st.st_size >= size)
+    {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void *serve_connection(void *arg)
+{
+    connection_t *conn = arg;
+    blk_msg_t mem_msg, queue_msg;
+    blk_msg_t ready = {.type = BLK_MSG_READY};
+    uint8_t *ram = NULL;
+    uint8_t *areas = NULL;
+    int fds[2];
+    hypercall_host_t *host = NULL;
+
+    if (recv_msg(conn->fd, &mem_msg, BLK_MSG_SET_MEM, fds, 1) < 0)
+    {
+        warn("blk-server: SET_MEM");
+        goto out;
+    }
+
+    ram = map_fd(fds[0], mem_msg.size);
+
+    if (recv_msg(conn->fd, &queue_msg, BLK_MSG_SET_QUEUE, fds, 2) < 0)
+    {
+        warn("blk-server: SET_QUEUE");
+        goto out;
+    }
+
+    areas = map_fd(fds[0], queue_msg.size);
+
+    if (!ram || !areas || queue_msg.queue >= HYPERCALL_MAX_QUEUES ||
+        queue_msg.size < (queue_msg.queue + 1) * HYPERCALL_AREA_SIZE)
+    {
+        warnx("blk-server: bad guest memory or queue %u", queue_msg.queue);
+        close(fds[1]);
+        ready.error = EINVAL;
+        send_msg(conn->fd, &ready, NULL, 0);
+        goto out;
+    }
+
+    host = create_hypercall_host(server_disk, queue_msg.queue);
+    host->disk_lock = &disk_lock;
+    hypercall_host_set_guest_mem(host, ram, mem_msg.size);
+    hypercall_host_poll_ring(host, (pv_ring_t *)(areas + queue_msg.queue * HYPERCALL_AREA_SIZE + PV_RING_OFFSET),
+                             fds[1], queue_msg.poll_cpu);
+
+    ready.size = server_disk->size;
+    if (send_msg(conn->fd, &ready, NULL, 0) < 0)
+    {
+        warn("blk-server: READY");
+        goto out;
+    }
+
+    printf("blk-server: serving a VMM's PV queue %u\n", queue_msg.queue);
+
+    // The VMM keeps the connection open as long as its guest runs
+    char byte;
+    while (read(conn->fd, &byte, 1) > 0)
+        ;
+
+out:
+    if (host)
+    {
+        destroy_hypercall_host(host);
+        pthread_mutex_lock(&disk_lock);
+        if (disk_flush(server_disk) < 0)
+        {
+            warn("blk-server: flush");
+        }
+        pthread_mutex_unlock(&disk_lock);
+    }
+
+    if (ram)
+        munmap(ram, mem_msg.size);
+    if (areas)
+        munmap(areas, queue_msg.size);
+
+    printf("blk-server: VMM disconnected\n");
+    __atomic_store_n(&conn->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Joins the connection threads that are done, or all of them
+static void reap_connections(bool all)
+{
+    pthread_mutex_lock(&connections_lock);
+
+    for (connection_t **prev = &connections; *prev;)
+    {
+        connection_t *conn = *prev;
+
+        if (all)
+            shutdown(conn->fd, SHUT_RDWR);
+
+        if (!all && !__atomic_load_n(&conn->done, __ATOMIC_ACQUIRE))
+        {
+            prev = &conn->next;
+            continue;
+        }
+
+        pthread_join(conn->thread, NULL);
+        close(conn->fd);
+        *prev = conn->next;
+        free(conn);
+    }
+
+    pthread_mutex_unlock(&connections_lock);
+}
+
+static void stop(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+int blk_server_main(char *socket_path, disk_config_t *config, char *manifest)
+{
+    int sock = listen_unix_socket(socket_path);
+
+    server_disk = create_disk(config);
+
+    // Without SA_RESTART, so that accept() returns; other threads block the signals
+    struct sigaction action = {.sa_handler = &stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    sigset_t signals, old;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    printf("blk-server: serving %s on %s\n", config->path, socket_path);
+
+    while (!stopping)
+    {
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0)
+        {
+            if (errno != EINTR)
+                warn("blk-server: accept");
+            continue;
+        }
+
+        reap_connections(false);
+
+        connection_t *conn = (connection_t *)calloc(1, sizeof(connection_t));
+        conn->fd = fd;
+
+        pthread_sigmask(SIG_BLOCK, &signals, &old);
+        if (pthread_create(&conn->thread, NULL, &serve_connection, conn) != 0)
+        {
+            errx(1, "VMM: can't start a blk-server connection thread");
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        pthread_mutex_lock(&connections_lock);
+        conn->next = connections;
+        connections = conn;
+        pthread_mutex_unlock(&connections_lock);
+    }
+
+    printf("blk-server: stopping\n");
+    reap_connections(true);
+    close(sock);
+    unlink(socket_path);
+
+    // Once the VMMs are gone, what they left on the disk
+    int status = EXIT_SUCCESS;
+    if (manifest)
+    {
+        int64_t differing = verify_disk(server_disk, manifest);
+
+        if (differing < 0)
+        {
+            warn("VMM: verifying %s against %s", config->path, manifest);
+            status = EXIT_FAILURE;
+        }
+        else if (differing > 0)
+        {
+            printf("verify: %ld sectors of %s differ from %s\n", differing, config->path, manifest);
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            printf("verify: %s matches %s\n", config->path, manifest);
+        }
+    }
+
+    destroy_disk(server_disk);
+    return status;
+}
+
+int connect_blk_backend(char *socket_path, int queue, int poll_cpu, int ram_fd, uint64_t ram_size, int hypercall_fd,
+                        int doorbell)
+{
+    int sock = connect_unix_socket(socket_path);
+
+    blk_msg_t mem_msg = {.type = BLK_MSG_SET_MEM, .size = ram_size};
+    blk_msg_t queue_msg = {
+        .type = BLK_MSG_SET_QUEUE,
+        .queue = queue,
+        .poll_cpu = poll_cpu,
+        .size = HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE};
+    int fds[2] = {hypercall_fd, doorbell};
+    blk_msg_t ready;
+
+    if (send_msg(sock, &mem_msg, &ram_fd, 1) < 0 || send_msg(sock, &queue_msg, fds, 2) < 0 ||
+        recv_msg(sock, &ready, BLK_MSG_READY, NULL, 0) < 0)
+    {
+        err(1, "VMM: talking to the block backend at %s", socket_path);
+    }
+
+    if (ready.error)
+    {
+        errno = ready.error;
+        err(1, "VMM: the block backend at %s refused PV queue %d", socket_path, queue);
+    }
+
+    printf("PV queue %d served by the block backend at %s (%lu bytes)\n", queue, socket_path, ready.size);
+    return sock;
+}
@@ -0,0 +1,35 @@
+#ifndef _BLK_BACKEND_H_
+#define _BLK_BACKEND_H_
+
+#include <stdint.h>
+#include "disk.h"
+
+#define BLK_BACKEND_VERSION 1
+
+// Messages between a VMM and a block backend, in this order:
+// SET_MEM (fd: guest RAM memfd), SET_QUEUE (fds: hypercall areas memfd and
+// the queue's doorbell eventfd), then READY from the backend.
+typedef enum
+{
+    BLK_MSG_SET_MEM = 1,
+    BLK_MSG_SET_QUEUE,
+    BLK_MSG_READY,
+} blk_msg_type_t;
+
+typedef struct blk_msg
+{
+    uint32_t type;
+    uint32_t version;
+    uint32_t queue;   // SET_QUEUE
+    int32_t poll_cpu; // SET_QUEUE: pin the backend's poller, if >= 0
+    uint64_t size;    // SET_MEM: of guest RAM, SET_QUEUE: of the hypercall areas, READY: of the disk
+    int32_t error;    // READY: errno if the backend can't serve the queue
+    uint32_t reserved;
+} blk_msg_t;
+
+// Serves the disk until SIGINT or SIGTERM, then checks it against manifest if not NULL
+int blk_server_main(char *socket_path, disk_config_t *config, char *manifest);
+int connect_blk_backend(char *socket_path, int queue, int poll_cpu, int ram_fd, uint64_t ram_size, int hypercall_fd,
+                        int doorbell);
+
+#endif
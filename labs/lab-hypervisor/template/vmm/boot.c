@@ -0,0 +1,181 @@
+// Direct boot in protected or long mode (see shared/boot.h): instead of the
+// guest's real-mode trampoline, the VMM builds what it would have, in the boot
+// area: a GDT with flat segments and, for long mode, page tables identity
+// mapping RAM and the first 4 GB with 1 GB pages (2 MB ones if the CPU lacks
+// them).
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "boot.h"
+
+#define PAGE_SIZE 4096
+
+#define BOOT_GDT_ADDR BOOT_AREA_ADDR
+#define BOOT_PML4_ADDR (BOOT_AREA_ADDR + 0x1000)
+#define BOOT_PDPT_ADDR (BOOT_AREA_ADDR + 0x2000)
+#define BOOT_PD_ADDR (BOOT_AREA_ADDR + 0x3000) // one per GB, with 2 MB pages
+#define BOOT_MAX_PDS ((BOOT_AREA_SIZE - 0x3000) / PAGE_SIZE)
+
+#define GB (1ULL << 30)
+
+#define PTE_PRESENT 0x1
+#define PTE_WRITE 0x2
+#define PTE_LARGE 0x80 // 2 MB or 1 GB page
+
+#define CR0_PE 0x1
+#define CR0_ET 0x10
+#define CR0_PG 0x80000000
+#define CR4_PAE 0x20
+#define EFER_LME 0x100
+#define EFER_LMA 0x400
+
+// Flat 4 GB segments: limit 0xFFFFF with 4K granularity, base 0
+static const uint64_t gdt[] = {
+    0,                  // null descriptor
+    0x00CF9B000000FFFF, // 32-bit code: present, execute/read, D=1
+    0x00CF93000000FFFF, // data: present, read/write, D=1
+    0x00AF9B000000FFFF, // 64-bit code: present, execute/read, L=1
+};
+
+int parse_boot_mode(const char *name, boot_mode_t *mode)
+{
+    if (strcmp(name, "real") == 0)
+        *mode = BOOT_REAL;
+    else if (strcmp(name, "protected") == 0)
+        *mode = BOOT_PROTECTED;
+    else if (strcmp(name, "long") == 0)
+        *mode = BOOT_LONG;
+    else
+        return -1;
+
+    return 0;
+}
+
+// Size with an optional K, M or G suffix
+int parse_mem_size(const char *value, uint64_t *size)
+{
+    char *end;
+    int shift = 0;
+
+    errno = 0;
+    *size = strtoull(value, &end, 0);
+
+    switch (*end)
+    {
+    case 'G':
+        shift += 10;
+        // fall through
+    case 'M':
+        shift += 10;
+        // fall through
+    case 'K':
+        shift += 10;
+        end++;
+        break;
+    }
+
+    // strtoull takes "-1" for a very large size
+    if (end == value || *end || errno == ERANGE || strchr(value, '-') || *size > UINT64_MAX >> shift)
+        return -1;
+
+    *size <<= shift;
+    return *size < PAGE_SIZE ? -1 : 0;
+}
+
+bool find_boot_header(const uint8_t *image, size_t size, boot_header_t *header)
+{
+    size_t end = size < BOOT_HEADER_SEARCH ? size : BOOT_HEADER_SEARCH;
+
+    for (size_t offset = 0; offset + sizeof(boot_header_t) <= end; offset += 4)
+    {
+        memcpy(header, image + offset, sizeof(boot_header_t));
+
+        if (header->magic == BOOT_MAGIC && header->magic + header->flags + header->checksum == 0)
+            return true;
+    }
+
+    return false;
+}
+
+void setup_boot_area(uint8_t *area, boot_mode_t mode, uint64_t mem_size, bool gb_pages)
+{
+    memset(area, 0, BOOT_AREA_SIZE);
+    memcpy(area + (BOOT_GDT_ADDR - BOOT_AREA_ADDR), gdt, sizeof(gdt));
+
+    if (mode != BOOT_LONG)
+        return;
+
+    // Identity map RAM, and all of the first 4 GB for the devices
+    uint64_t mapped = mem_size > 4 * GB ? mem_size : 4 * GB;
+    uint64_t gbs = (mapped + GB - 1) / GB;
+    uint64_t *pml4 = (uint64_t *)(area + (BOOT_PML4_ADDR - BOOT_AREA_ADDR));
+    uint64_t *pdpt = (uint64_t *)(area + (BOOT_PDPT_ADDR - BOOT_AREA_ADDR));
+
+    if (gbs > (gb_pages ? 512 : BOOT_MAX_PDS))
+    {
+        errx(1, "VMM: can't map %lu GB of RAM for a long mode boot%s", gbs,
+             gb_pages ? "" : " without 1 GB pages");
+    }
+
+    pml4[0] = BOOT_PDPT_ADDR | PTE_PRESENT | PTE_WRITE;
+
+    for (uint64_t i = 0; i < gbs; i++)
+    {
+        if (gb_pages)
+        {
+            pdpt[i] = i * GB | PTE_PRESENT | PTE_WRITE | PTE_LARGE;
+            continue;
+        }
+
+        uint64_t *pd = (uint64_t *)(area + (BOOT_PD_ADDR - BOOT_AREA_ADDR) + i * PAGE_SIZE);
+        pdpt[i] = (BOOT_PD_ADDR + i * PAGE_SIZE) | PTE_PRESENT | PTE_WRITE;
+
+        for (uint64_t j = 0; j < 512; j++)
+        {
+            pd[j] = (i * GB + (j << 21)) | PTE_PRESENT | PTE_WRITE | PTE_LARGE;
+        }
+    }
+
+    printf("boot: identity mapped %lu GB with %s pages\n", gbs, gb_pages ? "1 GB" : "2 MB");
+}
+
+static void flat_segment(struct kvm_segment *seg, uint16_t selector, uint8_t type)
+{
+    seg->base = 0;
+    seg->limit = 0xFFFFFFFF;
+    seg->selector = selector;
+    seg->type = type;
+    seg->present = 1;
+    seg->dpl = 0;
+    seg->db = 1;
+    seg->s = 1;
+    seg->l = 0;
+    seg->g = 1;
+    seg->avl = 0;
+    seg->unusable = 0;
+}
+
+void set_boot_sregs(struct kvm_sregs *sregs, boot_mode_t mode)
+{
+    flat_segment(&sregs->cs, BOOT_CODE32_SELECTOR, 0xB); // execute/read, accessed
+    flat_segment(&sregs->ds, BOOT_DATA_SELECTOR, 0x3);   // read/write, accessed
+    sregs->es = sregs->fs = sregs->gs = sregs->ss = sregs->ds;
+
+    sregs->gdt.base = BOOT_GDT_ADDR;
+    sregs->gdt.limit = sizeof(gdt) - 1;
+    sregs->cr0 = CR0_PE | CR0_ET;
+
+    if (mode == BOOT_LONG)
+    {
+        sregs->cs.selector = BOOT_CODE64_SELECTOR;
+        sregs->cs.l = 1;
+        sregs->cs.db = 0;
+        sregs->cr3 = BOOT_PML4_ADDR;
+        sregs->cr4 = CR4_PAE;
+        sregs->efer = EFER_LME | EFER_LMA;
+        sregs->cr0 |= CR0_PG;
+    }
+}
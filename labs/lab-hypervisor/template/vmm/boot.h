@@ -0,0 +1,26 @@
+#ifndef _BOOT_H_
+#define _BOOT_H_
+
+#include <linux/kvm.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "shared/boot.h"
+
+typedef enum
+{
+    BOOT_REAL,      // at 0 in real mode, the guest switches modes itself
+    BOOT_PROTECTED, // at the boot header's entry32, in 32-bit protected mode
+    BOOT_LONG,      // at the boot header's entry64, in 64-bit mode
+} boot_mode_t;
+
+// The GDT and page tables of direct boots live in their own memory slot
+#define BOOT_AREA_ADDR 0xF0000
+#define BOOT_AREA_SIZE 0x9000
+
+int parse_boot_mode(const char *name, boot_mode_t *mode);
+int parse_mem_size(const char *value, uint64_t *size);
+bool find_boot_header(const uint8_t *image, size_t size, boot_header_t *header);
+void setup_boot_area(uint8_t *area, boot_mode_t mode, uint64_t mem_size, bool gb_pages);
+void set_boot_sregs(struct kvm_sregs *sregs, boot_mode_t mode);
+
+#endif
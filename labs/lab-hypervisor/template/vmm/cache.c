@@ -0,0 +1,567 @@
+// In-VMM block cache, stacked on top of another disk backend.
+// The disk is split into extents (4K or 64K) kept in an LRU. Each extent tracks
+// which of its sectors hold data (valid) and which must be written back (dirty),
+// so partial writes never need to read the extent from the backend first.
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+#define MAX_EXTENT_SECTORS 128
+#define BITMAP_WORDS (MAX_EXTENT_SECTORS / 64)
+#define READAHEAD_EXTENTS 4
+#define MIN_EXTENTS (4 * READAHEAD_EXTENTS)
+
+typedef struct extent
+{
+    uint64_t index; // extent number on the disk
+    uint8_t *data;
+    uint64_t valid[BITMAP_WORDS];
+    uint64_t dirty[BITMAP_WORDS];
+    struct extent *prev; // LRU list, most recently used first
+    struct extent *next;
+    struct extent *hash_next; // hash bucket chain, or free list
+} extent_t;
+
+typedef struct cache_disk
+{
+    disk_t disk;
+    disk_t *backend;
+    cache_mode_t mode;
+    int extent_size;
+    int extent_sectors;
+
+    int nr_extents;
+    extent_t *extents;
+    uint8_t *data;
+    extent_t *free_list;
+    extent_t lru; // sentinel
+
+    int nr_buckets;
+    extent_t **buckets;
+
+    uint64_t next_read_offset; // to detect sequential reads
+    pthread_mutex_t lock;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t host_reads;
+    uint64_t host_writes;
+} cache_disk_t;
+
+static bool test_bit(const uint64_t *map, int bit)
+{
+    return map[bit / 64] & (1ULL << (bit % 64));
+}
+
+static void set_bits(uint64_t *map, int from, int count)
+{
+    for (int i = from; i < from + count; i++)
+    {
+        map[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+static void clear_bits(uint64_t *map, int from, int count)
+{
+    for (int i = from; i < from + count; i++)
+    {
+        map[i / 64] &= ~(1ULL << (i % 64));
+    }
+}
+
+static bool any_bit(const uint64_t *map)
+{
+    for (int i = 0; i < BITMAP_WORDS; i++)
+    {
+        if (map[i])
+            return true;
+    }
+    return false;
+}
+
+static unsigned bucket_of(cache_disk_t *cache, uint64_t index)
+{
+    return (unsigned)((index * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->nr_buckets - 1);
+}
+
+static uint64_t extent_offset(cache_disk_t *cache, extent_t *e)
+{
+    return e->index * cache->extent_size;
+}
+
+// Number of sectors of the extent that are inside the disk (the last extent may be short)
+static int extent_length(cache_disk_t *cache, uint64_t index)
+{
+    uint64_t left = cache->disk.size - index * cache->extent_size;
+    return left < (uint64_t)cache->extent_size ? (int)(left / SECTOR_SIZE) : cache->extent_sectors;
+}
+
+static void lru_unlink(extent_t *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void lru_push_front(cache_disk_t *cache, extent_t *e)
+{
+    e->prev = &cache->lru;
+    e->next = cache->lru.next;
+    cache->lru.next->prev = e;
+    cache->lru.next = e;
+}
+
+static extent_t *lookup(cache_disk_t *cache, uint64_t index)
+{
+    for (extent_t *e = cache->buckets[bucket_of(cache, index)]; e; e = e->hash_next)
+    {
+        if (e->index == index)
+            return e;
+    }
+    return NULL;
+}
+
+static void hash_remove(cache_disk_t *cache, extent_t *e)
+{
+    extent_t **p = &cache->buckets[bucket_of(cache, e->index)];
+    while (*p != e)
+    {
+        p = &(*p)->hash_next;
+    }
+    *p = e->hash_next;
+}
+
+static int compare_extents(const void *a, const void *b)
+{
+    const extent_t *ea = *(extent_t *const *)a;
+    const extent_t *eb = *(extent_t *const *)b;
+    return (ea->index > eb->index) - (ea->index < eb->index);
+}
+
+// Write the dirty sectors of the given extents back to the backend.
+// Adjacent dirty sectors, even across extents, are coalesced into one pwritev.
+static int write_back(cache_disk_t *cache, extent_t **list, int count)
+{
+    static __thread struct iovec iov[UIO_MAXIOV];
+    int iovcnt = 0;
+    uint64_t run_offset = 0, run_end = 0;
+
+    qsort(list, count, sizeof(extent_t *), &compare_extents);
+
+    for (int i = 0; i <= count; i++)
+    {
+        extent_t *e = i < count ? list[i] : NULL;
+        int s = 0;
+
+        while (true)
+        {
+            // Find the next run of dirty sectors in this extent
+            int start = -1, n = 0;
+            if (e)
+            {
+                while (s < cache->extent_sectors && !test_bit(e->dirty, s))
+                    s++;
+                start = s;
+                while (s < cache->extent_sectors && test_bit(e->dirty, s))
+                    s++;
+                n = s - start;
+            }
+
+            uint64_t offset = e ? extent_offset(cache, e) + (uint64_t)start * SECTOR_SIZE : 0;
+
+            // No more dirty sectors in this extent: the run may continue in the next one
+            if (e && n == 0)
+                break;
+
+            // Submit the current run if this one doesn't extend it
+            if (iovcnt > 0 && (!e || offset != run_end || iovcnt == UIO_MAXIOV))
+            {
+                if (cache->backend->writev(cache->backend, iov, iovcnt, run_offset) < 0)
+                    return -1;
+                cache->host_writes++;
+                iovcnt = 0;
+            }
+
+            if (!e)
+                break;
+
+            if (iovcnt == 0)
+                run_offset = run_end = offset;
+
+            iov[iovcnt].iov_base = e->data + (size_t)start * SECTOR_SIZE;
+            iov[iovcnt].iov_len = (size_t)n * SECTOR_SIZE;
+            iovcnt++;
+            run_end += iov[iovcnt - 1].iov_len;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        memset(list[i]->dirty, 0, sizeof(list[i]->dirty));
+    }
+
+    return 0;
+}
+
+static int write_back_all(cache_disk_t *cache)
+{
+    extent_t **list = malloc(cache->nr_extents * sizeof(extent_t *));
+    int count = 0;
+
+    for (extent_t *e = cache->lru.next; e != &cache->lru; e = e->next)
+    {
+        if (any_bit(e->dirty))
+            list[count++] = e;
+    }
+
+    int ret = write_back(cache, list, count);
+    free(list);
+    return ret;
+}
+
+// Get a cache slot for the extent at index, evicting the least recently used one if needed
+static extent_t *allocate(cache_disk_t *cache, uint64_t index)
+{
+    extent_t *e = cache->free_list;
+
+    if (e)
+    {
+        cache->free_list = e->hash_next;
+    }
+    else
+    {
+        e = cache->lru.prev;
+        if (any_bit(e->dirty) && write_back(cache, &e, 1) < 0)
+            return NULL;
+        lru_unlink(e);
+        hash_remove(cache, e);
+    }
+
+    e->index = index;
+    memset(e->valid, 0, sizeof(e->valid));
+    memset(e->dirty, 0, sizeof(e->dirty));
+
+    unsigned bucket = bucket_of(cache, index);
+    e->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = e;
+    lru_push_front(cache, e);
+    return e;
+}
+
+static extent_t *get_extent(cache_disk_t *cache, uint64_t index)
+{
+    extent_t *e = lookup(cache, index);
+
+    if (e)
+    {
+        lru_unlink(e);
+        lru_push_front(cache, e);
+        return e;
+    }
+
+    return allocate(cache, index);
+}
+
+// Read up to count consecutive uncached extents starting at index with a single preadv
+static int read_ahead(cache_disk_t *cache, uint64_t index, int count)
+{
+    uint64_t last = (cache->disk.size - 1) / cache->extent_size;
+    extent_t *list[READAHEAD_EXTENTS];
+    struct iovec iov[READAHEAD_EXTENTS];
+    int n = 0;
+
+    while (n < count && index + n <= last && !lookup(cache, index + n))
+    {
+        extent_t *e = allocate(cache, index + n);
+        if (!e)
+            return -1;
+        list[n] = e;
+        iov[n].iov_base = e->data;
+        iov[n].iov_len = (size_t)extent_length(cache, index + n) * SECTOR_SIZE;
+        n++;
+    }
+
+    if (n == 0)
+        return 0;
+
+    if (cache->backend->readv(cache->backend, iov, n, index * cache->extent_size) < 0)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            lru_unlink(list[i]);
+            hash_remove(cache, list[i]);
+            list[i]->hash_next = cache->free_list;
+            cache->free_list = list[i];
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        set_bits(list[i]->valid, 0, cache->extent_sectors);
+    }
+
+    cache->host_reads++;
+    return 0;
+}
+
+// Make sectors [first, first + count) of a partially written extent valid
+static int fill(cache_disk_t *cache, extent_t *e, int first, int count)
+{
+    bool missing = false;
+    for (int s = first; s < first + count; s++)
+    {
+        missing |= !test_bit(e->valid, s);
+    }
+
+    if (!missing)
+        return 0;
+
+    uint8_t buf[MAX_EXTENT_SECTORS * SECTOR_SIZE];
+    struct iovec iov = {.iov_base = buf, .iov_len = (size_t)extent_length(cache, e->index) * SECTOR_SIZE};
+
+    if (cache->backend->readv(cache->backend, &iov, 1, extent_offset(cache, e)) < 0)
+        return -1;
+
+    cache->host_reads++;
+
+    // Keep sectors written in the cache, take the rest from the backend
+    for (int s = 0; s < cache->extent_sectors; s++)
+    {
+        if (!test_bit(e->valid, s))
+            memcpy(e->data + s * SECTOR_SIZE, buf + s * SECTOR_SIZE, SECTOR_SIZE);
+    }
+
+    set_bits(e->valid, 0, cache->extent_sectors);
+    return 0;
+}
+
+static int cache_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    cache_disk_t *cache = (cache_disk_t *)disk;
+    size_t len = iov_length(iov, iovcnt);
+    size_t done = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    bool sequential = offset == cache->next_read_offset;
+    cache->next_read_offset = offset + len;
+
+    while (done < len)
+    {
+        uint64_t index = (offset + done) / cache->extent_size;
+        int first = (int)((offset + done) % cache->extent_size) / SECTOR_SIZE;
+        int count = (int)((len - done) / SECTOR_SIZE);
+        count = count < cache->extent_sectors - first ? count : cache->extent_sectors - first;
+
+        extent_t *e = lookup(cache, index);
+
+        if (e)
+        {
+            cache->hits++;
+        }
+        else
+        {
+            cache->misses++;
+            if (read_ahead(cache, index, sequential ? READAHEAD_EXTENTS : 1) < 0)
+            {
+                ret = -1;
+                break;
+            }
+        }
+
+        e = get_extent(cache, index);
+        if (!e || fill(cache, e, first, count) < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        iov_from_buf(iov, iovcnt, done, e->data + first * SECTOR_SIZE, (size_t)count * SECTOR_SIZE);
+        done += (size_t)count * SECTOR_SIZE;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+static int cache_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    cache_disk_t *cache = (cache_disk_t *)disk;
+    size_t len = iov_length(iov, iovcnt);
+    size_t done = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    while (done < len)
+    {
+        uint64_t index = (offset + done) / cache->extent_size;
+        int first = (int)((offset + done) % cache->extent_size) / SECTOR_SIZE;
+        int count = (int)((len - done) / SECTOR_SIZE);
+        count = count < cache->extent_sectors - first ? count : cache->extent_sectors - first;
+
+        extent_t *e = get_extent(cache, index);
+        if (!e)
+        {
+            ret = -1;
+            break;
+        }
+
+        iov_to_buf(iov, iovcnt, done, e->data + first * SECTOR_SIZE, (size_t)count * SECTOR_SIZE);
+        set_bits(e->valid, first, count);
+
+        if (cache->mode != CACHE_WRITETHROUGH)
+            set_bits(e->dirty, first, count);
+
+        done += (size_t)count * SECTOR_SIZE;
+    }
+
+    if (ret == 0 && cache->mode == CACHE_WRITETHROUGH)
+    {
+        ret = cache->backend->writev(cache->backend, iov, iovcnt, offset);
+        if (ret == 0)
+            ret = cache->backend->flush(cache->backend);
+        cache->host_writes++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+static int cache_flush(disk_t *disk)
+{
+    cache_disk_t *cache = (cache_disk_t *)disk;
+
+    if (cache->mode == CACHE_UNSAFE)
+        return 0;
+
+    pthread_mutex_lock(&cache->lock);
+    int ret = write_back_all(cache);
+    if (ret == 0)
+        ret = cache->backend->flush(cache->backend);
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+// Forget the discarded sectors (dirty or not), then pass the discard down
+static int cache_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    cache_disk_t *cache = (cache_disk_t *)disk;
+    uint64_t done = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    while (done < length)
+    {
+        uint64_t index = (offset + done) / cache->extent_size;
+        int first = (int)((offset + done) % cache->extent_size) / SECTOR_SIZE;
+        uint64_t left = (length - done) / SECTOR_SIZE;
+        int count = left < (uint64_t)(cache->extent_sectors - first) ? (int)left : cache->extent_sectors - first;
+
+        extent_t *e = lookup(cache, index);
+        if (e)
+        {
+            clear_bits(e->valid, first, count);
+            clear_bits(e->dirty, first, count);
+        }
+
+        done += (uint64_t)count * SECTOR_SIZE;
+    }
+
+    int ret = cache->backend->discard ? cache->backend->discard(cache->backend, offset, length) : 0;
+    pthread_mutex_unlock(&cache->lock);
+    return ret;
+}
+
+// Dirty data may live in what is still a hole in the backend: write it back first
+static uint64_t cache_next_data(disk_t *disk, uint64_t offset)
+{
+    cache_disk_t *cache = (cache_disk_t *)disk;
+
+    pthread_mutex_lock(&cache->lock);
+    uint64_t data = write_back_all(cache) < 0 ? offset : disk_next_data(cache->backend, offset);
+    pthread_mutex_unlock(&cache->lock);
+
+    return data;
+}
+
+static void cache_destroy(disk_t *disk)
+{
+    cache_disk_t *cache = (cache_disk_t *)disk;
+
+    // Dirty data is always written back on a clean shutdown, even in unsafe mode
+    if (write_back_all(cache) < 0 || cache->backend->flush(cache->backend) < 0)
+    {
+        warn("VMM: cache write back failed");
+    }
+
+    printf("cache: %lu hits, %lu misses, %lu host reads, %lu host writes\n",
+           cache->hits, cache->misses, cache->host_reads, cache->host_writes);
+
+    destroy_disk(cache->backend);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache->extents);
+    free(cache->data);
+    free(cache);
+}
+
+disk_t *create_cache_disk(disk_t *backend, cache_mode_t mode, int extent_size, size_t cache_size)
+{
+    if (extent_size < SECTOR_SIZE || (extent_size & (extent_size - 1)) != 0 ||
+        extent_size / SECTOR_SIZE > MAX_EXTENT_SECTORS)
+    {
+        errx(1, "VMM: invalid cache extent size %d", extent_size);
+    }
+
+    cache_disk_t *cache = (cache_disk_t *)calloc(1, sizeof(cache_disk_t));
+    cache->backend = backend;
+    cache->mode = mode;
+    cache->extent_size = extent_size;
+    cache->extent_sectors = extent_size / SECTOR_SIZE;
+
+    cache->nr_extents = (int)(cache_size / extent_size);
+    if (cache->nr_extents < MIN_EXTENTS)
+        cache->nr_extents = MIN_EXTENTS;
+
+    cache->nr_buckets = 1;
+    while (cache->nr_buckets < 2 * cache->nr_extents)
+        cache->nr_buckets <<= 1;
+
+    cache->extents = calloc(cache->nr_extents, sizeof(extent_t));
+    cache->data = malloc((size_t)cache->nr_extents * extent_size);
+    cache->buckets = calloc(cache->nr_buckets, sizeof(extent_t *));
+
+    if (!cache->extents || !cache->data || !cache->buckets)
+    {
+        err(1, "VMM: allocating block cache");
+    }
+
+    cache->lru.next = cache->lru.prev = &cache->lru;
+    for (int i = cache->nr_extents - 1; i >= 0; i--)
+    {
+        cache->extents[i].data = cache->data + (size_t)i * extent_size;
+        cache->extents[i].hash_next = cache->free_list;
+        cache->free_list = &cache->extents[i];
+    }
+
+    cache->next_read_offset = UINT64_MAX;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    cache->disk.readv = &cache_readv;
+    cache->disk.writev = &cache_writev;
+    cache->disk.flush = &cache_flush;
+    cache->disk.discard = &cache_discard;
+    cache->disk.next_data = &cache_next_data;
+    cache->disk.destroy = &cache_destroy;
+    cache->disk.size = backend->size;
+    return &cache->disk;
+}
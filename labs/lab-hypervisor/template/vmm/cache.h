@@ -0,0 +1,8 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "disk.h"
+
+disk_t *create_cache_disk(disk_t *backend, cache_mode_t mode, int extent_size, size_t cache_size);
+
+#endif
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define CHECKPOINT_SIGNAL SIGALRM
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+static checkpoints_t *active_checkpoints; // the one the timer signal is for
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+checkpoints_t *create_checkpoints(uint32_t devices_size)
+{
+    checkpoints_t *cp = (checkpoints_t *)calloc(1, sizeof(checkpoints_t));
+    cp->devices_size = devices_size;
+    pthread_mutex_init(&cp->lock, NULL);
+    return cp;
+}
+
+// slot: the memory slot of the region if the dirty log has it, -1 otherwise
+void checkpoints_add_region(checkpoints_t *cp, int slot, uint64_t gpa, uint8_t *mem, uint64_t size)
+{
+    if (cp->nr_regions == CHECKPOINT_MAX_REGIONS)
+    {
+        errx(1, "VMM: too many memory regions in checkpoints");
+    }
+
+    checkpoint_region_t *region = &cp->regions[cp->nr_regions++];
+    region->slot = slot;
+    region->gpa = gpa;
+    region->mem = mem;
+    region->size = size;
+
+    if (slot < 0 && !(region->copy = calloc(1, size)))
+    {
+        err(1, "VMM: allocating checkpoints");
+    }
+}
+
+static uint64_t record_size(checkpoints_t *cp, uint64_t pages)
+{
+    return sizeof(checkpoint_header_t) + sizeof(vm_state_t) + cp->devices_size + pages * sizeof(checkpoint_page_t);
+}
+
+static void write_or_die(FILE *file, const void *data, size_t size, const char *path)
+{
+    if (fwrite(data, 1, size, file) != size)
+    {
+        err(1, "VMM: writing %s", path);
+    }
+}
+
+// Starts a new chain at path
+void checkpoints_start(checkpoints_t *cp, const char *path, int interval_ms, int keep, dirty_log_t *dirty,
+                       int vcpufd)
+{
+    cp->path = strdup(path);
+    cp->file = fopen(path, "w");
+    cp->interval_ms = interval_ms;
+    cp->keep = keep;
+    cp->dirty = dirty;
+    vm_state_init(&cp->state, vcpufd);
+
+    if (!cp->file)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    setvbuf(cp->file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+    checkpoint_chain_header_t header = {.magic = CHECKPOINT_MAGIC,
+                                        .state_size = sizeof(vm_state_t),
+                                        .devices_size = cp->devices_size};
+    write_or_die(cp->file, &header, sizeof(header), path);
+    fflush(cp->file);
+    cp->end = sizeof(header);
+
+    printf("checkpoints: every %d ms to %s, the last %d restorable\n", interval_ms, path, keep);
+}
+
+static void on_timer(int sig)
+{
+    (void)sig;
+    active_checkpoints->due = 1;
+    active_checkpoints->run->immediate_exit = 1; // KVM_RUN returns with EINTR, even if entered after this
+}
+
+// In the vCPU thread: the timer signals this thread only
+void checkpoints_start_timer(checkpoints_t *cp, struct kvm_run *run)
+{
+    cp->run = run;
+    active_checkpoints = cp;
+
+    // Other system calls of the thread restart, KVM_RUN returns with EINTR
+    struct sigaction action = {.sa_handler = &on_timer, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(CHECKPOINT_SIGNAL, &action, NULL) < 0)
+    {
+        err(1, "VMM: sigaction");
+    }
+
+    struct sigevent event = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = CHECKPOINT_SIGNAL};
+    event.sigev_notify_thread_id = gettid();
+
+    if (timer_create(CLOCK_MONOTONIC, &event, &cp->timer) < 0)
+    {
+        err(1, "VMM: timer_create");
+    }
+
+    struct itimerspec spec = {.it_interval = {cp->interval_ms / 1000, cp->interval_ms % 1000 * 1000000L},
+                              .it_value = {cp->interval_ms / 1000, cp->interval_ms % 1000 * 1000000L}};
+
+    if (timer_settime(cp->timer, 0, &spec, NULL) < 0)
+    {
+        err(1, "VMM: timer_settime");
+    }
+}
+
+static void write_page(checkpoints_t *cp, uint64_t gpa, const uint8_t *data)
+{
+    write_or_die(cp->file, &gpa, sizeof(gpa), cp->path);
+    write_or_die(cp->file, data, CHECKPOINT_PAGE_SIZE, cp->path);
+}
+
+// Writes the pages of the region the checkpoint has, returns how many
+static uint64_t write_region(checkpoints_t *cp, checkpoint_region_t *region, bool full)
+{
+    uint64_t pages = 0;
+    dirty_slot_t *slot = NULL;
+
+    for (int i = 0; region->slot >= 0 && i < cp->dirty->nr_slots; i++)
+    {
+        if (cp->dirty->slots[i].slot == region->slot)
+            slot = &cp->dirty->slots[i];
+    }
+
+    for (uint64_t offset = 0; offset < region->size; offset += CHECKPOINT_PAGE_SIZE)
+    {
+        uint64_t page = offset / CHECKPOINT_PAGE_SIZE;
+        bool dirty;
+
+        if (slot)
+            dirty = slot->bitmap[page / 64] & (1ULL << (page % 64));
+        else
+            dirty = memcmp(region->mem + offset, region->copy + offset, CHECKPOINT_PAGE_SIZE) != 0;
+
+        if (!dirty && !full)
+            continue;
+
+        if (!slot)
+            memcpy(region->copy + offset, region->mem + offset, CHECKPOINT_PAGE_SIZE);
+
+        write_page(cp, region->gpa + offset, region->mem + offset);
+        pages++;
+    }
+
+    return pages;
+}
+
+static void start_compaction(checkpoints_t *cp);
+
+// Appends a checkpoint to the chain, called with the vCPU out of KVM_RUN and
+// its last exit completed. The guest is paused for as long as it takes.
+void checkpoint_take(checkpoints_t *cp, int vmfd, int vcpufd, const void *devices)
+{
+    uint64_t start = now_ns(CLOCK_MONOTONIC);
+    cp->due = 0;
+
+    dirty_log_collect(cp->dirty);
+    vm_state_save(&cp->state, vmfd, vcpufd);
+
+    pthread_mutex_lock(&cp->lock);
+
+    bool full = cp->nr_entries == 0;
+    checkpoint_header_t header = {.index = cp->next_index++,
+                                  .flags = full ? CHECKPOINT_FULL : 0,
+                                  .time_ns = now_ns(CLOCK_REALTIME)};
+    uint64_t offset = cp->end;
+
+    // The page count goes in the header once known
+    write_or_die(cp->file, &header, sizeof(header), cp->path);
+    write_or_die(cp->file, &cp->state, sizeof(vm_state_t), cp->path);
+    write_or_die(cp->file, devices, cp->devices_size, cp->path);
+
+    for (int i = 0; i < cp->nr_regions; i++)
+    {
+        header.pages += write_region(cp, &cp->regions[i], full);
+    }
+
+    dirty_log_clear(cp->dirty);
+
+    if (fflush(cp->file) != 0 || pwrite(fileno(cp->file), &header, sizeof(header), offset) != sizeof(header))
+    {
+        err(1, "VMM: writing %s", cp->path);
+    }
+
+    cp->end += record_size(cp, header.pages);
+
+    if (cp->nr_entries == cp->max_entries)
+    {
+        cp->max_entries = cp->max_entries ? cp->max_entries * 2 : 16;
+        cp->entries = realloc(cp->entries, cp->max_entries * sizeof(checkpoint_entry_t));
+    }
+
+    cp->entries[cp->nr_entries++] =
+        (checkpoint_entry_t){.index = header.index, .flags = header.flags, .pages = header.pages, .offset = offset};
+
+    bool should_compact = !cp->compacting && cp->nr_entries > 2 * cp->keep;
+    pthread_mutex_unlock(&cp->lock);
+
+    uint64_t pause = now_ns(CLOCK_MONOTONIC) - start;
+    cp->taken++;
+    cp->pages += header.pages;
+    cp->pause_ns += pause;
+    cp->max_pause_ns = pause > cp->max_pause_ns ? pause : cp->max_pause_ns;
+
+    printf("checkpoint %u: %lu pages%s, guest paused %.0f us\n", header.index, header.pages, full ? " (full)" : "",
+           pause / 1e3);
+
+    if (should_compact)
+    {
+        start_compaction(cp);
+    }
+}
+
+// Copies [from, to) of the old chain to the new one
+static void copy_range(int from_fd, uint64_t from, uint64_t to, FILE *dest, const char *path)
+{
+    static char buf[64 * 1024];
+
+    while (from < to)
+    {
+        size_t length = to - from < sizeof(buf) ? to - from : sizeof(buf);
+        ssize_t ret = pread(from_fd, buf, length, from);
+
+        if (ret <= 0)
+        {
+            err(1, "VMM: reading %s", path);
+        }
+
+        write_or_die(dest, buf, ret, path);
+        from += ret;
+    }
+}
+
+static checkpoint_region_t *find_region(checkpoints_t *cp, uint64_t gpa)
+{
+    for (int i = 0; i < cp->nr_regions; i++)
+    {
+        checkpoint_region_t *region = &cp->regions[i];
+
+        if (gpa >= region->gpa && gpa < region->gpa + region->size)
+            return region;
+    }
+
+    return NULL;
+}
+
+// Folds every checkpoint but the last keep into the oldest of those, which
+// becomes a full one, in a new chain that replaces the old one. Checkpoints
+// taken meanwhile are appended to the old chain, then copied over.
+static void *compact(void *arg)
+{
+    checkpoints_t *cp = arg;
+    uint64_t start = now_ns(CLOCK_MONOTONIC);
+
+    pthread_mutex_lock(&cp->lock);
+    int fold = cp->nr_entries - cp->keep; // the new full checkpoint
+    checkpoint_entry_t *entries = malloc((fold + 1) * sizeof(checkpoint_entry_t));
+    memcpy(entries, cp->entries, (fold + 1) * sizeof(checkpoint_entry_t));
+    uint64_t end = cp->end;
+    pthread_mutex_unlock(&cp->lock);
+
+    int fd = open(cp->path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        err(1, "VMM: %s", cp->path);
+    }
+
+    // Where the latest copy of each page is in the old chain, 0 if none
+    uint64_t *latest[CHECKPOINT_MAX_REGIONS];
+
+    for (int i = 0; i < cp->nr_regions; i++)
+    {
+        latest[i] = calloc(cp->regions[i].size / CHECKPOINT_PAGE_SIZE, sizeof(uint64_t));
+    }
+
+    uint64_t pages = 0;
+
+    for (int i = 0; i <= fold; i++)
+    {
+        uint64_t offset = entries[i].offset + record_size(cp, 0);
+
+        for (uint64_t page = 0; page < entries[i].pages; page++, offset += sizeof(checkpoint_page_t))
+        {
+            uint64_t gpa;
+
+            if (pread(fd, &gpa, sizeof(gpa), offset) != sizeof(gpa))
+            {
+                err(1, "VMM: reading %s", cp->path);
+            }
+
+            checkpoint_region_t *region = find_region(cp, gpa);
+
+            if (!region)
+                continue;
+
+            uint64_t *slot = &latest[region - cp->regions][(gpa - region->gpa) / CHECKPOINT_PAGE_SIZE];
+            pages += *slot == 0;
+            *slot = offset;
+        }
+    }
+
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp", cp->path) < 0)
+    {
+        err(1, NULL);
+    }
+
+    FILE *file = fopen(tmp_path, "w");
+
+    if (!file)
+    {
+        err(1, "VMM: %s", tmp_path);
+    }
+
+    setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+    copy_range(fd, 0, sizeof(checkpoint_chain_header_t), file, tmp_path);
+
+    // The full checkpoint: the state of the fold one, and the latest pages
+    checkpoint_header_t header;
+
+    if (pread(fd, &header, sizeof(header), entries[fold].offset) != sizeof(header))
+    {
+        err(1, "VMM: reading %s", cp->path);
+    }
+
+    header.flags |= CHECKPOINT_FULL;
+    header.pages = pages;
+    write_or_die(file, &header, sizeof(header), tmp_path);
+    copy_range(fd, entries[fold].offset + sizeof(header), entries[fold].offset + record_size(cp, 0), file, tmp_path);
+
+    for (int i = 0; i < cp->nr_regions; i++)
+    {
+        for (uint64_t page = 0; page < cp->regions[i].size / CHECKPOINT_PAGE_SIZE; page++)
+        {
+            if (latest[i][page])
+                copy_range(fd, latest[i][page], latest[i][page] + sizeof(checkpoint_page_t), file, tmp_path);
+        }
+
+        free(latest[i]);
+    }
+
+    // The checkpoints after it, as they are
+    uint64_t base = sizeof(checkpoint_chain_header_t) + record_size(cp, pages);
+    uint64_t tail = entries[fold].offset + record_size(cp, entries[fold].pages);
+    copy_range(fd, tail, end, file, tmp_path);
+
+    pthread_mutex_lock(&cp->lock);
+
+    // The ones taken meanwhile
+    copy_range(fd, end, cp->end, file, tmp_path);
+
+    if (fclose(file) != 0 || rename(tmp_path, cp->path) < 0)
+    {
+        err(1, "VMM: writing %s", tmp_path);
+    }
+
+    // Not in append mode: checkpoint_take() writes the header it appended
+    fclose(cp->file);
+    cp->file = fopen(cp->path, "r+");
+
+    if (!cp->file || fseek(cp->file, 0, SEEK_END) < 0)
+    {
+        err(1, "VMM: %s", cp->path);
+    }
+
+    setvbuf(cp->file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+    cp->entries[fold].offset = sizeof(checkpoint_chain_header_t);
+    cp->entries[fold].flags |= CHECKPOINT_FULL;
+    cp->entries[fold].pages = pages;
+
+    for (int i = fold + 1; i < cp->nr_entries; i++)
+    {
+        cp->entries[i].offset = cp->entries[i].offset - tail + base;
+    }
+
+    cp->end = cp->end - tail + base;
+    cp->nr_entries -= fold;
+    memmove(cp->entries, cp->entries + fold, cp->nr_entries * sizeof(checkpoint_entry_t));
+    cp->compactions++;
+    cp->compacting = false;
+    pthread_mutex_unlock(&cp->lock);
+
+    close(fd);
+    printf("checkpoints: compacted %d checkpoints into checkpoint %u (%lu pages) in %.1f ms\n", fold + 1,
+           header.index, pages, (now_ns(CLOCK_MONOTONIC) - start) / 1e6);
+
+    free(tmp_path);
+    free(entries);
+    return NULL;
+}
+
+static void start_compaction(checkpoints_t *cp)
+{
+    if (cp->compactor_started)
+    {
+        pthread_join(cp->compactor, NULL);
+    }
+
+    cp->compacting = true;
+    cp->compactor_started = true;
+
+    if (pthread_create(&cp->compactor, NULL, &compact, cp) != 0)
+    {
+        errx(1, "VMM: starting the compaction of %s", cp->path);
+    }
+}
+
+static void read_or_die(FILE *file, void *data, size_t size, const char *path)
+{
+    if (fread(data, 1, size, file) != size)
+    {
+        errx(1, "VMM: %s is truncated", path);
+    }
+}
+
+// Puts the pages of the chain's checkpoint index (-1: the last one) in guest
+// memory, and its state in state and devices. Returns its index.
+int checkpoint_restore(checkpoints_t *cp, const char *path, int index, vm_state_t *state, void *devices)
+{
+    uint64_t start = now_ns(CLOCK_MONOTONIC);
+    FILE *file = fopen(path, "r");
+
+    if (!file)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    checkpoint_chain_header_t chain;
+    read_or_die(file, &chain, sizeof(chain), path);
+
+    if (memcmp(chain.magic, CHECKPOINT_MAGIC, sizeof(chain.magic)) != 0 || chain.state_size != sizeof(vm_state_t) ||
+        chain.devices_size != cp->devices_size)
+    {
+        errx(1, "VMM: %s isn't a checkpoint chain of this VMM", path);
+    }
+
+    // Finds the checkpoint, and the last full one up to it
+    checkpoint_header_t header;
+    long base = -1;
+    long target = -1;
+    long offset = sizeof(chain);
+
+    while (fread(&header, sizeof(header), 1, file) == 1)
+    {
+        if (header.flags & CHECKPOINT_FULL)
+            base = offset;
+
+        if ((int)header.index == index || index < 0)
+            target = offset;
+
+        if ((int)header.index == index)
+            break;
+
+        offset += record_size(cp, header.pages);
+
+        if (fseek(file, offset, SEEK_SET) < 0)
+        {
+            err(1, "VMM: reading %s", path);
+        }
+    }
+
+    if (target < 0 || base < 0)
+    {
+        errx(1, "VMM: %s has no checkpoint %d, it may have been compacted", path, index);
+    }
+
+    // The pages of every checkpoint from the full one, later ones last
+    uint64_t pages = 0;
+
+    for (offset = base; offset <= target; offset += record_size(cp, header.pages))
+    {
+        if (fseek(file, offset, SEEK_SET) < 0)
+        {
+            err(1, "VMM: reading %s", path);
+        }
+
+        read_or_die(file, &header, sizeof(header), path);
+
+        if (offset == target)
+        {
+            read_or_die(file, state, sizeof(vm_state_t), path);
+            read_or_die(file, devices, cp->devices_size, path);
+        }
+        else if (fseek(file, sizeof(vm_state_t) + cp->devices_size, SEEK_CUR) < 0)
+        {
+            err(1, "VMM: reading %s", path);
+        }
+
+        for (uint64_t page = 0; page < header.pages; page++)
+        {
+            uint64_t gpa;
+            read_or_die(file, &gpa, sizeof(gpa), path);
+            checkpoint_region_t *region = find_region(cp, gpa);
+
+            if (!region || gpa + CHECKPOINT_PAGE_SIZE > region->gpa + region->size)
+            {
+                errx(1, "VMM: %s has a page at 0x%lx, outside of the guest's memory", path, gpa);
+            }
+
+            read_or_die(file, region->mem + gpa - region->gpa, CHECKPOINT_PAGE_SIZE, path);
+            pages++;
+        }
+    }
+
+    fclose(file);
+    printf("checkpoint %u of %s restored: %lu pages in %.1f ms\n", header.index, path, pages,
+           (now_ns(CLOCK_MONOTONIC) - start) / 1e6);
+    return header.index;
+}
+
+void destroy_checkpoints(checkpoints_t *cp)
+{
+    if (cp->run)
+    {
+        timer_delete(cp->timer);
+    }
+
+    if (cp->compactor_started)
+    {
+        pthread_join(cp->compactor, NULL);
+    }
+
+    if (cp->taken)
+    {
+        printf("checkpoints: %lu taken, %.1f pages and %.0f us of pause each on average, %.0f us at most, "
+               "%lu compactions\n",
+               cp->taken, (double)cp->pages / cp->taken, cp->pause_ns / 1e3 / cp->taken, cp->max_pause_ns / 1e3,
+               cp->compactions);
+    }
+
+    if (cp->file)
+    {
+        fclose(cp->file);
+    }
+
+    for (int i = 0; i < cp->nr_regions; i++)
+    {
+        free(cp->regions[i].copy);
+    }
+
+    pthread_mutex_destroy(&cp->lock);
+    free(cp->entries);
+    free(cp->path);
+    free(cp);
+}
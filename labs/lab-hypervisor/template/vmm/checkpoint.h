@@ -0,0 +1,116 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "dirty.h"
+#include "vmstate.h"
+
+// Checkpoint chain: a file of checkpoints of a running VM, taken periodically.
+// The first one has all of the guest's memory, the next ones only the pages
+// written since the previous one. Restoring a checkpoint applies the pages of
+// the last full one before it, then of every one up to it.
+//
+// The chain is a header followed by checkpoints, each a checkpoint_header_t,
+// the vm_state_t, the state of the VMM's device models, then its pages, each
+// a checkpoint_page_t. Every few checkpoints, a background thread compacts
+// the chain: the oldest ones are folded into a full one, only the last few
+// can still be restored.
+
+#define CHECKPOINT_MAGIC "VMMCKPT1"
+#define CHECKPOINT_MAX_REGIONS 8
+#define CHECKPOINT_PAGE_SIZE 4096
+
+#define CHECKPOINT_FULL 0x1 // has all of the guest's memory
+
+typedef struct checkpoint_chain_header
+{
+    char magic[8];
+    uint32_t state_size; // of vm_state_t
+    uint32_t devices_size;
+} checkpoint_chain_header_t;
+
+typedef struct checkpoint_header
+{
+    uint32_t index; // from 0, in the order they were taken
+    uint32_t flags;
+    uint64_t pages;
+    uint64_t time_ns; // CLOCK_REALTIME
+} checkpoint_header_t;
+
+typedef struct checkpoint_page
+{
+    uint64_t gpa;
+    uint8_t data[CHECKPOINT_PAGE_SIZE];
+} checkpoint_page_t;
+
+// Guest memory checkpoints have. Regions of memory slots logging dirty pages
+// get theirs from the dirty log, the others are compared with their copy.
+typedef struct checkpoint_region
+{
+    int slot; // -1 if it doesn't log dirty pages
+    uint64_t gpa;
+    uint8_t *mem;
+    uint64_t size;
+    uint8_t *copy;
+} checkpoint_region_t;
+
+// A checkpoint in the chain file
+typedef struct checkpoint_entry
+{
+    uint32_t index;
+    uint32_t flags;
+    uint64_t pages;
+    uint64_t offset;
+} checkpoint_entry_t;
+
+typedef struct checkpoints
+{
+    checkpoint_region_t regions[CHECKPOINT_MAX_REGIONS];
+    int nr_regions;
+    uint32_t devices_size;
+
+    // The chain being written
+    char *path;
+    FILE *file;
+    uint64_t end;
+    pthread_mutex_t lock; // the file and entries, also used by the compaction
+    checkpoint_entry_t *entries;
+    int nr_entries;
+    int max_entries;
+    uint32_t next_index;
+    int keep; // checkpoints compaction leaves restorable
+    dirty_log_t *dirty;
+    vm_state_t state;
+
+    // Periodic checkpoints: the timer kicks the vCPU out of KVM_RUN
+    int interval_ms;
+    timer_t timer;
+    struct kvm_run *run;
+    volatile sig_atomic_t due;
+
+    pthread_t compactor;
+    bool compactor_started;
+    bool compacting;
+
+    uint64_t taken;
+    uint64_t pages;
+    uint64_t pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t compactions;
+} checkpoints_t;
+
+checkpoints_t *create_checkpoints(uint32_t devices_size);
+void checkpoints_add_region(checkpoints_t *cp, int slot, uint64_t gpa, uint8_t *mem, uint64_t size);
+void checkpoints_start(checkpoints_t *cp, const char *path, int interval_ms, int keep, dirty_log_t *dirty,
+                       int vcpufd);
+void checkpoints_start_timer(checkpoints_t *cp, struct kvm_run *run);
+void checkpoint_take(checkpoints_t *cp, int vmfd, int vcpufd, const void *devices);
+int checkpoint_restore(checkpoints_t *cp, const char *path, int index, vm_state_t *state, void *devices);
+void destroy_checkpoints(checkpoints_t *cp);
+
+#endif
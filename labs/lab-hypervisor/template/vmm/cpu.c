@@ -0,0 +1,214 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "cpu.h"
+
+// Feature bits each x86-64 level adds, by CPUID leaf
+typedef struct level_features
+{
+    uint32_t leaf1_ecx;
+    uint32_t leaf7_ebx;
+    uint32_t leaf7_ecx;
+    uint32_t leaf7_edx;
+    uint32_t ext1_ecx;   // leaf 0x80000001
+    uint32_t leafd1_eax; // leaf 0xD subleaf 1: XSAVE instructions
+    uint64_t xcr0;       // XSAVE state components
+} level_features_t;
+
+#define XCR0_AVX (1 << 2)
+#define XCR0_AVX512 (7 << 5) // opmask, ZMM_Hi256 and Hi16_ZMM
+#define XCR0_AMX (3ULL << 17)
+
+#define XSAVE_EXTENSIONS 0xF // XSAVEOPT, XSAVEC, XGETBV with ECX = 1, XSAVES
+#define XSAVES (1 << 3)
+#define XFD (1 << 4)
+#define MIN_XSAVE_SIZE 576 // legacy area and XSAVE header
+
+static const level_features_t levels[] = {
+    // x86-64-v2: SSE3, SSSE3, CX16, SSE4.1, SSE4.2, POPCNT, LAHF
+    [2] = {.leaf1_ecx = 1 << 0 | 1 << 9 | 1 << 13 | 1 << 19 | 1 << 20 | 1 << 23, .ext1_ecx = 1 << 0},
+    // x86-64-v3: FMA, MOVBE, XSAVE (and its extensions), AVX, F16C, BMI1, AVX2, BMI2, LZCNT
+    [3] = {.leaf1_ecx = 1 << 12 | 1 << 22 | 1 << 26 | 1 << 28 | 1 << 29,
+           .leaf7_ebx = 1 << 3 | 1 << 5 | 1 << 8,
+           .ext1_ecx = 1 << 5,
+           .leafd1_eax = XSAVE_EXTENSIONS,
+           .xcr0 = XCR0_AVX},
+    // x86-64-v4: AVX-512 F, DQ, CD, BW, VL, and the later AVX-512 extensions
+    [4] = {.leaf7_ebx = 1 << 16 | 1 << 17 | 1 << 21 | 1 << 26 | 1 << 27 | 1 << 28 | 1U << 30 | 1U << 31,
+           .leaf7_ecx = 1 << 1 | 1 << 6 | 1 << 11 | 1 << 12 | 1 << 14,
+           .leaf7_edx = 1 << 2 | 1 << 3 | 1 << 8 | 1 << 23,
+           .xcr0 = XCR0_AVX512},
+    // Beyond any level: AMX
+    [5] = {.leaf7_edx = 1 << 22 | 1 << 24 | 1 << 25, .leafd1_eax = XFD, .xcr0 = XCR0_AMX},
+};
+
+#define MAX_LEVEL 5
+
+static const cpu_model_t models[] = {
+    {"host", 0},
+    {"x86-64-v1", 1},
+    {"x86-64-v2", 2},
+    {"x86-64-v3", 3},
+    {"x86-64-v4", 4},
+};
+
+const cpu_model_t *find_cpu_model(const char *name)
+{
+    for (unsigned i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+    {
+        if (strcmp(models[i].name, name) == 0)
+            return &models[i];
+    }
+
+    return NULL;
+}
+
+// Clears the features of the levels above the model's
+static void apply_level(struct kvm_cpuid2 *cpuid, int level)
+{
+    level_features_t removed = {0};
+
+    for (int l = level + 1; l <= MAX_LEVEL; l++)
+    {
+        removed.leaf1_ecx |= levels[l].leaf1_ecx;
+        removed.leaf7_ebx |= levels[l].leaf7_ebx;
+        removed.leaf7_ecx |= levels[l].leaf7_ecx;
+        removed.leaf7_edx |= levels[l].leaf7_edx;
+        removed.ext1_ecx |= levels[l].ext1_ecx;
+        removed.leafd1_eax |= levels[l].leafd1_eax;
+        removed.xcr0 |= levels[l].xcr0;
+    }
+
+    uint32_t xsave_size = MIN_XSAVE_SIZE;
+
+    for (uint32_t i = 0; i < cpuid->nent; i++)
+    {
+        struct kvm_cpuid_entry2 *entry = &cpuid->entries[i];
+
+        if (entry->function == 1)
+        {
+            entry->ecx &= ~removed.leaf1_ecx;
+        }
+        else if (entry->function == 7 && entry->index == 0)
+        {
+            entry->ebx &= ~removed.leaf7_ebx;
+            entry->ecx &= ~removed.leaf7_ecx;
+            entry->edx &= ~removed.leaf7_edx;
+        }
+        else if (entry->function == 0xD && entry->index == 0)
+        {
+            entry->eax &= ~(uint32_t)removed.xcr0;
+            entry->edx &= ~(uint32_t)(removed.xcr0 >> 32);
+        }
+        else if (entry->function == 0xD && entry->index == 1)
+        {
+            entry->eax &= ~removed.leafd1_eax;
+
+            // Supervisor state components are only saved by XSAVES
+            if (removed.leafd1_eax & XSAVES)
+                entry->ecx = entry->edx = 0;
+        }
+        else if (entry->function == 0xD && entry->index < 64)
+        {
+            // Size and offset of a state component: none for the components removed
+            bool supervisor = entry->ecx & 1;
+            if ((removed.xcr0 >> entry->index & 1) || (supervisor && removed.leafd1_eax & XSAVES))
+                entry->eax = entry->ebx = entry->ecx = entry->edx = 0;
+            else if (!supervisor && entry->eax && entry->ebx + entry->eax > xsave_size)
+                xsave_size = entry->ebx + entry->eax;
+        }
+        else if (entry->function == 0x80000001)
+        {
+            entry->ecx &= ~removed.ext1_ecx;
+        }
+    }
+
+    // The XSAVE area of all the components left (KVM keeps EBX, the size for
+    // the components enabled in XCR0, up to date itself)
+    for (uint32_t i = 0; i < cpuid->nent; i++)
+    {
+        if (cpuid->entries[i].function == 0xD && cpuid->entries[i].index == 0)
+            cpuid->entries[i].ecx = xsave_size;
+    }
+}
+
+void set_cpu_model(int kvmfd, int vcpufd, const cpu_model_t *model, bool *gb_pages)
+{
+    struct kvm_cpuid2 *cpuid = NULL;
+
+    // KVM says E2BIG until there is room for all of its entries
+    for (int nent = 128;; nent *= 2)
+    {
+        free(cpuid);
+        cpuid = calloc(1, sizeof(struct kvm_cpuid2) + nent * sizeof(struct kvm_cpuid_entry2));
+        cpuid->nent = nent;
+
+        if (ioctl(kvmfd, KVM_GET_SUPPORTED_CPUID, cpuid) == 0)
+            break;
+
+        if (errno != E2BIG)
+        {
+            err(1, "VMM: KVM_GET_SUPPORTED_CPUID");
+        }
+    }
+
+    if (model->level)
+    {
+        apply_level(cpuid, model->level);
+    }
+
+    if (ioctl(vcpufd, KVM_SET_CPUID2, cpuid) < 0)
+    {
+        err(1, "VMM: KVM_SET_CPUID2");
+    }
+
+    uint32_t leaf1_ecx = 0, leaf7_ebx = 0;
+    *gb_pages = false;
+
+    for (uint32_t i = 0; i < cpuid->nent; i++)
+    {
+        struct kvm_cpuid_entry2 *entry = &cpuid->entries[i];
+
+        if (entry->function == 1)
+            leaf1_ecx = entry->ecx;
+        else if (entry->function == 7 && entry->index == 0)
+            leaf7_ebx = entry->ebx;
+        else if (entry->function == 0x80000001)
+            *gb_pages = entry->edx & (1 << 26); // Page1GB
+    }
+
+    printf("cpu: %s, SSE4.2 %s, AVX %s, AVX2 %s, AVX-512 %s\n", model->name, leaf1_ecx & (1 << 20) ? "yes" : "no",
+           leaf1_ecx & (1 << 28) ? "yes" : "no", leaf7_ebx & (1 << 5) ? "yes" : "no",
+           leaf7_ebx & (1 << 16) ? "yes" : "no");
+    free(cpuid);
+}
+
+void save_fpu_state(int vcpufd, fpu_state_t *state)
+{
+    if (ioctl(vcpufd, KVM_GET_XCRS, &state->xcrs) < 0)
+    {
+        err(1, "VMM: KVM_GET_XCRS");
+    }
+
+    if (ioctl(vcpufd, KVM_GET_XSAVE, &state->xsave) < 0)
+    {
+        err(1, "VMM: KVM_GET_XSAVE");
+    }
+}
+
+// XCR0 first: it says which parts of the XSAVE area are in use
+void restore_fpu_state(int vcpufd, const fpu_state_t *state)
+{
+    if (ioctl(vcpufd, KVM_SET_XCRS, &state->xcrs) < 0)
+    {
+        err(1, "VMM: KVM_SET_XCRS");
+    }
+
+    if (ioctl(vcpufd, KVM_SET_XSAVE, &state->xsave) < 0)
+    {
+        err(1, "VMM: KVM_SET_XSAVE");
+    }
+}
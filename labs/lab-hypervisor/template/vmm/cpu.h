@@ -0,0 +1,30 @@
+#ifndef _CPU_H_
+#define _CPU_H_
+
+#include <linux/kvm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// CPUID of the vCPU: everything KVM supports (host), or one of the x86-64
+// microarchitecture levels (x86-64-v1 to v4) for guests that must run the
+// same on different hosts.
+typedef struct cpu_model
+{
+    const char *name;
+    int level; // 0 for host
+} cpu_model_t;
+
+// Vector unit state of a vCPU (x87, SSE, AVX...), which KVM_GET_REGS and
+// KVM_GET_SREGS leave out: saving and restoring a vCPU must include it.
+typedef struct fpu_state
+{
+    struct kvm_xcrs xcrs;
+    struct kvm_xsave xsave;
+} fpu_state_t;
+
+const cpu_model_t *find_cpu_model(const char *name);
+void set_cpu_model(int kvmfd, int vcpufd, const cpu_model_t *model, bool *gb_pages);
+void save_fpu_state(int vcpufd, fpu_state_t *state);
+void restore_fpu_state(int vcpufd, const fpu_state_t *state);
+
+#endif
@@ -0,0 +1,831 @@
+// Deduplicating disk images on top of a shared, content-addressed chunk store.
+//
+// A dedup image is only a chunk map: the disk is split into 64K chunks and
+// the map holds, for each of them, the key of its content in the store
+// (0 for an all-zero chunk, which is never stored). The store is a directory
+// shared by any number of images:
+//   <store>/<first two hex digits>/<16 hex digits key>
+// Each chunk file starts with a header holding its reference count (the number
+// of map entries pointing to it, across all images), updated under flock().
+// Keys are the chunk hash; on a collision with different content the next
+// free key is used, so identical chunks always share a key. Only chunk-aligned
+// duplicates are found: the same data at another offset in a chunk isn't.
+//
+// The most recently used chunks are kept decompressed in memory; writes
+// modify them there and are committed to the store (hashed, inserted, map
+// updated) on flush or eviction. References dropped by a commit are only
+// released after the map is durable, so a crash can leak a chunk but never
+// lose one. Built with LZ4=1, chunks that compress well are stored compressed.
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#include "dedup.h"
+#include "verify.h"
+
+#define DEDUP_MAGIC "VMMDEDUP"
+#define DEDUP_VERSION 1
+#define CHUNK_SIZE (64 * 1024)
+#define MAP_OFFSET 4096
+
+#define CHUNK_MAGIC 0x4b4e4843 // "CHNK"
+#define CHUNK_LZ4 1
+
+#define NR_BUFFERS 32
+
+typedef struct dedup_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t size;
+    uint64_t nr_chunks;
+    uint64_t map_offset;
+    uint32_t store_len; // the store path follows the header
+    uint32_t pad;
+} dedup_header_t;
+
+typedef struct chunk_header
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t refcount;
+    uint32_t stored_len; // bytes after the header
+    uint32_t pad;
+} chunk_header_t;
+
+typedef struct chunk_store
+{
+    char *dir;
+    uint64_t inserted; // new chunk files
+    uint64_t shared;   // insertions that found the content already there
+    uint64_t compressed;
+    uint64_t released; // chunk files removed
+} chunk_store_t;
+
+typedef struct chunk_buffer
+{
+    uint64_t chunk; // chunk number, UINT64_MAX when unused
+    uint8_t *data;
+    bool dirty;
+    uint64_t last_used;
+} chunk_buffer_t;
+
+typedef struct dedup_disk
+{
+    disk_t disk;
+    int fd;
+    dedup_header_t header;
+    uint64_t *map;
+    chunk_store_t store;
+
+    chunk_buffer_t buffers[NR_BUFFERS];
+    uint64_t clock;
+
+    uint64_t *released; // keys to unreference once the map is durable
+    size_t nr_released;
+    size_t released_size;
+
+    pthread_mutex_t lock;
+    uint64_t loads;
+    uint64_t commits;
+} dedup_disk_t;
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    return fd_readv(fd, &iov, 1, offset);
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    return fd_writev(fd, &iov, 1, offset);
+}
+
+static bool is_zero(const uint8_t *data, size_t len)
+{
+    static const uint8_t zeros[4096];
+    for (size_t pos = 0; pos < len; pos += sizeof(zeros))
+    {
+        if (memcmp(data + pos, zeros, sizeof(zeros)) != 0)
+            return false;
+    }
+    return true;
+}
+
+static void chunk_path(chunk_store_t *store, uint64_t key, char *path, bool create_dir)
+{
+    if (snprintf(path, PATH_MAX, "%s/%02x", store->dir, (unsigned)(key >> 56)) >= PATH_MAX)
+    {
+        errx(1, "VMM: store path too long: %s", store->dir);
+    }
+
+    if (create_dir && mkdir(path, 0755) < 0 && errno != EEXIST)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    if (snprintf(path, PATH_MAX, "%s/%02x/%016lx", store->dir, (unsigned)(key >> 56), key) >= PATH_MAX)
+    {
+        errx(1, "VMM: store path too long: %s", store->dir);
+    }
+}
+
+// Read a chunk file's data (decompressing it), with its lock held
+static int read_chunk_data(int fd, const chunk_header_t *header, uint8_t *data)
+{
+    if (!(header->flags & CHUNK_LZ4))
+        return header->stored_len == CHUNK_SIZE ? pread_full(fd, data, CHUNK_SIZE, sizeof(chunk_header_t)) : -1;
+
+#ifdef HAVE_LZ4
+    char *stored = malloc(header->stored_len);
+    int ret = pread_full(fd, stored, header->stored_len, sizeof(chunk_header_t));
+    if (ret == 0 && LZ4_decompress_safe(stored, (char *)data, header->stored_len, CHUNK_SIZE) != CHUNK_SIZE)
+        ret = -1;
+    free(stored);
+    return ret;
+#else
+    errx(1, "VMM: compressed chunk in the store, rebuild the VMM with LZ4=1");
+#endif
+}
+
+// Write a new chunk file's header and (possibly compressed) data, with its lock held
+static int write_chunk(chunk_store_t *store, int fd, const uint8_t *data)
+{
+    chunk_header_t header = {.magic = CHUNK_MAGIC, .refcount = 1, .stored_len = CHUNK_SIZE};
+    const void *stored = data;
+    void *compressed = NULL;
+
+#ifdef HAVE_LZ4
+    compressed = malloc(LZ4_compressBound(CHUNK_SIZE));
+    int len = LZ4_compress_default((const char *)data, compressed, CHUNK_SIZE, LZ4_compressBound(CHUNK_SIZE));
+    if (len > 0 && len < CHUNK_SIZE - CHUNK_SIZE / 8) // not worth a decompression otherwise
+    {
+        header.flags = CHUNK_LZ4;
+        header.stored_len = len;
+        stored = compressed;
+        store->compressed++;
+    }
+#else
+    (void)store;
+#endif
+
+    int ret = 0;
+    if (ftruncate(fd, 0) < 0 || pwrite_full(fd, stored, header.stored_len, sizeof(header)) < 0 ||
+        pwrite_full(fd, &header, sizeof(header), 0) < 0 || fdatasync(fd) < 0)
+    {
+        ret = -1;
+    }
+
+    free(compressed);
+    return ret;
+}
+
+// Add a reference to the chunk holding data, creating it if needed.
+// Returns its key (never 0), 0 on error.
+static uint64_t store_insert(chunk_store_t *store, const uint8_t *data)
+{
+    uint8_t *existing = malloc(CHUNK_SIZE);
+    uint64_t key = hash_buffer(data, CHUNK_SIZE);
+    char path[PATH_MAX];
+
+    for (;; key++)
+    {
+        if (key == 0)
+            continue;
+
+        chunk_path(store, key, path, true);
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0 || flock(fd, LOCK_EX) < 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            key = 0;
+            break;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            close(fd);
+            key = 0;
+            break;
+        }
+
+        if (st.st_nlink == 0)
+        {
+            // Removed by whoever dropped the last reference while we waited
+            // for the lock: look again
+            close(fd);
+            key--;
+            continue;
+        }
+
+        chunk_header_t header;
+        bool complete = st.st_size >= (off_t)sizeof(header) && pread_full(fd, &header, sizeof(header), 0) == 0 &&
+                        header.magic == CHUNK_MAGIC && st.st_size == (off_t)(sizeof(header) + header.stored_len);
+
+        if (!complete || header.refcount == 0)
+        {
+            // New, or left unreferenced by a crash: half-written, or between
+            // the last reference dropped and the removal
+            int ret = write_chunk(store, fd, data);
+            close(fd);
+            if (ret < 0)
+                key = 0;
+            else
+                store->inserted++;
+            break;
+        }
+
+        if (read_chunk_data(fd, &header, existing) == 0 && memcmp(existing, data, CHUNK_SIZE) == 0)
+        {
+            header.refcount++;
+            int ret = pwrite_full(fd, &header, sizeof(header), 0) < 0 || fdatasync(fd) < 0 ? -1 : 0;
+            close(fd);
+            if (ret < 0)
+                key = 0;
+            else
+                store->shared++;
+            break;
+        }
+
+        close(fd); // hash collision: try the next key
+    }
+
+    free(existing);
+    return key;
+}
+
+// Add a reference to an existing chunk
+static int store_ref(chunk_store_t *store, uint64_t key)
+{
+    char path[PATH_MAX];
+    chunk_path(store, key, path, false);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    chunk_header_t header;
+    int ret = -1;
+    if (flock(fd, LOCK_EX) == 0 && pread_full(fd, &header, sizeof(header), 0) == 0 && header.refcount > 0)
+    {
+        header.refcount++;
+        ret = pwrite_full(fd, &header, sizeof(header), 0) < 0 || fdatasync(fd) < 0 ? -1 : 0;
+    }
+
+    close(fd);
+    return ret;
+}
+
+// Drop a reference, removing the chunk with the last one.
+// A failure only leaks the chunk.
+static void store_unref(chunk_store_t *store, uint64_t key)
+{
+    char path[PATH_MAX];
+    chunk_path(store, key, path, false);
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        warn("VMM: %s", path);
+        return;
+    }
+
+    chunk_header_t header;
+    if (flock(fd, LOCK_EX) == 0 && pread_full(fd, &header, sizeof(header), 0) == 0 && header.refcount > 0)
+    {
+        header.refcount--;
+        if (pwrite_full(fd, &header, sizeof(header), 0) == 0 && header.refcount == 0)
+        {
+            unlink(path);
+            store->released++;
+        }
+    }
+
+    close(fd);
+}
+
+static int store_read(chunk_store_t *store, uint64_t key, uint8_t *data)
+{
+    char path[PATH_MAX];
+    chunk_path(store, key, path, false);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    // Shared lock: the header must not change under us
+    chunk_header_t header;
+    int ret = flock(fd, LOCK_SH) == 0 && pread_full(fd, &header, sizeof(header), 0) == 0 &&
+                      header.magic == CHUNK_MAGIC
+                  ? read_chunk_data(fd, &header, data)
+                  : -1;
+
+    close(fd);
+    if (ret < 0)
+        errno = EIO;
+    return ret;
+}
+
+static int read_header(int fd, dedup_header_t *header, char *store_dir)
+{
+    if (pread_full(fd, header, sizeof(*header), 0) < 0)
+        return -1;
+
+    if (memcmp(header->magic, DEDUP_MAGIC, sizeof(header->magic)) != 0 || header->version != DEDUP_VERSION ||
+        header->chunk_size != CHUNK_SIZE || header->store_len >= PATH_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pread_full(fd, store_dir, header->store_len, sizeof(*header)) < 0)
+        return -1;
+    store_dir[header->store_len] = '\0';
+    return 0;
+}
+
+bool is_dedup_image(char *path)
+{
+    char magic[8];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    bool ret = pread_full(fd, magic, sizeof(magic), 0) == 0 && memcmp(magic, DEDUP_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return ret;
+}
+
+// Turn the raw image at path into a dedup image: its chunks are inserted into
+// the store and the file is replaced by the chunk map.
+void create_dedup_image(char *path, char *store_dir)
+{
+    chunk_store_t store = {0};
+    char store_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+
+    if (mkdir(store_dir, 0755) < 0 && errno != EEXIST)
+    {
+        err(1, "VMM: %s", store_dir);
+    }
+
+    if (!realpath(store_dir, store_path))
+    {
+        err(1, "VMM: %s", store_dir);
+    }
+    store.dir = store_path;
+
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    dedup_header_t header = {
+        .version = DEDUP_VERSION,
+        .chunk_size = CHUNK_SIZE,
+        .size = st.st_size,
+        .nr_chunks = (st.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE,
+        .map_offset = MAP_OFFSET,
+        .store_len = (uint32_t)strlen(store_path)};
+    memcpy(header.magic, DEDUP_MAGIC, sizeof(header.magic));
+
+    if (sizeof(header) + header.store_len > MAP_OFFSET)
+    {
+        errx(1, "VMM: store path too long: %s", store_path);
+    }
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.dedup-tmp", path) >= (int)sizeof(tmp_path))
+    {
+        errx(1, "VMM: path too long: %s", path);
+    }
+
+    int out = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+    {
+        err(1, "VMM: %s", tmp_path);
+    }
+
+    uint64_t *map = calloc(header.nr_chunks, sizeof(uint64_t));
+    uint8_t *data = malloc(CHUNK_SIZE);
+    uint64_t zero_chunks = 0;
+
+    for (uint64_t c = 0; c < header.nr_chunks; c++)
+    {
+        // The last chunk is zero-padded
+        struct iovec iov = {.iov_base = data, .iov_len = CHUNK_SIZE};
+        if (fd_readv(in, &iov, 1, c * CHUNK_SIZE) < 0)
+        {
+            err(1, "VMM: %s", path);
+        }
+
+        if (is_zero(data, CHUNK_SIZE))
+        {
+            zero_chunks++;
+            continue;
+        }
+
+        if (!(map[c] = store_insert(&store, data)))
+        {
+            err(1, "VMM: inserting into %s", store_path);
+        }
+    }
+
+    if (pwrite_full(out, &header, sizeof(header), 0) < 0 ||
+        pwrite_full(out, store_path, header.store_len, sizeof(header)) < 0 ||
+        pwrite_full(out, map, header.nr_chunks * sizeof(uint64_t), MAP_OFFSET) < 0 ||
+        fdatasync(out) < 0 || rename(tmp_path, path) < 0)
+    {
+        err(1, "VMM: creating dedup image %s", path);
+    }
+
+    printf("disk %s moved into store %s: %lu chunks, %lu already there, %lu zero\n",
+           path, store_path, header.nr_chunks, store.shared, zero_chunks);
+
+    free(map);
+    free(data);
+    close(in);
+    close(out);
+}
+
+// Add a reference to every chunk of the dedup image at path, or drop them
+static void reference_chunks(char *path, bool ref)
+{
+    chunk_store_t store = {0};
+    char store_dir[PATH_MAX];
+    dedup_header_t header;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || read_header(fd, &header, store_dir) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+    store.dir = store_dir;
+
+    uint64_t *map = malloc(header.nr_chunks * sizeof(uint64_t));
+    if (pread_full(fd, map, header.nr_chunks * sizeof(uint64_t), header.map_offset) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    for (uint64_t c = 0; c < header.nr_chunks; c++)
+    {
+        if (!map[c])
+            continue;
+
+        if (!ref)
+            store_unref(&store, map[c]);
+        else if (store_ref(&store, map[c]) < 0)
+            err(1, "VMM: chunk %016lx of %s", map[c], path);
+    }
+
+    if (!ref)
+    {
+        printf("dedup image %s overwritten: %lu chunks released from %s\n", path, store.released, store_dir);
+    }
+
+    free(map);
+    close(fd);
+}
+
+// A copy of a dedup image (see clone_disk_image()) references the same chunks
+void share_dedup_chunks(char *path)
+{
+    reference_chunks(path, true);
+}
+
+// Before the dedup image at path is overwritten: it no longer references its chunks
+void release_dedup_chunks(char *path)
+{
+    reference_chunks(path, false);
+}
+
+static chunk_buffer_t *find_buffer(dedup_disk_t *dd, uint64_t chunk)
+{
+    for (int i = 0; i < NR_BUFFERS; i++)
+    {
+        if (dd->buffers[i].chunk == chunk)
+        {
+            dd->buffers[i].last_used = ++dd->clock;
+            return &dd->buffers[i];
+        }
+    }
+    return NULL;
+}
+
+static void release_later(dedup_disk_t *dd, uint64_t key)
+{
+    if (dd->nr_released == dd->released_size)
+    {
+        dd->released_size = dd->released_size ? 2 * dd->released_size : 64;
+        dd->released = realloc(dd->released, dd->released_size * sizeof(uint64_t));
+    }
+    dd->released[dd->nr_released++] = key;
+}
+
+static int set_map_entry(dedup_disk_t *dd, uint64_t chunk, uint64_t key)
+{
+    if (dd->map[chunk])
+        release_later(dd, dd->map[chunk]);
+
+    dd->map[chunk] = key;
+    return pwrite_full(dd->fd, &key, sizeof(key), dd->header.map_offset + chunk * sizeof(uint64_t));
+}
+
+// Put a dirty buffer's content in the store and point the map to it
+static int commit_buffer(dedup_disk_t *dd, chunk_buffer_t *buf)
+{
+    if (!buf->dirty)
+        return 0;
+
+    uint64_t key = 0;
+    if (!is_zero(buf->data, CHUNK_SIZE) && !(key = store_insert(&dd->store, buf->data)))
+        return -1;
+
+    if (set_map_entry(dd, buf->chunk, key) < 0)
+        return -1;
+
+    buf->dirty = false;
+    dd->commits++;
+    return 0;
+}
+
+// Get the buffer for a chunk, loading it unless it will be overwritten entirely
+static chunk_buffer_t *get_buffer(dedup_disk_t *dd, uint64_t chunk, bool load)
+{
+    chunk_buffer_t *buf = find_buffer(dd, chunk);
+    if (buf)
+        return buf;
+
+    buf = &dd->buffers[0];
+    for (int i = 1; i < NR_BUFFERS; i++)
+    {
+        if (dd->buffers[i].last_used < buf->last_used)
+            buf = &dd->buffers[i];
+    }
+
+    if (commit_buffer(dd, buf) < 0)
+        return NULL;
+
+    buf->chunk = UINT64_MAX;
+    if (load && dd->map[chunk])
+    {
+        if (store_read(&dd->store, dd->map[chunk], buf->data) < 0)
+            return NULL;
+        dd->loads++;
+    }
+    else if (load)
+    {
+        memset(buf->data, 0, CHUNK_SIZE);
+    }
+
+    buf->chunk = chunk;
+    buf->last_used = ++dd->clock;
+    return buf;
+}
+
+static int dedup_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    dedup_disk_t *dd = (dedup_disk_t *)disk;
+    size_t len = iov_length(iov, iovcnt);
+    size_t done = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&dd->lock);
+
+    while (done < len && ret == 0)
+    {
+        uint64_t pos = offset + done;
+        uint64_t chunk = pos / CHUNK_SIZE;
+        size_t in_chunk = pos % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - in_chunk < len - done ? CHUNK_SIZE - in_chunk : len - done;
+
+        chunk_buffer_t *buf = find_buffer(dd, chunk);
+        if (!buf && !dd->map[chunk])
+        {
+            struct iovec part[iovcnt];
+            int cnt = iov_slice(iov, iovcnt, done, n, part);
+            for (int i = 0; i < cnt; i++)
+            {
+                memset(part[i].iov_base, 0, part[i].iov_len);
+            }
+        }
+        else if ((buf = buf ? buf : get_buffer(dd, chunk, true)))
+        {
+            iov_from_buf(iov, iovcnt, done, buf->data + in_chunk, n);
+        }
+        else
+        {
+            ret = -1;
+        }
+
+        done += n;
+    }
+
+    pthread_mutex_unlock(&dd->lock);
+    return ret;
+}
+
+static int dedup_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    dedup_disk_t *dd = (dedup_disk_t *)disk;
+    size_t len = iov_length(iov, iovcnt);
+    size_t done = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&dd->lock);
+
+    while (done < len && ret == 0)
+    {
+        uint64_t pos = offset + done;
+        uint64_t chunk = pos / CHUNK_SIZE;
+        size_t in_chunk = pos % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - in_chunk < len - done ? CHUNK_SIZE - in_chunk : len - done;
+
+        chunk_buffer_t *buf = get_buffer(dd, chunk, n < CHUNK_SIZE);
+        if (buf)
+        {
+            iov_to_buf(iov, iovcnt, done, buf->data + in_chunk, n);
+            buf->dirty = true;
+        }
+        else
+        {
+            ret = -1;
+        }
+
+        done += n;
+    }
+
+    pthread_mutex_unlock(&dd->lock);
+    return ret;
+}
+
+// Commit everything, make the map durable, then drop the references it no longer holds
+static int flush_locked(dedup_disk_t *dd)
+{
+    for (int i = 0; i < NR_BUFFERS; i++)
+    {
+        if (commit_buffer(dd, &dd->buffers[i]) < 0)
+            return -1;
+    }
+
+    if (fdatasync(dd->fd) < 0)
+        return -1;
+
+    for (size_t i = 0; i < dd->nr_released; i++)
+    {
+        store_unref(&dd->store, dd->released[i]);
+    }
+    dd->nr_released = 0;
+    return 0;
+}
+
+static int dedup_flush(disk_t *disk)
+{
+    dedup_disk_t *dd = (dedup_disk_t *)disk;
+
+    pthread_mutex_lock(&dd->lock);
+    int ret = flush_locked(dd);
+    pthread_mutex_unlock(&dd->lock);
+    return ret;
+}
+
+// Whole chunks are dropped; partially discarded ones are zeroed
+static int dedup_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    dedup_disk_t *dd = (dedup_disk_t *)disk;
+    uint64_t end = offset + length;
+    int ret = 0;
+
+    pthread_mutex_lock(&dd->lock);
+
+    for (uint64_t pos = offset; pos < end && ret == 0;)
+    {
+        uint64_t chunk = pos / CHUNK_SIZE;
+        size_t in_chunk = pos % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - in_chunk < end - pos ? CHUNK_SIZE - in_chunk : end - pos;
+        chunk_buffer_t *buf = find_buffer(dd, chunk);
+
+        if (n == CHUNK_SIZE)
+        {
+            if (buf)
+            {
+                buf->chunk = UINT64_MAX;
+                buf->dirty = false;
+                buf->last_used = 0;
+            }
+            if (dd->map[chunk])
+                ret = set_map_entry(dd, chunk, 0);
+        }
+        else if (buf || dd->map[chunk])
+        {
+            if ((buf = get_buffer(dd, chunk, true)))
+            {
+                memset(buf->data + in_chunk, 0, n);
+                buf->dirty = true;
+            }
+            else
+            {
+                ret = -1;
+            }
+        }
+
+        pos += n;
+    }
+
+    pthread_mutex_unlock(&dd->lock);
+    return ret;
+}
+
+static uint64_t dedup_next_data(disk_t *disk, uint64_t offset)
+{
+    dedup_disk_t *dd = (dedup_disk_t *)disk;
+    uint64_t chunk = offset / CHUNK_SIZE;
+
+    pthread_mutex_lock(&dd->lock);
+
+    while (chunk < dd->header.nr_chunks && !dd->map[chunk] && !find_buffer(dd, chunk))
+    {
+        chunk++;
+    }
+
+    pthread_mutex_unlock(&dd->lock);
+    return chunk * CHUNK_SIZE > offset ? chunk * CHUNK_SIZE : offset;
+}
+
+static void dedup_destroy(disk_t *disk)
+{
+    dedup_disk_t *dd = (dedup_disk_t *)disk;
+
+    if (flush_locked(dd) < 0)
+    {
+        warn("VMM: dedup flush failed");
+    }
+
+    printf("dedup: %lu chunk loads, %lu commits: %lu new chunks (%lu compressed), %lu shared, %lu released\n",
+           dd->loads, dd->commits, dd->store.inserted, dd->store.compressed, dd->store.shared, dd->store.released);
+
+    for (int i = 0; i < NR_BUFFERS; i++)
+    {
+        free(dd->buffers[i].data);
+    }
+    pthread_mutex_destroy(&dd->lock);
+    close(dd->fd);
+    free(dd->released);
+    free(dd->map);
+    free(dd->store.dir);
+    free(dd);
+}
+
+disk_t *create_dedup_disk(char *path)
+{
+    dedup_disk_t *dd = (dedup_disk_t *)calloc(1, sizeof(dedup_disk_t));
+    char store_dir[PATH_MAX];
+
+    dd->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (dd->fd < 0 || read_header(dd->fd, &dd->header, store_dir) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+    dd->store.dir = strdup(store_dir);
+
+    dd->map = malloc(dd->header.nr_chunks * sizeof(uint64_t));
+    if (!dd->map || pread_full(dd->fd, dd->map, dd->header.nr_chunks * sizeof(uint64_t), dd->header.map_offset) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    for (int i = 0; i < NR_BUFFERS; i++)
+    {
+        dd->buffers[i].chunk = UINT64_MAX;
+        dd->buffers[i].data = malloc(CHUNK_SIZE);
+    }
+
+    pthread_mutex_init(&dd->lock, NULL);
+    dd->disk.readv = &dedup_readv;
+    dd->disk.writev = &dedup_writev;
+    dd->disk.flush = &dedup_flush;
+    dd->disk.discard = &dedup_discard;
+    dd->disk.next_data = &dedup_next_data;
+    dd->disk.destroy = &dedup_destroy;
+    dd->disk.size = dd->header.size;
+
+    printf("dedup image %s on store %s\n", path, store_dir);
+    return &dd->disk;
+}
@@ -0,0 +1,12 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "disk.h"
+
+bool is_dedup_image(char *path);
+void create_dedup_image(char *path, char *store_dir);
+void share_dedup_chunks(char *path);
+void release_dedup_chunks(char *path);
+disk_t *create_dedup_disk(char *path);
+
+#endif
@@ -0,0 +1,268 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "dirty.h"
+
+#define PAGE_SIZE 4096
+
+static uint64_t bitmap_words(uint64_t size)
+{
+    return (size / PAGE_SIZE + 63) / 64;
+}
+
+uint32_t dirty_ring_enable(int vmfd, uint32_t entries)
+{
+    int max_size = ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING_ACQ_REL);
+
+    if (max_size <= 0)
+        return 0;
+
+    while (entries * sizeof(struct kvm_dirty_gfn) > (uint32_t)max_size)
+        entries /= 2;
+
+    struct kvm_enable_cap cap = {.cap = KVM_CAP_DIRTY_LOG_RING_ACQ_REL,
+                                 .args[0] = entries * sizeof(struct kvm_dirty_gfn)};
+
+    if (ioctl(vmfd, KVM_ENABLE_CAP, &cap) < 0)
+    {
+        warn("VMM: KVM_ENABLE_CAP KVM_CAP_DIRTY_LOG_RING_ACQ_REL");
+        return 0;
+    }
+
+    return entries;
+}
+
+dirty_log_t *create_dirty_log(int vmfd, int vcpufd, uint32_t ring_entries)
+{
+    dirty_log_t *log = calloc(1, sizeof(dirty_log_t));
+    log->vmfd = vmfd;
+    log->ring_entries = ring_entries;
+    pthread_mutex_init(&log->lock, NULL);
+
+    if (ring_entries)
+    {
+        size_t size = ring_entries * sizeof(struct kvm_dirty_gfn);
+        log->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpufd,
+                         KVM_DIRTY_LOG_PAGE_OFFSET * getpagesize());
+
+        if (log->ring == MAP_FAILED)
+        {
+            err(1, "VMM: mapping the dirty ring");
+        }
+    }
+
+    printf("dirty log: %s\n", ring_entries ? "dirty ring" : "dirty bitmaps");
+    return log;
+}
+
+void dirty_log_add_slot(dirty_log_t *log, int slot, uint64_t gpa, uint8_t *mem, uint64_t size)
+{
+    if (log->nr_slots == DIRTY_MAX_SLOTS)
+    {
+        errx(1, "VMM: too many memory slots in the dirty log");
+    }
+
+    dirty_slot_t *dirty_slot = &log->slots[log->nr_slots++];
+    dirty_slot->slot = slot;
+    dirty_slot->gpa = gpa;
+    dirty_slot->mem = mem;
+    dirty_slot->size = size;
+    dirty_slot->bitmap = calloc(bitmap_words(size), sizeof(uint64_t));
+
+    // Large enough for the largest slot
+    uint64_t largest = 0;
+    for (int i = 0; i < log->nr_slots; i++)
+        largest = log->slots[i].size > largest ? log->slots[i].size : largest;
+
+    free(log->kvm_bitmap);
+    log->kvm_bitmap = calloc(bitmap_words(largest), sizeof(uint64_t));
+
+    if (!dirty_slot->bitmap || !log->kvm_bitmap)
+    {
+        err(1, "VMM: allocating the dirty log");
+    }
+}
+
+static dirty_slot_t *find_slot(dirty_log_t *log, int slot)
+{
+    for (int i = 0; i < log->nr_slots; i++)
+    {
+        if (log->slots[i].slot == slot)
+            return &log->slots[i];
+    }
+
+    return NULL;
+}
+
+// Moves the ring's entries to the bitmaps, then has KVM reuse them
+static void harvest(dirty_log_t *log)
+{
+    if (!log->ring)
+        return;
+
+    uint32_t harvested = 0;
+
+    while (1)
+    {
+        struct kvm_dirty_gfn *gfn = &log->ring[log->fetch % log->ring_entries];
+
+        // KVM writes the entry, then its flags
+        if (!(__atomic_load_n(&gfn->flags, __ATOMIC_ACQUIRE) & KVM_DIRTY_GFN_F_DIRTY))
+            break;
+
+        dirty_slot_t *slot = find_slot(log, gfn->slot & 0xFFFF);
+
+        if (slot && gfn->offset < slot->size / PAGE_SIZE)
+        {
+            slot->bitmap[gfn->offset / 64] |= 1ULL << (gfn->offset % 64);
+        }
+
+        __atomic_store_n(&gfn->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+        log->fetch++;
+        harvested++;
+    }
+
+    if (harvested && ioctl(log->vmfd, KVM_RESET_DIRTY_RINGS, 0) < 0)
+    {
+        err(1, "VMM: KVM_RESET_DIRTY_RINGS");
+    }
+
+    log->harvested += harvested;
+}
+
+void dirty_log_harvest(dirty_log_t *log)
+{
+    pthread_mutex_lock(&log->lock);
+    harvest(log);
+    pthread_mutex_unlock(&log->lock);
+}
+
+static void collect(dirty_log_t *log)
+{
+    if (log->ring)
+    {
+        harvest(log);
+        return;
+    }
+
+    for (int i = 0; i < log->nr_slots; i++)
+    {
+        dirty_slot_t *slot = &log->slots[i];
+        struct kvm_dirty_log dirty_log = {.slot = slot->slot, .dirty_bitmap = log->kvm_bitmap};
+
+        if (ioctl(log->vmfd, KVM_GET_DIRTY_LOG, &dirty_log) < 0)
+        {
+            err(1, "VMM: KVM_GET_DIRTY_LOG");
+        }
+
+        for (uint64_t word = 0; word < bitmap_words(slot->size); word++)
+            slot->bitmap[word] |= log->kvm_bitmap[word];
+    }
+}
+
+// Brings the slots' bitmaps up to date with what KVM logged
+void dirty_log_collect(dirty_log_t *log)
+{
+    pthread_mutex_lock(&log->lock);
+    collect(log);
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Guest memory the VMM wrote (mem is in one of the slots)
+void dirty_log_mark(dirty_log_t *log, const uint8_t *mem, uint64_t length)
+{
+    pthread_mutex_lock(&log->lock);
+
+    for (int i = 0; i < log->nr_slots; i++)
+    {
+        dirty_slot_t *slot = &log->slots[i];
+
+        if (mem < slot->mem || mem >= slot->mem + slot->size || !length)
+            continue;
+
+        uint64_t offset = mem - slot->mem;
+        uint64_t last = offset + length - 1 < slot->size ? offset + length - 1 : slot->size - 1;
+
+        for (uint64_t page = offset / PAGE_SIZE; page <= last / PAGE_SIZE; page++)
+        {
+            slot->bitmap[page / 64] |= 1ULL << (page % 64);
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Dirty pages in the bitmaps
+uint64_t dirty_log_count(dirty_log_t *log)
+{
+    uint64_t count = 0;
+
+    for (int i = 0; i < log->nr_slots; i++)
+    {
+        for (uint64_t word = 0; word < bitmap_words(log->slots[i].size); word++)
+            count += __builtin_popcountll(log->slots[i].bitmap[word]);
+    }
+
+    return count;
+}
+
+void dirty_log_clear(dirty_log_t *log)
+{
+    pthread_mutex_lock(&log->lock);
+
+    for (int i = 0; i < log->nr_slots; i++)
+    {
+        memset(log->slots[i].bitmap, 0, bitmap_words(log->slots[i].size) * sizeof(uint64_t));
+    }
+
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Collects the dirty pages and moves them to bitmaps, bitmaps[i] for
+// slots[i], in one go: what is written meanwhile stays in the log. Returns
+// how many pages bitmaps have.
+uint64_t dirty_log_take(dirty_log_t *log, uint64_t **bitmaps)
+{
+    uint64_t count = 0;
+
+    pthread_mutex_lock(&log->lock);
+    collect(log);
+
+    for (int i = 0; i < log->nr_slots; i++)
+    {
+        dirty_slot_t *slot = &log->slots[i];
+
+        for (uint64_t word = 0; word < bitmap_words(slot->size); word++)
+        {
+            bitmaps[i][word] |= slot->bitmap[word];
+            slot->bitmap[word] = 0;
+            count += __builtin_popcountll(bitmaps[i][word]);
+        }
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return count;
+}
+
+void destroy_dirty_log(dirty_log_t *log)
+{
+    if (log->ring)
+    {
+        printf("dirty log: %lu pages harvested from the ring, %lu times full\n", log->harvested, log->ring_full);
+        munmap(log->ring, log->ring_entries * sizeof(struct kvm_dirty_gfn));
+    }
+
+    for (int i = 0; i < log->nr_slots; i++)
+    {
+        free(log->slots[i].bitmap);
+    }
+
+    pthread_mutex_destroy(&log->lock);
+    free(log->kvm_bitmap);
+    free(log);
+}
@@ -0,0 +1,61 @@
+#ifndef _DIRTY_H_
+#define _DIRTY_H_
+
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DIRTY_MAX_SLOTS 8
+// 1 MB per vCPU. Smaller rings were seen to overflow (and stall the vCPU)
+// when the host itself runs nested, past the slack KVM keeps for PML flushes.
+#define DIRTY_RING_ENTRIES 65536
+
+// A memory slot whose dirty pages are tracked
+typedef struct dirty_slot
+{
+    int slot;
+    uint64_t gpa;
+    uint8_t *mem;
+    uint64_t size;
+    uint64_t *bitmap; // pages written since they were last collected
+} dirty_slot_t;
+
+// Pages of guest memory written since they were last collected. KVM reports
+// the guest's writes in the vCPU's dirty ring (KVM_CAP_DIRTY_LOG_RING_ACQ_REL):
+// page by page as they happen, harvested when the ring fills up and when the
+// pages are collected. Without it, they are in each memory slot's bitmap,
+// fetched with KVM_GET_DIRTY_LOG. The VMM's own writes are marked by hand.
+// Either way, the slots must log dirty pages (KVM_MEM_LOG_DIRTY_PAGES).
+// The log can be collected from another thread while the vCPU runs.
+typedef struct dirty_log
+{
+    int vmfd;
+    pthread_mutex_t lock; // the ring's fetch index and the bitmaps
+    struct kvm_dirty_gfn *ring; // NULL with bitmaps
+    uint32_t ring_entries;
+    uint32_t fetch; // next entry to harvest
+
+    dirty_slot_t slots[DIRTY_MAX_SLOTS];
+    int nr_slots;
+    uint64_t *kvm_bitmap; // KVM_GET_DIRTY_LOG's, of the largest slot
+
+    uint64_t ring_full; // exits because the ring was full
+    uint64_t harvested;
+} dirty_log_t;
+
+// Before the vCPU is created: returns the number of entries of the rings, 0 if
+// KVM doesn't have them
+uint32_t dirty_ring_enable(int vmfd, uint32_t entries);
+
+dirty_log_t *create_dirty_log(int vmfd, int vcpufd, uint32_t ring_entries);
+void dirty_log_add_slot(dirty_log_t *log, int slot, uint64_t gpa, uint8_t *mem, uint64_t size);
+void dirty_log_harvest(dirty_log_t *log);
+void dirty_log_collect(dirty_log_t *log);
+void dirty_log_mark(dirty_log_t *log, const uint8_t *mem, uint64_t length);
+uint64_t dirty_log_count(dirty_log_t *log);
+void dirty_log_clear(dirty_log_t *log);
+uint64_t dirty_log_take(dirty_log_t *log, uint64_t **bitmaps);
+void destroy_dirty_log(dirty_log_t *log);
+
+#endif
@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include "disk.h"
+#include "cache.h"
+#include "dedup.h"
+#include "iothread.h"
+#include "log.h"
+#include "overlay.h"
+#include "throttle.h"
+
+#define DEFAULT_CACHE_EXTENT_SIZE 4096
+#define DEFAULT_CACHE_SIZE (16 * 1024 * 1024)
+
+typedef struct raw_disk
+{
+    disk_t disk;
+    int fd;
+} raw_disk_t;
+
+size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+// Copy len bytes out of an iovec array, starting skip bytes into it
+void iov_to_buf(const struct iovec *iov, int iovcnt, size_t skip, void *buf, size_t len)
+{
+    uint8_t *dst = buf;
+    for (int i = 0; i < iovcnt && len > 0; i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t n = iov[i].iov_len - skip;
+        n = n < len ? n : len;
+        memcpy(dst, (uint8_t *)iov[i].iov_base + skip, n);
+        dst += n;
+        len -= n;
+        skip = 0;
+    }
+}
+
+// Copy len bytes into an iovec array, starting skip bytes into it
+void iov_from_buf(const struct iovec *iov, int iovcnt, size_t skip, const void *buf, size_t len)
+{
+    const uint8_t *src = buf;
+    for (int i = 0; i < iovcnt && len > 0; i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t n = iov[i].iov_len - skip;
+        n = n < len ? n : len;
+        memcpy((uint8_t *)iov[i].iov_base + skip, src, n);
+        src += n;
+        len -= n;
+        skip = 0;
+    }
+}
+
+// Describe len bytes of an iovec array, starting skip bytes into it, with out
+// (which must have room for iovcnt entries). Returns the number of entries used.
+int iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len, struct iovec *out)
+{
+    int n = 0;
+    for (int i = 0; i < iovcnt && len > 0; i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t chunk = iov[i].iov_len - skip;
+        chunk = chunk < len ? chunk : len;
+        out[n].iov_base = (uint8_t *)iov[i].iov_base + skip;
+        out[n].iov_len = chunk;
+        n++;
+        len -= chunk;
+        skip = 0;
+    }
+    return n;
+}
+
+// Advance an iovec array past n bytes that were already transferred.
+// The array is modified in place.
+static int iov_advance(struct iovec **iov, int iovcnt, size_t n)
+{
+    while (iovcnt > 0 && n >= (*iov)->iov_len)
+    {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        iovcnt--;
+    }
+
+    if (iovcnt > 0)
+    {
+        (*iov)->iov_base = (uint8_t *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+
+    return iovcnt;
+}
+
+// preadv() the whole iovec array, retrying short reads.
+// Anything past the end of the file reads as zeros.
+int fd_readv(int fd, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    struct iovec local[iovcnt];
+    struct iovec *cur = local;
+    memcpy(local, iov, sizeof(local));
+
+    while (iovcnt > 0)
+    {
+        ssize_t n = preadv(fd, cur, iovcnt, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            // Past the end of the file: reads as zeros
+            for (int i = 0; i < iovcnt; i++)
+            {
+                memset(cur[i].iov_base, 0, cur[i].iov_len);
+            }
+            break;
+        }
+
+        offset += n;
+        iovcnt = iov_advance(&cur, iovcnt, n);
+    }
+
+    return 0;
+}
+
+// pwritev() the whole iovec array, retrying short writes
+int fd_writev(int fd, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    struct iovec local[iovcnt];
+    struct iovec *cur = local;
+    memcpy(local, iov, sizeof(local));
+
+    while (iovcnt > 0)
+    {
+        ssize_t n = pwritev(fd, cur, iovcnt, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        offset += n;
+        iovcnt = iov_advance(&cur, iovcnt, n);
+    }
+
+    return 0;
+}
+
+static int raw_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    raw_disk_t *raw = (raw_disk_t *)disk;
+    return fd_readv(raw->fd, iov, iovcnt, offset);
+}
+
+static int raw_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    raw_disk_t *raw = (raw_disk_t *)disk;
+    return fd_writev(raw->fd, iov, iovcnt, offset);
+}
+
+static int raw_flush(disk_t *disk)
+{
+    raw_disk_t *raw = (raw_disk_t *)disk;
+    return fdatasync(raw->fd);
+}
+
+// Deallocate the range in the host file: it then reads as zeros and uses no space
+static int raw_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    raw_disk_t *raw = (raw_disk_t *)disk;
+    return fallocate(raw->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
+
+static uint64_t raw_next_data(disk_t *disk, uint64_t offset)
+{
+    raw_disk_t *raw = (raw_disk_t *)disk;
+    off_t data = lseek(raw->fd, offset, SEEK_DATA);
+
+    if (data < 0)
+        return errno == ENXIO ? disk->size : offset;
+
+    return (uint64_t)data;
+}
+
+static void raw_destroy(disk_t *disk)
+{
+    raw_disk_t *raw = (raw_disk_t *)disk;
+    close(raw->fd);
+    free(raw);
+}
+
+disk_t *create_raw_disk(char *path, bool read_only)
+{
+    int fd = open(path, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    raw_disk_t *raw = (raw_disk_t *)malloc(sizeof(raw_disk_t));
+    raw->fd = fd;
+    raw->disk.readv = &raw_readv;
+    raw->disk.writev = &raw_writev;
+    raw->disk.flush = &raw_flush;
+    raw->disk.discard = read_only ? NULL : &raw_discard;
+    raw->disk.next_data = &raw_next_data;
+    raw->disk.destroy = &raw_destroy;
+    raw->disk.size = st.st_size;
+    return &raw->disk;
+}
+
+// Copy len bytes at offset, skipping all-zero blocks so the destination stays sparse
+static int copy_range_slow(int in, int out, uint64_t offset, uint64_t len)
+{
+    static uint8_t buf[1024 * 1024];
+    static const uint8_t zeros[4096];
+
+    while (len > 0)
+    {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        struct iovec iov = {.iov_base = buf, .iov_len = chunk};
+        if (fd_readv(in, &iov, 1, offset) < 0)
+            return -1;
+
+        for (size_t pos = 0; pos < chunk; pos += sizeof(zeros))
+        {
+            size_t n = chunk - pos < sizeof(zeros) ? chunk - pos : sizeof(zeros);
+            if (memcmp(buf + pos, zeros, n) == 0)
+                continue;
+
+            struct iovec block = {.iov_base = buf + pos, .iov_len = n};
+            if (fd_writev(out, &block, 1, offset + pos) < 0)
+                return -1;
+        }
+
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// Copy a data range, letting the kernel do it (possibly sharing extents) when it can
+static int copy_range(int in, int out, uint64_t offset, uint64_t len, bool *slow)
+{
+    while (len > 0 && !*slow)
+    {
+        loff_t off_in = offset, off_out = offset;
+        ssize_t n = copy_file_range(in, &off_in, out, &off_out, len, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+                return -1;
+            *slow = true;
+            break;
+        }
+
+        offset += n;
+        len -= n;
+    }
+
+    return len > 0 ? copy_range_slow(in, out, offset, len) : 0;
+}
+
+static bool same_file(char *a, char *b)
+{
+    struct stat st_a, st_b;
+    return stat(a, &st_a) == 0 && stat(b, &st_b) == 0 && st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+// Create path as a copy of base: a reflink (FICLONE) when the filesystem supports it,
+// otherwise a copy of the data ranges only (SEEK_DATA/SEEK_HOLE) so holes stay holes.
+void clone_disk_image(char *base, char *path)
+{
+    int in = open(base, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        err(1, "VMM: %s", base);
+    }
+
+    struct stat st;
+    if (fstat(in, &st) < 0)
+    {
+        err(1, "VMM: %s", base);
+    }
+
+    if (same_file(base, path))
+    {
+        errx(1, "VMM: clone %s would overwrite its own base image", path);
+    }
+
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    if (ioctl(out, FICLONE, in) == 0)
+    {
+        printf("disk %s cloned from %s (reflink)\n", path, base);
+        close(in);
+        close(out);
+        return;
+    }
+
+    if (ftruncate(out, st.st_size) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    bool slow = false;
+    uint64_t copied = 0;
+    off_t data = 0;
+
+    while (data < st.st_size)
+    {
+        data = lseek(in, data, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            break; // only holes left
+        if (data < 0 && errno != EINVAL)
+            err(1, "VMM: %s", base);
+
+        off_t hole = data < 0 ? st.st_size : lseek(in, data, SEEK_HOLE);
+        if (data < 0)
+            data = 0; // SEEK_DATA unsupported: everything is data
+        if (hole < 0)
+            hole = st.st_size;
+
+        if (copy_range(in, out, data, hole - data, &slow) < 0)
+        {
+            err(1, "VMM: copying %s to %s", base, path);
+        }
+
+        copied += hole - data;
+        data = hole;
+    }
+
+    printf("disk %s cloned from %s (%lu of %lu bytes copied%s)\n", path, base,
+           copied, (uint64_t)st.st_size, copied && !slow ? " with copy_file_range" : "");
+    close(in);
+    close(out);
+}
+
+void disk_config_init(disk_config_t *config, char *path)
+{
+    memset(config, 0, sizeof(disk_config_t));
+    config->path = path;
+    config->cache_mode = CACHE_WRITEBACK;
+    config->cache_extent_size = DEFAULT_CACHE_EXTENT_SIZE;
+    config->cache_size = DEFAULT_CACHE_SIZE;
+    throttle_config_init(&config->throttle);
+    config->iothread = true;
+}
+
+int parse_cache_mode(const char *name, cache_mode_t *mode)
+{
+    static const char *names[] = {
+        [CACHE_NONE] = "none",
+        [CACHE_WRITEBACK] = "writeback",
+        [CACHE_WRITETHROUGH] = "writethrough",
+        [CACHE_UNSAFE] = "unsafe",
+    };
+
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strcasecmp(name, names[i]) == 0)
+        {
+            *mode = (cache_mode_t)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int parse_disk_format(const char *name, disk_format_t *format)
+{
+    static const char *names[] = {
+        [DISK_FORMAT_AUTO] = "auto",
+        [DISK_FORMAT_RAW] = "raw",
+        [DISK_FORMAT_OVERLAY] = "overlay",
+        [DISK_FORMAT_DEDUP] = "dedup",
+        [DISK_FORMAT_LOG] = "log",
+    };
+
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strcasecmp(name, names[i]) == 0)
+        {
+            *format = (disk_format_t)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int parse_bool(const char *value, bool *b)
+{
+    if (strcasecmp(value, "on") == 0)
+        *b = true;
+    else if (strcasecmp(value, "off") == 0)
+        *b = false;
+    else
+        return -1;
+    return 0;
+}
+
+static int parse_cache_extent(const char *value, int *extent_size)
+{
+    char *end;
+    long size = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || (size != 4096 && size != 65536))
+        return -1;
+
+    *extent_size = (int)size;
+    return 0;
+}
+
+// Set one option of a disk, by the name it has in -drive.
+// Strings are not copied. Returns -1 for an unknown key or an invalid value.
+int disk_config_set(disk_config_t *config, char *key, char *value)
+{
+    if (strcmp(key, "file") == 0)
+        config->path = value;
+    else if (strcmp(key, "backing") == 0)
+        config->backing = value;
+    else if (strcmp(key, "clone") == 0)
+        config->clone = value;
+    else if (strcmp(key, "dedup-store") == 0)
+        config->dedup_store = value;
+    else if (strcmp(key, "format") == 0)
+        return parse_disk_format(value, &config->format);
+    else if (strcmp(key, "cache") == 0)
+        return parse_cache_mode(value, &config->cache_mode);
+    else if (strcmp(key, "cache-extent") == 0)
+        return parse_cache_extent(value, &config->cache_extent_size);
+    else if (strcmp(key, "cache-size") == 0)
+        config->cache_size = (size_t)atoi(value) * 1024 * 1024;
+    else if (strcmp(key, "iops") == 0)
+        config->throttle.iops = strtoull(value, NULL, 0);
+    else if (strcmp(key, "bps") == 0)
+        config->throttle.bps = strtoull(value, NULL, 0);
+    else if (strcmp(key, "burst") == 0)
+        config->throttle.burst = atof(value);
+    else if (strcmp(key, "group") == 0)
+        config->throttle.group = value;
+    else if (strcmp(key, "group-iops") == 0)
+        config->throttle.group_iops = strtoull(value, NULL, 0);
+    else if (strcmp(key, "group-bps") == 0)
+        config->throttle.group_bps = strtoull(value, NULL, 0);
+    else if (strcmp(key, "iothread") == 0)
+        return parse_bool(value, &config->iothread);
+    else
+        return -1;
+
+    return 0;
+}
+
+// Build the backend stack described by config
+disk_t *create_disk(disk_config_t *config)
+{
+    disk_t *disk;
+
+    if (config->backing && config->clone)
+    {
+        errx(1, "VMM: a disk can't be both an overlay and a clone");
+    }
+
+    if (config->backing && config->format == DISK_FORMAT_RAW)
+    {
+        errx(1, "VMM: a disk with a backing image is an overlay");
+    }
+
+    if (config->backing && config->dedup_store)
+    {
+        errx(1, "VMM: a disk can't be both an overlay and a dedup image");
+    }
+
+    if (config->backing)
+    {
+        create_overlay_image(config->path, config->backing);
+        remove_log_segments(config->path);
+    }
+
+    // The guest writes whatever it wants in a raw image, headers included:
+    // only the options tell what the image is, never its content
+    disk_format_t format = config->format;
+    if (format == DISK_FORMAT_AUTO && config->backing)
+        format = DISK_FORMAT_OVERLAY;
+    else if (format == DISK_FORMAT_AUTO && config->dedup_store)
+        format = DISK_FORMAT_DEDUP;
+
+    if (config->clone)
+    {
+        // The dedup image being replaced drops its chunks
+        if (format == DISK_FORMAT_DEDUP && !same_file(config->clone, config->path) && is_dedup_image(config->path))
+        {
+            release_dedup_chunks(config->path);
+        }
+
+        clone_disk_image(config->clone, config->path);
+        remove_log_segments(config->path);
+        // A raw clone becomes a dedup image below, with its own references
+        if (format == DISK_FORMAT_DEDUP && is_dedup_image(config->path))
+        {
+            share_dedup_chunks(config->path);
+        }
+    }
+
+    // Unless it's one already (a dedup image made by an earlier run)
+    if (config->dedup_store && !is_dedup_image(config->path))
+    {
+        create_dedup_image(config->path, config->dedup_store);
+    }
+
+    if (format == DISK_FORMAT_OVERLAY)
+    {
+        disk = create_overlay_disk(config->path);
+    }
+    else if (format == DISK_FORMAT_DEDUP)
+    {
+        disk = create_dedup_disk(config->path);
+    }
+    else
+    {
+        disk = create_raw_disk(config->path, false);
+    }
+
+    // Leftover segments hold data that isn't in the image yet: always replay them
+    if (config->format == DISK_FORMAT_LOG || has_log_segments(config->path))
+    {
+        disk = create_log_disk(disk, config->path);
+    }
+
+    if (config->cache_mode != CACHE_NONE)
+    {
+        disk = create_cache_disk(disk, config->cache_mode, config->cache_extent_size, config->cache_size);
+    }
+
+    if (config->iothread)
+    {
+        bool posted = config->cache_mode == CACHE_WRITEBACK || config->cache_mode == CACHE_UNSAFE;
+        disk = create_iothread_disk(disk, posted);
+    }
+
+    // On top of everything: the limits are on what the guest does, so a
+    // request waits for its tokens before it's posted to the I/O thread
+    if (throttle_enabled(&config->throttle))
+    {
+        disk = create_throttle_disk(disk, &config->throttle);
+    }
+
+    return disk;
+}
+
+void destroy_disk(disk_t *disk)
+{
+    disk->destroy(disk);
+}
+
+static int check_bounds(disk_t *disk, int sector_idx, int sector_count)
+{
+    if (sector_idx < 0 || sector_count < 0 ||
+        ((uint64_t)sector_idx + (uint64_t)sector_count) * SECTOR_SIZE > disk->size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int disk_read_sectors(disk_t *disk, int sector_idx, int sector_count, void *buf)
+{
+    if (check_bounds(disk, sector_idx, sector_count) < 0)
+        return -1;
+
+    struct iovec iov = {.iov_base = buf, .iov_len = (size_t)sector_count * SECTOR_SIZE};
+    return disk->readv(disk, &iov, 1, (uint64_t)sector_idx * SECTOR_SIZE);
+}
+
+int disk_write_sectors(disk_t *disk, int sector_idx, int sector_count, void *buf)
+{
+    if (check_bounds(disk, sector_idx, sector_count) < 0)
+        return -1;
+
+    struct iovec iov = {.iov_base = buf, .iov_len = (size_t)sector_count * SECTOR_SIZE};
+    return disk->writev(disk, &iov, 1, (uint64_t)sector_idx * SECTOR_SIZE);
+}
+
+int disk_flush(disk_t *disk)
+{
+    return disk->flush(disk);
+}
+
+int disk_discard_sectors(disk_t *disk, uint64_t sector_idx, uint64_t sector_count)
+{
+    uint64_t nsect = disk->size / SECTOR_SIZE;
+
+    // Without overflows: a negative int from the guest is a huge value here
+    if (sector_idx >= nsect || sector_count > nsect - sector_idx)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!disk->discard || sector_count == 0)
+        return 0;
+
+    return disk->discard(disk, sector_idx * SECTOR_SIZE, sector_count * SECTOR_SIZE);
+}
+
+// Offset of the first byte at or after offset that may hold data (anything
+// before it reads as zeros), disk->size if there is none.
+// Backends that can't tell report everything as data.
+uint64_t disk_next_data(disk_t *disk, uint64_t offset)
+{
+    if (!disk->next_data)
+        return offset;
+
+    uint64_t data = disk->next_data(disk, offset);
+    return data < disk->size ? data : disk->size;
+}
@@ -0,0 +1,95 @@
+#ifndef _DISK_H_
+#define _DISK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "shared/ide.h"
+
+typedef enum
+{
+    CACHE_NONE,         // no cache, every request goes to the backend
+    CACHE_WRITEBACK,    // writes stay in the cache until a flush or an eviction
+    CACHE_WRITETHROUGH, // writes go to the backend and are flushed right away
+    CACHE_UNSAFE,       // like writeback, but guest flushes are ignored
+} cache_mode_t;
+
+typedef enum
+{
+    DISK_FORMAT_AUTO,    // overlay with a backing image, dedup with a store, raw otherwise
+    DISK_FORMAT_RAW,
+    DISK_FORMAT_OVERLAY,
+    DISK_FORMAT_DEDUP,
+    DISK_FORMAT_LOG,     // raw, with a log-structured layer in front of it
+} disk_format_t;
+
+// I/O limits of a disk, see throttle.c. 0 means unlimited.
+typedef struct throttle_config
+{
+    uint64_t iops;
+    uint64_t bps;
+    double burst; // seconds worth of I/O an idle disk may do at once
+    char *group;  // disks in the same group are scheduled fairly and share the group limits
+    uint64_t group_iops;
+    uint64_t group_bps;
+} throttle_config_t;
+
+// How a disk is put together, see create_disk().
+typedef struct disk_config
+{
+    char *path;
+    char *backing; // when set, create path as a new overlay on top of this image
+    char *clone;   // when set, create path as a copy of this image
+    char *dedup_store; // when set, move path into this chunk store (unless it's already a dedup image)
+    disk_format_t format;
+    cache_mode_t cache_mode;
+    int cache_extent_size;
+    size_t cache_size;
+    throttle_config_t throttle;
+    bool iothread; // give the disk its own I/O thread, see iothread.c
+} disk_config_t;
+
+// A block device backend.
+// Layers (e.g. the block cache) implement the same interface on top of another
+// disk, so devices never know what they talk to.
+// All offsets and lengths are multiples of SECTOR_SIZE.
+// Functions return 0 on success, -1 with errno set on failure.
+struct disk
+{
+    int (*readv)(struct disk *disk, const struct iovec *iov, int iovcnt, uint64_t offset);
+    int (*writev)(struct disk *disk, const struct iovec *iov, int iovcnt, uint64_t offset);
+    int (*flush)(struct disk *disk);
+    int (*discard)(struct disk *disk, uint64_t offset, uint64_t length); // optional
+    uint64_t (*next_data)(struct disk *disk, uint64_t offset);           // optional, see disk_next_data()
+    void (*destroy)(struct disk *disk);
+    uint64_t size;
+};
+
+typedef struct disk disk_t;
+
+void disk_config_init(disk_config_t *config, char *path);
+int parse_cache_mode(const char *name, cache_mode_t *mode);
+int parse_disk_format(const char *name, disk_format_t *format);
+int disk_config_set(disk_config_t *config, char *key, char *value);
+disk_t *create_disk(disk_config_t *config);
+void destroy_disk(disk_t *disk);
+
+disk_t *create_raw_disk(char *path, bool read_only);
+void clone_disk_image(char *base, char *path);
+
+int disk_read_sectors(disk_t *disk, int sector_idx, int sector_count, void *buf);
+int disk_write_sectors(disk_t *disk, int sector_idx, int sector_count, void *buf);
+int disk_flush(disk_t *disk);
+int disk_discard_sectors(disk_t *disk, uint64_t sector_idx, uint64_t sector_count);
+uint64_t disk_next_data(disk_t *disk, uint64_t offset);
+
+size_t iov_length(const struct iovec *iov, int iovcnt);
+void iov_to_buf(const struct iovec *iov, int iovcnt, size_t skip, void *buf, size_t len);
+void iov_from_buf(const struct iovec *iov, int iovcnt, size_t skip, const void *buf, size_t len);
+int fd_readv(int fd, const struct iovec *iov, int iovcnt, uint64_t offset);
+int fd_writev(int fd, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len, struct iovec *out);
+
+#endif
@@ -0,0 +1,271 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "exitlog.h"
+
+#define LOG_BUFFER_SIZE (1024 * 1024)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void write_log(exit_log_t *log, const void *buf, size_t length)
+{
+    if (length && fwrite(buf, length, 1, log->file) != 1)
+    {
+        err(1, "VMM: writing the exit log");
+    }
+}
+
+static exit_log_t *alloc_exit_log(FILE *file)
+{
+    exit_log_t *log = (exit_log_t *)calloc(1, sizeof(exit_log_t));
+    log->file = file;
+    pthread_mutex_init(&log->lock, NULL);
+    setvbuf(file, NULL, _IOFBF, LOG_BUFFER_SIZE);
+    return log;
+}
+
+exit_log_t *create_exit_log(const char *path, const exit_log_header_t *header)
+{
+    FILE *file = fopen(path, "wb");
+
+    if (!file)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    exit_log_t *log = alloc_exit_log(file);
+    exit_log_header_t h = *header;
+    memcpy(h.magic, EXIT_LOG_MAGIC, sizeof(h.magic));
+    write_log(log, &h, sizeof(h));
+
+    printf("exits recorded to %s\n", path);
+    return log;
+}
+
+void exit_log_lock(exit_log_t *log)
+{
+    pthread_mutex_lock(&log->lock);
+}
+
+void exit_log_unlock(exit_log_t *log)
+{
+    pthread_mutex_unlock(&log->lock);
+}
+
+// Data of an exit, NULL if there is none or it is too large
+static uint8_t *exit_data(struct kvm_run *run, uint32_t *length)
+{
+    if (run->exit_reason == KVM_EXIT_IO)
+    {
+        *length = (uint32_t)run->io.size * run->io.count;
+        return *length <= EXIT_LOG_MAX_DATA ? (uint8_t *)run + run->io.data_offset : NULL;
+    }
+
+    *length = run->mmio.len;
+    return run->mmio.data;
+}
+
+// Called with the lock held, before the exit is handled
+void exit_log_begin(exit_log_t *log, struct kvm_run *run)
+{
+    exit_record_t *record = &log->record;
+    memset(record, 0, sizeof(exit_record_t));
+
+    if (run->exit_reason == KVM_EXIT_IO)
+    {
+        record->type = EXIT_RECORD_IO;
+        record->size = run->io.size;
+        record->direction = run->io.direction;
+        record->port = run->io.port;
+        record->count = run->io.count;
+    }
+    else
+    {
+        record->type = EXIT_RECORD_MMIO;
+        record->size = run->mmio.len;
+        record->direction = run->mmio.is_write;
+        record->addr = run->mmio.phys_addr;
+    }
+
+    // What the guest wrote: the device model may reuse the buffer
+    uint32_t length;
+    uint8_t *data = exit_data(run, &length);
+    bool out = record->type == EXIT_RECORD_IO ? record->direction == KVM_EXIT_IO_OUT : record->direction;
+
+    if (!data)
+    {
+        errx(1, "VMM: exit with %u bytes of data, too many to record", length);
+    }
+
+    if (out)
+    {
+        memcpy(log->data, data, length);
+    }
+
+    log->in_exit = true;
+    log->start_ns = now_ns();
+}
+
+// Registers the device model read (out = false) or set (out = true) while
+// handling the exit. Only the first ones read are what the guest gave.
+void exit_log_regs(exit_log_t *log, const struct kvm_regs *regs, bool out)
+{
+    if (!log->in_exit)
+        return;
+
+    if (out)
+    {
+        log->regs[1] = *regs;
+        log->record.flags |= EXIT_REGS_OUT;
+    }
+    else if (!(log->record.flags & EXIT_REGS_IN))
+    {
+        log->regs[0] = *regs;
+        log->record.flags |= EXIT_REGS_IN;
+    }
+}
+
+// Called with the lock held, once the exit was handled
+void exit_log_end(exit_log_t *log, struct kvm_run *run)
+{
+    exit_record_t *record = &log->record;
+    record->ns = (uint32_t)(now_ns() - log->start_ns);
+    log->in_exit = false;
+
+    uint32_t length;
+    uint8_t *data = exit_data(run, &length);
+    bool out = record->type == EXIT_RECORD_IO ? record->direction == KVM_EXIT_IO_OUT : record->direction;
+
+    // What the device model answered
+    if (!out)
+    {
+        memcpy(log->data, data, length);
+    }
+
+    write_log(log, record, sizeof(exit_record_t));
+    write_log(log, log->data, length);
+
+    if (record->flags & EXIT_REGS_IN)
+        write_log(log, &log->regs[0], sizeof(struct kvm_regs));
+    if (record->flags & EXIT_REGS_OUT)
+        write_log(log, &log->regs[1], sizeof(struct kvm_regs));
+
+    log->exits++;
+}
+
+// Called with the lock held
+void exit_log_memory(exit_log_t *log, uint64_t gpa, const void *data, uint32_t length)
+{
+    exit_record_t record = {.type = EXIT_RECORD_MEMORY, .count = length, .addr = gpa};
+
+    write_log(log, &record, sizeof(record));
+    write_log(log, data, length);
+    log->changes++;
+}
+
+// Called with the lock held
+void exit_log_key(exit_log_t *log, int scancode, bool pressed)
+{
+    exit_record_t record = {.type = EXIT_RECORD_KEY, .count = pressed, .addr = scancode};
+
+    write_log(log, &record, sizeof(record));
+    log->keys++;
+}
+
+exit_log_t *open_exit_log(const char *path, exit_log_header_t *header)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (!file)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    if (fread(header, sizeof(exit_log_header_t), 1, file) != 1 ||
+        memcmp(header->magic, EXIT_LOG_MAGIC, sizeof(header->magic)) != 0)
+    {
+        errx(1, "VMM: %s is not an exit log", path);
+    }
+
+    return alloc_exit_log(file);
+}
+
+static void read_log(exit_log_t *log, void *buf, size_t length)
+{
+    if (length && fread(buf, length, 1, log->file) != 1)
+    {
+        errx(1, "VMM: truncated exit log");
+    }
+}
+
+// Reads the next record, its data (EXIT_LOG_MAX_DATA bytes at most) and, if
+// the record has them, its registers. Returns false at the end of the log.
+bool exit_log_read(exit_log_t *log, exit_record_t *record, void *data, struct kvm_regs *regs_in,
+                   struct kvm_regs *regs_out)
+{
+    if (fread(record, sizeof(exit_record_t), 1, log->file) != 1)
+    {
+        if (ferror(log->file))
+        {
+            err(1, "VMM: reading the exit log");
+        }
+        return false;
+    }
+
+    uint32_t length;
+
+    switch (record->type)
+    {
+    case EXIT_RECORD_IO:
+        length = (uint32_t)record->size * record->count;
+        log->exits++;
+        break;
+    case EXIT_RECORD_MMIO:
+        length = record->size;
+        log->exits++;
+        break;
+    case EXIT_RECORD_MEMORY:
+        length = record->count;
+        log->changes++;
+        break;
+    case EXIT_RECORD_KEY:
+        length = 0;
+        log->keys++;
+        break;
+    default:
+        errx(1, "VMM: unknown record type %u in the exit log", record->type);
+    }
+
+    if (length > EXIT_LOG_MAX_DATA)
+    {
+        errx(1, "VMM: exit log record with %u bytes of data", length);
+    }
+
+    read_log(log, data, length);
+
+    if (record->flags & EXIT_REGS_IN)
+        read_log(log, regs_in, sizeof(struct kvm_regs));
+    if (record->flags & EXIT_REGS_OUT)
+        read_log(log, regs_out, sizeof(struct kvm_regs));
+
+    return true;
+}
+
+void destroy_exit_log(exit_log_t *log)
+{
+    printf("exit log: %lu exits, %lu guest memory changes, %lu key events\n", log->exits, log->changes, log->keys);
+
+    if (fclose(log->file) != 0)
+    {
+        warn("VMM: closing the exit log");
+    }
+
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
@@ -0,0 +1,97 @@
+#ifndef _EXITLOG_H_
+#define _EXITLOG_H_
+
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Exit log: every exit the VMM handled, with what the guest gave the device
+// models (the I/O data, the registers they read, the guest memory it wrote
+// since the previous exit) and what they answered (the I/O data read, the
+// registers they set). Replaying it feeds the device models the same exits
+// without KVM, see -replay-exits.
+//
+// The log is a header followed by records, each an exit_record_t then its
+// data (IO: size * count bytes, MMIO: size bytes, MEMORY: count bytes) and
+// the registers its flags announce.
+
+#define EXIT_LOG_MAGIC "VMMEXIT1"
+#define EXIT_LOG_MAX_DATA 4096 // KVM's I/O data is in one page of kvm_run
+
+// Header flags: devices the VM had
+#define EXIT_LOG_SERIAL 0x1
+
+typedef struct exit_log_header
+{
+    char magic[8];
+    uint32_t flags;
+    uint32_t ide_channels; // bitmask of the channels with a drive
+    uint32_t pv_queues;    // bitmask of the queues with a drive
+    uint32_t reserved;
+    uint64_t guest_mem_size;
+} exit_log_header_t;
+
+typedef enum
+{
+    EXIT_RECORD_IO = 1,
+    EXIT_RECORD_MMIO,
+    EXIT_RECORD_MEMORY, // bytes of guest memory the guest changed (or initially there)
+    EXIT_RECORD_KEY,    // key event from the display loop
+} exit_record_type_t;
+
+// Record flags
+#define EXIT_REGS_IN 0x1  // the registers the device model read follow
+#define EXIT_REGS_OUT 0x2 // then the registers it set
+
+typedef struct exit_record
+{
+    uint8_t type;
+    uint8_t flags;
+    uint8_t size;      // IO: access size, MMIO: length
+    uint8_t direction; // IO: KVM_EXIT_IO_IN or _OUT, MMIO: is_write
+    uint16_t port;
+    uint16_t reserved;
+    uint32_t count; // IO: repetitions, MEMORY: bytes, KEY: pressed
+    uint32_t ns;    // time the VMM took to handle the exit
+    uint64_t addr;  // MMIO, MEMORY: guest-physical address, KEY: SDL scancode
+} exit_record_t;
+
+typedef struct exit_log
+{
+    FILE *file;
+    pthread_mutex_t lock;
+
+    // Exit being handled, while recording
+    bool in_exit;
+    uint64_t start_ns;
+    exit_record_t record;
+    uint8_t data[EXIT_LOG_MAX_DATA];
+    struct kvm_regs regs[2]; // in, out
+
+    uint64_t exits;
+    uint64_t changes; // memory records
+    uint64_t keys;
+} exit_log_t;
+
+// Recording. Exits and key events are recorded with the lock held, and
+// applied to the device models under it too: the log has them in the order
+// the devices saw them.
+exit_log_t *create_exit_log(const char *path, const exit_log_header_t *header);
+void exit_log_lock(exit_log_t *log);
+void exit_log_unlock(exit_log_t *log);
+void exit_log_begin(exit_log_t *log, struct kvm_run *run);
+void exit_log_regs(exit_log_t *log, const struct kvm_regs *regs, bool out);
+void exit_log_end(exit_log_t *log, struct kvm_run *run);
+void exit_log_memory(exit_log_t *log, uint64_t gpa, const void *data, uint32_t length);
+void exit_log_key(exit_log_t *log, int scancode, bool pressed);
+
+// Replay
+exit_log_t *open_exit_log(const char *path, exit_log_header_t *header);
+bool exit_log_read(exit_log_t *log, exit_record_t *record, void *data, struct kvm_regs *regs_in,
+                   struct kvm_regs *regs_out);
+
+void destroy_exit_log(exit_log_t *log);
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "forkserver.h"
+#include "unixsock.h"
+
+static volatile sig_atomic_t stopping;
+
+static void stop_serving(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+fork_server_t *create_fork_server(char *path)
+{
+    fork_server_t *fs = (fork_server_t *)calloc(1, sizeof(fork_server_t));
+    fs->path = path;
+    fs->sock = listen_unix_socket(path);
+    fs->start_ns = now_ns();
+    return fs;
+}
+
+void destroy_fork_server(fork_server_t *fs)
+{
+    close(fs->sock);
+    unlink(fs->path);
+    free(fs);
+}
+
+// Resident memory of the process, proportional share of it (pages shared with
+// other processes count for their share) and private memory it wrote
+static void print_memory_usage(const char *who)
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    unsigned long rss = 0, pss = 0, dirty = 0;
+    char line[256];
+
+    if (!fp)
+    {
+        warn("VMM: /proc/self/smaps_rollup");
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        sscanf(line, "Rss: %lu", &rss);
+        sscanf(line, "Pss: %lu", &pss);
+        sscanf(line, "Private_Dirty: %lu", &dirty);
+    }
+
+    fclose(fp);
+    printf("%s: RSS %lu KB, PSS %lu KB, %lu KB private dirty\n", who, rss, pss, dirty);
+}
+
+// Where the device models expect it, without copying anything
+void make_private(void *mem, uint64_t size, int fd)
+{
+    if (mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        err(1, "VMM: mapping guest memory copy-on-write");
+    }
+}
+
+// In the forked process: the clone's output goes to the connection
+static void start_clone(fork_server_t *fs, const fork_server_ops_t *ops, int conn, uint64_t start)
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    close(fs->sock);
+
+    if (dup2(conn, STDOUT_FILENO) < 0 || dup2(conn, STDERR_FILENO) < 0)
+    {
+        err(1, "VMM: dup2");
+    }
+
+    close(conn);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    ops->run_clone(start);
+    print_memory_usage("clone");
+    exit(EXIT_SUCCESS);
+}
+
+void fork_server_serve(fork_server_t *fs, const fork_server_ops_t *ops)
+{
+    printf("fork-server: guest ready in %.1f ms, serving clones on %s\n", (now_ns() - fs->start_ns) / 1e6,
+           fs->path);
+    print_memory_usage("fork-server");
+
+    // Without SA_RESTART, so that accept() returns; the kernel reaps the clones
+    struct sigaction action = {.sa_handler = &stop_serving};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGCHLD, SIG_IGN);
+
+    while (!stopping)
+    {
+        int conn = accept4(fs->sock, NULL, NULL, SOCK_CLOEXEC);
+        uint64_t start = now_ns();
+
+        if (conn < 0)
+        {
+            if (errno != EINTR)
+                warn("fork-server: accept");
+            continue;
+        }
+
+        fflush(stdout);
+        ops->flush();
+
+        fs->clones++;
+        pid_t pid = fork();
+
+        if (pid == 0)
+        {
+            start_clone(fs, ops, conn, start);
+        }
+
+        if (pid < 0)
+        {
+            warn("fork-server: fork");
+        }
+
+        close(conn);
+    }
+
+    printf("fork-server: stopping after %lu clones\n", fs->clones);
+}
+
+// -clone
+int clone_main(const char *path)
+{
+    int sock = connect_unix_socket(path);
+
+    char buf[4096];
+    ssize_t length;
+
+    while ((length = read(sock, buf, sizeof(buf))) > 0)
+    {
+        if (write(STDOUT_FILENO, buf, length) != length)
+        {
+            err(1, "VMM: writing the clone's output");
+        }
+    }
+
+    close(sock);
+    return EXIT_SUCCESS;
+}
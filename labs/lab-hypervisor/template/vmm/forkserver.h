@@ -0,0 +1,45 @@
+#ifndef _FORKSERVER_H_
+#define _FORKSERVER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fork server (-fork-server): the guest runs up to its ready point
+// (SNAPSHOT_TAKE), then every connection to the socket gets a clone of the VM
+// from there, in a forked process whose output goes to the connection
+// (-clone). The clones share the server's memory copy-on-write, see
+// make_private().
+typedef struct fork_server
+{
+    char *path;
+    int sock;
+    bool at_ready_point; // the server's guest got there: vm_run returns
+    uint64_t start_ns;
+    uint64_t clones;
+} fork_server_t;
+
+// What the server does around its fork()s
+typedef struct fork_server_ops
+{
+    // Before each one: flushes what is buffered, or every clone would write it again
+    void (*flush)(void);
+    // In the clone: runs it, start_ns being when the connection came, and exits
+    void (*run_clone)(uint64_t start_ns);
+} fork_server_ops_t;
+
+// The socket is listened on right away, connections wait there until the
+// guest is ready
+fork_server_t *create_fork_server(char *path);
+// Once the guest is at its ready point: a clone for each connection, until
+// SIGINT or SIGTERM
+void fork_server_serve(fork_server_t *fs, const fork_server_ops_t *ops);
+void destroy_fork_server(fork_server_t *fs);
+
+// In a clone: the shared mapping of fd at mem becomes a private, copy-on-write
+// one, at the same address
+void make_private(void *mem, uint64_t size, int fd);
+
+// Has a fork server start a clone and shows its output until it's done
+int clone_main(const char *path);
+
+#endif
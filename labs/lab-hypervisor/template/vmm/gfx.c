@@ -146,3 +146,31 @@ SDL_Keycode gfx_keypressed()
     }
     return 0;
 }
+
+/// Wait for a key to be pressed or released (key repeats count as presses).
+/// Other events are handled on the way.
+/// @param timeout_ms How long to wait at most, in milliseconds; 0 doesn't wait.
+/// @param scancode Where to store the key's scancode.
+/// @param pressed Where to store whether the key was pressed or released.
+/// @return true if a key was pressed or released, false if none was in time.
+bool gfx_wait_key(int timeout_ms, SDL_Scancode *scancode, bool *pressed)
+{
+    uint32_t deadline = SDL_GetTicks() + timeout_ms;
+    SDL_Event event;
+
+    for (;;)
+    {
+        int remaining = (int32_t)(deadline - SDL_GetTicks());
+        int got = remaining > 0 ? SDL_WaitEventTimeout(&event, remaining) : SDL_PollEvent(&event);
+
+        if (!got)
+            return false;
+
+        if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+        {
+            *scancode = event.key.keysym.scancode;
+            *pressed = event.type == SDL_KEYDOWN;
+            return true;
+        }
+    }
+}
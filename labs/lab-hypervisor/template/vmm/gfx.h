@@ -38,5 +38,6 @@ extern gfx_context_t *gfx_create(char *text, int width, int height);
 extern void gfx_destroy(gfx_context_t *ctxt);
 extern void gfx_present(gfx_context_t *ctxt);
 extern SDL_Keycode gfx_keypressed();
+extern bool gfx_wait_key(int timeout_ms, SDL_Scancode *scancode, bool *pressed);
 
 #endif
@@ -4,6 +4,7 @@
 #define DIRECTION_OUT KVM_EXIT_IO_OUT
 
 void write_file(ide_t *ide);
+void trim_ranges(ide_t *ide);
 
 void state_1(struct ide *ide, struct kvm_run *run);
 void state_2(struct ide *ide, struct kvm_run *run);
@@ -14,6 +15,14 @@ void state_6(struct ide *ide, struct kvm_run *run);
 void state_7(struct ide *ide, struct kvm_run *run);
 void state_8(struct ide *ide, struct kvm_run *run);
 void state_9(struct ide *ide, struct kvm_run *run);
+void state_flush(struct ide *ide, struct kvm_run *run);
+
+// The states by number, which saved states have instead of their address
+static void (*const ide_steps[])(struct ide *ide, struct kvm_run *run) = {
+    &state_1, &state_2, &state_3, &state_4, &state_5, &state_6, &state_7, &state_8, &state_9, &state_flush,
+};
+
+#define IDE_STEPS (int)(sizeof(ide_steps) / sizeof(ide_steps[0]))
 
 void reset_and_goto_1(struct ide *ide)
 {
@@ -21,12 +30,14 @@ void reset_and_goto_1(struct ide *ide)
     memset(ide->data, 0, SECTOR_SIZE);
     ide->data_count = 0;
     ide->sector_idx = 0;
+    ide->features = 0;
+    ide->command = 0;
     ide->next = &state_1;
 }
 
 void state_1(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_IN && run->io.size == 1 && run->io.port == STATUS_PORT)
+    if (run->io.direction == DIRECTION_IN && run->io.size == 1 && run->io.port == ide->base + ATA_REG_STATUS)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         *addr = 0x40;
@@ -39,7 +50,33 @@ void state_1(struct ide *ide, struct kvm_run *run)
 
 void state_2(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == 0x1F2)
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_STATUS)
+    {
+        uint8_t *addr = (uint8_t *)run + run->io.data_offset;
+        uint32_t value = *addr;
+
+        if (value == ATA_CMD_FLUSH_CACHE)
+        {
+            printf("flushing cache\n");
+            if (disk_flush(ide->disk) < 0)
+            {
+                perror("flush failed");
+            }
+            ide->next = &state_flush;
+            return;
+        }
+    }
+
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_FEATURES)
+    {
+        uint8_t *addr = (uint8_t *)run + run->io.data_offset;
+        ide->features = *addr;
+
+        printf("features set to 0x%x\n", ide->features);
+        return;
+    }
+
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_COUNT)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         uint32_t value = *addr;
@@ -57,7 +94,7 @@ void state_2(struct ide *ide, struct kvm_run *run)
 
 void state_3(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == 0x1F3)
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_LBA0)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         uint32_t value = *addr;
@@ -73,7 +110,7 @@ void state_3(struct ide *ide, struct kvm_run *run)
 
 void state_4(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == 0x1F4)
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_LBA1)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         uint32_t value = *addr;
@@ -89,7 +126,7 @@ void state_4(struct ide *ide, struct kvm_run *run)
 
 void state_5(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == 0x1F5)
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_LBA2)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         uint32_t value = *addr;
@@ -105,7 +142,7 @@ void state_5(struct ide *ide, struct kvm_run *run)
 
 void state_6(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == 0x1F6)
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_DEVICE)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         uint32_t value = (*addr) & 0x0F;
@@ -123,14 +160,23 @@ void state_6(struct ide *ide, struct kvm_run *run)
 
 void state_7(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == STATUS_PORT)
+    if (run->io.direction == DIRECTION_OUT && run->io.size == 1 && run->io.port == ide->base + ATA_REG_STATUS)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         uint32_t value = *addr;
 
-        if (value == 0x30)
+        if (value == ATA_CMD_WRITE_SECTORS)
         {
             printf("now writing with retry\n");
+            ide->command = value;
+            ide->next = &state_8;
+            return;
+        }
+
+        if (value == ATA_CMD_DATA_SET_MANAGEMENT && ide->features == ATA_DSM_TRIM)
+        {
+            printf("now receiving trim ranges\n");
+            ide->command = value;
             ide->next = &state_8;
             return;
         }
@@ -141,7 +187,7 @@ void state_7(struct ide *ide, struct kvm_run *run)
 
 void state_8(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_IN && run->io.size == 1 && run->io.port == STATUS_PORT)
+    if (run->io.direction == DIRECTION_IN && run->io.size == 1 && run->io.port == ide->base + ATA_REG_STATUS)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         *addr = 0x40;
@@ -156,7 +202,7 @@ void state_8(struct ide *ide, struct kvm_run *run)
 
 void state_9(struct ide *ide, struct kvm_run *run)
 {
-    if (run->io.direction == DIRECTION_OUT && run->io.port == DATA_PORT)
+    if (run->io.direction == DIRECTION_OUT && run->io.port == ide->base + ATA_REG_DATA)
     {
         int size = run->io.size;
 
@@ -194,8 +240,8 @@ void state_9(struct ide *ide, struct kvm_run *run)
         }
         case 4:
         {
-            uint64_t *data = (uint64_t *)(ide->data + ide->data_count);
-            uint64_t value = *(uint64_t *)addr;
+            uint32_t *data = (uint32_t *)(ide->data + ide->data_count);
+            uint32_t value = *(uint32_t *)addr;
             *data = value;
             break;
         }
@@ -206,7 +252,10 @@ void state_9(struct ide *ide, struct kvm_run *run)
         if (ide->data_count == SECTOR_SIZE)
         {
             printf("received all data\n");
-            write_file(ide);
+            if (ide->command == ATA_CMD_DATA_SET_MANAGEMENT)
+                trim_ranges(ide);
+            else
+                write_file(ide);
             reset_and_goto_1(ide);
             return;
         }
@@ -218,31 +267,91 @@ void state_9(struct ide *ide, struct kvm_run *run)
     reset_and_goto_1(ide);
 }
 
+void state_flush(struct ide *ide, struct kvm_run *run)
+{
+    if (run->io.direction == DIRECTION_IN && run->io.size == 1 && run->io.port == ide->base + ATA_REG_STATUS)
+    {
+        uint8_t *addr = (uint8_t *)run + run->io.data_offset;
+        *addr = 0x40;
+
+        printf("flush done\n");
+    }
+
+    reset_and_goto_1(ide);
+}
+
 void write_file(ide_t *ide)
 {
-    write_data_to_sector(ide->disk_path, ide->sector_idx, ide->data);
+    write_data_to_sector(ide->disk, ide->sector_idx, ide->data);
 }
 
-void write_data_to_sector(char *disk_path, int sector_idx, void *data)
+// The data block of a TRIM command holds up to 64 range entries
+void trim_ranges(ide_t *ide)
 {
-    printf("writing to file %s\n", disk_path);
-    FILE *fp = fopen(disk_path, "r+b");
-    if (fp == NULL)
+    uint64_t *entries = (uint64_t *)ide->data;
+
+    for (int i = 0; i < SECTOR_SIZE / 8; i++)
     {
-        printf("failed to open disk.img\n");
-        return;
+        uint64_t lba = ATA_DSM_RANGE_LBA(entries[i]);
+        uint64_t count = ATA_DSM_RANGE_COUNT(entries[i]);
+
+        if (count == 0)
+            continue;
+
+        printf("trimming %lu sectors from %lu\n", count, lba);
+        if (disk_discard_sectors(ide->disk, lba, count) < 0)
+        {
+            perror("failed to trim sectors");
+        }
     }
+}
 
-    fseek(fp, sector_idx * SECTOR_SIZE, SEEK_SET);
-    fwrite(data, 1, SECTOR_SIZE, fp);
-    fclose(fp);
+void write_data_to_sector(disk_t *disk, int sector_idx, void *data)
+{
+    printf("writing sector %d\n", sector_idx);
+    if (disk_write_sectors(disk, sector_idx, 1, data) < 0)
+    {
+        perror("failed to write sector");
+    }
+}
+
+bool ide_owns_port(ide_t *ide, uint16_t port)
+{
+    return port >= ide->base && port < ide->base + ATA_REGS;
+}
+
+void ide_save_state(ide_t *ide, ide_state_t *state)
+{
+    state->step = 0;
+    for (int i = 0; i < IDE_STEPS; i++)
+    {
+        if (ide_steps[i] == ide->next)
+            state->step = i;
+    }
+
+    state->sector_idx = ide->sector_idx;
+    state->features = ide->features;
+    state->command = ide->command;
+    state->data_count = ide->data_count;
+    memcpy(state->data, ide->data, SECTOR_SIZE);
+}
+
+void ide_restore_state(ide_t *ide, const ide_state_t *state)
+{
+    ide->next = state->step >= 0 && state->step < IDE_STEPS ? ide_steps[state->step] : &state_1;
+    ide->sector_idx = state->sector_idx;
+    ide->features = state->features;
+    ide->command = state->command;
+    ide->data_count = state->data_count;
+    memcpy(ide->data, state->data, SECTOR_SIZE);
 }
 
-ide_t *create_ide_state_machine(char *disk_path)
+ide_t *create_ide_state_machine(disk_t *disk, uint16_t base)
 {
     ide_t *ide = (ide_t *)malloc(sizeof(ide_t));
     ide->data = (void *)malloc(SECTOR_SIZE);
-    ide->disk_path = disk_path;
+    ide->disk = disk;
+    ide->base = base;
 
     reset_and_goto_1(ide);
 
@@ -8,20 +8,39 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include "disk.h"
 
 struct ide
 {
     void (*next)(struct ide *ide, struct kvm_run *run);
-    char *disk_path;
+    disk_t *disk;
+    uint16_t base; // first port of the channel's command block
     int sector_idx;
+    int features;
+    int command;
     int data_count;
     void *data;
 };
 
 typedef struct ide ide_t;
 
-ide_t *create_ide_state_machine(char *disk_path);
+// State of a channel, for snapshots and checkpoints: where its state machine
+// is, and the sector being transferred
+typedef struct ide_state
+{
+    int step; // of the state machine, by number
+    int sector_idx;
+    int features;
+    int command;
+    int data_count;
+    uint8_t data[SECTOR_SIZE];
+} ide_state_t;
+
+ide_t *create_ide_state_machine(disk_t *disk, uint16_t base);
+bool ide_owns_port(ide_t *ide, uint16_t port);
 void destroy_ide_state_machine(ide_t *ide);
-void write_data_to_sector(char *disk_path, int sector_idx, void *data);
+void ide_save_state(ide_t *ide, ide_state_t *state);
+void ide_restore_state(ide_t *ide, const ide_state_t *state);
+void write_data_to_sector(disk_t *disk, int sector_idx, void *data);
 
 #endif
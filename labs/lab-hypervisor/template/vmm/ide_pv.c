@@ -1,30 +1,281 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 #include "ide.h"
 #include "ide_pv.h"
+#include "shared/boot.h"
+
+// Adaptive back-off of polled queues, like KVM's halt polling: the poller spins
+// for a window after the last request before sleeping. The window doubles when
+// the poller is woken up no later than the longest window would have waited,
+// and halves when it sleeps for longer than that.
+#define POLL_MIN_NS 20000ULL
+#define POLL_MAX_NS 2000000ULL
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Host address of a guest buffer, NULL unless it is entirely in guest RAM
+static void *guest_buffer(struct hypercall_host *host, uint64_t gpa, uint64_t length)
+{
+    if (gpa > host->guest_mem_size || length > host->guest_mem_size - gpa)
+        return NULL;
+
+    // Not in the device area below 1 MB
+    if (host->guest_mem_size > LOW_RAM_END && gpa < HIGH_RAM_START && gpa + length > LOW_RAM_END)
+        return NULL;
+
+    return host->guest_mem + gpa;
+}
+
+// Zero-copy read or write: the disk works directly on the guest's buffer
+static int guest_io(struct hypercall_host *host, bool write, int sector_idx, int sector_count, uint32_t gpa)
+{
+    uint64_t length = (uint64_t)(uint32_t)sector_count * SECTOR_SIZE;
+    void *buf = guest_buffer(host, gpa, length);
+
+    if (!buf || sector_count <= 0)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (write)
+        return disk_write_sectors(host->disk, sector_idx, sector_count, buf);
+
+    return disk_read_sectors(host->disk, sector_idx, sector_count, buf);
+}
+
+static int do_request(struct hypercall_host *host, pv_request_t *req)
+{
+    switch (req->op)
+    {
+    case HYPERCALL_WRITE:
+    case HYPERCALL_READ:
+        return guest_io(host, req->op == HYPERCALL_WRITE, req->sector_idx, req->sector_count, req->gpa);
+    case HYPERCALL_FLUSH:
+        return disk_flush(host->disk);
+    case HYPERCALL_DISCARD:
+        return disk_discard_sectors(host->disk, req->sector_idx, req->sector_count);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+static int process_request(struct hypercall_host *host, pv_request_t *req)
+{
+    if (!host->disk_lock)
+        return do_request(host, req);
+
+    pthread_mutex_lock(host->disk_lock);
+    int ret = do_request(host, req);
+    pthread_mutex_unlock(host->disk_lock);
+    return ret;
+}
+
+static void *poller(void *arg)
+{
+    struct hypercall_host *host = arg;
+    pv_ring_t *ring = host->ring;
+    uint32_t consumer = ring->consumer;
+    uint64_t spin_ns = POLL_MIN_NS;
+    uint64_t idle_since = now_ns();
+
+    while (!__atomic_load_n(&host->stopping, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE) != consumer)
+        {
+            pv_request_t *req = &ring->requests[consumer % PV_RING_SIZE];
+            req->status = process_request(host, req);
+            if (req->status < 0)
+            {
+                warn("VMM: PV request %u on port 0x%x failed", req->op, host->port);
+            }
+
+            __atomic_store_n(&ring->consumer, ++consumer, __ATOMIC_RELEASE);
+            host->polled++;
+            idle_since = now_ns();
+            continue;
+        }
+
+        if (now_ns() - idle_since < spin_ns)
+        {
+            __builtin_ia32_pause();
+            continue;
+        }
+
+        // Announce we sleep, then look again: a guest that published a request
+        // before seeing the flag didn't ring the doorbell
+        __atomic_store_n(&ring->poller_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->producer, __ATOMIC_SEQ_CST) == consumer)
+        {
+            uint64_t asleep = now_ns();
+            uint64_t value;
+            if (read(host->doorbell, &value, sizeof(value)) < 0 && errno != EINTR)
+            {
+                err(1, "VMM: PV doorbell");
+            }
+
+            asleep = now_ns() - asleep;
+            host->sleeps++;
+
+            if (asleep <= POLL_MAX_NS && spin_ns < POLL_MAX_NS)
+                spin_ns *= 2;
+            else if (asleep > POLL_MAX_NS && spin_ns > POLL_MIN_NS)
+                spin_ns /= 2;
+        }
+
+        __atomic_store_n(&ring->poller_sleeping, 0, __ATOMIC_SEQ_CST);
+        idle_since = now_ns();
+    }
+
+    host->spin_ns = spin_ns;
+    return NULL;
+}
+
+int hypercall_host_reg_request(hypercall_host_t *host, uint32_t op, uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+    // A polled queue's disk belongs to its poller
+    if (host->ring)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    pv_request_t req = {.op = op, .sector_idx = arg1, .sector_count = arg2, .gpa = arg3};
+    int ret = process_request(host, &req);
+
+    if (ret < 0)
+    {
+        warn("VMM: register hypercall %u on queue port 0x%x failed", op, host->port);
+    }
+
+    return ret;
+}
 
 void handle_hypercall(struct hypercall_host *host, hypercall_t *hypercall, struct kvm_run *run)
 {
-    if (run->io.direction == KVM_EXIT_IO_OUT && run->io.size == 1 && run->io.port == HYPERCALL_PORT)
+    if (run->io.direction == KVM_EXIT_IO_OUT && run->io.size == 1 && run->io.port == host->port)
     {
         uint8_t *addr = (uint8_t *)run + run->io.data_offset;
         uint32_t value = *addr;
 
-        if (value == HYPERCALL_MAGIC)
+        // A polled queue's disk belongs to its poller: requests go through the ring
+        if (host->ring)
         {
-            printf("handle_hypercall\n");
-            write_data_to_sector(host->disk_path, hypercall->sector_idx, hypercall->data);
+            warnx("VMM: hypercall %u on polled queue port 0x%x refused", value, host->port);
+            hypercall->status = -1;
+            return;
+        }
+
+        switch (value)
+        {
+        case HYPERCALL_MAGIC:
+            write_data_to_sector(host->disk, hypercall->sector_idx, hypercall->data);
+            break;
+        case HYPERCALL_FLUSH:
+            if (disk_flush(host->disk) < 0)
+            {
+                perror("flush failed");
+            }
+            break;
+        case HYPERCALL_DISCARD:
+            if (disk_discard_sectors(host->disk, hypercall->sector_idx, hypercall->sector_count) < 0)
+            {
+                perror("discard failed");
+            }
+            break;
+        case HYPERCALL_WRITE:
+        case HYPERCALL_READ:
+            hypercall->status = guest_io(host, value == HYPERCALL_WRITE, hypercall->sector_idx,
+                                         hypercall->sector_count, hypercall->gpa);
+            if (hypercall->status < 0)
+            {
+                perror(value == HYPERCALL_WRITE ? "write failed" : "read failed");
+            }
+            break;
         }
     }
 }
 
-hypercall_host_t *create_hypercall_host(char *disk_path)
+hypercall_host_t *create_hypercall_host(disk_t *disk, int queue)
 {
-    hypercall_host_t *hypercall_host = (hypercall_host_t *)malloc(sizeof(hypercall_host_t));
-    hypercall_host->disk_path = disk_path;
+    hypercall_host_t *hypercall_host = (hypercall_host_t *)calloc(1, sizeof(hypercall_host_t));
+    hypercall_host->disk = disk;
+    hypercall_host->port = HYPERCALL_QUEUE_PORT(queue);
+    hypercall_host->doorbell = -1;
     hypercall_host->next = &handle_hypercall;
     return hypercall_host;
 }
 
+void hypercall_host_set_guest_mem(hypercall_host_t *hypercall_host, uint8_t *guest_mem, uint64_t guest_mem_size)
+{
+    hypercall_host->guest_mem = guest_mem;
+    hypercall_host->guest_mem_size = guest_mem_size;
+}
+
+void hypercall_host_poll_ring(hypercall_host_t *hypercall_host, pv_ring_t *ring, int doorbell, int cpu)
+{
+    hypercall_host->ring = ring;
+    hypercall_host->doorbell = doorbell;
+
+    if (pthread_create(&hypercall_host->poller, NULL, &poller, hypercall_host) != 0)
+    {
+        errx(1, "VMM: can't start the PV poller");
+    }
+
+    if (cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(hypercall_host->poller, sizeof(cpus), &cpus) != 0)
+        {
+            warnx("VMM: can't pin the PV poller to CPU %d", cpu);
+        }
+    }
+
+    __atomic_store_n(&ring->enabled, 1, __ATOMIC_RELEASE);
+    printf("PV queue on port 0x%x polled%s\n", hypercall_host->port, cpu >= 0 ? " by a pinned thread" : "");
+}
+
+void hypercall_host_start_polling(hypercall_host_t *hypercall_host, hypercall_t *hypercall, int cpu)
+{
+    int doorbell = eventfd(0, EFD_CLOEXEC);
+
+    if (doorbell < 0)
+    {
+        err(1, "VMM: eventfd");
+    }
+
+    hypercall_host_poll_ring(hypercall_host, (pv_ring_t *)((uint8_t *)hypercall + PV_RING_OFFSET), doorbell, cpu);
+}
+
 void destroy_hypercall_host(hypercall_host_t *hypercall_host)
 {
+    if (hypercall_host->ring)
+    {
+        uint64_t one = 1;
+        __atomic_store_n(&hypercall_host->stopping, true, __ATOMIC_RELEASE);
+        if (write(hypercall_host->doorbell, &one, sizeof(one)) < 0)
+        {
+            perror("doorbell failed");
+        }
+        pthread_join(hypercall_host->poller, NULL);
+        close(hypercall_host->doorbell);
+
+        printf("PV queue on port 0x%x: %lu polled requests, woken up by the doorbell %lu times, spin window %lu us\n",
+               hypercall_host->port, hypercall_host->polled, hypercall_host->sleeps, hypercall_host->spin_ns / 1000);
+    }
+
     free(hypercall_host);
-}
\ No newline at end of file
+}
@@ -1,17 +1,38 @@
 #ifndef _IDEPV_H_
 #define _IDEPV_H_
 
+#include <linux/kvm.h>
+#include <pthread.h>
 #include "shared/ide_pv.h"
+#include "disk.h"
 
 struct hypercall_host
 {
-    char *disk_path;
+    disk_t *disk;
+    uint16_t port; // the queue's; its hypercall area is passed to next()
+    uint8_t *guest_mem; // where zero-copy requests find their buffers
+    uint64_t guest_mem_size;
+    pthread_mutex_t *disk_lock; // if the disk is shared with other threads
+
+    // Polled queues only
+    pv_ring_t *ring;
+    int doorbell; // eventfd the poller sleeps on, signaled by KVM
+    pthread_t poller;
+    bool stopping;
+    uint64_t polled;
+    uint64_t sleeps;
+    uint64_t spin_ns;
     void (*next)(struct hypercall_host *hypercall_host, hypercall_t *hypercall, struct kvm_run *run);
 };
 
 typedef struct hypercall_host hypercall_host_t;
 
-hypercall_host_t *create_hypercall_host(char *disk_path);
+hypercall_host_t *create_hypercall_host(disk_t *disk, int queue);
+void hypercall_host_set_guest_mem(hypercall_host_t *hypercall_host, uint8_t *guest_mem, uint64_t guest_mem_size);
+void hypercall_host_start_polling(hypercall_host_t *hypercall_host, hypercall_t *hypercall, int cpu);
+void hypercall_host_poll_ring(hypercall_host_t *hypercall_host, pv_ring_t *ring, int doorbell, int cpu);
+int hypercall_host_reg_request(hypercall_host_t *hypercall_host, uint32_t op, uint32_t arg1, uint32_t arg2,
+                               uint32_t arg3);
 void destroy_hypercall_host(hypercall_host_t *hypercall_host);
 
 #endif
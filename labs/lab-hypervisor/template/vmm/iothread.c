@@ -0,0 +1,296 @@
+// Per-disk I/O thread, stacked on top of a disk's backend stack, under the
+// throttle layer.
+// With a write-back cache mode, writes and discards are posted: their data is
+// copied, they are queued for the disk's thread and the guest carries on right
+// away, so several disks (and the vCPU) work in parallel. Reads and flushes
+// first wait for the queue to drain, so they see every earlier request. A
+// posted request that fails makes the next flush fail.
+// Otherwise (writethrough, none), a write only completes once it is done, so
+// requests run in the caller's thread after the queue drained.
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iothread.h"
+
+#define MAX_QUEUED_BYTES (8 * 1024 * 1024)
+
+typedef enum
+{
+    IO_WRITE,
+    IO_DISCARD,
+} io_type_t;
+
+typedef struct io_request
+{
+    io_type_t type;
+    uint64_t offset;
+    uint64_t length;
+    uint8_t *data;
+    struct io_request *next;
+} io_request_t;
+
+typedef struct iothread_disk
+{
+    disk_t disk;
+    disk_t *backend;
+    bool posted;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // requests were queued
+    pthread_cond_t drained; // the queue went empty, or got room
+    io_request_t *head;
+    io_request_t *tail;
+    size_t queued_bytes;
+    bool busy;
+    bool stopping;
+    int error; // errno of the first failed posted request since the last flush
+
+    uint64_t requests;
+    uint64_t waits; // times the guest waited for the queue
+    int max_depth;
+    int depth;
+} iothread_disk_t;
+
+static void *iothread(void *arg)
+{
+    iothread_disk_t *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+
+    for (;;)
+    {
+        while (!io->head && !io->stopping)
+        {
+            pthread_cond_wait(&io->work, &io->lock);
+        }
+
+        if (!io->head)
+            break;
+
+        io_request_t *req = io->head;
+        io->busy = true;
+        pthread_mutex_unlock(&io->lock);
+
+        int ret;
+        if (req->type == IO_WRITE)
+        {
+            struct iovec iov = {.iov_base = req->data, .iov_len = req->length};
+            ret = io->backend->writev(io->backend, &iov, 1, req->offset);
+        }
+        else
+        {
+            ret = io->backend->discard(io->backend, req->offset, req->length);
+        }
+
+        pthread_mutex_lock(&io->lock);
+
+        if (ret < 0 && !io->error)
+        {
+            io->error = errno;
+            warn("VMM: posted %s at %lu failed", req->type == IO_WRITE ? "write" : "discard", req->offset);
+        }
+
+        io->head = req->next;
+        if (!io->head)
+            io->tail = NULL;
+        io->queued_bytes -= req->type == IO_WRITE ? req->length : 0;
+        io->depth--;
+        io->busy = false;
+        pthread_cond_broadcast(&io->drained);
+
+        free(req->data);
+        free(req);
+    }
+
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+// Wait for every queued request to be done. Called with the lock held.
+static void drain(iothread_disk_t *io)
+{
+    if (io->head || io->busy)
+        io->waits++;
+
+    while (io->head || io->busy)
+    {
+        pthread_cond_wait(&io->drained, &io->lock);
+    }
+}
+
+static void post(iothread_disk_t *io, io_request_t *req)
+{
+    size_t bytes = req->type == IO_WRITE ? req->length : 0;
+
+    pthread_mutex_lock(&io->lock);
+
+    if (io->queued_bytes > 0 && io->queued_bytes + bytes > MAX_QUEUED_BYTES)
+        io->waits++;
+
+    while (io->queued_bytes > 0 && io->queued_bytes + bytes > MAX_QUEUED_BYTES)
+    {
+        pthread_cond_wait(&io->drained, &io->lock);
+    }
+
+    req->next = NULL;
+    if (io->tail)
+        io->tail->next = req;
+    else
+        io->head = req;
+    io->tail = req;
+
+    io->queued_bytes += bytes;
+    io->requests++;
+    if (++io->depth > io->max_depth)
+        io->max_depth = io->depth;
+
+    pthread_cond_signal(&io->work);
+    pthread_mutex_unlock(&io->lock);
+}
+
+static int iothread_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    iothread_disk_t *io = (iothread_disk_t *)disk;
+
+    pthread_mutex_lock(&io->lock);
+    drain(io);
+    pthread_mutex_unlock(&io->lock);
+
+    return io->backend->readv(io->backend, iov, iovcnt, offset);
+}
+
+static int iothread_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    iothread_disk_t *io = (iothread_disk_t *)disk;
+
+    if (!io->posted)
+    {
+        pthread_mutex_lock(&io->lock);
+        drain(io);
+        pthread_mutex_unlock(&io->lock);
+        return io->backend->writev(io->backend, iov, iovcnt, offset);
+    }
+
+    io_request_t *req = (io_request_t *)malloc(sizeof(io_request_t));
+    req->type = IO_WRITE;
+    req->offset = offset;
+    req->length = iov_length(iov, iovcnt);
+    req->data = malloc(req->length);
+    if (!req->data)
+    {
+        free(req);
+        return -1;
+    }
+
+    iov_to_buf(iov, iovcnt, 0, req->data, req->length);
+    post(io, req);
+    return 0;
+}
+
+static int iothread_flush(disk_t *disk)
+{
+    iothread_disk_t *io = (iothread_disk_t *)disk;
+
+    pthread_mutex_lock(&io->lock);
+    drain(io);
+    int error = io->error;
+    io->error = 0;
+    pthread_mutex_unlock(&io->lock);
+
+    if (error)
+    {
+        errno = error;
+        return -1;
+    }
+
+    return io->backend->flush(io->backend);
+}
+
+static int iothread_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    iothread_disk_t *io = (iothread_disk_t *)disk;
+
+    if (!io->posted)
+    {
+        pthread_mutex_lock(&io->lock);
+        drain(io);
+        pthread_mutex_unlock(&io->lock);
+        return io->backend->discard(io->backend, offset, length);
+    }
+
+    io_request_t *req = (io_request_t *)calloc(1, sizeof(io_request_t));
+    req->type = IO_DISCARD;
+    req->offset = offset;
+    req->length = length;
+    post(io, req);
+    return 0;
+}
+
+static uint64_t iothread_next_data(disk_t *disk, uint64_t offset)
+{
+    iothread_disk_t *io = (iothread_disk_t *)disk;
+
+    pthread_mutex_lock(&io->lock);
+    drain(io);
+    pthread_mutex_unlock(&io->lock);
+
+    return disk_next_data(io->backend, offset);
+}
+
+static void iothread_destroy(disk_t *disk)
+{
+    iothread_disk_t *io = (iothread_disk_t *)disk;
+
+    pthread_mutex_lock(&io->lock);
+    drain(io);
+    io->stopping = true;
+    pthread_cond_signal(&io->work);
+    pthread_mutex_unlock(&io->lock);
+    pthread_join(io->thread, NULL);
+
+    if (io->error)
+    {
+        errno = io->error;
+        warn("VMM: posted I/O failed since the last flush");
+    }
+
+    printf("iothread: %lu posted requests, queue depth %d at most, waited for the queue %lu times\n",
+           io->requests, io->max_depth, io->waits);
+
+    pthread_cond_destroy(&io->work);
+    pthread_cond_destroy(&io->drained);
+    pthread_mutex_destroy(&io->lock);
+    io->backend->destroy(io->backend);
+    free(io);
+}
+
+disk_t *create_iothread_disk(disk_t *backend, bool posted)
+{
+    iothread_disk_t *io = (iothread_disk_t *)calloc(1, sizeof(iothread_disk_t));
+    io->backend = backend;
+    io->posted = posted;
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work, NULL);
+    pthread_cond_init(&io->drained, NULL);
+
+    io->disk.readv = &iothread_readv;
+    io->disk.writev = &iothread_writev;
+    io->disk.flush = &iothread_flush;
+    io->disk.discard = backend->discard ? &iothread_discard : NULL;
+    io->disk.next_data = &iothread_next_data;
+    io->disk.destroy = &iothread_destroy;
+    io->disk.size = backend->size;
+
+    if (pthread_create(&io->thread, NULL, &iothread, io) != 0)
+    {
+        errx(1, "VMM: can't start the disk's I/O thread");
+    }
+
+    return &io->disk;
+}
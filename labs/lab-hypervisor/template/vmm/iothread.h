@@ -0,0 +1,8 @@
+#ifndef _IOTHREAD_H_
+#define _IOTHREAD_H_
+
+#include "disk.h"
+
+disk_t *create_iothread_disk(disk_t *backend, bool posted);
+
+#endif
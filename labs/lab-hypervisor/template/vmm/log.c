@@ -0,0 +1,752 @@
+// Log-structured disk layer, stacked on top of another disk backend.
+// Every write is appended to the current log segment (<path>.seg.<id>) and an
+// in-memory index maps each sector to its latest copy in the log, so random
+// guest writes become sequential appends. Flushes are group-committed: one
+// fdatasync of the current segment covers every write appended before it, and
+// concurrent flushers wait for the sync in progress instead of issuing their own.
+// Full segments are sealed and a background thread compacts them into the base
+// image, oldest first; a segment file is only removed once the base image holds
+// its live sectors durably. On open, leftover segments are replayed in order.
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+#include "verify.h"
+
+#define LOG_MAGIC 0x474f4c56 // "VLOG"
+#define LOG_WRITE 1
+#define LOG_DISCARD 2
+
+#define SEGMENT_SIZE (16 * 1024 * 1024)
+
+// Index entries: segment id in the top bits, byte offset in the segment below.
+// 0 means the sector is not in the log (read it from the base).
+#define ENTRY_OFFSET_BITS 40
+#define ENTRY(id, offset) (((uint64_t)(id) << ENTRY_OFFSET_BITS) | (offset))
+#define ENTRY_SEGMENT(entry) ((uint32_t)((entry) >> ENTRY_OFFSET_BITS))
+#define ENTRY_OFFSET(entry) ((entry) & ((1ULL << ENTRY_OFFSET_BITS) - 1))
+
+typedef struct log_record
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sector;
+    uint64_t count; // sectors; the data follows the record for LOG_WRITE
+    uint64_t hash;  // of the record (with hash = 0) and the data
+} log_record_t;
+
+typedef struct segment
+{
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    char *path;
+    struct segment *next; // sealed list, oldest first
+} segment_t;
+
+typedef struct log_disk
+{
+    disk_t disk;
+    disk_t *base;
+    char *path;
+
+    uint64_t *index;
+    segment_t *current;
+    segment_t *sealed;
+
+    pthread_mutex_t lock;
+
+    // Group commit: bytes appended so far, and how many of them are durable
+    uint64_t appended;
+    uint64_t synced;
+    bool syncing;
+    pthread_cond_t synced_cond;
+
+    pthread_t compactor;
+    pthread_cond_t compact_cond;
+    bool stopping;
+
+    uint64_t records;
+    uint64_t flushes;
+    uint64_t syncs;
+    uint64_t compacted;
+} log_disk_t;
+
+static uint64_t mix(uint64_t hash, uint64_t value)
+{
+    hash ^= value;
+    hash *= 0x9E3779B185EBCA87ULL;
+    return hash << 31 | hash >> 33;
+}
+
+// The data is hashed sector by sector so the result doesn't depend on how
+// it is split in the iovec array.
+static uint64_t record_hash(const log_record_t *record, const struct iovec *iov, int iovcnt)
+{
+    log_record_t header = *record;
+    header.hash = 0;
+    uint64_t hash = hash_buffer(&header, sizeof(header));
+
+    if (record->type != LOG_WRITE)
+        return hash;
+
+    uint8_t bounce[SECTOR_SIZE];
+    size_t skip = 0;
+    int i = 0;
+
+    for (uint64_t s = 0; s < record->count; s++)
+    {
+        while (skip == iov[i].iov_len)
+        {
+            i++;
+            skip = 0;
+        }
+
+        if (iov[i].iov_len - skip >= SECTOR_SIZE)
+        {
+            hash = mix(hash, hash_buffer((uint8_t *)iov[i].iov_base + skip, SECTOR_SIZE));
+            skip += SECTOR_SIZE;
+            continue;
+        }
+
+        // The sector straddles iovec entries
+        iov_to_buf(iov + i, iovcnt - i, skip, bounce, SECTOR_SIZE);
+        hash = mix(hash, hash_buffer(bounce, SECTOR_SIZE));
+
+        size_t left = SECTOR_SIZE;
+        while (left > 0)
+        {
+            size_t n = iov[i].iov_len - skip < left ? iov[i].iov_len - skip : left;
+            skip += n;
+            left -= n;
+            if (left > 0)
+            {
+                i++;
+                skip = 0;
+            }
+        }
+    }
+
+    return hash;
+}
+
+static segment_t *open_segment(log_disk_t *ld, uint32_t id, bool create)
+{
+    segment_t *seg = calloc(1, sizeof(segment_t));
+    if (asprintf(&seg->path, "%s.seg.%08u", ld->path, id) < 0)
+    {
+        err(1, "VMM: asprintf");
+    }
+
+    seg->id = id;
+    seg->fd = open(seg->path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (seg->fd < 0)
+    {
+        err(1, "VMM: %s", seg->path);
+    }
+
+    return seg;
+}
+
+static void close_segment(segment_t *seg, bool remove)
+{
+    close(seg->fd);
+    if (remove && unlink(seg->path) < 0)
+    {
+        warn("VMM: %s", seg->path);
+    }
+    free(seg->path);
+    free(seg);
+}
+
+static segment_t *find_segment(log_disk_t *ld, uint32_t id)
+{
+    if (ld->current->id == id)
+        return ld->current;
+
+    for (segment_t *seg = ld->sealed; seg; seg = seg->next)
+    {
+        if (seg->id == id)
+            return seg;
+    }
+
+    return NULL;
+}
+
+static void append_sealed(log_disk_t *ld, segment_t *seg)
+{
+    segment_t **tail = &ld->sealed;
+    while (*tail)
+    {
+        tail = &(*tail)->next;
+    }
+    seg->next = NULL;
+    *tail = seg;
+}
+
+// Make the current segment durable, hand it to the compactor and start a new one.
+// Called with the lock held.
+static int seal_segment(log_disk_t *ld)
+{
+    // A flush may be syncing the current segment without the lock
+    while (ld->syncing)
+    {
+        pthread_cond_wait(&ld->synced_cond, &ld->lock);
+    }
+
+    if (fdatasync(ld->current->fd) < 0)
+        return -1;
+
+    ld->synced = ld->appended;
+    ld->syncs++;
+
+    uint32_t id = ld->current->id + 1;
+    append_sealed(ld, ld->current);
+    ld->current = open_segment(ld, id, true);
+    pthread_cond_signal(&ld->compact_cond);
+    return 0;
+}
+
+// Append a record (and its data) to the log. Called with the lock held.
+// Returns the offset of the record in the current segment, -1 on error.
+static int64_t append_record(log_disk_t *ld, log_record_t *record, const struct iovec *iov, int iovcnt)
+{
+    size_t len = sizeof(log_record_t) + iov_length(iov, iovcnt);
+
+    if (ld->current->size > 0 && ld->current->size + len > SEGMENT_SIZE && seal_segment(ld) < 0)
+        return -1;
+
+    segment_t *seg = ld->current;
+    uint64_t pos = seg->size;
+    struct iovec header = {.iov_base = record, .iov_len = sizeof(log_record_t)};
+
+    if (iovcnt < UIO_MAXIOV)
+    {
+        struct iovec out[iovcnt + 1];
+        out[0] = header;
+        memcpy(out + 1, iov, iovcnt * sizeof(struct iovec));
+        if (fd_writev(seg->fd, out, iovcnt + 1, pos) < 0)
+            return -1;
+    }
+    else if (fd_writev(seg->fd, &header, 1, pos) < 0 ||
+             fd_writev(seg->fd, iov, iovcnt, pos + sizeof(log_record_t)) < 0)
+    {
+        return -1;
+    }
+
+    // A failed append leaves garbage past seg->size: the next one overwrites it
+    seg->size += len;
+    ld->appended += len;
+    ld->records++;
+    return (int64_t)pos;
+}
+
+static int log_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    log_disk_t *ld = (log_disk_t *)disk;
+    uint64_t first = offset / SECTOR_SIZE;
+    uint64_t count = iov_length(iov, iovcnt) / SECTOR_SIZE;
+    struct iovec part[iovcnt];
+    int ret = 0;
+
+    pthread_mutex_lock(&ld->lock);
+
+    // Split the request into runs that are contiguous in the log or in the base
+    for (uint64_t i = 0; i < count && ret == 0;)
+    {
+        uint64_t entry = ld->index[first + i];
+        uint64_t n = 1;
+
+        while (i + n < count &&
+               ld->index[first + i + n] == (entry ? entry + n * SECTOR_SIZE : 0))
+        {
+            n++;
+        }
+
+        int cnt = iov_slice(iov, iovcnt, i * SECTOR_SIZE, n * SECTOR_SIZE, part);
+
+        if (!entry)
+        {
+            ret = ld->base->readv(ld->base, part, cnt, (first + i) * SECTOR_SIZE);
+        }
+        else
+        {
+            segment_t *seg = find_segment(ld, ENTRY_SEGMENT(entry));
+            ret = fd_readv(seg->fd, part, cnt, ENTRY_OFFSET(entry));
+        }
+
+        i += n;
+    }
+
+    pthread_mutex_unlock(&ld->lock);
+    return ret;
+}
+
+static int log_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    log_disk_t *ld = (log_disk_t *)disk;
+    log_record_t record = {
+        .magic = LOG_MAGIC,
+        .type = LOG_WRITE,
+        .sector = offset / SECTOR_SIZE,
+        .count = iov_length(iov, iovcnt) / SECTOR_SIZE,
+    };
+    record.hash = record_hash(&record, iov, iovcnt);
+
+    pthread_mutex_lock(&ld->lock);
+
+    int64_t pos = append_record(ld, &record, iov, iovcnt);
+    if (pos >= 0)
+    {
+        uint64_t data = pos + sizeof(log_record_t);
+        for (uint64_t i = 0; i < record.count; i++)
+        {
+            ld->index[record.sector + i] = ENTRY(ld->current->id, data + i * SECTOR_SIZE);
+        }
+    }
+
+    pthread_mutex_unlock(&ld->lock);
+    return pos < 0 ? -1 : 0;
+}
+
+// Group commit: whoever finds no sync in progress syncs everything appended so
+// far; flushers arriving meanwhile wait and are covered by it, or by the next one.
+static int log_flush(disk_t *disk)
+{
+    log_disk_t *ld = (log_disk_t *)disk;
+    int ret = 0;
+
+    pthread_mutex_lock(&ld->lock);
+    ld->flushes++;
+
+    uint64_t target = ld->appended;
+    while (ld->synced < target && ret == 0)
+    {
+        if (ld->syncing)
+        {
+            pthread_cond_wait(&ld->synced_cond, &ld->lock);
+            continue;
+        }
+
+        uint64_t upto = ld->appended;
+        int fd = ld->current->fd;
+
+        ld->syncing = true;
+        pthread_mutex_unlock(&ld->lock);
+        ret = fdatasync(fd);
+        pthread_mutex_lock(&ld->lock);
+        ld->syncing = false;
+
+        if (ret == 0)
+        {
+            ld->synced = upto;
+            ld->syncs++;
+        }
+        pthread_cond_broadcast(&ld->synced_cond);
+    }
+
+    pthread_mutex_unlock(&ld->lock);
+    return ret;
+}
+
+// The discard is logged too, so replay doesn't resurrect older logged data
+static int log_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    log_disk_t *ld = (log_disk_t *)disk;
+    log_record_t record = {
+        .magic = LOG_MAGIC,
+        .type = LOG_DISCARD,
+        .sector = offset / SECTOR_SIZE,
+        .count = length / SECTOR_SIZE,
+    };
+    record.hash = record_hash(&record, NULL, 0);
+
+    if (!ld->base->discard)
+        return 0;
+
+    pthread_mutex_lock(&ld->lock);
+
+    int ret = append_record(ld, &record, NULL, 0) < 0 ? -1 : 0;
+    if (ret == 0)
+    {
+        memset(ld->index + record.sector, 0, record.count * sizeof(uint64_t));
+        ret = ld->base->discard(ld->base, offset, length);
+    }
+
+    pthread_mutex_unlock(&ld->lock);
+    return ret;
+}
+
+static uint64_t log_next_data(disk_t *disk, uint64_t offset)
+{
+    log_disk_t *ld = (log_disk_t *)disk;
+    uint64_t nr_sectors = disk->size / SECTOR_SIZE;
+
+    pthread_mutex_lock(&ld->lock);
+
+    uint64_t data = disk_next_data(ld->base, offset);
+    for (uint64_t s = offset / SECTOR_SIZE; s < nr_sectors && s * SECTOR_SIZE < data; s++)
+    {
+        if (ld->index[s])
+        {
+            data = s * SECTOR_SIZE;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&ld->lock);
+    return data;
+}
+
+static int read_record(segment_t *seg, uint64_t pos, log_record_t *record)
+{
+    struct iovec iov = {.iov_base = record, .iov_len = sizeof(log_record_t)};
+    return fd_readv(seg->fd, &iov, 1, pos);
+}
+
+// Copy the sectors of a sealed segment that are still live into the base image,
+// then drop the segment. Sealed segments are immutable, so they are read
+// without the lock; the index is only checked and updated with it.
+static int compact_segment(log_disk_t *ld, segment_t *seg)
+{
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+    uint64_t pos = 0;
+    int ret = 0;
+
+    while (pos < seg->size && ret == 0)
+    {
+        log_record_t record;
+        if ((ret = read_record(seg, pos, &record)) < 0)
+            break;
+
+        uint64_t data = pos + sizeof(log_record_t);
+        size_t len = record.type == LOG_WRITE ? record.count * SECTOR_SIZE : 0;
+        pos = data + len;
+
+        if (len == 0)
+            continue;
+
+        if (len > buf_size)
+        {
+            free(buf);
+            buf_size = len;
+            buf = malloc(buf_size);
+        }
+
+        struct iovec iov = {.iov_base = buf, .iov_len = len};
+        if ((ret = fd_readv(seg->fd, &iov, 1, data)) < 0)
+            break;
+
+        pthread_mutex_lock(&ld->lock);
+
+        for (uint64_t i = 0; i < record.count && ret == 0;)
+        {
+            uint64_t n = 0;
+            while (i + n < record.count &&
+                   ld->index[record.sector + i + n] == ENTRY(seg->id, data + (i + n) * SECTOR_SIZE))
+            {
+                n++;
+            }
+
+            if (n == 0)
+            {
+                i++; // overwritten or discarded since
+                continue;
+            }
+
+            struct iovec run = {.iov_base = buf + i * SECTOR_SIZE, .iov_len = n * SECTOR_SIZE};
+            ret = ld->base->writev(ld->base, &run, 1, (record.sector + i) * SECTOR_SIZE);
+            i += n;
+        }
+
+        pthread_mutex_unlock(&ld->lock);
+    }
+
+    free(buf);
+
+    if (ret < 0 || disk_flush(ld->base) < 0)
+    {
+        warn("VMM: compacting %s", seg->path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ld->lock);
+
+    uint64_t nr_sectors = ld->disk.size / SECTOR_SIZE;
+    for (uint64_t s = 0; s < nr_sectors; s++)
+    {
+        if (ENTRY_SEGMENT(ld->index[s]) == seg->id)
+            ld->index[s] = 0;
+    }
+
+    segment_t **prev = &ld->sealed;
+    while (*prev != seg)
+    {
+        prev = &(*prev)->next;
+    }
+    *prev = seg->next;
+
+    close_segment(seg, true);
+    ld->compacted++;
+
+    pthread_mutex_unlock(&ld->lock);
+    return 0;
+}
+
+static void *compactor(void *arg)
+{
+    log_disk_t *ld = arg;
+
+    pthread_mutex_lock(&ld->lock);
+
+    while (!ld->stopping)
+    {
+        if (!ld->sealed)
+        {
+            pthread_cond_wait(&ld->compact_cond, &ld->lock);
+            continue;
+        }
+
+        segment_t *seg = ld->sealed;
+        pthread_mutex_unlock(&ld->lock);
+        int ret = compact_segment(ld, seg);
+        pthread_mutex_lock(&ld->lock);
+
+        if (ret < 0)
+            break; // leave the segments for the next start
+    }
+
+    pthread_mutex_unlock(&ld->lock);
+    return NULL;
+}
+
+// Rebuild the index from a segment. A torn record (crash during an append)
+// ends the segment: it and anything after it is cut off.
+static void replay_segment(log_disk_t *ld, segment_t *seg)
+{
+    uint64_t nr_sectors = ld->disk.size / SECTOR_SIZE;
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+    uint64_t pos = 0;
+    struct stat st;
+
+    if (fstat(seg->fd, &st) < 0)
+    {
+        err(1, "VMM: %s", seg->path);
+    }
+
+    while (pos + sizeof(log_record_t) <= (uint64_t)st.st_size)
+    {
+        log_record_t record;
+        if (read_record(seg, pos, &record) < 0)
+        {
+            err(1, "VMM: %s", seg->path);
+        }
+
+        uint64_t data = pos + sizeof(log_record_t);
+        size_t len = record.type == LOG_WRITE ? record.count * SECTOR_SIZE : 0;
+
+        if (record.magic != LOG_MAGIC || (record.type != LOG_WRITE && record.type != LOG_DISCARD) ||
+            record.sector + record.count > nr_sectors || data + len > (uint64_t)st.st_size)
+        {
+            break;
+        }
+
+        if (len > buf_size)
+        {
+            free(buf);
+            buf_size = len;
+            buf = malloc(buf_size);
+        }
+
+        struct iovec iov = {.iov_base = buf, .iov_len = len};
+        if (len > 0 && fd_readv(seg->fd, &iov, 1, data) < 0)
+        {
+            err(1, "VMM: %s", seg->path);
+        }
+
+        if (record_hash(&record, &iov, 1) != record.hash)
+            break;
+
+        if (record.type == LOG_WRITE)
+        {
+            for (uint64_t i = 0; i < record.count; i++)
+            {
+                ld->index[record.sector + i] = ENTRY(seg->id, data + i * SECTOR_SIZE);
+            }
+        }
+        else
+        {
+            memset(ld->index + record.sector, 0, record.count * sizeof(uint64_t));
+            // The base discard may not have been durable
+            if (ld->base->discard)
+                ld->base->discard(ld->base, record.sector * SECTOR_SIZE, record.count * SECTOR_SIZE);
+        }
+
+        ld->records++;
+        pos = data + len;
+    }
+
+    if (pos < (uint64_t)st.st_size)
+    {
+        printf("log: %s: dropping %lu bytes of torn records\n", seg->path, st.st_size - pos);
+        if (ftruncate(seg->fd, pos) < 0)
+        {
+            err(1, "VMM: %s", seg->path);
+        }
+    }
+
+    seg->size = pos;
+    free(buf);
+}
+
+static glob_t find_segments(char *path)
+{
+    char *pattern;
+    glob_t g = {0};
+
+    if (asprintf(&pattern, "%s.seg.*", path) < 0)
+    {
+        err(1, "VMM: asprintf");
+    }
+
+    // Ids are zero-padded, so glob's sorting is replay order
+    glob(pattern, 0, NULL, &g);
+    free(pattern);
+    return g;
+}
+
+bool has_log_segments(char *path)
+{
+    glob_t g = find_segments(path);
+    bool found = g.gl_pathc > 0;
+    globfree(&g);
+    return found;
+}
+
+// When path is recreated: its leftover segments were writes to the old image
+void remove_log_segments(char *path)
+{
+    glob_t g = find_segments(path);
+
+    for (size_t i = 0; i < g.gl_pathc; i++)
+    {
+        if (unlink(g.gl_pathv[i]) < 0)
+        {
+            err(1, "VMM: %s", g.gl_pathv[i]);
+        }
+    }
+
+    if (g.gl_pathc > 0)
+    {
+        printf("log: %zu leftover segments of the previous %s removed\n", g.gl_pathc, path);
+    }
+
+    globfree(&g);
+}
+
+// Replay leftover segments (they stay sealed, for the compactor) and open a new current one
+static void replay(log_disk_t *ld)
+{
+    glob_t g = find_segments(ld->path);
+    uint32_t last = 0;
+
+    for (size_t i = 0; i < g.gl_pathc; i++)
+    {
+        char *suffix = strrchr(g.gl_pathv[i], '.') + 1;
+        uint32_t id = strtoul(suffix, NULL, 10);
+
+        segment_t *seg = open_segment(ld, id, false);
+        replay_segment(ld, seg);
+        append_sealed(ld, seg);
+        last = id;
+    }
+
+    if (g.gl_pathc > 0)
+    {
+        printf("log: replayed %lu records from %zu segments\n", ld->records, g.gl_pathc);
+    }
+
+    globfree(&g);
+    ld->current = open_segment(ld, last + 1, true);
+    ld->records = 0;
+}
+
+// On exit everything is compacted, so the base image can be used on its own
+static void log_destroy(disk_t *disk)
+{
+    log_disk_t *ld = (log_disk_t *)disk;
+
+    pthread_mutex_lock(&ld->lock);
+    ld->stopping = true;
+    pthread_cond_signal(&ld->compact_cond);
+    pthread_mutex_unlock(&ld->lock);
+    pthread_join(ld->compactor, NULL);
+
+    append_sealed(ld, ld->current);
+    while (ld->sealed && compact_segment(ld, ld->sealed) == 0)
+        ;
+
+    printf("log: %lu records appended, %lu flushes, %lu fdatasyncs, %lu segments compacted\n",
+           ld->records, ld->flushes, ld->syncs, ld->compacted);
+
+    while (ld->sealed)
+    {
+        segment_t *seg = ld->sealed;
+        ld->sealed = seg->next;
+        printf("log: %s kept for the next start\n", seg->path);
+        close_segment(seg, false);
+    }
+
+    ld->base->destroy(ld->base);
+    pthread_cond_destroy(&ld->compact_cond);
+    pthread_cond_destroy(&ld->synced_cond);
+    pthread_mutex_destroy(&ld->lock);
+    free(ld->index);
+    free(ld->path);
+    free(ld);
+}
+
+disk_t *create_log_disk(disk_t *base, char *path)
+{
+    log_disk_t *ld = (log_disk_t *)calloc(1, sizeof(log_disk_t));
+    ld->base = base;
+    ld->path = strdup(path);
+    ld->index = calloc(base->size / SECTOR_SIZE, sizeof(uint64_t));
+    if (!ld->index)
+    {
+        err(1, "VMM: log index");
+    }
+
+    ld->disk.readv = &log_readv;
+    ld->disk.writev = &log_writev;
+    ld->disk.flush = &log_flush;
+    ld->disk.discard = &log_discard;
+    ld->disk.next_data = &log_next_data;
+    ld->disk.destroy = &log_destroy;
+    ld->disk.size = base->size;
+
+    pthread_mutex_init(&ld->lock, NULL);
+    pthread_cond_init(&ld->synced_cond, NULL);
+    pthread_cond_init(&ld->compact_cond, NULL);
+
+    replay(ld);
+
+    if (pthread_create(&ld->compactor, NULL, &compactor, ld) != 0)
+    {
+        errx(1, "VMM: can't start the log compactor");
+    }
+
+    printf("log: %s.seg.* in front of %s, %d MiB segments\n", path, path, SEGMENT_SIZE / (1024 * 1024));
+    return &ld->disk;
+}
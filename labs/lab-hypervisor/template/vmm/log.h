@@ -0,0 +1,10 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include "disk.h"
+
+bool has_log_segments(char *path);
+void remove_log_segments(char *path);
+disk_t *create_log_disk(disk_t *base, char *path);
+
+#endif
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "migrate.h"
+
+#define MIGRATION_SIGNAL SIGUSR1
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bitmap_words(uint64_t size)
+{
+    return (size / MIGRATION_PAGE_SIZE + 63) / 64;
+}
+
+migration_t *create_migration(int fd, uint64_t guest_mem_size, uint32_t devices_size)
+{
+    migration_t *m = (migration_t *)calloc(1, sizeof(migration_t));
+    m->fd = fd;
+    m->guest_mem_size = guest_mem_size;
+    m->devices_size = devices_size;
+    return m;
+}
+
+// slot: the memory slot of the region if the dirty log has it, -1 otherwise
+void migration_add_region(migration_t *m, int slot, uint64_t gpa, uint8_t *mem, uint64_t size)
+{
+    if (m->nr_regions == MIGRATION_MAX_REGIONS)
+    {
+        errx(1, "VMM: too many memory regions to migrate");
+    }
+
+    m->regions[m->nr_regions++] = (migration_region_t){.slot = slot, .gpa = gpa, .mem = mem, .size = size};
+}
+
+static void send_or_die(migration_t *m, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, m->file) != size)
+    {
+        err(1, "VMM: sending the VM to the destination");
+    }
+}
+
+static void send_record(migration_t *m, migration_record_type_t type, uint64_t gpa)
+{
+    migration_record_t record = {.type = type, .gpa = gpa};
+    send_or_die(m, &record, sizeof(record));
+}
+
+// Sends what is buffered, then waits for the destination to have taken it all
+static void wait_for_destination(migration_t *m)
+{
+    if (fflush(m->file) != 0)
+    {
+        err(1, "VMM: sending the VM to the destination");
+    }
+
+    char ack;
+    if (read(m->fd, &ack, 1) != 1)
+    {
+        errx(1, "VMM: the destination didn't take the VM");
+    }
+}
+
+static void send_page(migration_t *m, uint64_t gpa, const uint8_t *data)
+{
+    send_record(m, MIGRATION_PAGE, gpa);
+    send_or_die(m, data, MIGRATION_PAGE_SIZE);
+    m->pages++;
+}
+
+// Sends the pages of the bitmaps and clears them, returns how many
+static uint64_t send_dirty_pages(migration_t *m)
+{
+    uint64_t pages = 0;
+
+    for (int i = 0; i < m->dirty->nr_slots; i++)
+    {
+        dirty_slot_t *slot = &m->dirty->slots[i];
+
+        for (uint64_t word = 0; word < bitmap_words(slot->size); word++)
+        {
+            uint64_t bits = m->bitmaps[i][word];
+            m->bitmaps[i][word] = 0;
+
+            for (; bits; bits &= bits - 1)
+            {
+                uint64_t offset = (word * 64 + __builtin_ctzll(bits)) * MIGRATION_PAGE_SIZE;
+                send_page(m, slot->gpa + offset, slot->mem + offset);
+                pages++;
+            }
+        }
+    }
+
+    return pages;
+}
+
+// Sends every page of the regions that are (dirty_logged) or aren't in the
+// dirty log, returns how many
+static uint64_t send_regions(migration_t *m, bool dirty_logged)
+{
+    uint64_t pages = 0;
+
+    for (int i = 0; i < m->nr_regions; i++)
+    {
+        migration_region_t *region = &m->regions[i];
+
+        if ((region->slot >= 0) != dirty_logged)
+            continue;
+
+        for (uint64_t offset = 0; offset < region->size; offset += MIGRATION_PAGE_SIZE)
+        {
+            send_page(m, region->gpa + offset, region->mem + offset);
+            pages++;
+        }
+    }
+
+    return pages;
+}
+
+// The pre-copy thread: the guest keeps running while its memory is sent
+static void *precopy(void *arg)
+{
+    migration_t *m = (migration_t *)arg;
+    struct timespec delay = {m->delay_ms / 1000, m->delay_ms % 1000 * 1000000L};
+    nanosleep(&delay, NULL);
+
+    m->start_ns = now_ns();
+    migration_header_t header = {.magic = MIGRATION_MAGIC,
+                                 .guest_mem_size = m->guest_mem_size,
+                                 .state_size = sizeof(vm_state_t),
+                                 .devices_size = m->devices_size};
+    send_or_die(m, &header, sizeof(header));
+
+    // Everything, then what was written meanwhile
+    dirty_log_take(m->dirty, m->bitmaps);
+
+    for (int i = 0; i < m->dirty->nr_slots; i++)
+    {
+        memset(m->bitmaps[i], 0, bitmap_words(m->dirty->slots[i].size) * sizeof(uint64_t));
+    }
+
+    uint64_t start = now_ns();
+    uint64_t pages = send_regions(m, true);
+    send_record(m, MIGRATION_SYNC, 0);
+    wait_for_destination(m);
+
+    // How long the destination takes to get a page, to tell how long the
+    // last pass will be
+    double page_ns = (double)(now_ns() - start) / (pages ? pages : 1);
+    printf("migration: pass 0: %lu pages in %.1f ms\n", pages, (now_ns() - start) / 1e6);
+
+    for (m->passes = 1; m->passes < MIGRATION_MAX_PASSES; m->passes++)
+    {
+        pages = dirty_log_take(m->dirty, m->bitmaps);
+
+        if (pages * page_ns <= MIGRATION_PAUSE_TARGET_US * 1000.0)
+            break;
+
+        start = now_ns();
+        send_dirty_pages(m);
+        send_record(m, MIGRATION_SYNC, 0);
+        wait_for_destination(m);
+        page_ns = (double)(now_ns() - start) / pages;
+        printf("migration: pass %d: %lu pages in %.1f ms\n", m->passes, pages, (now_ns() - start) / 1e6);
+    }
+
+    // The rest with the guest paused
+    m->pause_start_ns = now_ns();
+    m->due = 1;
+    m->run->immediate_exit = 1; // KVM_RUN returns with EINTR, even if entered after this
+    pthread_kill(m->vcpu_thread, MIGRATION_SIGNAL);
+    return NULL;
+}
+
+static void on_kick(int sig)
+{
+    (void)sig;
+}
+
+// In the vCPU thread, once the VM runs: the migration starts after delay_ms
+void migration_start(migration_t *m, int delay_ms, dirty_log_t *dirty, struct kvm_run *run)
+{
+    m->delay_ms = delay_ms;
+    m->dirty = dirty;
+    m->run = run;
+    m->vcpu_thread = pthread_self();
+
+    for (int i = 0; i < dirty->nr_slots; i++)
+    {
+        if (!(m->bitmaps[i] = calloc(bitmap_words(dirty->slots[i].size), sizeof(uint64_t))))
+        {
+            err(1, "VMM: allocating the migration");
+        }
+    }
+
+    if (!(m->file = fdopen(m->fd, "w")))
+    {
+        err(1, "VMM: fdopen");
+    }
+
+    setvbuf(m->file, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+
+    // Other system calls of the thread restart, KVM_RUN returns with EINTR
+    struct sigaction action = {.sa_handler = &on_kick, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(MIGRATION_SIGNAL, &action, NULL) < 0)
+    {
+        err(1, "VMM: sigaction");
+    }
+
+    if (pthread_create(&m->thread, NULL, &precopy, m) != 0)
+    {
+        errx(1, "VMM: pthread_create");
+    }
+}
+
+// Called with the vCPU out of KVM_RUN and its last exit completed, once due:
+// the last pass. The VM must not run again.
+void migration_complete(migration_t *m, int vmfd, int vcpufd, const void *devices)
+{
+    m->due = 0;
+    pthread_join(m->thread, NULL);
+
+    m->last_pages = dirty_log_take(m->dirty, m->bitmaps);
+    send_dirty_pages(m);
+    m->last_pages += send_regions(m, false);
+
+    vm_state_init(&m->state, vcpufd);
+    vm_state_save(&m->state, vmfd, vcpufd);
+
+    send_record(m, MIGRATION_STATE, 0);
+    send_or_die(m, &m->state, sizeof(vm_state_t));
+    send_or_die(m, devices, m->devices_size);
+
+    // The guest runs on the destination from now on
+    wait_for_destination(m);
+
+    uint64_t end = now_ns();
+    m->done = true;
+    printf("migration: %lu pages in %d passes and %.1f ms, guest paused %.0f us for the last %lu\n", m->pages,
+           m->passes + 1, (end - m->start_ns) / 1e6, (end - m->pause_start_ns) / 1e3, m->last_pages);
+}
+
+static void receive_or_die(migration_t *m, void *data, size_t size)
+{
+    if (fread(data, 1, size, m->file) != size)
+    {
+        errx(1, "VMM: the source of the migration went away");
+    }
+}
+
+static migration_region_t *find_region(migration_t *m, uint64_t gpa)
+{
+    for (int i = 0; i < m->nr_regions; i++)
+    {
+        if (gpa >= m->regions[i].gpa && gpa < m->regions[i].gpa + m->regions[i].size)
+            return &m->regions[i];
+    }
+
+    return NULL;
+}
+
+static void acknowledge(migration_t *m)
+{
+    char ack = 1;
+
+    if (write(m->fd, &ack, 1) != 1)
+    {
+        err(1, "VMM: acknowledging the migration");
+    }
+}
+
+// Destination: puts the pages in guest memory as they come, up to the state,
+// which goes in state and devices
+void migration_receive(migration_t *m, vm_state_t *state, void *devices)
+{
+    if (!(m->file = fdopen(m->fd, "r")))
+    {
+        err(1, "VMM: fdopen");
+    }
+
+    setvbuf(m->file, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+
+    migration_header_t header;
+    receive_or_die(m, &header, sizeof(header));
+    m->start_ns = now_ns();
+
+    if (memcmp(header.magic, MIGRATION_MAGIC, sizeof(header.magic)) != 0 || header.state_size != sizeof(vm_state_t) ||
+        header.devices_size != m->devices_size)
+    {
+        errx(1, "VMM: the source of the migration isn't this VMM");
+    }
+
+    if (header.guest_mem_size != m->guest_mem_size)
+    {
+        errx(1, "VMM: the source VM has %lu KB of RAM, not %lu", header.guest_mem_size / 1024,
+             m->guest_mem_size / 1024);
+    }
+
+    migration_record_t record;
+
+    for (receive_or_die(m, &record, sizeof(record)); record.type != MIGRATION_STATE;
+         receive_or_die(m, &record, sizeof(record)))
+    {
+        if (record.type == MIGRATION_SYNC)
+        {
+            // The source waits for what it sent to be here
+            acknowledge(m);
+            continue;
+        }
+
+        if (record.type != MIGRATION_PAGE)
+        {
+            errx(1, "VMM: unknown migration record %u", record.type);
+        }
+
+        migration_region_t *region = find_region(m, record.gpa);
+
+        if (!region || record.gpa + MIGRATION_PAGE_SIZE > region->gpa + region->size)
+        {
+            errx(1, "VMM: the source sent a page at 0x%lx, outside of the guest's memory", record.gpa);
+        }
+
+        receive_or_die(m, region->mem + record.gpa - region->gpa, MIGRATION_PAGE_SIZE);
+        m->pages++;
+    }
+
+    receive_or_die(m, state, sizeof(vm_state_t));
+    receive_or_die(m, devices, m->devices_size);
+}
+
+// Destination, once the state is loaded: the source can go
+void migration_acknowledge(migration_t *m)
+{
+    acknowledge(m);
+    m->done = true;
+    printf("migration: %lu pages received in %.1f ms\n", m->pages, (now_ns() - m->start_ns) / 1e6);
+}
+
+void destroy_migration(migration_t *m)
+{
+    if (m->run && !m->done)
+    {
+        // The guest stopped before the migration was over
+        pthread_cancel(m->thread);
+        pthread_join(m->thread, NULL);
+    }
+
+    if (m->file)
+        fclose(m->file);
+    else
+        close(m->fd);
+
+    for (int i = 0; i < DIRTY_MAX_SLOTS; i++)
+    {
+        free(m->bitmaps[i]);
+    }
+
+    free(m);
+}
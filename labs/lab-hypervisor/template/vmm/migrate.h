@@ -0,0 +1,105 @@
+#ifndef _MIGRATE_H_
+#define _MIGRATE_H_
+
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "dirty.h"
+#include "vmstate.h"
+
+// Live migration of a running VM to another VMM process, through a socket
+// (pre-copy). While the guest keeps running, a thread of the source sends all
+// of its memory, then the pages it wrote meanwhile, again and again until
+// there are few enough left to send them in about MIGRATION_PAUSE_TARGET_US.
+// The vCPU then pauses for the last pass: the remaining pages, the memory
+// that isn't dirty-logged, the vm_state_t and the device models' state. The
+// destination, started with the same VM options and devices, loads them and
+// acknowledges, then runs the guest while the source exits.
+//
+// The stream is a migration_header_t followed by records, each a
+// migration_record_t then a page (MIGRATION_PAGE) or the vm_state_t and the
+// devices' state (MIGRATION_STATE, the last one). The destination answers
+// MIGRATION_SYNC, sent after each pass, and MIGRATION_STATE with a byte.
+
+#define MIGRATION_MAGIC "VMMMIGR1"
+#define MIGRATION_MAX_REGIONS 8
+#define MIGRATION_PAGE_SIZE 4096
+#define MIGRATION_MAX_PASSES 30
+#define MIGRATION_PAUSE_TARGET_US 1000
+
+typedef struct migration_header
+{
+    char magic[8];
+    uint64_t guest_mem_size;
+    uint32_t state_size; // of vm_state_t
+    uint32_t devices_size;
+} migration_header_t;
+
+typedef enum
+{
+    MIGRATION_PAGE = 1,
+    MIGRATION_SYNC,
+    MIGRATION_STATE,
+} migration_record_type_t;
+
+typedef struct migration_record
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t gpa; // MIGRATION_PAGE
+} migration_record_t;
+
+// Guest memory to migrate. Regions of memory slots in the dirty log are sent
+// while the guest runs, the others while it's paused.
+typedef struct migration_region
+{
+    int slot; // -1 if it doesn't log dirty pages
+    uint64_t gpa;
+    uint8_t *mem;
+    uint64_t size;
+} migration_region_t;
+
+typedef struct migration
+{
+    int fd;
+    FILE *file;
+    uint64_t guest_mem_size;
+    uint32_t devices_size;
+    migration_region_t regions[MIGRATION_MAX_REGIONS];
+    int nr_regions;
+
+    // Source: the pre-copy thread kicks the vCPU out of KVM_RUN when done
+    dirty_log_t *dirty;
+    uint64_t *bitmaps[DIRTY_MAX_SLOTS]; // pages left to send, of the dirty log's slots
+    int delay_ms;
+    pthread_t thread;
+    pthread_t vcpu_thread;
+    struct kvm_run *run;
+    volatile sig_atomic_t due;
+    bool done;
+    vm_state_t state;
+
+    uint64_t start_ns;
+    uint64_t pause_start_ns;
+    int passes;
+    uint64_t pages;
+    uint64_t last_pages; // sent while paused
+} migration_t;
+
+migration_t *create_migration(int fd, uint64_t guest_mem_size, uint32_t devices_size);
+void migration_add_region(migration_t *m, int slot, uint64_t gpa, uint8_t *mem, uint64_t size);
+
+// Source
+void migration_start(migration_t *m, int delay_ms, dirty_log_t *dirty, struct kvm_run *run);
+void migration_complete(migration_t *m, int vmfd, int vcpufd, const void *devices);
+
+// Destination
+void migration_receive(migration_t *m, vm_state_t *state, void *devices);
+void migration_acknowledge(migration_t *m);
+
+void destroy_migration(migration_t *m);
+
+#endif
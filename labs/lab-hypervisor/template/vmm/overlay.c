@@ -0,0 +1,499 @@
+// Sparse copy-on-write overlay image on top of a read-only raw backing image.
+//
+// File layout (all integers little endian):
+//   cluster 0      header, followed by the backing image path
+//   cluster 1..n   L1 table: one 64-bit file offset of an L2 table per entry
+//   ...            L2 tables (one cluster each) and data clusters, allocated
+//                  at the end of the file as the guest writes
+// An offset of 0 means "not allocated": L2 lookups then read through to the
+// backing image (or zeros past its end).
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "overlay.h"
+
+#define OVERLAY_MAGIC "VMMOVL\0\1"
+#define OVERLAY_VERSION 1
+#define CLUSTER_BITS 16
+#define CLUSTER_SIZE (1 << CLUSTER_BITS)
+#define L2_ENTRIES (CLUSTER_SIZE / sizeof(uint64_t))
+
+typedef struct overlay_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t size;
+    uint64_t l1_offset;
+    uint32_t l1_entries;
+    uint32_t backing_len;
+} overlay_header_t;
+
+typedef struct overlay_disk
+{
+    disk_t disk;
+    int fd;
+    disk_t *backing;
+    uint64_t *l1;
+    uint64_t **l2; // L2 tables loaded so far, indexed like l1
+    uint32_t l1_entries;
+    uint64_t l1_offset;
+    uint64_t end; // where the next cluster gets allocated
+    pthread_mutex_t lock;
+    uint64_t allocated;
+} overlay_disk_t;
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    return fd_readv(fd, &iov, 1, offset);
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    return fd_writev(fd, &iov, 1, offset);
+}
+
+// Create (or truncate) path as an empty overlay on top of backing
+void create_overlay_image(char *path, char *backing)
+{
+    char backing_path[PATH_MAX];
+    if (!realpath(backing, backing_path))
+    {
+        err(1, "VMM: %s", backing);
+    }
+
+    struct stat st;
+    if (stat(backing_path, &st) < 0)
+    {
+        err(1, "VMM: %s", backing_path);
+    }
+
+    struct stat existing;
+    if (stat(path, &existing) == 0 && existing.st_dev == st.st_dev && existing.st_ino == st.st_ino)
+    {
+        errx(1, "VMM: overlay %s would overwrite its own backing image", path);
+    }
+
+    uint64_t size = st.st_size;
+    uint64_t l1_entries = (size + (uint64_t)L2_ENTRIES * CLUSTER_SIZE - 1) / ((uint64_t)L2_ENTRIES * CLUSTER_SIZE);
+    uint64_t l1_size = (l1_entries * sizeof(uint64_t) + CLUSTER_SIZE - 1) & ~(uint64_t)(CLUSTER_SIZE - 1);
+
+    overlay_header_t header = {
+        .version = OVERLAY_VERSION,
+        .cluster_bits = CLUSTER_BITS,
+        .size = size,
+        .l1_offset = CLUSTER_SIZE,
+        .l1_entries = (uint32_t)l1_entries,
+        .backing_len = (uint32_t)strlen(backing_path)};
+    memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+
+    if (sizeof(header) + header.backing_len > CLUSTER_SIZE)
+    {
+        errx(1, "VMM: backing path too long: %s", backing_path);
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    // The L1 table is all zeros, so extending the file is enough to create it
+    if (pwrite_full(fd, &header, sizeof(header), 0) < 0 ||
+        pwrite_full(fd, backing_path, header.backing_len, sizeof(header)) < 0 ||
+        ftruncate(fd, CLUSTER_SIZE + l1_size) < 0 ||
+        fdatasync(fd) < 0)
+    {
+        err(1, "VMM: creating overlay %s", path);
+    }
+
+    close(fd);
+    printf("overlay %s created on top of %s\n", path, backing_path);
+}
+
+// Load (if needed) and return the L2 table for l1_index, allocating it when alloc is set.
+// Returns NULL on error, or with *missing set if it isn't allocated.
+static uint64_t *get_l2(overlay_disk_t *ovl, uint64_t l1_index, bool alloc, bool *missing)
+{
+    *missing = false;
+
+    // Past the end of the disk
+    if (l1_index >= ovl->l1_entries)
+        return NULL;
+
+    if (ovl->l2[l1_index])
+        return ovl->l2[l1_index];
+
+    if (!ovl->l1[l1_index] && !alloc)
+    {
+        *missing = true;
+        return NULL;
+    }
+
+    uint64_t *table = calloc(L2_ENTRIES, sizeof(uint64_t));
+    if (!table)
+        return NULL;
+
+    if (ovl->l1[l1_index])
+    {
+        if (pread_full(ovl->fd, table, CLUSTER_SIZE, ovl->l1[l1_index]) < 0)
+        {
+            free(table);
+            return NULL;
+        }
+    }
+    else
+    {
+        // New (empty) L2 table: write it before pointing the L1 entry at it
+        uint64_t offset = ovl->end;
+        if (pwrite_full(ovl->fd, table, CLUSTER_SIZE, offset) < 0 ||
+            pwrite_full(ovl->fd, &offset, sizeof(offset), ovl->l1_offset + l1_index * sizeof(uint64_t)) < 0)
+        {
+            free(table);
+            return NULL;
+        }
+
+        ovl->end += CLUSTER_SIZE;
+        ovl->l1[l1_index] = offset;
+    }
+
+    ovl->l2[l1_index] = table;
+    return table;
+}
+
+// Find the file offset of the cluster holding the given disk offset (0 if not allocated)
+static int lookup_cluster(overlay_disk_t *ovl, uint64_t offset, uint64_t *cluster_offset)
+{
+    uint64_t cluster = offset >> CLUSTER_BITS;
+    bool missing;
+    uint64_t *l2 = get_l2(ovl, cluster / L2_ENTRIES, false, &missing);
+
+    if (!l2 && !missing)
+        return -1;
+
+    *cluster_offset = l2 ? l2[cluster % L2_ENTRIES] : 0;
+    return 0;
+}
+
+// Read len bytes at disk offset from the backing image, zero-filling past its end
+static int read_backing(overlay_disk_t *ovl, const struct iovec *iov, int iovcnt, size_t skip, size_t len, uint64_t offset)
+{
+    struct iovec sub[iovcnt];
+    uint64_t backing_size = ovl->backing ? ovl->backing->size : 0;
+    size_t from_backing = offset >= backing_size ? 0 : (backing_size - offset < len ? backing_size - offset : len);
+
+    if (from_backing > 0)
+    {
+        int n = iov_slice(iov, iovcnt, skip, from_backing, sub);
+        if (ovl->backing->readv(ovl->backing, sub, n, offset) < 0)
+            return -1;
+    }
+
+    int n = iov_slice(iov, iovcnt, skip + from_backing, len - from_backing, sub);
+    for (int i = 0; i < n; i++)
+    {
+        memset(sub[i].iov_base, 0, sub[i].iov_len);
+    }
+
+    return 0;
+}
+
+static int overlay_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    overlay_disk_t *ovl = (overlay_disk_t *)disk;
+    size_t len = iov_length(iov, iovcnt);
+    size_t done = 0;
+    struct iovec sub[iovcnt];
+    int ret = 0;
+
+    pthread_mutex_lock(&ovl->lock);
+
+    while (done < len && ret == 0)
+    {
+        uint64_t pos = offset + done;
+        size_t in_cluster = CLUSTER_SIZE - (pos & (CLUSTER_SIZE - 1));
+        size_t chunk = len - done < in_cluster ? len - done : in_cluster;
+        uint64_t cluster_offset;
+
+        ret = lookup_cluster(ovl, pos, &cluster_offset);
+        if (ret == 0 && cluster_offset)
+        {
+            int n = iov_slice(iov, iovcnt, done, chunk, sub);
+            ret = fd_readv(ovl->fd, sub, n, cluster_offset + (pos & (CLUSTER_SIZE - 1)));
+        }
+        else if (ret == 0)
+        {
+            ret = read_backing(ovl, iov, iovcnt, done, chunk, pos);
+        }
+
+        done += chunk;
+    }
+
+    pthread_mutex_unlock(&ovl->lock);
+    return ret;
+}
+
+// Allocate the cluster holding pos: copy what the backing image has for it,
+// merge in the bytes being written, then point the L2 entry at it.
+static int allocate_cluster(overlay_disk_t *ovl, uint64_t pos, const struct iovec *iov, int iovcnt, size_t skip, size_t chunk)
+{
+    uint64_t cluster = pos >> CLUSTER_BITS;
+    bool missing;
+    uint64_t *l2 = get_l2(ovl, cluster / L2_ENTRIES, true, &missing);
+    if (!l2)
+        return -1;
+
+    uint8_t *buf = malloc(CLUSTER_SIZE);
+    if (!buf)
+        return -1;
+
+    uint64_t cluster_start = cluster << CLUSTER_BITS;
+    size_t in_cluster = pos - cluster_start;
+    int ret = 0;
+
+    // Whole-cluster writes don't need the backing data
+    if (chunk != CLUSTER_SIZE)
+    {
+        struct iovec whole = {.iov_base = buf, .iov_len = CLUSTER_SIZE};
+        ret = read_backing(ovl, &whole, 1, 0, CLUSTER_SIZE, cluster_start);
+    }
+
+    uint64_t offset = ovl->end;
+    if (ret == 0)
+    {
+        iov_to_buf(iov, iovcnt, skip, buf + in_cluster, chunk);
+        ret = pwrite_full(ovl->fd, buf, CLUSTER_SIZE, offset);
+    }
+
+    // Data goes to disk before the metadata pointing at it
+    if (ret == 0)
+        ret = pwrite_full(ovl->fd, &offset, sizeof(offset), ovl->l1[cluster / L2_ENTRIES] + (cluster % L2_ENTRIES) * sizeof(uint64_t));
+
+    if (ret == 0)
+    {
+        ovl->end += CLUSTER_SIZE;
+        l2[cluster % L2_ENTRIES] = offset;
+        ovl->allocated++;
+    }
+
+    free(buf);
+    return ret;
+}
+
+static int overlay_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    overlay_disk_t *ovl = (overlay_disk_t *)disk;
+    size_t len = iov_length(iov, iovcnt);
+    size_t done = 0;
+    struct iovec sub[iovcnt];
+    int ret = 0;
+
+    pthread_mutex_lock(&ovl->lock);
+
+    while (done < len && ret == 0)
+    {
+        uint64_t pos = offset + done;
+        size_t in_cluster = CLUSTER_SIZE - (pos & (CLUSTER_SIZE - 1));
+        size_t chunk = len - done < in_cluster ? len - done : in_cluster;
+        uint64_t cluster_offset;
+
+        ret = lookup_cluster(ovl, pos, &cluster_offset);
+        if (ret == 0 && cluster_offset)
+        {
+            int n = iov_slice(iov, iovcnt, done, chunk, sub);
+            ret = fd_writev(ovl->fd, sub, n, cluster_offset + (pos & (CLUSTER_SIZE - 1)));
+        }
+        else if (ret == 0)
+        {
+            ret = allocate_cluster(ovl, pos, iov, iovcnt, done, chunk);
+        }
+
+        done += chunk;
+    }
+
+    pthread_mutex_unlock(&ovl->lock);
+    return ret;
+}
+
+static int overlay_flush(disk_t *disk)
+{
+    overlay_disk_t *ovl = (overlay_disk_t *)disk;
+    return fdatasync(ovl->fd);
+}
+
+// Punch holes in the allocated clusters of the range. Clusters stay allocated
+// (so they read as zeros rather than as the backing image's data).
+static int overlay_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    overlay_disk_t *ovl = (overlay_disk_t *)disk;
+    uint64_t done = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&ovl->lock);
+
+    while (done < length && ret == 0)
+    {
+        uint64_t pos = offset + done;
+        uint64_t in_cluster = CLUSTER_SIZE - (pos & (CLUSTER_SIZE - 1));
+        uint64_t chunk = length - done < in_cluster ? length - done : in_cluster;
+        uint64_t cluster_offset;
+
+        ret = lookup_cluster(ovl, pos, &cluster_offset);
+        if (ret == 0 && cluster_offset)
+        {
+            ret = fallocate(ovl->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            cluster_offset + (pos & (CLUSTER_SIZE - 1)), chunk);
+        }
+
+        done += chunk;
+    }
+
+    pthread_mutex_unlock(&ovl->lock);
+    return ret;
+}
+
+// Allocated clusters are data; elsewhere, whatever the backing image has
+static uint64_t overlay_next_data(disk_t *disk, uint64_t offset)
+{
+    overlay_disk_t *ovl = (overlay_disk_t *)disk;
+    uint64_t l2_span = (uint64_t)L2_ENTRIES * CLUSTER_SIZE;
+    uint64_t pos = offset;
+
+    pthread_mutex_lock(&ovl->lock);
+
+    while (pos < disk->size)
+    {
+        uint64_t cluster = pos >> CLUSTER_BITS;
+        bool missing;
+        uint64_t *l2 = get_l2(ovl, cluster / L2_ENTRIES, false, &missing);
+
+        if (!l2 && !missing)
+            break; // can't tell, report data
+
+        // Unallocated range: up to the end of the L2 table, or of the cluster
+        uint64_t end = l2 ? (cluster + 1) << CLUSTER_BITS : (cluster / L2_ENTRIES + 1) * l2_span;
+
+        if (l2 && l2[cluster % L2_ENTRIES])
+            break;
+
+        if (ovl->backing && pos < ovl->backing->size)
+        {
+            uint64_t data = disk_next_data(ovl->backing, pos);
+            if (data < end && data < ovl->backing->size)
+            {
+                pos = data;
+                break;
+            }
+        }
+
+        pos = end;
+    }
+
+    pthread_mutex_unlock(&ovl->lock);
+    return pos;
+}
+
+static void overlay_destroy(disk_t *disk)
+{
+    overlay_disk_t *ovl = (overlay_disk_t *)disk;
+
+    printf("overlay: %lu clusters allocated\n", ovl->allocated);
+
+    for (uint32_t i = 0; i < ovl->l1_entries; i++)
+    {
+        free(ovl->l2[i]);
+    }
+
+    if (ovl->backing)
+    {
+        destroy_disk(ovl->backing);
+    }
+
+    pthread_mutex_destroy(&ovl->lock);
+    close(ovl->fd);
+    free(ovl->l2);
+    free(ovl->l1);
+    free(ovl);
+}
+
+disk_t *create_overlay_disk(char *path)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    overlay_header_t header;
+    if (pread_full(fd, &header, sizeof(header), 0) < 0 ||
+        memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) != 0)
+    {
+        errx(1, "VMM: %s: not an overlay image", path);
+    }
+
+    if (header.version != OVERLAY_VERSION || header.cluster_bits != CLUSTER_BITS)
+    {
+        errx(1, "VMM: %s: unsupported overlay version %u (cluster bits %u)", path, header.version, header.cluster_bits);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        err(1, "VMM: %s", path);
+    }
+
+    // The L1 table must map the whole disk, after the header and within the file
+    uint64_t l1_entries = (header.size + (uint64_t)L2_ENTRIES * CLUSTER_SIZE - 1) / ((uint64_t)L2_ENTRIES * CLUSTER_SIZE);
+    if (header.size > UINT64_MAX / 2 || header.l1_entries != l1_entries || header.l1_offset < sizeof(header) ||
+        header.l1_offset > (uint64_t)st.st_size || l1_entries * sizeof(uint64_t) > (uint64_t)st.st_size - header.l1_offset)
+    {
+        errx(1, "VMM: %s: corrupt overlay header", path);
+    }
+
+    overlay_disk_t *ovl = (overlay_disk_t *)calloc(1, sizeof(overlay_disk_t));
+    ovl->fd = fd;
+    ovl->l1_entries = header.l1_entries;
+    ovl->l1_offset = header.l1_offset;
+    ovl->l1 = calloc(header.l1_entries, sizeof(uint64_t));
+    ovl->l2 = calloc(header.l1_entries, sizeof(uint64_t *));
+
+    if (pread_full(fd, ovl->l1, header.l1_entries * sizeof(uint64_t), header.l1_offset) < 0)
+    {
+        errx(1, "VMM: %s: cannot read L1 table", path);
+    }
+
+    if (header.backing_len > 0)
+    {
+        char backing_path[PATH_MAX];
+        if (header.backing_len >= sizeof(backing_path) ||
+            pread_full(fd, backing_path, header.backing_len, sizeof(header)) < 0)
+        {
+            errx(1, "VMM: %s: cannot read backing path", path);
+        }
+        backing_path[header.backing_len] = '\0';
+        ovl->backing = create_raw_disk(backing_path, true);
+    }
+
+    ovl->end = (st.st_size + CLUSTER_SIZE - 1) & ~(uint64_t)(CLUSTER_SIZE - 1);
+
+    pthread_mutex_init(&ovl->lock, NULL);
+    ovl->disk.readv = &overlay_readv;
+    ovl->disk.writev = &overlay_writev;
+    ovl->disk.flush = &overlay_flush;
+    ovl->disk.discard = &overlay_discard;
+    ovl->disk.next_data = &overlay_next_data;
+    ovl->disk.destroy = &overlay_destroy;
+    ovl->disk.size = header.size;
+    return &ovl->disk;
+}
@@ -0,0 +1,9 @@
+#ifndef _OVERLAY_H_
+#define _OVERLAY_H_
+
+#include "disk.h"
+
+void create_overlay_image(char *path, char *backing);
+disk_t *create_overlay_disk(char *path);
+
+#endif
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "pool.h"
+#include "unixsock.h"
+
+#define POOL_MAX_REQUEST (64 * 1024)
+
+typedef struct pool
+{
+    char *path;
+    int sock;
+    int size;
+    pid_t *workers;
+    const pool_worker_ops_t *ops;
+} pool_t;
+
+static volatile sig_atomic_t stopping;
+
+static void stop_serving(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The job's request: the client's working directory, then its arguments, all
+// NUL-terminated. Returns argc, argv[0] being the program's name; *cwd is the
+// start of the request, for the caller to free.
+static int read_job(int conn, char **argv, int max_args, char **cwd)
+{
+    char *request = malloc(POOL_MAX_REQUEST);
+    size_t length = 0;
+    ssize_t ret;
+
+    while ((ret = read(conn, request + length, POOL_MAX_REQUEST - length)) > 0)
+    {
+        length += ret;
+
+        if (length == POOL_MAX_REQUEST)
+        {
+            errx(1, "VMM: job request larger than %d bytes", POOL_MAX_REQUEST);
+        }
+    }
+
+    if (ret < 0 || length == 0 || request[length - 1] != '\0')
+    {
+        errx(1, "VMM: incomplete job request");
+    }
+
+    int argc = 0;
+    argv[argc++] = "vmm";
+    *cwd = request;
+
+    for (char *arg = request + strlen(request) + 1; arg < request + length; arg += strlen(arg) + 1)
+    {
+        if (argc == max_args - 1)
+        {
+            errx(1, "VMM: too many job arguments");
+        }
+        argv[argc++] = arg;
+    }
+
+    argv[argc] = NULL;
+    return argc;
+}
+
+// A pool worker: starts, then runs jobs until it is killed
+static void pool_worker(pool_t *pool, int id)
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN); // clients may go away before their job is done
+
+    pool->ops->start(id);
+
+    // The job's output goes to its connection
+    int out = dup(STDOUT_FILENO);
+    int errout = dup(STDERR_FILENO);
+    char *argv[256];
+    char *cwd;
+
+    while (1)
+    {
+        fflush(stdout);
+        int conn = accept4(pool->sock, NULL, NULL, SOCK_CLOEXEC);
+        uint64_t job_start = now_ns();
+
+        if (conn < 0)
+        {
+            if (errno != EINTR)
+                warn("pool: accept");
+            continue;
+        }
+
+        if (dup2(conn, STDOUT_FILENO) < 0 || dup2(conn, STDERR_FILENO) < 0)
+        {
+            err(1, "VMM: dup2");
+        }
+
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        int argc = read_job(conn, argv, sizeof(argv) / sizeof(argv[0]), &cwd);
+
+        if (chdir(cwd) < 0)
+        {
+            err(1, "VMM: %s", cwd);
+        }
+
+        int status = pool->ops->run_job(argc, argv, job_start);
+        free(cwd);
+
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+        dup2(errout, STDERR_FILENO);
+        close(conn);
+
+        pool->ops->reset(id, status);
+    }
+}
+
+static pid_t start_pool_worker(pool_t *pool, int id)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        pool_worker(pool, id);
+    }
+
+    if (pid < 0)
+    {
+        err(1, "VMM: fork");
+    }
+
+    return pid;
+}
+
+// -serve: starts the workers, and another one whenever one exits, until SIGINT
+// or SIGTERM
+int serve_pool(char *path, int size, const pool_worker_ops_t *ops)
+{
+    pool_t pool = {
+        .path = path,
+        .sock = listen_unix_socket(path),
+        .size = size,
+        .workers = calloc(size, sizeof(pid_t)),
+        .ops = ops,
+    };
+
+    // Without SA_RESTART, so that waitpid() returns
+    struct sigaction action = {.sa_handler = &stop_serving};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (int i = 0; i < size; i++)
+    {
+        pool.workers[i] = start_pool_worker(&pool, i);
+    }
+
+    while (!stopping)
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        for (int i = 0; i < size && pid > 0 && !stopping; i++)
+        {
+            if (pool.workers[i] != pid)
+                continue;
+
+            printf("pool: worker %d exited (status 0x%x), starting another one\n", i, status);
+            fflush(stdout);
+            pool.workers[i] = start_pool_worker(&pool, i);
+        }
+    }
+
+    printf("pool: stopping\n");
+
+    for (int i = 0; i < size; i++)
+    {
+        kill(pool.workers[i], SIGTERM);
+        waitpid(pool.workers[i], NULL, 0);
+    }
+
+    close(pool.sock);
+    unlink(path);
+    free(pool.workers);
+    return EXIT_SUCCESS;
+}
+
+// -submit
+int submit_main(const char *path, int argc, char **argv)
+{
+    int sock = connect_unix_socket(path);
+    char *cwd = getcwd(NULL, 0);
+
+    if (!cwd)
+    {
+        err(1, "VMM: getcwd");
+    }
+
+    // Every argument but -submit <socket>
+    FILE *request = fdopen(dup(sock), "w");
+    fwrite(cwd, 1, strlen(cwd) + 1, request);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-submit") == 0)
+        {
+            i++;
+            continue;
+        }
+        fwrite(argv[i], 1, strlen(argv[i]) + 1, request);
+    }
+
+    if (fclose(request) != 0 || shutdown(sock, SHUT_WR) < 0)
+    {
+        err(1, "VMM: sending the job to %s", path);
+    }
+
+    free(cwd);
+
+    char buf[4096];
+    char line[256];
+    int line_length = 0;
+    int status = EXIT_FAILURE;
+    ssize_t length;
+
+    while ((length = read(sock, buf, sizeof(buf))) > 0)
+    {
+        if (write(STDOUT_FILENO, buf, length) != length)
+        {
+            err(1, "VMM: writing the job's output");
+        }
+
+        // The status is on the job's last line
+        for (ssize_t i = 0; i < length; i++)
+        {
+            if (buf[i] != '\n')
+            {
+                if (line_length < (int)sizeof(line) - 1)
+                    line[line_length++] = buf[i];
+                continue;
+            }
+
+            line[line_length] = '\0';
+            line_length = 0;
+            char *exit_status = strstr(line, ", exit status ");
+
+            if (strncmp(line, "job: ", 5) == 0 && exit_status)
+            {
+                status = atoi(exit_status + strlen(", exit status "));
+            }
+        }
+    }
+
+    close(sock);
+    return status;
+}
@@ -0,0 +1,30 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdint.h>
+
+// VM pool (-serve): worker processes, each with a VM created up front, run
+// the jobs clients submit (-submit), one at a time, on the shared socket.
+// A job is the client's command line, run in its working directory with its
+// output going back to the client. The pool starts another worker whenever
+// one exits, on an invalid job for instance.
+
+// What a worker does, in its process
+typedef struct pool_worker_ops
+{
+    // Once, when the worker starts: creates its VM
+    void (*start)(int id);
+    // A job: returns its exit status, which ends the job's output in a line
+    // "job: ..., exit status <status>"
+    int (*run_job)(int argc, char **argv, uint64_t start_ns);
+    // After a job: the VM goes back to how it was before the first one
+    void (*reset)(int id, int status);
+} pool_worker_ops_t;
+
+int serve_pool(char *path, int size, const pool_worker_ops_t *ops);
+
+// Sends the job to the pool and shows its output. Returns the job's exit
+// status, or 1 if the pool's worker didn't finish it.
+int submit_main(const char *path, int argc, char **argv);
+
+#endif
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <elf.h>
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "profile.h"
+#include "shared/boot.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define PROFILE_SIGNAL SIGPROF
+#define INITIAL_TABLE_SIZE 1024
+#define MAX_LINE 4096
+
+static profile_t *active_profile; // the one the timer signal is for
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const symbol_t *x = a;
+    const symbol_t *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void add_symbol(symbol_t **symbols, int *count, uint64_t addr, uint64_t size, const char *name)
+{
+    if ((*count & (*count - 1)) == 0)
+    {
+        *symbols = realloc(*symbols, (*count ? *count * 2 : 64) * sizeof(symbol_t));
+    }
+
+    (*symbols)[*count] = (symbol_t){.addr = addr, .size = size, .name = strdup(name)};
+    (*count)++;
+}
+
+// Symbols of an ELF file (32 or 64-bit), from its symbol table
+static bool load_elf_symbols(profile_t *profile, const uint8_t *file, size_t length)
+{
+    const Elf32_Ehdr *ehdr32 = (const Elf32_Ehdr *)file;
+    const Elf64_Ehdr *ehdr64 = (const Elf64_Ehdr *)file;
+    bool is64 = file[EI_CLASS] == ELFCLASS64;
+
+    uint64_t shoff = is64 ? ehdr64->e_shoff : ehdr32->e_shoff;
+    int shnum = is64 ? ehdr64->e_shnum : ehdr32->e_shnum;
+    int shentsize = is64 ? ehdr64->e_shentsize : ehdr32->e_shentsize;
+
+    if (shoff + (uint64_t)shnum * shentsize > length)
+        return false;
+
+    for (int i = 0; i < shnum; i++)
+    {
+        const uint8_t *sh = file + shoff + (uint64_t)i * shentsize;
+        uint32_t type = is64 ? ((const Elf64_Shdr *)sh)->sh_type : ((const Elf32_Shdr *)sh)->sh_type;
+
+        if (type != SHT_SYMTAB)
+            continue;
+
+        uint64_t offset = is64 ? ((const Elf64_Shdr *)sh)->sh_offset : ((const Elf32_Shdr *)sh)->sh_offset;
+        uint64_t size = is64 ? ((const Elf64_Shdr *)sh)->sh_size : ((const Elf32_Shdr *)sh)->sh_size;
+        uint32_t link = is64 ? ((const Elf64_Shdr *)sh)->sh_link : ((const Elf32_Shdr *)sh)->sh_link;
+        const uint8_t *strsh = file + shoff + (uint64_t)link * shentsize;
+        uint64_t stroff = is64 ? ((const Elf64_Shdr *)strsh)->sh_offset : ((const Elf32_Shdr *)strsh)->sh_offset;
+        uint64_t strsize = is64 ? ((const Elf64_Shdr *)strsh)->sh_size : ((const Elf32_Shdr *)strsh)->sh_size;
+
+        if (link >= (uint32_t)shnum || offset + size > length || stroff + strsize > length)
+            return false;
+
+        size_t entsize = is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+
+        for (uint64_t s = 0; s < size / entsize; s++)
+        {
+            const uint8_t *sym = file + offset + s * entsize;
+            uint32_t name = is64 ? ((const Elf64_Sym *)sym)->st_name : ((const Elf32_Sym *)sym)->st_name;
+            uint8_t info = is64 ? ((const Elf64_Sym *)sym)->st_info : ((const Elf32_Sym *)sym)->st_info;
+            uint64_t value = is64 ? ((const Elf64_Sym *)sym)->st_value : ((const Elf32_Sym *)sym)->st_value;
+            uint64_t symsize = is64 ? ((const Elf64_Sym *)sym)->st_size : ((const Elf32_Sym *)sym)->st_size;
+
+            if (ELF32_ST_TYPE(info) != STT_FUNC || name >= strsize)
+                continue;
+
+            add_symbol(&profile->symbols, &profile->nr_symbols, value, symsize, (const char *)file + stroff + name);
+        }
+    }
+
+    return true;
+}
+
+// Global symbols and the code sections of each object file, from a GNU ld map
+// file (-Wl,-Map): static functions are only known by their object file.
+static void load_map_symbols(profile_t *profile, FILE *fp)
+{
+    char line[MAX_LINE];
+    char section[MAX_LINE] = "";
+    bool in_map = false;
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (!in_map)
+        {
+            in_map = strncmp(line, "Linker script and memory map", 28) == 0;
+            continue;
+        }
+
+        char a[MAX_LINE], b[MAX_LINE], c[MAX_LINE], d[MAX_LINE];
+        int fields = sscanf(line, "%s %s %s %s", a, b, c, d);
+
+        if (line[0] != ' ')
+        {
+            section[0] = '\0';
+            continue;
+        }
+
+        // Blank: sscanf returned EOF without setting a
+        if (fields < 1)
+            continue;
+
+        // Input section, whose address, size and file may be on the next line
+        // when its name is long: " .text  0x00000910  0x337 o/ide_emul.o"
+        if (a[0] == '.' && fields == 1)
+        {
+            strcpy(section, a);
+            continue;
+        }
+
+        if (a[0] == '.' && fields == 4)
+        {
+            strcpy(section, a);
+            memmove(a, b, sizeof(a));
+            memmove(b, c, sizeof(b));
+            memmove(c, d, sizeof(c));
+            fields = 3;
+        }
+
+        if (fields == 3 && section[0] && strncmp(a, "0x", 2) == 0 && strncmp(b, "0x", 2) == 0 &&
+            (strncmp(section, ".text", 5) == 0 || strcmp(section, ".entrypoint") == 0))
+        {
+            uint64_t size = strtoull(b, NULL, 16);
+            const char *file = strrchr(c, '/') ? strrchr(c, '/') + 1 : c;
+            if (size)
+                add_symbol(&profile->objects, &profile->nr_objects, strtoull(a, NULL, 16), size, file);
+            continue;
+        }
+
+        // Symbol: "                0x00000910                ide_select_channel"
+        if (fields == 2 && strncmp(a, "0x", 2) == 0 && (isalpha((unsigned char)b[0]) || b[0] == '_'))
+        {
+            add_symbol(&profile->symbols, &profile->nr_symbols, strtoull(a, NULL, 16), 0, b);
+        }
+    }
+}
+
+static symbol_t *find_symbol(symbol_t *symbols, int count, uint64_t addr)
+{
+    int lo = 0;
+    int hi = count - 1;
+    symbol_t *found = NULL;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= addr)
+        {
+            found = &symbols[mid];
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return found && addr < found->addr + found->size ? found : NULL;
+}
+
+static void load_symbols(profile_t *profile, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp)
+    {
+        warn("VMM: no guest symbols, %s", path);
+        return;
+    }
+
+    uint8_t magic[SELFMAG];
+    bool elf = fread(magic, SELFMAG, 1, fp) == 1 && memcmp(magic, ELFMAG, SELFMAG) == 0;
+
+    if (elf)
+    {
+        fseek(fp, 0, SEEK_END);
+        size_t length = ftell(fp);
+        uint8_t *file = malloc(length);
+        fseek(fp, 0, SEEK_SET);
+
+        if (fread(file, length, 1, fp) != 1 || !load_elf_symbols(profile, file, length))
+        {
+            warnx("VMM: can't read the symbols of %s", path);
+        }
+        free(file);
+    }
+    else
+    {
+        fseek(fp, 0, SEEK_SET);
+        load_map_symbols(profile, fp);
+    }
+
+    fclose(fp);
+
+    qsort(profile->symbols, profile->nr_symbols, sizeof(symbol_t), compare_symbols);
+    qsort(profile->objects, profile->nr_objects, sizeof(symbol_t), compare_symbols);
+
+    // Map symbols have no size: they go until the next one, within their object
+    for (int i = 0; i < profile->nr_symbols; i++)
+    {
+        symbol_t *symbol = &profile->symbols[i];
+
+        if (symbol->size)
+            continue;
+
+        uint64_t end = i + 1 < profile->nr_symbols ? profile->symbols[i + 1].addr : UINT64_MAX;
+        symbol_t *object = find_symbol(profile->objects, profile->nr_objects, symbol->addr);
+
+        if (object && object->addr + object->size < end)
+            end = object->addr + object->size;
+
+        symbol->size = end - symbol->addr;
+    }
+
+    printf("profile: %d symbols and %d object files from %s\n", profile->nr_symbols, profile->nr_objects, path);
+}
+
+static int format_frame(profile_t *profile, char *buf, size_t size, uint64_t pc)
+{
+    symbol_t *symbol = find_symbol(profile->symbols, profile->nr_symbols, pc);
+
+    if (symbol)
+        return snprintf(buf, size, "%s", symbol->name);
+
+    symbol_t *object = find_symbol(profile->objects, profile->nr_objects, pc);
+
+    if (object)
+        return snprintf(buf, size, "%s+0x%lx", object->name, pc - object->addr);
+
+    return snprintf(buf, size, "0x%lx", pc);
+}
+
+static void on_timer(int sig)
+{
+    (void)sig;
+    profile_t *profile = active_profile;
+
+    if (profile->in_vmm)
+        __atomic_add_fetch(&profile->vmm_ticks, 1, __ATOMIC_RELAXED);
+    else
+        profile->run->immediate_exit = 1; // KVM_RUN returns with EINTR, even if entered after this
+}
+
+profile_t *create_profile(const char *path, const char *symbols, int hz)
+{
+    profile_t *profile = (profile_t *)calloc(1, sizeof(profile_t));
+    profile->path = strdup(path);
+    profile->hz = hz;
+
+    if (symbols)
+    {
+        load_symbols(profile, symbols);
+    }
+
+    return profile;
+}
+
+void profile_set_guest_mem(profile_t *profile, uint8_t *guest_mem, uint64_t guest_mem_size)
+{
+    profile->guest_mem = guest_mem;
+    profile->guest_mem_size = guest_mem_size;
+}
+
+// Starts sampling, in the vCPU thread: the timer signals this thread only
+void profile_start(profile_t *profile, struct kvm_run *run)
+{
+    profile->run = run;
+    profile->in_vmm = 1;
+    active_profile = profile;
+
+    // Other system calls of the thread restart, KVM_RUN returns with EINTR
+    struct sigaction action = {.sa_handler = &on_timer, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(PROFILE_SIGNAL, &action, NULL) < 0)
+    {
+        err(1, "VMM: sigaction");
+    }
+
+    struct sigevent event = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = PROFILE_SIGNAL};
+    event.sigev_notify_thread_id = gettid();
+
+    if (timer_create(CLOCK_MONOTONIC, &event, &profile->timer) < 0)
+    {
+        err(1, "VMM: timer_create");
+    }
+
+    long interval_ns = 1000000000L / profile->hz;
+    struct itimerspec spec = {.it_interval = {interval_ns / 1000000000L, interval_ns % 1000000000L},
+                              .it_value = {interval_ns / 1000000000L, interval_ns % 1000000000L}};
+
+    if (timer_settime(profile->timer, 0, &spec, NULL) < 0)
+    {
+        err(1, "VMM: timer_settime");
+    }
+
+    printf("profile: sampling the guest %d times per second\n", profile->hz);
+}
+
+void profile_enter_guest(profile_t *profile)
+{
+    profile->in_vmm = 0;
+}
+
+void profile_leave_guest(profile_t *profile)
+{
+    profile->in_vmm = 1;
+}
+
+static bool read_guest(profile_t *profile, uint64_t gpa, uint64_t *value, int size)
+{
+    // RAM is identity-mapped, except the device area below 1 MB. Without
+    // overflows: gpa comes from the guest's frame pointers
+    if (gpa > profile->guest_mem_size || (uint64_t)size > profile->guest_mem_size - gpa ||
+        (gpa + size > LOW_RAM_END && gpa < HIGH_RAM_START))
+        return false;
+
+    *value = 0;
+    memcpy(value, profile->guest_mem + gpa, size);
+    return true;
+}
+
+// Guest code addresses of the stack, innermost first: the instruction pointer,
+// then the return addresses found by following the frame pointers
+static int walk_stack(profile_t *profile, const struct kvm_regs *regs, const struct kvm_sregs *sregs, uint64_t *pcs)
+{
+    int depth = 0;
+    pcs[depth++] = sregs->cs.base + regs->rip;
+
+    // Real mode guest code has no frame pointers to follow
+    if (!(sregs->cr0 & 1))
+        return depth;
+
+    int word = sregs->cs.l ? 8 : 4;
+    uint64_t fp = sregs->cs.l ? regs->rbp : (uint32_t)regs->rbp;
+
+    while (depth < PROFILE_MAX_DEPTH && fp)
+    {
+        uint64_t next;
+        uint64_t ret;
+
+        if (!read_guest(profile, fp, &next, word) || !read_guest(profile, fp + word, &ret, word) || !ret)
+            break;
+
+        pcs[depth++] = ret - 1; // in the call instruction
+
+        // The callers' frames are higher on the stack
+        if (next <= fp)
+            break;
+        fp = next;
+    }
+
+    return depth;
+}
+
+static uint64_t hash_stack(const uint64_t *pcs, int depth, const char *leaf)
+{
+    uint64_t hash = 14695981039346656037ULL ^ (uintptr_t)leaf;
+
+    for (int i = 0; i < depth; i++)
+    {
+        hash = (hash ^ pcs[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void table_add(stack_table_t *table, const uint64_t *pcs, int depth, const char *leaf, uint64_t count)
+{
+    if ((table->used + 1) * 2 > table->size)
+    {
+        stack_table_t grown = {.size = table->size ? table->size * 2 : INITIAL_TABLE_SIZE, .total = table->total};
+        grown.entries = calloc(grown.size, sizeof(stack_count_t));
+
+        for (uint64_t i = 0; i < table->size; i++)
+        {
+            stack_count_t *entry = &table->entries[i];
+            if (entry->count)
+                table_add(&grown, entry->pcs, entry->depth, entry->leaf, entry->count);
+        }
+
+        grown.total = table->total;
+        free(table->entries);
+        *table = grown;
+    }
+
+    uint64_t hash = hash_stack(pcs, depth, leaf);
+    uint64_t i = hash & (table->size - 1);
+
+    for (;; i = (i + 1) & (table->size - 1))
+    {
+        stack_count_t *entry = &table->entries[i];
+
+        if (!entry->count)
+        {
+            entry->hash = hash;
+            entry->leaf = leaf;
+            entry->depth = depth;
+            memcpy(entry->pcs, pcs, depth * sizeof(uint64_t));
+            table->used++;
+            break;
+        }
+
+        if (entry->hash == hash && entry->leaf == leaf && entry->depth == depth &&
+            memcmp(entry->pcs, pcs, depth * sizeof(uint64_t)) == 0)
+            break;
+    }
+
+    table->entries[i].count += count;
+    table->total += count;
+}
+
+// The vCPU was kicked out of the guest by the timer
+void profile_guest_sample(profile_t *profile, const struct kvm_regs *regs, const struct kvm_sregs *sregs)
+{
+    uint64_t pcs[PROFILE_MAX_DEPTH];
+    int depth = walk_stack(profile, regs, sregs, pcs);
+
+    table_add(&profile->samples, pcs, depth, NULL, 1);
+    profile->guest_samples++;
+}
+
+// An exit was handled by device: count it, and the samples taken meanwhile
+void profile_exit(profile_t *profile, const struct kvm_regs *regs, const struct kvm_sregs *sregs, const char *device)
+{
+    uint64_t pcs[PROFILE_MAX_DEPTH];
+    int depth = walk_stack(profile, regs, sregs, pcs);
+
+    table_add(&profile->exits, pcs, depth, device, 1);
+
+    int ticks = __atomic_exchange_n(&profile->vmm_ticks, 0, __ATOMIC_RELAXED);
+    if (ticks)
+    {
+        table_add(&profile->samples, pcs, depth, device, ticks);
+    }
+}
+
+typedef struct folded_line
+{
+    char *stack;
+    uint64_t count;
+} folded_line_t;
+
+static int compare_lines(const void *a, const void *b)
+{
+    return strcmp(((const folded_line_t *)a)->stack, ((const folded_line_t *)b)->stack);
+}
+
+// Writes a table as folded stacks, "outermost;...;innermost count" lines.
+// Stacks that only differ by addresses within the same functions are merged.
+static void write_folded(profile_t *profile, stack_table_t *table, const char *path, const char *leaf_format)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp)
+    {
+        warn("VMM: %s", path);
+        return;
+    }
+
+    folded_line_t *lines = calloc(table->used + 1, sizeof(folded_line_t));
+    uint64_t nr_lines = 0;
+
+    for (uint64_t i = 0; i < table->size; i++)
+    {
+        stack_count_t *entry = &table->entries[i];
+
+        if (!entry->count)
+            continue;
+
+        char buf[MAX_LINE];
+        int length = 0;
+
+        for (int d = entry->depth - 1; d >= 0 && length < MAX_LINE; d--)
+        {
+            length += format_frame(profile, buf + length, MAX_LINE - length, entry->pcs[d]);
+            if (d && length < MAX_LINE)
+                buf[length++] = ';';
+        }
+
+        if (entry->leaf && length < MAX_LINE)
+        {
+            length += snprintf(buf + length, MAX_LINE - length, leaf_format, entry->leaf);
+        }
+
+        buf[MAX_LINE - 1] = '\0';
+        lines[nr_lines++] = (folded_line_t){.stack = strdup(buf), .count = entry->count};
+    }
+
+    qsort(lines, nr_lines, sizeof(folded_line_t), compare_lines);
+
+    for (uint64_t i = 0; i < nr_lines; i++)
+    {
+        uint64_t count = lines[i].count;
+
+        while (i + 1 < nr_lines && strcmp(lines[i].stack, lines[i + 1].stack) == 0)
+        {
+            count += lines[++i].count;
+            free(lines[i - 1].stack);
+        }
+
+        fprintf(fp, "%s %lu\n", lines[i].stack, count);
+        free(lines[i].stack);
+    }
+
+    free(lines);
+    fclose(fp);
+}
+
+void destroy_profile(profile_t *profile)
+{
+    if (active_profile == profile)
+    {
+        timer_delete(profile->timer);
+        signal(PROFILE_SIGNAL, SIG_IGN);
+        active_profile = NULL;
+    }
+
+    char *exits_path;
+    if (asprintf(&exits_path, "%s.exits", profile->path) < 0)
+    {
+        err(1, NULL);
+    }
+
+    // The VMM's samples are on top of the exit's guest stack: ";[vmm:ide]"
+    write_folded(profile, &profile->samples, profile->path, ";[vmm:%s]");
+    write_folded(profile, &profile->exits, exits_path, ";[exit:%s]");
+
+    uint64_t samples = profile->samples.total;
+    printf("profile: %lu samples, %.1f%% in the guest and %.1f%% in the VMM, to %s; %lu exits, to %s\n", samples,
+           samples ? 100.0 * profile->guest_samples / samples : 0.0,
+           samples ? 100.0 * (samples - profile->guest_samples) / samples : 0.0, profile->path,
+           profile->exits.total, exits_path);
+
+    for (int i = 0; i < profile->nr_symbols; i++)
+    {
+        free(profile->symbols[i].name);
+    }
+    for (int i = 0; i < profile->nr_objects; i++)
+    {
+        free(profile->objects[i].name);
+    }
+
+    free(profile->symbols);
+    free(profile->objects);
+    free(profile->samples.entries);
+    free(profile->exits.entries);
+    free(exits_path);
+    free(profile->path);
+    free(profile);
+}
@@ -0,0 +1,73 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <linux/kvm.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_DEFAULT_HZ 997 // prime, not in step with the guest's periodic work
+
+typedef struct symbol
+{
+    uint64_t addr;
+    uint64_t size;
+    char *name;
+} symbol_t;
+
+typedef struct stack_count
+{
+    uint64_t hash;
+    const char *leaf; // frame added on top of the guest's, NULL if none
+    int depth;
+    uint64_t pcs[PROFILE_MAX_DEPTH]; // innermost first
+    uint64_t count;
+} stack_count_t;
+
+typedef struct stack_table
+{
+    stack_count_t *entries;
+    uint64_t size; // power of 2
+    uint64_t used;
+    uint64_t total;
+} stack_table_t;
+
+// Sampling profiler of the guest. A timer interrupts the vCPU thread: in the
+// guest, it kicks the vCPU out of KVM_RUN and the guest's stack is sampled
+// (frame pointer walk); in the VMM, the sample goes to the exit being handled,
+// on top of the guest's stack at the exit. Every exit is counted too, by guest
+// stack and device. Samples and exits are written as folded stacks for flame
+// graphs, symbolized with the guest's linker map or ELF file.
+typedef struct profile
+{
+    char *path;
+    int hz;
+    timer_t timer;
+    struct kvm_run *run;
+    volatile sig_atomic_t in_vmm;
+    volatile sig_atomic_t vmm_ticks; // samples taken while the VMM handled an exit
+
+    uint8_t *guest_mem;
+    uint64_t guest_mem_size;
+
+    symbol_t *symbols; // sorted by address
+    int nr_symbols;
+    symbol_t *objects; // code sections of the object files, for what has no symbol
+    int nr_objects;
+
+    stack_table_t samples;
+    stack_table_t exits;
+    uint64_t guest_samples;
+} profile_t;
+
+profile_t *create_profile(const char *path, const char *symbols, int hz);
+void profile_set_guest_mem(profile_t *profile, uint8_t *guest_mem, uint64_t guest_mem_size);
+void profile_start(profile_t *profile, struct kvm_run *run);
+void profile_enter_guest(profile_t *profile);
+void profile_leave_guest(profile_t *profile);
+void profile_guest_sample(profile_t *profile, const struct kvm_regs *regs, const struct kvm_sregs *sregs);
+void profile_exit(profile_t *profile, const struct kvm_regs *regs, const struct kvm_sregs *sregs, const char *device);
+void destroy_profile(profile_t *profile);
+
+#endif
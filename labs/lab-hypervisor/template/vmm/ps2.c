@@ -0,0 +1,311 @@
+// i8042 PS/2 controller emulation, with a keyboard.
+// The controller's output buffer and the keyboard's buffer are a single queue:
+// replies to commands and scancodes are read from it in order. The keyboard
+// always sends scancode set 1, i.e. what the controller's translation gives
+// guests by default. There is no mouse: the auxiliary port commands are ignored.
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "ps2.h"
+
+// Set 1 scancodes of SDL's keys (USB usage IDs), KBD_EXTENDED << 8 for the
+// extended ones. 0 for the keys that have none.
+static const uint16_t scancodes[SDL_NUM_SCANCODES] = {
+    [SDL_SCANCODE_A] = 0x1E, [SDL_SCANCODE_B] = 0x30, [SDL_SCANCODE_C] = 0x2E, [SDL_SCANCODE_D] = 0x20,
+    [SDL_SCANCODE_E] = 0x12, [SDL_SCANCODE_F] = 0x21, [SDL_SCANCODE_G] = 0x22, [SDL_SCANCODE_H] = 0x23,
+    [SDL_SCANCODE_I] = 0x17, [SDL_SCANCODE_J] = 0x24, [SDL_SCANCODE_K] = 0x25, [SDL_SCANCODE_L] = 0x26,
+    [SDL_SCANCODE_M] = 0x32, [SDL_SCANCODE_N] = 0x31, [SDL_SCANCODE_O] = 0x18, [SDL_SCANCODE_P] = 0x19,
+    [SDL_SCANCODE_Q] = 0x10, [SDL_SCANCODE_R] = 0x13, [SDL_SCANCODE_S] = 0x1F, [SDL_SCANCODE_T] = 0x14,
+    [SDL_SCANCODE_U] = 0x16, [SDL_SCANCODE_V] = 0x2F, [SDL_SCANCODE_W] = 0x11, [SDL_SCANCODE_X] = 0x2D,
+    [SDL_SCANCODE_Y] = 0x15, [SDL_SCANCODE_Z] = 0x2C,
+    [SDL_SCANCODE_1] = 0x02, [SDL_SCANCODE_2] = 0x03, [SDL_SCANCODE_3] = 0x04, [SDL_SCANCODE_4] = 0x05,
+    [SDL_SCANCODE_5] = 0x06, [SDL_SCANCODE_6] = 0x07, [SDL_SCANCODE_7] = 0x08, [SDL_SCANCODE_8] = 0x09,
+    [SDL_SCANCODE_9] = 0x0A, [SDL_SCANCODE_0] = 0x0B,
+    [SDL_SCANCODE_RETURN] = 0x1C, [SDL_SCANCODE_ESCAPE] = 0x01, [SDL_SCANCODE_BACKSPACE] = 0x0E,
+    [SDL_SCANCODE_TAB] = 0x0F, [SDL_SCANCODE_SPACE] = 0x39, [SDL_SCANCODE_MINUS] = 0x0C,
+    [SDL_SCANCODE_EQUALS] = 0x0D, [SDL_SCANCODE_LEFTBRACKET] = 0x1A, [SDL_SCANCODE_RIGHTBRACKET] = 0x1B,
+    [SDL_SCANCODE_BACKSLASH] = 0x2B, [SDL_SCANCODE_NONUSHASH] = 0x2B, [SDL_SCANCODE_SEMICOLON] = 0x27,
+    [SDL_SCANCODE_APOSTROPHE] = 0x28, [SDL_SCANCODE_GRAVE] = 0x29, [SDL_SCANCODE_COMMA] = 0x33,
+    [SDL_SCANCODE_PERIOD] = 0x34, [SDL_SCANCODE_SLASH] = 0x35, [SDL_SCANCODE_CAPSLOCK] = 0x3A,
+    [SDL_SCANCODE_F1] = 0x3B, [SDL_SCANCODE_F2] = 0x3C, [SDL_SCANCODE_F3] = 0x3D, [SDL_SCANCODE_F4] = 0x3E,
+    [SDL_SCANCODE_F5] = 0x3F, [SDL_SCANCODE_F6] = 0x40, [SDL_SCANCODE_F7] = 0x41, [SDL_SCANCODE_F8] = 0x42,
+    [SDL_SCANCODE_F9] = 0x43, [SDL_SCANCODE_F10] = 0x44, [SDL_SCANCODE_F11] = 0x57, [SDL_SCANCODE_F12] = 0x58,
+    [SDL_SCANCODE_PRINTSCREEN] = 0xE037, [SDL_SCANCODE_SCROLLLOCK] = 0x46, [SDL_SCANCODE_INSERT] = 0xE052,
+    [SDL_SCANCODE_HOME] = 0xE047, [SDL_SCANCODE_PAGEUP] = 0xE049, [SDL_SCANCODE_DELETE] = 0xE053,
+    [SDL_SCANCODE_END] = 0xE04F, [SDL_SCANCODE_PAGEDOWN] = 0xE051, [SDL_SCANCODE_RIGHT] = 0xE04D,
+    [SDL_SCANCODE_LEFT] = 0xE04B, [SDL_SCANCODE_DOWN] = 0xE050, [SDL_SCANCODE_UP] = 0xE048,
+    [SDL_SCANCODE_NUMLOCKCLEAR] = 0x45, [SDL_SCANCODE_KP_DIVIDE] = 0xE035, [SDL_SCANCODE_KP_MULTIPLY] = 0x37,
+    [SDL_SCANCODE_KP_MINUS] = 0x4A, [SDL_SCANCODE_KP_PLUS] = 0x4E, [SDL_SCANCODE_KP_ENTER] = 0xE01C,
+    [SDL_SCANCODE_KP_1] = 0x4F, [SDL_SCANCODE_KP_2] = 0x50, [SDL_SCANCODE_KP_3] = 0x51, [SDL_SCANCODE_KP_4] = 0x4B,
+    [SDL_SCANCODE_KP_5] = 0x4C, [SDL_SCANCODE_KP_6] = 0x4D, [SDL_SCANCODE_KP_7] = 0x47, [SDL_SCANCODE_KP_8] = 0x48,
+    [SDL_SCANCODE_KP_9] = 0x49, [SDL_SCANCODE_KP_0] = 0x52, [SDL_SCANCODE_KP_PERIOD] = 0x53,
+    [SDL_SCANCODE_NONUSBACKSLASH] = 0x56, [SDL_SCANCODE_APPLICATION] = 0xE05D,
+    [SDL_SCANCODE_LCTRL] = 0x1D, [SDL_SCANCODE_LSHIFT] = 0x2A, [SDL_SCANCODE_LALT] = 0x38,
+    [SDL_SCANCODE_LGUI] = 0xE05B, [SDL_SCANCODE_RCTRL] = 0xE01D, [SDL_SCANCODE_RSHIFT] = 0x36,
+    [SDL_SCANCODE_RALT] = 0xE038, [SDL_SCANCODE_RGUI] = 0xE05C,
+};
+
+// IRQ1 is up while there is something to read and the guest enabled it.
+// Called with the lock held.
+static void set_irq(ps2_t *ps2, int level)
+{
+    if (level == ps2->irq_level)
+        return;
+
+    struct kvm_irq_level irq = {.irq = PS2_KEYBOARD_IRQ, .level = level};
+    // Without a VM (exit replay) only the line's level is kept
+    if (ps2->vmfd >= 0 && ioctl(ps2->vmfd, KVM_IRQ_LINE, &irq) < 0)
+    {
+        err(1, "VMM: KVM_IRQ_LINE");
+    }
+    ps2->irq_level = level;
+}
+
+static void update_irq(ps2_t *ps2)
+{
+    set_irq(ps2, ps2->count && (ps2->config & PS2_CONFIG_KEYBOARD_IRQ));
+}
+
+// Called with the lock held
+static bool push(ps2_t *ps2, uint8_t byte)
+{
+    if (ps2->count == PS2_QUEUE_SIZE)
+    {
+        ps2->dropped++;
+        return false;
+    }
+
+    ps2->queue[(ps2->head + ps2->count) % PS2_QUEUE_SIZE] = byte;
+    ps2->count++;
+    return true;
+}
+
+static uint8_t pop(ps2_t *ps2)
+{
+    if (!ps2->count)
+        return 0;
+
+    uint8_t byte = ps2->queue[ps2->head];
+    ps2->head = (ps2->head + 1) % PS2_QUEUE_SIZE;
+    ps2->count--;
+    return byte;
+}
+
+static bool keyboard_enabled(ps2_t *ps2)
+{
+    return ps2->scanning && !(ps2->config & PS2_CONFIG_KEYBOARD_DISABLED);
+}
+
+static void keyboard_command(ps2_t *ps2, uint8_t value)
+{
+    if (ps2->pending_cmd)
+    {
+        // Data byte of KBD_CMD_SET_LEDS, _TYPEMATIC or _SCANCODE_SET
+        uint8_t cmd = ps2->pending_cmd;
+        ps2->pending_cmd = 0;
+        push(ps2, KBD_REPLY_ACK);
+        if (cmd == KBD_CMD_SCANCODE_SET && value == 0)
+            push(ps2, 1); // the current set
+        return;
+    }
+
+    switch (value)
+    {
+    case KBD_CMD_SET_LEDS:
+    case KBD_CMD_TYPEMATIC:
+    case KBD_CMD_SCANCODE_SET:
+        ps2->pending_cmd = value;
+        ps2->pending_kbd = true;
+        push(ps2, KBD_REPLY_ACK);
+        break;
+    case KBD_CMD_ECHO:
+        push(ps2, KBD_CMD_ECHO);
+        break;
+    case KBD_CMD_IDENTIFY:
+        push(ps2, KBD_REPLY_ACK);
+        push(ps2, 0xAB); // MF2 keyboard
+        push(ps2, 0x83);
+        break;
+    case KBD_CMD_ENABLE:
+        ps2->scanning = true;
+        push(ps2, KBD_REPLY_ACK);
+        break;
+    case KBD_CMD_DISABLE:
+        ps2->scanning = false;
+        push(ps2, KBD_REPLY_ACK);
+        break;
+    case KBD_CMD_RESET:
+        ps2->count = 0;
+        ps2->scanning = true;
+        push(ps2, KBD_REPLY_ACK);
+        push(ps2, KBD_REPLY_SELF_TEST_OK);
+        break;
+    default:
+        push(ps2, KBD_REPLY_RESEND);
+    }
+}
+
+static void controller_command(ps2_t *ps2, uint8_t cmd)
+{
+    switch (cmd)
+    {
+    case PS2_CMD_READ_CONFIG:
+        push(ps2, ps2->config);
+        break;
+    case PS2_CMD_WRITE_CONFIG:
+    case PS2_CMD_WRITE_OUTPUT:
+        ps2->pending_cmd = cmd;
+        ps2->pending_kbd = false;
+        break;
+    case PS2_CMD_SELF_TEST:
+        ps2->config |= PS2_CONFIG_SYS;
+        push(ps2, 0x55);
+        break;
+    case PS2_CMD_TEST_KEYBOARD:
+        push(ps2, 0x00);
+        break;
+    case PS2_CMD_DISABLE_KEYBOARD:
+        ps2->config |= PS2_CONFIG_KEYBOARD_DISABLED;
+        break;
+    case PS2_CMD_ENABLE_KEYBOARD:
+        ps2->config &= ~PS2_CONFIG_KEYBOARD_DISABLED;
+        break;
+    case PS2_CMD_READ_OUTPUT:
+        push(ps2, 0x03); // A20 enabled, no reset
+        break;
+    default: // PS2_CMD_DISABLE_AUX, _ENABLE_AUX, and what isn't emulated
+        break;
+    }
+}
+
+static void write_data(ps2_t *ps2, uint8_t value)
+{
+    if (ps2->pending_cmd && !ps2->pending_kbd)
+    {
+        if (ps2->pending_cmd == PS2_CMD_WRITE_CONFIG)
+            ps2->config = value;
+        ps2->pending_cmd = 0;
+        return;
+    }
+
+    keyboard_command(ps2, value);
+}
+
+bool ps2_owns_port(uint16_t port)
+{
+    return port == PS2_DATA_PORT || port == PS2_STATUS_PORT;
+}
+
+void ps2_handle_io(ps2_t *ps2, struct kvm_run *run)
+{
+    uint8_t *data = (uint8_t *)run + run->io.data_offset;
+
+    pthread_mutex_lock(&ps2->lock);
+
+    for (uint32_t i = 0; i < run->io.count; i++)
+    {
+        uint8_t *byte = data + i * run->io.size;
+
+        if (run->io.direction == KVM_EXIT_IO_OUT)
+        {
+            ps2->last_cmd = run->io.port == PS2_STATUS_PORT;
+            if (ps2->last_cmd)
+                controller_command(ps2, *byte);
+            else
+                write_data(ps2, *byte);
+        }
+        else if (run->io.port == PS2_STATUS_PORT)
+        {
+            *byte = (ps2->count ? PS2_STATUS_OBF : 0) | (ps2->config & PS2_CONFIG_SYS) |
+                    (ps2->last_cmd ? PS2_STATUS_CMD : 0) | PS2_STATUS_UNLOCK;
+        }
+        else
+        {
+            // A new edge for the next byte
+            set_irq(ps2, 0);
+            *byte = pop(ps2);
+        }
+    }
+
+    update_irq(ps2);
+    pthread_mutex_unlock(&ps2->lock);
+}
+
+void ps2_key_event(ps2_t *ps2, SDL_Scancode scancode, bool pressed)
+{
+    uint16_t code = (unsigned)scancode < SDL_NUM_SCANCODES ? scancodes[scancode] : 0;
+    if (!code)
+        return;
+
+    pthread_mutex_lock(&ps2->lock);
+
+    if (keyboard_enabled(ps2))
+    {
+        // Whole scancodes only: half an extended one would garble the next
+        if (ps2->count + 2 <= PS2_QUEUE_SIZE)
+        {
+            if (code >> 8)
+                push(ps2, KBD_EXTENDED);
+            push(ps2, (code & 0xFF) | (pressed ? 0 : KBD_RELEASE));
+            ps2->keys++;
+        }
+        else
+        {
+            ps2->dropped++;
+        }
+        update_irq(ps2);
+    }
+
+    pthread_mutex_unlock(&ps2->lock);
+}
+
+void ps2_save_state(ps2_t *ps2, ps2_state_t *state)
+{
+    pthread_mutex_lock(&ps2->lock);
+    state->config = ps2->config;
+    state->pending_cmd = ps2->pending_cmd;
+    state->pending_kbd = ps2->pending_kbd;
+    state->last_cmd = ps2->last_cmd;
+    state->scanning = ps2->scanning;
+    state->irq_level = ps2->irq_level;
+    memcpy(state->queue, ps2->queue, sizeof(state->queue));
+    state->head = ps2->head;
+    state->count = ps2->count;
+    pthread_mutex_unlock(&ps2->lock);
+}
+
+// The interrupt controllers are restored with the IRQ line as it was too
+void ps2_restore_state(ps2_t *ps2, const ps2_state_t *state)
+{
+    pthread_mutex_lock(&ps2->lock);
+    ps2->config = state->config;
+    ps2->pending_cmd = state->pending_cmd;
+    ps2->pending_kbd = state->pending_kbd;
+    ps2->last_cmd = state->last_cmd;
+    ps2->scanning = state->scanning;
+    ps2->irq_level = state->irq_level;
+    memcpy(ps2->queue, state->queue, sizeof(ps2->queue));
+    ps2->head = state->head;
+    ps2->count = state->count;
+    pthread_mutex_unlock(&ps2->lock);
+}
+
+ps2_t *create_ps2(int vmfd)
+{
+    ps2_t *ps2 = (ps2_t *)calloc(1, sizeof(ps2_t));
+    ps2->vmfd = vmfd;
+    ps2->config = PS2_CONFIG_KEYBOARD_IRQ | PS2_CONFIG_SYS | PS2_CONFIG_TRANSLATE;
+    ps2->scanning = true;
+    pthread_mutex_init(&ps2->lock, NULL);
+    return ps2;
+}
+
+void destroy_ps2(ps2_t *ps2)
+{
+    printf("ps2: %lu key events, %lu dropped\n", ps2->keys, ps2->dropped);
+    pthread_mutex_destroy(&ps2->lock);
+    free(ps2);
+}
@@ -0,0 +1,57 @@
+#ifndef _PS2_H_
+#define _PS2_H_
+
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+#include "shared/ps2.h"
+
+#define PS2_QUEUE_SIZE 256
+
+// i8042 controller and PS/2 keyboard. Key events from the display loop are
+// queued as scancodes; IRQ1 is raised as long as a byte waits in the output
+// buffer, so guests can sleep until a key comes.
+typedef struct ps2
+{
+    int vmfd;
+    uint8_t config;
+    uint8_t pending_cmd; // controller or keyboard command waiting for its data byte
+    bool pending_kbd;    // pending_cmd is a keyboard command
+    bool last_cmd;       // the last write was a command
+    bool scanning;
+    int irq_level;
+
+    uint8_t queue[PS2_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t count;
+    uint64_t keys;
+    uint64_t dropped;
+
+    pthread_mutex_t lock;
+} ps2_t;
+
+// What the guest sees of the controller, for snapshots
+typedef struct ps2_state
+{
+    uint8_t config;
+    uint8_t pending_cmd;
+    bool pending_kbd;
+    bool last_cmd;
+    bool scanning;
+    int irq_level;
+    uint8_t queue[PS2_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t count;
+} ps2_state_t;
+
+ps2_t *create_ps2(int vmfd);
+bool ps2_owns_port(uint16_t port);
+void ps2_handle_io(ps2_t *ps2, struct kvm_run *run);
+void ps2_key_event(ps2_t *ps2, SDL_Scancode scancode, bool pressed);
+void ps2_save_state(ps2_t *ps2, ps2_state_t *state);
+void ps2_restore_state(ps2_t *ps2, const ps2_state_t *state);
+void destroy_ps2(ps2_t *ps2);
+
+#endif
@@ -0,0 +1,213 @@
+// Scratch layer, stacked on top of a disk whose writes must not last, like the
+// disks of snapshot-reset iterations (vmm -iterations).
+//
+// Written sectors stay in memory and reads see them over the backend's, which
+// is never written to. scratch_disk_reset() drops them all at once: the disk
+// is back to what the backend has. The layer is only used by the vCPU thread,
+// so it has no lock.
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scratch.h"
+
+#define INITIAL_BUCKETS 64
+
+typedef struct scratch_disk
+{
+    disk_t disk;
+    disk_t *backend;
+
+    // Written sectors: buckets index sectors and data, open addressing, 0 is free
+    uint32_t *buckets;
+    uint32_t nr_buckets; // power of 2
+    uint64_t *sectors;
+    uint8_t *data;
+    uint32_t used;
+    uint32_t allocated;
+
+    uint64_t resets;
+    uint32_t max_used;
+} scratch_disk_t;
+
+static uint32_t bucket_of(scratch_disk_t *scratch, uint64_t sector)
+{
+    return (uint32_t)(sector * 0x9E3779B97F4A7C15ULL >> 32) & (scratch->nr_buckets - 1);
+}
+
+// Index + 1 of a written sector in sectors and data, 0 if it wasn't written
+static uint32_t *find_bucket(scratch_disk_t *scratch, uint64_t sector)
+{
+    uint32_t i = bucket_of(scratch, sector);
+
+    while (scratch->buckets[i] && scratch->sectors[scratch->buckets[i] - 1] != sector)
+    {
+        i = (i + 1) & (scratch->nr_buckets - 1);
+    }
+
+    return &scratch->buckets[i];
+}
+
+static void rehash(scratch_disk_t *scratch, uint32_t nr_buckets)
+{
+    free(scratch->buckets);
+    scratch->nr_buckets = nr_buckets;
+    scratch->buckets = calloc(nr_buckets, sizeof(uint32_t));
+
+    if (!scratch->buckets)
+    {
+        err(1, "VMM: allocating scratch disk");
+    }
+
+    for (uint32_t i = 0; i < scratch->used; i++)
+    {
+        *find_bucket(scratch, scratch->sectors[i]) = i + 1;
+    }
+}
+
+// Where the sector's data goes, written or not yet
+static uint8_t *sector_data(scratch_disk_t *scratch, uint64_t sector)
+{
+    uint32_t *bucket = find_bucket(scratch, sector);
+
+    if (*bucket)
+        return scratch->data + (size_t)(*bucket - 1) * SECTOR_SIZE;
+
+    if (scratch->used == scratch->allocated)
+    {
+        scratch->allocated *= 2;
+        scratch->sectors = realloc(scratch->sectors, scratch->allocated * sizeof(uint64_t));
+        scratch->data = realloc(scratch->data, (size_t)scratch->allocated * SECTOR_SIZE);
+
+        if (!scratch->sectors || !scratch->data)
+        {
+            err(1, "VMM: allocating scratch disk");
+        }
+    }
+
+    uint32_t index = scratch->used++;
+    scratch->sectors[index] = sector;
+    *bucket = index + 1;
+
+    if (scratch->used * 2 > scratch->nr_buckets)
+    {
+        rehash(scratch, scratch->nr_buckets * 2);
+    }
+
+    return scratch->data + (size_t)index * SECTOR_SIZE;
+}
+
+static int scratch_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    scratch_disk_t *scratch = (scratch_disk_t *)disk;
+
+    if (scratch->backend->readv(scratch->backend, iov, iovcnt, offset) < 0)
+        return -1;
+
+    if (!scratch->used)
+        return 0;
+
+    size_t length = iov_length(iov, iovcnt);
+
+    for (size_t done = 0; done < length; done += SECTOR_SIZE)
+    {
+        uint32_t index = *find_bucket(scratch, (offset + done) / SECTOR_SIZE);
+
+        if (index)
+        {
+            iov_from_buf(iov, iovcnt, done, scratch->data + (size_t)(index - 1) * SECTOR_SIZE, SECTOR_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+static int scratch_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    scratch_disk_t *scratch = (scratch_disk_t *)disk;
+    size_t length = iov_length(iov, iovcnt);
+
+    for (size_t done = 0; done < length; done += SECTOR_SIZE)
+    {
+        iov_to_buf(iov, iovcnt, done, sector_data(scratch, (offset + done) / SECTOR_SIZE), SECTOR_SIZE);
+    }
+
+    return 0;
+}
+
+// Nothing is ever written to the backend
+static int scratch_flush(disk_t *disk)
+{
+    (void)disk;
+    return 0;
+}
+
+static int scratch_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    scratch_disk_t *scratch = (scratch_disk_t *)disk;
+
+    for (uint64_t done = 0; done < length; done += SECTOR_SIZE)
+    {
+        memset(sector_data(scratch, (offset + done) / SECTOR_SIZE), 0, SECTOR_SIZE);
+    }
+
+    return 0;
+}
+
+void scratch_disk_reset(disk_t *disk)
+{
+    scratch_disk_t *scratch = (scratch_disk_t *)disk;
+
+    if (scratch->used > scratch->max_used)
+        scratch->max_used = scratch->used;
+
+    if (scratch->used)
+    {
+        memset(scratch->buckets, 0, scratch->nr_buckets * sizeof(uint32_t));
+        scratch->used = 0;
+    }
+
+    scratch->resets++;
+}
+
+static void scratch_destroy(disk_t *disk)
+{
+    scratch_disk_t *scratch = (scratch_disk_t *)disk;
+
+    if (scratch->used > scratch->max_used)
+        scratch->max_used = scratch->used;
+
+    printf("scratch disk: %lu resets, %u sectors written between two at most\n", scratch->resets,
+           scratch->max_used);
+
+    destroy_disk(scratch->backend);
+    free(scratch->buckets);
+    free(scratch->sectors);
+    free(scratch->data);
+    free(scratch);
+}
+
+disk_t *create_scratch_disk(disk_t *backend)
+{
+    scratch_disk_t *scratch = (scratch_disk_t *)calloc(1, sizeof(scratch_disk_t));
+    scratch->backend = backend;
+    scratch->allocated = INITIAL_BUCKETS / 2;
+    scratch->sectors = malloc(scratch->allocated * sizeof(uint64_t));
+    scratch->data = malloc((size_t)scratch->allocated * SECTOR_SIZE);
+
+    if (!scratch->sectors || !scratch->data)
+    {
+        err(1, "VMM: allocating scratch disk");
+    }
+
+    rehash(scratch, INITIAL_BUCKETS);
+
+    scratch->disk.readv = &scratch_readv;
+    scratch->disk.writev = &scratch_writev;
+    scratch->disk.flush = &scratch_flush;
+    scratch->disk.discard = &scratch_discard;
+    scratch->disk.destroy = &scratch_destroy;
+    scratch->disk.size = backend->size;
+    return &scratch->disk;
+}
@@ -0,0 +1,9 @@
+#ifndef _SCRATCH_H_
+#define _SCRATCH_H_
+
+#include "disk.h"
+
+disk_t *create_scratch_disk(disk_t *backend);
+void scratch_disk_reset(disk_t *disk);
+
+#endif
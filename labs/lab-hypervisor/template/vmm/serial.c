@@ -0,0 +1,376 @@
+// 16550 UART emulation.
+// Every character the guest writes to THR is an exit, but not a write(): the
+// bytes go to a buffer, written out in large writes. The paravirtual port
+// sends a whole guest buffer in a single exit. There is no real line: the
+// transmitter is always empty, and the baud rate is only remembered.
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "serial.h"
+#include "shared/boot.h"
+
+// Called with the lock held
+static void write_out(serial_t *serial)
+{
+    uint32_t done = 0;
+
+    if (serial->out_fd == STDOUT_FILENO)
+        fflush(stdout); // keep the VMM's messages in order
+
+    while (done < serial->tx_count)
+    {
+        ssize_t n = write(serial->out_fd, serial->tx + done, serial->tx_count - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            warn("VMM: serial output");
+            break;
+        }
+        done += n;
+    }
+
+    if (serial->tx_count)
+        serial->tx_writes++;
+    serial->tx_count = 0;
+}
+
+// Called with the lock held
+static void transmit(serial_t *serial, const uint8_t *data, uint32_t length)
+{
+    serial->tx_bytes += length;
+
+    while (length)
+    {
+        uint32_t n = SERIAL_TX_SIZE - serial->tx_count;
+        n = n < length ? n : length;
+        memcpy(serial->tx + serial->tx_count, data, n);
+        serial->tx_count += n;
+        data += n;
+        length -= n;
+
+        if (serial->tx_count == SERIAL_TX_SIZE)
+            write_out(serial);
+    }
+}
+
+// The interrupt line is up while an enabled interrupt is pending. Called with
+// the lock held.
+static void update_irq(serial_t *serial)
+{
+    int level = ((serial->ier & UART_IER_RDI) && serial->rx_count) ||
+                ((serial->ier & UART_IER_THRI) && serial->thri_pending);
+
+    if (level == serial->irq_level)
+        return;
+
+    struct kvm_irq_level irq = {.irq = SERIAL_COM1_IRQ, .level = level};
+    // Without a VM (exit replay) only the line's level is kept
+    if (serial->vmfd >= 0 && ioctl(serial->vmfd, KVM_IRQ_LINE, &irq) < 0)
+    {
+        err(1, "VMM: KVM_IRQ_LINE");
+    }
+    serial->irq_level = level;
+}
+
+// Called with the lock held
+static void receive(serial_t *serial, uint8_t c)
+{
+    serial->rx[(serial->rx_head + serial->rx_count) % SERIAL_RX_SIZE] = c;
+    serial->rx_count++;
+}
+
+static void unlock(void *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+static void *rx_thread(void *arg)
+{
+    serial_t *serial = arg;
+    uint8_t buf[256];
+
+    for (;;)
+    {
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        pthread_mutex_lock(&serial->lock);
+        pthread_cleanup_push(unlock, &serial->lock); // cancelled while waiting
+        for (ssize_t i = 0; i < n; i++)
+        {
+            // Like hardware flow control: wait for the guest to catch up
+            while (serial->rx_count == SERIAL_RX_SIZE)
+            {
+                pthread_cond_wait(&serial->rx_space, &serial->lock);
+            }
+            receive(serial, buf[i]);
+        }
+        update_irq(serial);
+        pthread_cleanup_pop(1);
+    }
+
+    return NULL;
+}
+
+static uint8_t read_reg(serial_t *serial, int reg)
+{
+    bool dlab = serial->lcr & UART_LCR_DLAB;
+    uint8_t value;
+
+    switch (reg)
+    {
+    case UART_RBR:
+        if (dlab)
+            return serial->divisor & 0xFF;
+        if (!serial->rx_count)
+            return 0;
+        value = serial->rx[serial->rx_head];
+        serial->rx_head = (serial->rx_head + 1) % SERIAL_RX_SIZE;
+        serial->rx_count--;
+        pthread_cond_signal(&serial->rx_space);
+        return value;
+    case UART_IER:
+        return dlab ? serial->divisor >> 8 : serial->ier;
+    case UART_IIR:
+        value = serial->fifo ? UART_IIR_FIFO : 0;
+        if ((serial->ier & UART_IER_RDI) && serial->rx_count)
+            return value | UART_IIR_RDI;
+        if ((serial->ier & UART_IER_THRI) && serial->thri_pending)
+        {
+            serial->thri_pending = false; // reading IIR acknowledges it
+            return value | UART_IIR_THRI;
+        }
+        return value | UART_IIR_NO_INT;
+    case UART_LCR:
+        return serial->lcr;
+    case UART_MCR:
+        return serial->mcr;
+    case UART_LSR:
+        return UART_LSR_THRE | UART_LSR_TEMT | (serial->rx_count ? UART_LSR_DR : 0);
+    case UART_MSR:
+        return 0xB0; // DCD, DSR and CTS: always connected
+    default:
+        return serial->scr;
+    }
+}
+
+static void write_reg(serial_t *serial, int reg, uint8_t value)
+{
+    bool dlab = serial->lcr & UART_LCR_DLAB;
+
+    switch (reg)
+    {
+    case UART_THR:
+        if (dlab)
+        {
+            serial->divisor = (serial->divisor & 0xFF00) | value;
+            break;
+        }
+        if (serial->mcr & UART_MCR_LOOP)
+        {
+            if (serial->rx_count < SERIAL_RX_SIZE)
+                receive(serial, value);
+        }
+        else
+        {
+            transmit(serial, &value, 1);
+        }
+        serial->thri_pending = true; // empty again right away
+        break;
+    case UART_IER:
+        if (dlab)
+        {
+            serial->divisor = (serial->divisor & 0x00FF) | value << 8;
+            break;
+        }
+        // Enabling the THR empty interrupt raises it: THR is empty
+        if ((value & UART_IER_THRI) && !(serial->ier & UART_IER_THRI))
+            serial->thri_pending = true;
+        serial->ier = value & 0x0F;
+        break;
+    case UART_FCR:
+        serial->fifo = value & UART_FCR_ENABLE;
+        if (value & UART_FCR_CLEAR_RCVR)
+        {
+            serial->rx_count = 0;
+            pthread_cond_signal(&serial->rx_space);
+        }
+        break;
+    case UART_LCR:
+        serial->lcr = value;
+        break;
+    case UART_MCR:
+        serial->mcr = value & 0x1F;
+        break;
+    case UART_SCR:
+        serial->scr = value;
+        break;
+    default: // LSR and MSR are read-only
+        break;
+    }
+}
+
+bool serial_owns_port(uint16_t port)
+{
+    return port >= SERIAL_COM1_BASE && port < SERIAL_COM1_BASE + UART_REGS;
+}
+
+// Handles string I/O too: a rep outsb to THR is a single exit
+void serial_handle_io(serial_t *serial, struct kvm_run *run)
+{
+    uint8_t *data = (uint8_t *)run + run->io.data_offset;
+    int reg = run->io.port - SERIAL_COM1_BASE;
+
+    pthread_mutex_lock(&serial->lock);
+
+    for (uint32_t i = 0; i < run->io.count; i++)
+    {
+        for (int j = 0; j < run->io.size; j++) // wider accesses go to the next registers
+        {
+            uint8_t *byte = data + i * run->io.size + j;
+            if (reg + j >= UART_REGS)
+            {
+                if (run->io.direction == KVM_EXIT_IO_IN)
+                    *byte = 0xFF;
+            }
+            else if (run->io.direction == KVM_EXIT_IO_OUT)
+            {
+                write_reg(serial, reg + j, *byte);
+            }
+            else
+            {
+                *byte = read_reg(serial, reg + j);
+            }
+        }
+    }
+
+    update_irq(serial);
+    pthread_mutex_unlock(&serial->lock);
+}
+
+void serial_set_guest_mem(serial_t *serial, uint8_t *mem, uint64_t size)
+{
+    serial->guest_mem = mem;
+    serial->guest_mem_size = size;
+}
+
+int serial_pv_write(serial_t *serial, uint32_t gpa, uint32_t length)
+{
+    uint64_t size = serial->guest_mem_size;
+
+    if (gpa > size || length > size - gpa)
+        return -1;
+
+    // Not in the device area below 1 MB
+    if (size > LOW_RAM_END && gpa < HIGH_RAM_START && (uint64_t)gpa + length > LOW_RAM_END)
+        return -1;
+
+    pthread_mutex_lock(&serial->lock);
+    transmit(serial, serial->guest_mem + gpa, length);
+    pthread_mutex_unlock(&serial->lock);
+    return length;
+}
+
+void serial_flush(serial_t *serial)
+{
+    pthread_mutex_lock(&serial->lock);
+    write_out(serial);
+    pthread_mutex_unlock(&serial->lock);
+}
+
+void serial_save_state(serial_t *serial, serial_state_t *state)
+{
+    pthread_mutex_lock(&serial->lock);
+    state->ier = serial->ier;
+    state->lcr = serial->lcr;
+    state->mcr = serial->mcr;
+    state->scr = serial->scr;
+    state->divisor = serial->divisor;
+    state->fifo = serial->fifo;
+    state->thri_pending = serial->thri_pending;
+    state->irq_level = serial->irq_level;
+    memcpy(state->rx, serial->rx, sizeof(state->rx));
+    state->rx_head = serial->rx_head;
+    state->rx_count = serial->rx_count;
+    pthread_mutex_unlock(&serial->lock);
+}
+
+// The interrupt controllers are restored with the IRQ line as it was too
+void serial_restore_state(serial_t *serial, const serial_state_t *state)
+{
+    pthread_mutex_lock(&serial->lock);
+    serial->ier = state->ier;
+    serial->lcr = state->lcr;
+    serial->mcr = state->mcr;
+    serial->scr = state->scr;
+    serial->divisor = state->divisor;
+    serial->fifo = state->fifo;
+    serial->thri_pending = state->thri_pending;
+    serial->irq_level = state->irq_level;
+    memcpy(serial->rx, state->rx, sizeof(serial->rx));
+    serial->rx_head = state->rx_head;
+    serial->rx_count = state->rx_count;
+    pthread_cond_signal(&serial->rx_space);
+    pthread_mutex_unlock(&serial->lock);
+}
+
+// dest: stdio, or a file the output goes to
+serial_t *create_serial(const char *dest, int vmfd)
+{
+    serial_t *serial = (serial_t *)calloc(1, sizeof(serial_t));
+    serial->vmfd = vmfd;
+    serial->lcr = UART_LCR_8N1;
+    serial->divisor = 12; // 9600 baud, as after a reset
+    pthread_mutex_init(&serial->lock, NULL);
+    pthread_cond_init(&serial->rx_space, NULL);
+
+    if (strcmp(dest, "stdio") == 0)
+    {
+        serial->out_fd = STDOUT_FILENO;
+        serial->stdin_rx = true;
+
+        if (pthread_create(&serial->rx_thread, NULL, &rx_thread, serial) != 0)
+        {
+            errx(1, "VMM: can't start the serial port's receive thread");
+        }
+    }
+    else
+    {
+        serial->out_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (serial->out_fd < 0)
+        {
+            err(1, "VMM: %s", dest);
+        }
+    }
+
+    printf("serial port at 0x%x (IRQ %d) to %s\n", SERIAL_COM1_BASE, SERIAL_COM1_IRQ, dest);
+    return serial;
+}
+
+void destroy_serial(serial_t *serial)
+{
+    if (serial->stdin_rx)
+    {
+        pthread_cancel(serial->rx_thread);
+        pthread_join(serial->rx_thread, NULL);
+    }
+
+    serial_flush(serial);
+    printf("serial: %lu bytes sent in %lu writes\n", serial->tx_bytes, serial->tx_writes);
+
+    if (serial->out_fd != STDOUT_FILENO)
+        close(serial->out_fd);
+    pthread_cond_destroy(&serial->rx_space);
+    pthread_mutex_destroy(&serial->lock);
+    free(serial);
+}
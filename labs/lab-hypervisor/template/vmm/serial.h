@@ -0,0 +1,72 @@
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "shared/serial.h"
+
+#define SERIAL_RX_SIZE 4096
+#define SERIAL_TX_SIZE (64 * 1024)
+
+// 16550 UART. Transmitted bytes are buffered and written out when the buffer
+// is full, at every serial_flush() and on destroy; with stdio, bytes read
+// from stdin are received, with an interrupt.
+typedef struct serial
+{
+    int vmfd;
+    uint8_t ier;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint16_t divisor;
+    bool fifo;
+    bool thri_pending; // THR empty interrupt, until IIR reports it or THR is written
+    int irq_level;
+
+    uint8_t rx[SERIAL_RX_SIZE];
+    uint32_t rx_head;
+    uint32_t rx_count;
+    pthread_t rx_thread;
+    pthread_cond_t rx_space;
+    bool stdin_rx; // receives from stdin
+
+    int out_fd;
+    uint8_t tx[SERIAL_TX_SIZE];
+    uint32_t tx_count;
+    uint64_t tx_bytes;
+    uint64_t tx_writes;
+
+    pthread_mutex_t lock;
+    uint8_t *guest_mem;
+    uint64_t guest_mem_size;
+} serial_t;
+
+// What the guest sees of the UART, for snapshots. Output already sent stays sent.
+typedef struct serial_state
+{
+    uint8_t ier;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint16_t divisor;
+    bool fifo;
+    bool thri_pending;
+    int irq_level;
+    uint8_t rx[SERIAL_RX_SIZE];
+    uint32_t rx_head;
+    uint32_t rx_count;
+} serial_state_t;
+
+serial_t *create_serial(const char *dest, int vmfd);
+void serial_set_guest_mem(serial_t *serial, uint8_t *mem, uint64_t size);
+bool serial_owns_port(uint16_t port);
+void serial_handle_io(serial_t *serial, struct kvm_run *run);
+int serial_pv_write(serial_t *serial, uint32_t gpa, uint32_t length);
+void serial_flush(serial_t *serial);
+void serial_save_state(serial_t *serial, serial_state_t *state);
+void serial_restore_state(serial_t *serial, const serial_state_t *state);
+void destroy_serial(serial_t *serial);
+
+#endif
@@ -0,0 +1,206 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include "snapshot.h"
+
+#define PAGE_SIZE 4096
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vm_ioctl(snapshot_t *snapshot, unsigned long request, void *arg, const char *name)
+{
+    if (ioctl(snapshot->vmfd, request, arg) < 0)
+    {
+        err(1, "VMM: %s", name);
+    }
+}
+
+snapshot_t *create_snapshot(int vmfd, int vcpufd, struct kvm_run *run)
+{
+    snapshot_t *snapshot = (snapshot_t *)calloc(1, sizeof(snapshot_t));
+    snapshot->vmfd = vmfd;
+    snapshot->vcpufd = vcpufd;
+    snapshot->run = run;
+    vm_state_init(&snapshot->state, vcpufd);
+    return snapshot;
+}
+
+// Restores go to another VM from now on, e.g. one made in a forked process
+void snapshot_set_vm(snapshot_t *snapshot, int vmfd, int vcpufd, struct kvm_run *run)
+{
+    snapshot->vmfd = vmfd;
+    snapshot->vcpufd = vcpufd;
+    snapshot->run = run;
+}
+
+// slot: the memory slot of the region if it logs dirty pages, -1 otherwise
+void snapshot_add_region(snapshot_t *snapshot, int slot, uint8_t *mem, uint64_t size)
+{
+    if (snapshot->nr_regions == SNAPSHOT_MAX_REGIONS)
+    {
+        errx(1, "VMM: too many memory regions in a snapshot");
+    }
+
+    uint64_t words = (size / PAGE_SIZE + 63) / 64;
+    snapshot_region_t *region = &snapshot->regions[snapshot->nr_regions++];
+    region->slot = slot;
+    region->size = size;
+    region->mem = mem;
+    region->copy = malloc(size);
+    region->vmm_dirty = calloc(words, sizeof(uint64_t));
+
+    // Large enough for the largest region
+    uint64_t largest = 0;
+    for (int i = 0; i < snapshot->nr_regions; i++)
+        largest = snapshot->regions[i].size > largest ? snapshot->regions[i].size : largest;
+
+    free(snapshot->dirty_bitmap);
+    snapshot->dirty_bitmap = calloc((largest / PAGE_SIZE + 63) / 64, sizeof(uint64_t));
+
+    if (!region->copy || !region->vmm_dirty || !snapshot->dirty_bitmap)
+    {
+        err(1, "VMM: allocating snapshot");
+    }
+}
+
+// Pages written since the previous call, which clears them
+static void get_dirty_log(snapshot_t *snapshot, snapshot_region_t *region)
+{
+    struct kvm_dirty_log dirty_log = {.slot = region->slot, .dirty_bitmap = snapshot->dirty_bitmap};
+    vm_ioctl(snapshot, KVM_GET_DIRTY_LOG, &dirty_log, "KVM_GET_DIRTY_LOG");
+}
+
+// The I/O of the exit being handled is completed when KVM_RUN is entered
+// again: until then, the vCPU's state is not consistent, and completing it
+// later would change the state set meanwhile. With immediate_exit, KVM_RUN
+// completes it and returns right away.
+static void complete_exit(snapshot_t *snapshot)
+{
+    snapshot->run->immediate_exit = 1;
+    if (ioctl(snapshot->vcpufd, KVM_RUN, NULL) == 0 || errno != EINTR)
+    {
+        err(1, "VMM: KVM_RUN to complete the exit");
+    }
+    snapshot->run->immediate_exit = 0;
+}
+
+// Called while an exit is handled
+void snapshot_take(snapshot_t *snapshot)
+{
+    complete_exit(snapshot);
+
+    for (int i = 0; i < snapshot->nr_regions; i++)
+    {
+        snapshot_region_t *region = &snapshot->regions[i];
+
+        if (region->slot >= 0)
+            get_dirty_log(snapshot, region);
+
+        memcpy(region->copy, region->mem, region->size);
+        memset(region->vmm_dirty, 0, (region->size / PAGE_SIZE + 63) / 64 * sizeof(uint64_t));
+    }
+
+    vm_state_save(&snapshot->state, snapshot->vmfd, snapshot->vcpufd);
+
+    uint64_t size = 0;
+    for (int i = 0; i < snapshot->nr_regions; i++)
+        size += snapshot->regions[i].size;
+
+    if (size)
+        printf("snapshot: taken at rip 0x%llx, %lu KB of guest memory\n", snapshot->state.regs.rip, size / 1024);
+    else
+        printf("snapshot: taken at rip 0x%llx, without guest memory\n", snapshot->state.regs.rip);
+}
+
+// Guest memory the VMM wrote (mem is in one of the regions): KVM only logs the
+// guest's writes
+void snapshot_mark_dirty(snapshot_t *snapshot, const uint8_t *mem, uint64_t length)
+{
+    for (int i = 0; i < snapshot->nr_regions; i++)
+    {
+        snapshot_region_t *region = &snapshot->regions[i];
+
+        if (mem < region->mem || mem >= region->mem + region->size || !length)
+            continue;
+
+        uint64_t offset = mem - region->mem;
+        uint64_t last = offset + length - 1 < region->size ? offset + length - 1 : region->size - 1;
+
+        for (uint64_t page = offset / PAGE_SIZE; page <= last / PAGE_SIZE; page++)
+        {
+            region->vmm_dirty[page / 64] |= 1ULL << (page % 64);
+        }
+        return;
+    }
+}
+
+static void restore_region(snapshot_t *snapshot, snapshot_region_t *region)
+{
+    if (region->slot < 0)
+    {
+        memcpy(region->mem, region->copy, region->size);
+        return;
+    }
+
+    get_dirty_log(snapshot, region);
+
+    uint64_t pages = region->size / PAGE_SIZE;
+
+    for (uint64_t word = 0; word < (pages + 63) / 64; word++)
+    {
+        uint64_t bits = snapshot->dirty_bitmap[word] | region->vmm_dirty[word];
+        region->vmm_dirty[word] = 0;
+
+        for (; bits; bits &= bits - 1)
+        {
+            uint64_t offset = (word * 64 + __builtin_ctzll(bits)) * PAGE_SIZE;
+            memcpy(region->mem + offset, region->copy + offset, PAGE_SIZE);
+            snapshot->pages_restored++;
+        }
+    }
+}
+
+// Resets the VM to the snapshot, called while an exit is handled
+void snapshot_restore(snapshot_t *snapshot)
+{
+    uint64_t start = now_ns();
+    complete_exit(snapshot);
+
+    for (int i = 0; i < snapshot->nr_regions; i++)
+    {
+        restore_region(snapshot, &snapshot->regions[i]);
+    }
+
+    vm_state_restore(&snapshot->state, snapshot->vmfd, snapshot->vcpufd, snapshot->run);
+
+    snapshot->restores++;
+    snapshot->restore_ns += now_ns() - start;
+}
+
+void destroy_snapshot(snapshot_t *snapshot)
+{
+    if (snapshot->restores)
+    {
+        printf("snapshot: %lu restores, %.1f us and %.1f pages each on average\n", snapshot->restores,
+               snapshot->restore_ns / 1000.0 / snapshot->restores,
+               (double)snapshot->pages_restored / snapshot->restores);
+    }
+
+    for (int i = 0; i < snapshot->nr_regions; i++)
+    {
+        free(snapshot->regions[i].copy);
+        free(snapshot->regions[i].vmm_dirty);
+    }
+
+    free(snapshot->dirty_bitmap);
+    free(snapshot);
+}
@@ -0,0 +1,52 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <linux/kvm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "vmstate.h"
+#include "shared/snapshot.h"
+
+#define SNAPSHOT_MAX_REGIONS 8
+
+// Guest memory the snapshot has a copy of. Regions of memory slots logging
+// dirty pages are restored page by page, the others whole.
+typedef struct snapshot_region
+{
+    int slot; // -1 if it doesn't log dirty pages
+    uint64_t size;
+    uint8_t *mem;
+    uint8_t *copy;
+    uint64_t *vmm_dirty; // pages written by the VMM, which KVM doesn't see
+} snapshot_region_t;
+
+// State of a VM at a point it can cheaply be reset to: only the pages written
+// since are copied back, along with the state of the vCPU and of the in-kernel
+// interrupt controllers, timer and clock. The VMM's device models save and
+// restore their own state.
+typedef struct snapshot
+{
+    int vmfd;
+    int vcpufd;
+    struct kvm_run *run;
+
+    snapshot_region_t regions[SNAPSHOT_MAX_REGIONS];
+    int nr_regions;
+    uint64_t *dirty_bitmap; // of the largest region
+
+    vm_state_t state; // set by the next restore, the VMM may change its registers
+
+    uint64_t restores;
+    uint64_t pages_restored;
+    uint64_t restore_ns;
+} snapshot_t;
+
+snapshot_t *create_snapshot(int vmfd, int vcpufd, struct kvm_run *run);
+void snapshot_set_vm(snapshot_t *snapshot, int vmfd, int vcpufd, struct kvm_run *run);
+void snapshot_add_region(snapshot_t *snapshot, int slot, uint8_t *mem, uint64_t size);
+void snapshot_take(snapshot_t *snapshot);
+void snapshot_mark_dirty(snapshot_t *snapshot, const uint8_t *mem, uint64_t length);
+void snapshot_restore(snapshot_t *snapshot);
+void destroy_snapshot(snapshot_t *snapshot);
+
+#endif
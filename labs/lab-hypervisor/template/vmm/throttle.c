@@ -0,0 +1,392 @@
+// I/O throttling layer, stacked on top of the whole backend stack of a disk.
+//
+// Each disk can have IOPS and bandwidth limits, enforced with token buckets:
+// a bucket fills at the limit's rate up to `burst` seconds worth of tokens,
+// so an idle disk can briefly go faster than its limit. A request that doesn't
+// fit waits (blocking the thread that submitted it, i.e. the guest, before the
+// request is posted to the disk's I/O thread) until it does; requests bigger than the bucket go through once it is full, and leave
+// it in debt.
+//
+// Disks are also members of a throttle group, which can have limits of its own
+// for all its disks together. Requests waiting in a group are dispatched in
+// start-time fair queueing order: each disk has a virtual clock advanced by the
+// cost of its requests, and the eligible request with the smallest start tag
+// goes first. A disk that keeps the group busy gets a late tag and falls
+// behind disks that only issue a request now and then, so those keep a low
+// latency. Disks without a group name each get a group of their own.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "throttle.h"
+
+#define DEFAULT_BURST 1.0
+#define OP_COST 4096 // fair queueing cost of a request, on top of its bytes
+
+typedef struct token_bucket
+{
+    double rate; // tokens per second, 0 when unlimited
+    double burst;
+    double tokens;
+    uint64_t last_ns;
+} token_bucket_t;
+
+typedef struct waiter
+{
+    struct throttle_disk *td;
+    uint64_t bytes;
+    double start_tag;
+    double finish_tag;
+    struct waiter *next;
+} waiter_t;
+
+typedef struct throttle_group
+{
+    char *name;
+    token_bucket_t iops;
+    token_bucket_t bps;
+    double vtime; // start tag of the last request dispatched
+    waiter_t *waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    struct throttle_group *next;
+} throttle_group_t;
+
+typedef struct throttle_disk
+{
+    disk_t disk;
+    disk_t *backend;
+    throttle_group_t *group;
+    token_bucket_t iops;
+    token_bucket_t bps;
+    double finish_tag; // of this disk's last request
+
+    uint64_t requests;
+    uint64_t throttled;
+    uint64_t throttled_ns;
+    uint64_t max_throttled_ns;
+} throttle_disk_t;
+
+static throttle_group_t *groups;
+static pthread_mutex_t groups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bucket_init(token_bucket_t *bucket, uint64_t rate, double burst)
+{
+    bucket->rate = rate;
+    bucket->burst = rate * burst;
+    bucket->tokens = bucket->burst;
+    bucket->last_ns = now_ns();
+}
+
+static void bucket_refill(token_bucket_t *bucket, uint64_t now)
+{
+    if (!bucket->rate)
+        return;
+
+    bucket->tokens += bucket->rate * (now - bucket->last_ns) / 1e9;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last_ns = now;
+}
+
+// Nanoseconds until cost fits in the bucket (0 if it does)
+static uint64_t bucket_delay(token_bucket_t *bucket, double cost)
+{
+    if (!bucket->rate)
+        return 0;
+
+    double needed = cost < bucket->burst ? cost : bucket->burst;
+    if (bucket->tokens >= needed)
+        return 0;
+
+    return (uint64_t)((needed - bucket->tokens) / bucket->rate * 1e9) + 1;
+}
+
+static void bucket_take(token_bucket_t *bucket, double cost)
+{
+    if (bucket->rate)
+        bucket->tokens -= cost;
+}
+
+static uint64_t max_u64(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+// Time until a request would fit in its disk's buckets
+static uint64_t disk_delay(waiter_t *w, uint64_t now)
+{
+    throttle_disk_t *td = w->td;
+    bucket_refill(&td->iops, now);
+    bucket_refill(&td->bps, now);
+    return max_u64(bucket_delay(&td->iops, 1), bucket_delay(&td->bps, w->bytes));
+}
+
+// The request to dispatch next: the one with the smallest start tag among those
+// its own disk's limits allow. Sets *delay to how long until one can go.
+static waiter_t *pick(throttle_group_t *group, uint64_t now, uint64_t *delay)
+{
+    waiter_t *best = NULL;
+    uint64_t next = UINT64_MAX;
+
+    for (waiter_t *w = group->waiting; w; w = w->next)
+    {
+        uint64_t d = disk_delay(w, now);
+        if (d > 0)
+        {
+            next = d < next ? d : next;
+            continue;
+        }
+
+        if (!best || w->start_tag < best->start_tag)
+            best = w;
+    }
+
+    if (best)
+    {
+        bucket_refill(&group->iops, now);
+        bucket_refill(&group->bps, now);
+        uint64_t d = max_u64(bucket_delay(&group->iops, 1), bucket_delay(&group->bps, best->bytes));
+        if (d > 0)
+        {
+            *delay = d;
+            return NULL;
+        }
+    }
+
+    *delay = next;
+    return best;
+}
+
+static void remove_waiter(throttle_group_t *group, waiter_t *w)
+{
+    waiter_t **prev = &group->waiting;
+    while (*prev != w)
+    {
+        prev = &(*prev)->next;
+    }
+    *prev = w->next;
+}
+
+// Wait until the request may go to the backend
+static void throttle(throttle_disk_t *td, uint64_t bytes)
+{
+    throttle_group_t *group = td->group;
+    uint64_t start = now_ns();
+    waiter_t w = {.td = td, .bytes = bytes};
+
+    // This is the guest's thread, which the display loop cancels: not while
+    // it holds the lock or is in the queue
+    int cancel_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+    pthread_mutex_lock(&group->lock);
+
+    w.start_tag = td->finish_tag > group->vtime ? td->finish_tag : group->vtime;
+    w.finish_tag = w.start_tag + bytes + OP_COST;
+    td->finish_tag = w.finish_tag;
+    w.next = group->waiting;
+    group->waiting = &w;
+
+    for (;;)
+    {
+        uint64_t now = now_ns();
+        uint64_t delay;
+        waiter_t *next = pick(group, now, &delay);
+
+        if (next == &w)
+            break;
+
+        if (next)
+        {
+            // Someone else's turn: make sure it knows
+            pthread_cond_broadcast(&group->cond);
+        }
+
+        if (next || delay == UINT64_MAX)
+        {
+            pthread_cond_wait(&group->cond, &group->lock);
+        }
+        else
+        {
+            uint64_t deadline = now + delay;
+            struct timespec ts = {.tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL};
+            pthread_cond_timedwait(&group->cond, &group->lock, &ts);
+        }
+    }
+
+    remove_waiter(group, &w);
+    bucket_take(&td->iops, 1);
+    bucket_take(&td->bps, bytes);
+    bucket_take(&group->iops, 1);
+    bucket_take(&group->bps, bytes);
+    group->vtime = w.start_tag;
+
+    uint64_t waited = now_ns() - start;
+    td->requests++;
+    if (waited > 10000) // more than scheduling noise
+    {
+        td->throttled++;
+        td->throttled_ns += waited;
+        td->max_throttled_ns = max_u64(td->max_throttled_ns, waited);
+    }
+
+    if (group->waiting)
+        pthread_cond_broadcast(&group->cond);
+
+    pthread_mutex_unlock(&group->lock);
+    pthread_setcancelstate(cancel_state, NULL);
+}
+
+static int throttle_readv(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    throttle_disk_t *td = (throttle_disk_t *)disk;
+    throttle(td, iov_length(iov, iovcnt));
+    return td->backend->readv(td->backend, iov, iovcnt, offset);
+}
+
+static int throttle_writev(disk_t *disk, const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    throttle_disk_t *td = (throttle_disk_t *)disk;
+    throttle(td, iov_length(iov, iovcnt));
+    return td->backend->writev(td->backend, iov, iovcnt, offset);
+}
+
+// Flushes aren't throttled: holding them back only delays data getting safe
+static int throttle_flush(disk_t *disk)
+{
+    throttle_disk_t *td = (throttle_disk_t *)disk;
+    return td->backend->flush(td->backend);
+}
+
+static int throttle_discard(disk_t *disk, uint64_t offset, uint64_t length)
+{
+    throttle_disk_t *td = (throttle_disk_t *)disk;
+    throttle(td, 0);
+    return td->backend->discard(td->backend, offset, length);
+}
+
+static uint64_t throttle_next_data(disk_t *disk, uint64_t offset)
+{
+    throttle_disk_t *td = (throttle_disk_t *)disk;
+    return disk_next_data(td->backend, offset);
+}
+
+static throttle_group_t *get_group(throttle_config_t *config)
+{
+    throttle_group_t *group = NULL;
+
+    pthread_mutex_lock(&groups_lock);
+
+    for (group = config->group ? groups : NULL; group; group = group->next)
+    {
+        if (strcmp(group->name, config->group) == 0)
+            break;
+    }
+
+    if (!group)
+    {
+        group = calloc(1, sizeof(throttle_group_t));
+        group->name = config->group ? strdup(config->group) : NULL;
+        pthread_mutex_init(&group->lock, NULL);
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&group->cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if (group->name)
+        {
+            group->next = groups;
+            groups = group;
+        }
+    }
+
+    // The first disk with group limits sets them
+    if (!group->iops.rate && !group->bps.rate)
+    {
+        bucket_init(&group->iops, config->group_iops, config->burst);
+        bucket_init(&group->bps, config->group_bps, config->burst);
+    }
+
+    group->refs++;
+    pthread_mutex_unlock(&groups_lock);
+    return group;
+}
+
+static void put_group(throttle_group_t *group)
+{
+    pthread_mutex_lock(&groups_lock);
+
+    if (--group->refs == 0)
+    {
+        throttle_group_t **prev = &groups;
+        while (*prev && *prev != group)
+        {
+            prev = &(*prev)->next;
+        }
+        if (*prev)
+            *prev = group->next;
+
+        pthread_cond_destroy(&group->cond);
+        pthread_mutex_destroy(&group->lock);
+        free(group->name);
+        free(group);
+    }
+
+    pthread_mutex_unlock(&groups_lock);
+}
+
+static void throttle_destroy(disk_t *disk)
+{
+    throttle_disk_t *td = (throttle_disk_t *)disk;
+
+    printf("throttle: %lu requests, %lu throttled for %lu ms in total (%lu ms at most)\n",
+           td->requests, td->throttled, td->throttled_ns / 1000000, td->max_throttled_ns / 1000000);
+
+    put_group(td->group);
+    td->backend->destroy(td->backend);
+    free(td);
+}
+
+void throttle_config_init(throttle_config_t *config)
+{
+    memset(config, 0, sizeof(throttle_config_t));
+    config->burst = DEFAULT_BURST;
+}
+
+bool throttle_enabled(throttle_config_t *config)
+{
+    return config->iops || config->bps || config->group || config->group_iops || config->group_bps;
+}
+
+disk_t *create_throttle_disk(disk_t *backend, throttle_config_t *config)
+{
+    throttle_disk_t *td = (throttle_disk_t *)calloc(1, sizeof(throttle_disk_t));
+    td->backend = backend;
+    td->group = get_group(config);
+    bucket_init(&td->iops, config->iops, config->burst);
+    bucket_init(&td->bps, config->bps, config->burst);
+
+    td->disk.readv = &throttle_readv;
+    td->disk.writev = &throttle_writev;
+    td->disk.flush = &throttle_flush;
+    td->disk.discard = backend->discard ? &throttle_discard : NULL;
+    td->disk.next_data = &throttle_next_data;
+    td->disk.destroy = &throttle_destroy;
+    td->disk.size = backend->size;
+
+    printf("throttle: %lu IOPS, %lu B/s, %.1fs burst, group %s\n", config->iops, config->bps, config->burst,
+           config->group ? config->group : "(own)");
+    return &td->disk;
+}
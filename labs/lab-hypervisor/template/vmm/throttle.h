@@ -0,0 +1,10 @@
+#ifndef _THROTTLE_H_
+#define _THROTTLE_H_
+
+#include "disk.h"
+
+void throttle_config_init(throttle_config_t *config);
+bool throttle_enabled(throttle_config_t *config);
+disk_t *create_throttle_disk(disk_t *backend, throttle_config_t *config);
+
+#endif
@@ -0,0 +1,59 @@
+#include <err.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "unixsock.h"
+
+static void socket_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        errx(1, "VMM: socket path %s is too long", path);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+// Listens on the socket at path, replacing a stale one
+int listen_unix_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    socket_address(path, &addr);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0)
+    {
+        err(1, "VMM: listening on %s", path);
+    }
+
+    return sock;
+}
+
+// Connects to the socket at path, waiting for it to be up for a few seconds
+int connect_unix_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    socket_address(path, &addr);
+
+    for (int tries = 0;; tries++)
+    {
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return sock;
+
+        if (sock < 0 || (errno != ENOENT && errno != ECONNREFUSED) || tries == 500)
+        {
+            err(1, "VMM: connecting to %s", path);
+        }
+
+        close(sock);
+        usleep(10000);
+    }
+}
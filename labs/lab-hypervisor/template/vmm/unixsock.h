@@ -0,0 +1,10 @@
+#ifndef _UNIXSOCK_H_
+#define _UNIXSOCK_H_
+
+// Unix sockets of the fork server, the VM pool, live migrations and the block
+// backend
+
+int listen_unix_socket(const char *path);
+int connect_unix_socket(const char *path);
+
+#endif
@@ -0,0 +1,324 @@
+// In-process disk verification against a golden manifest.
+//
+// A manifest holds a hash per sector and a hash per extent (the hash of the
+// extent's sector hashes). Verification hashes the disk, compares extent
+// hashes first, and only looks at the sector hashes of the extents that
+// differ to report exactly which sectors are wrong. Holes are never read:
+// their hashes are those of zero-filled sectors.
+//
+// File layout: header, extent hashes, then sector hashes (all 64-bit).
+
+#include <emmintrin.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "verify.h"
+
+#define MANIFEST_MAGIC "VMMMANI1"
+#define EXTENT_SIZE (64 * 1024)
+#define EXTENT_SECTORS (EXTENT_SIZE / SECTOR_SIZE)
+
+#define STRIPE_SIZE 64
+#define STRIPES_PER_BLOCK 8 // scramble the accumulators every 512 bytes
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+
+typedef struct manifest_header
+{
+    char magic[8];
+    uint32_t extent_size;
+    uint32_t pad;
+    uint64_t size;
+    uint64_t nr_extents;
+    uint64_t nr_sectors;
+} manifest_header_t;
+
+// Per-stripe keys: stripe i of a block uses keys[2i..2i+7], so reordered stripes hash differently
+static const uint64_t keys[2 * (STRIPES_PER_BLOCK + 3)] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+    0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+    0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL,
+    0xc3ebd33483acc5eaULL, 0xeb6313faffa081c5ULL, 0x49daf0b751dd0d17ULL, 0x9e68d429265516d3ULL,
+    0xfca1477d58be162bULL, 0xce31d07ad1b8f88fULL};
+
+// Accumulate one 64-byte stripe into 4 x 2 64-bit lanes (SSE2):
+// each lane adds (data ^ key).lo32 * (data ^ key).hi32, plus the data of its neighbour lane.
+static inline void accumulate_stripe(__m128i acc[4], const uint8_t *data, const uint64_t *key)
+{
+    for (int j = 0; j < 4; j++)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(data + 16 * j));
+        __m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(key + 2 * j)));
+        __m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+        acc[j] = _mm_add_epi64(acc[j], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc[j] = _mm_add_epi64(acc[j], product);
+    }
+}
+
+// Mix the accumulators so the next block's stripes don't cancel out with this one's
+static inline void scramble(__m128i acc[4])
+{
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+
+    for (int j = 0; j < 4; j++)
+    {
+        __m128i a = _mm_xor_si128(acc[j], _mm_srli_epi64(acc[j], 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(keys + 2 * j + 1)));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        acc[j] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Fast 64-bit hash of a buffer, in the spirit of XXH3's SSE2 loop.
+// Not cryptographic: it detects corruption, not tampering.
+uint64_t hash_buffer(const void *buf, size_t len)
+{
+    const uint8_t *data = buf;
+    __m128i acc[4] = {
+        _mm_set_epi64x(PRIME64_1, PRIME64_2), _mm_set_epi64x(PRIME64_3, PRIME32_1),
+        _mm_set_epi64x(PRIME64_2, PRIME64_3), _mm_set_epi64x(PRIME32_1, PRIME64_1)};
+    size_t stripes = len / STRIPE_SIZE;
+    size_t stripe;
+
+    for (stripe = 0; stripe < stripes; stripe++)
+    {
+        accumulate_stripe(acc, data + stripe * STRIPE_SIZE, keys + 2 * (stripe % STRIPES_PER_BLOCK));
+        if (stripe % STRIPES_PER_BLOCK == STRIPES_PER_BLOCK - 1)
+            scramble(acc);
+    }
+
+    size_t tail = len - stripe * STRIPE_SIZE;
+    if (tail > 0)
+    {
+        uint8_t last[STRIPE_SIZE] = {0};
+        memcpy(last, data + stripe * STRIPE_SIZE, tail);
+        accumulate_stripe(acc, last, keys + 2 * (stripe % STRIPES_PER_BLOCK));
+    }
+
+    uint64_t lanes[8];
+    memcpy(lanes, acc, sizeof(lanes));
+
+    uint64_t h = len * PRIME64_1;
+    for (int i = 0; i < 8; i++)
+    {
+        h += avalanche(lanes[i] ^ keys[i]);
+        h = (h << 27 | h >> 37) * PRIME64_1;
+    }
+
+    return avalanche(h);
+}
+
+// Hash every extent of the disk. Calls back for each extent with its sector hashes.
+// Extents without data (see disk_next_data()) are not read.
+static int hash_disk(disk_t *disk, int (*extent_done)(void *ctx, uint64_t extent, uint64_t hash, const uint64_t *sector_hashes, int nr_sectors), void *ctx)
+{
+    uint8_t *buf = malloc(EXTENT_SIZE);
+    uint64_t sector_hashes[EXTENT_SECTORS];
+    uint8_t zero_sector[SECTOR_SIZE] = {0};
+    uint64_t zero_hash = hash_buffer(zero_sector, SECTOR_SIZE);
+    uint64_t nr_extents = (disk->size + EXTENT_SIZE - 1) / EXTENT_SIZE;
+    uint64_t data = 0;
+    uint64_t holes = 0;
+    int ret = 0;
+
+    if (!buf)
+        return -1;
+
+    for (uint64_t e = 0; e < nr_extents && ret == 0; e++)
+    {
+        uint64_t offset = e * EXTENT_SIZE;
+        size_t len = disk->size - offset < EXTENT_SIZE ? disk->size - offset : EXTENT_SIZE;
+        int nr_sectors = (int)(len / SECTOR_SIZE);
+
+        if (data < offset)
+            data = disk_next_data(disk, offset);
+
+        if (data >= offset + len)
+        {
+            for (int s = 0; s < nr_sectors; s++)
+            {
+                sector_hashes[s] = zero_hash;
+            }
+            holes++;
+        }
+        else
+        {
+            struct iovec iov = {.iov_base = buf, .iov_len = len};
+            if (disk->readv(disk, &iov, 1, offset) < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            for (int s = 0; s < nr_sectors; s++)
+            {
+                sector_hashes[s] = hash_buffer(buf + s * SECTOR_SIZE, SECTOR_SIZE);
+            }
+        }
+
+        uint64_t hash = hash_buffer(sector_hashes, nr_sectors * sizeof(uint64_t));
+        ret = extent_done(ctx, e, hash, sector_hashes, nr_sectors);
+    }
+
+    printf("verify: hashed %lu extents (%lu holes skipped)\n", nr_extents, holes);
+    free(buf);
+    return ret;
+}
+
+typedef struct manifest_writer
+{
+    int fd;
+    manifest_header_t header;
+} manifest_writer_t;
+
+static int write_extent(void *ctx, uint64_t extent, uint64_t hash, const uint64_t *sector_hashes, int nr_sectors)
+{
+    manifest_writer_t *w = ctx;
+    uint64_t extents_offset = sizeof(manifest_header_t);
+    uint64_t sectors_offset = extents_offset + w->header.nr_extents * sizeof(uint64_t);
+    struct iovec h = {.iov_base = &hash, .iov_len = sizeof(hash)};
+    struct iovec s = {.iov_base = (void *)sector_hashes, .iov_len = nr_sectors * sizeof(uint64_t)};
+
+    if (fd_writev(w->fd, &h, 1, extents_offset + extent * sizeof(uint64_t)) < 0)
+        return -1;
+
+    return fd_writev(w->fd, &s, 1, sectors_offset + extent * EXTENT_SECTORS * sizeof(uint64_t));
+}
+
+int write_manifest(disk_t *disk, char *manifest_path)
+{
+    manifest_writer_t w = {0};
+    memcpy(w.header.magic, MANIFEST_MAGIC, sizeof(w.header.magic));
+    w.header.extent_size = EXTENT_SIZE;
+    w.header.size = disk->size;
+    w.header.nr_extents = (disk->size + EXTENT_SIZE - 1) / EXTENT_SIZE;
+    w.header.nr_sectors = disk->size / SECTOR_SIZE;
+
+    w.fd = open(manifest_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fd < 0)
+        return -1;
+
+    struct iovec iov = {.iov_base = &w.header, .iov_len = sizeof(w.header)};
+    int ret = fd_writev(w.fd, &iov, 1, 0);
+
+    if (ret == 0)
+        ret = hash_disk(disk, &write_extent, &w);
+
+    close(w.fd);
+    return ret;
+}
+
+typedef struct manifest_reader
+{
+    int fd;
+    manifest_header_t header;
+    uint64_t *extent_hashes;
+    uint64_t differing_sectors;
+    int64_t range_start; // current run of differing sectors, -1 if none
+    int64_t range_end;
+} manifest_reader_t;
+
+static void report_range(manifest_reader_t *r)
+{
+    if (r->range_start < 0)
+        return;
+
+    if (r->range_end - r->range_start == 1)
+        printf("verify: sector %ld differs\n", r->range_start);
+    else
+        printf("verify: sectors %ld-%ld differ\n", r->range_start, r->range_end - 1);
+
+    r->range_start = -1;
+}
+
+static int compare_extent(void *ctx, uint64_t extent, uint64_t hash, const uint64_t *sector_hashes, int nr_sectors)
+{
+    manifest_reader_t *r = ctx;
+
+    if (extent >= r->header.nr_extents || r->extent_hashes[extent] == hash)
+        return 0;
+
+    // Only now look at the sector hashes
+    uint64_t expected[EXTENT_SECTORS];
+    uint64_t sectors_offset = sizeof(manifest_header_t) + r->header.nr_extents * sizeof(uint64_t);
+    struct iovec iov = {.iov_base = expected, .iov_len = nr_sectors * sizeof(uint64_t)};
+
+    if (fd_readv(r->fd, &iov, 1, sectors_offset + extent * EXTENT_SECTORS * sizeof(uint64_t)) < 0)
+        return -1;
+
+    for (int s = 0; s < nr_sectors; s++)
+    {
+        if (expected[s] == sector_hashes[s])
+            continue;
+
+        int64_t sector = extent * EXTENT_SECTORS + s;
+        if (r->range_start >= 0 && r->range_end != sector)
+            report_range(r);
+        if (r->range_start < 0)
+            r->range_start = sector;
+        r->range_end = sector + 1;
+        r->differing_sectors++;
+    }
+
+    return 0;
+}
+
+// Returns the number of sectors that differ from the manifest, -1 on error
+int64_t verify_disk(disk_t *disk, char *manifest_path)
+{
+    manifest_reader_t r = {.range_start = -1};
+
+    r.fd = open(manifest_path, O_RDONLY | O_CLOEXEC);
+    if (r.fd < 0)
+        return -1;
+
+    struct iovec iov = {.iov_base = &r.header, .iov_len = sizeof(r.header)};
+    if (fd_readv(r.fd, &iov, 1, 0) < 0 || memcmp(r.header.magic, MANIFEST_MAGIC, sizeof(r.header.magic)) != 0 ||
+        r.header.extent_size != EXTENT_SIZE)
+    {
+        close(r.fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (r.header.size != disk->size)
+    {
+        printf("verify: disk is %lu bytes, expected %lu\n", disk->size, r.header.size);
+    }
+
+    r.extent_hashes = malloc(r.header.nr_extents * sizeof(uint64_t));
+    struct iovec hashes = {.iov_base = r.extent_hashes, .iov_len = r.header.nr_extents * sizeof(uint64_t)};
+
+    int64_t ret = -1;
+    if (r.extent_hashes && fd_readv(r.fd, &hashes, 1, sizeof(r.header)) == 0 &&
+        hash_disk(disk, &compare_extent, &r) == 0)
+    {
+        report_range(&r);
+        ret = (int64_t)r.differing_sectors;
+        if (r.header.size != disk->size && ret == 0)
+            ret = 1;
+    }
+
+    free(r.extent_hashes);
+    close(r.fd);
+    return ret;
+}
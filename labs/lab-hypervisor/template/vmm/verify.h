@@ -0,0 +1,10 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include "disk.h"
+
+uint64_t hash_buffer(const void *buf, size_t len);
+int write_manifest(disk_t *disk, char *manifest_path);
+int64_t verify_disk(disk_t *disk, char *manifest_path);
+
+#endif
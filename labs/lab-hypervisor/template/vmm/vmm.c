@@ -1,15 +1,20 @@
 // KVM API reference: https://www.kernel.org/doc/html/latest/virt/kvm/api.html
 // Code initially based on example from https://lwn.net/Articles/658511/
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <err.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <linux/kvm.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -22,7 +27,38 @@
 #include "font.h"
 #include "ide.h"
 #include "ide_pv.h"
+#include "disk.h"
+#include "verify.h"
+#include "blk_backend.h"
+#include "boot.h"
+#include "cpu.h"
+#include "serial.h"
+#include "ps2.h"
+#include "exitlog.h"
+#include "profile.h"
+#include "scratch.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "migrate.h"
+#include "forkserver.h"
+#include "pool.h"
+#include "unixsock.h"
 #include "shared/vga.h"
+#include "shared/pvclock.h"
+
+// kvmclock MSR, see Documentation/virt/kvm/x86/msr.rst
+#define MSR_KVM_SYSTEM_TIME_NEW 0x4b564d01
+
+// With an in-kernel irqchip, "hlt" is handled by KVM and never exits, so
+// guests write to this port before halting to tell the VMM they are done.
+#define HALT_PORT 0xF4
+
+#define GUEST_PAGE_SIZE 4096
+
+// glibc's sigevent has no name for it, see profile.c
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 typedef struct
 {
@@ -32,379 +68,2493 @@ typedef struct
 
     struct kvm_run *run;
     int vcpu_mmap_size;
+    bool sync_regs;       // KVM puts the registers in run->s.regs on every exit
+    struct kvm_regs regs; // otherwise, see vcpu_regs()
+    struct kvm_sregs sregs;
 
     uint8_t *guest_mem;
-    u_int guest_mem_size;
+    uint64_t guest_mem_size; // RAM is at [0, LOW_RAM_END) and [HIGH_RAM_START, guest_mem_size) when larger
+    uint8_t *boot_area;      // GDT and page tables of direct boots
+    int boot_area_fd;
+    boot_mode_t boot_mode;
+    int guest_memfd; // so out-of-process backends can map guest RAM too
+
+    pvclock_t *pvclock;
+    int pvclock_fd;
+    uint64_t *dirty_bitmap; // of a memory slot, while recording exits
+    uint8_t *shadow_mem;    // what the exit log has of RAM, then of the hypercall areas
+    dirty_log_t *dirty_log; // pages checkpoints or a migration have to write
+
+    const char *stop_reason; // why vm_run() returned
+    uint64_t exits;
 } vm_t;
 
 gfx_context_t *window;
 uint8_t *fb;
+int fb_fd;
 hypercall_t *hypercall;
+int hypercall_fd;
 int fb_size;
-ide_t *machine;
-hypercall_host_t *hypercall_host;
+ide_t *ide_channels[IDE_CHANNELS];
+hypercall_host_t *pv_queues[HYPERCALL_MAX_QUEUES];
+serial_t *serial;
+ps2_t *ps2;
+exit_log_t *exit_log;
+profile_t *profiler;
+
+// The device models' state, for snapshots and checkpoints
+typedef struct device_state
+{
+    ide_state_t ide[IDE_CHANNELS];
+    serial_state_t serial;
+    ps2_state_t ps2;
+} device_state_t;
 
-static void handle_pmio(vm_t *vm)
+// Snapshot-reset iterations, see shared/snapshot.h
+typedef struct iterations
 {
-    struct kvm_run *run = vm->run;
-    machine->next(machine, run);
-    hypercall_host->next(hypercall_host, hypercall, run);
+    uint64_t count; // to run
+    uint64_t done;
+    uint64_t crashes;
+    uint64_t failures; // SNAPSHOT_DONE with a non-zero result
+    bool ended;        // the guest sent SNAPSHOT_DONE
+    uint64_t start_ns;
+
+    uint8_t *buffer; // the guest's input buffer
+    uint32_t buffer_size;
+    uint8_t *input; // this iteration's
+    uint32_t input_length;
+    uint8_t **corpus; // -inputs: used as they are, then mutated
+    uint32_t *corpus_lengths;
+    int corpus_size;
+    uint64_t rng;
+    char *crash_dir;
+
+    device_state_t devices; // at the snapshot
+} iterations_t;
+
+iterations_t *iterations;
+snapshot_t *snapshot;
+
+// Fork server (-fork-server), see forkserver.h
+fork_server_t *fork_server;
+
+// Periodic incremental checkpoints (-checkpoint), see checkpoint.h
+checkpoints_t *checkpoints;
+bool dirty_ring = true; // -dirty-log: where checkpoints and migrations get the dirty pages from
+
+// Live migration to another VMM (-migrate), see migrate.h
+migration_t *migration;
+int migrate_delay_ms = 1000;
+
+// Set when the job a VM pool worker runs is out of time, see -serve
+static volatile sig_atomic_t job_timed_out;
+
+// Device models exits go to
+typedef enum
+{
+    DEVICE_NONE,
+    DEVICE_PS2,
+    DEVICE_SERIAL,
+    DEVICE_SERIAL_PV,
+    DEVICE_REG_HYPERCALL,
+    DEVICE_PV_QUEUE,
+    DEVICE_IDE,
+    DEVICE_MMIO,
+    DEVICE_SNAPSHOT,
+    DEVICE_COUNT,
+} device_t;
+
+static const char *device_names[DEVICE_COUNT] = {"none", "ps2", "serial", "serial-pv", "pv-reg",
+                                                 "pv-queue", "ide", "mmio", "snapshot"};
+
+typedef enum
+{
+    DRIVE_IF_ALL, // -disk: IDE and PV
+    DRIVE_IF_IDE,
+    DRIVE_IF_PV,
+} drive_if_t;
+
+typedef struct drive
+{
+    disk_config_t config;
+    drive_if_t interface;
+    char *verify; // manifest to check the disk against once the VM is done
+    bool poll;    // PV queue polled by a host thread
+    int poll_cpu; // the poller is pinned to this CPU, if >= 0
+    int pv_queue; // -1 if none
+    char *socket; // out-of-process block backend serving the drive, see blk_backend.c
+    int backend;  // connection to it
+    disk_t *disk; // NULL with a block backend
+} drive_t;
+
+#define MAX_DRIVES (IDE_CHANNELS + HYPERCALL_MAX_QUEUES)
+
+drive_t drives[MAX_DRIVES];
+int nr_drives;
+
+static bool guest_halted(struct kvm_run *run)
+{
+    return run->io.direction == KVM_EXIT_IO_OUT && run->io.port == HALT_PORT;
 }
 
-static void handle_mmio(vm_t *vm)
+static uint64_t now_ns(void)
 {
-    struct kvm_run *run = vm->run;
-    // Guest wrote to an MMIO address (i.e. a memory slot marked as read-only)
-    if (run->mmio.is_write)
-    {
-        uint32_t value;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-        switch (run->mmio.len)
-        {
-        case 1:
-            value = *((uint8_t *)run->mmio.data);
-            break;
-        case 2:
-            value = *((uint16_t *)run->mmio.data);
-            break;
-        case 4:
-            value = *((uint32_t *)run->mmio.data);
-            break;
-        default:
-            fprintf(stderr, "VMM: Unsupported size in KVM_EXIT_MMIO\n");
-            value = 0;
-        }
+// Host address of guest memory the device models can read, NULL if it isn't
+static uint8_t *guest_memory(vm_t *vm, uint64_t gpa, uint64_t length)
+{
+    uint64_t areas_size = HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE;
 
-        printf("VMM: MMIO guest write: len=%d addr=%ld value=%d\n", run->mmio.len, (long int)run->mmio.phys_addr - VGA_FB_ADDR, value);
-    }
+    // Without overflows: gpa and length come from the guest
+    if (gpa >= HYPERCALL_ADDR && gpa - HYPERCALL_ADDR <= areas_size && length <= areas_size - (gpa - HYPERCALL_ADDR))
+        return (uint8_t *)hypercall + gpa - HYPERCALL_ADDR;
+
+    if (gpa <= vm->guest_mem_size && length <= vm->guest_mem_size - gpa)
+        return vm->guest_mem + gpa;
+
+    return NULL;
 }
 
-static void check_capability(int kvm, int cap, char *cap_string)
+// Hypercall area of a PV queue
+static hypercall_t *pv_area(int queue)
 {
-    if (!ioctl(kvm, KVM_CHECK_EXTENSION, cap))
+    return (hypercall_t *)((uint8_t *)hypercall + queue * HYPERCALL_AREA_SIZE);
+}
+
+// The guest's doorbell on a polled PV queue signals fd in the kernel, without
+// exiting to the VMM
+static void register_doorbell(vm_t *vm, int queue, int fd)
+{
+    struct kvm_ioeventfd ioeventfd = {
+        .datamatch = HYPERCALL_DOORBELL,
+        .addr = HYPERCALL_QUEUE_PORT(queue),
+        .len = 1,
+        .fd = fd,
+        .flags = KVM_IOEVENTFD_FLAG_PIO | KVM_IOEVENTFD_FLAG_DATAMATCH};
+
+    if (ioctl(vm->vmfd, KVM_IOEVENTFD, &ioeventfd) < 0)
     {
-        errx(1, "VMM: Required extension %s not available", cap_string);
+        err(1, "VMM: KVM_IOEVENTFD");
     }
 }
 
-static vm_t *vm_create(const char *guest_binary)
+// Registers of the vCPU at the current exit. With KVM_CAP_SYNC_REGS they are
+// already in kvm_run, without a KVM_GET_REGS.
+static struct kvm_regs *vcpu_regs(vm_t *vm)
 {
-    vm_t *vm = malloc(sizeof(vm_t));
+    struct kvm_regs *regs = &vm->run->s.regs.regs;
 
-    if (!vm)
+    if (!vm->sync_regs)
     {
-        err(1, NULL);
+        if (ioctl(vm->vcpufd, KVM_GET_REGS, &vm->regs) < 0)
+        {
+            err(1, "VMM: KVM_GET_REGS");
+        }
+
+        regs = &vm->regs;
     }
 
-    memset(vm, 0, sizeof(vm_t));
+    if (exit_log)
+    {
+        exit_log_regs(exit_log, regs, false);
+    }
 
-    char kvm_dev[] = "/dev/kvm";
-    vm->kvmfd = open(kvm_dev, O_RDWR | O_CLOEXEC);
+    return regs;
+}
 
-    if (vm->kvmfd < 0)
+// Segment and control registers of the vCPU at the current exit, see vcpu_regs()
+static struct kvm_sregs *vcpu_sregs(vm_t *vm)
+{
+    if (vm->sync_regs)
+        return &vm->run->s.regs.sregs;
+
+    if (ioctl(vm->vcpufd, KVM_GET_SREGS, &vm->sregs) < 0)
     {
-        err(1, "%s", kvm_dev);
+        err(1, "VMM: KVM_GET_SREGS");
     }
 
-    // Make sure we have the right version of the API
-    int version = ioctl(vm->kvmfd, KVM_GET_API_VERSION, NULL);
+    return &vm->sregs;
+}
 
-    if (version < 0)
+// Makes the vCPU resume with the registers changed through vcpu_regs(). With
+// KVM_CAP_SYNC_REGS, KVM_RUN loads them itself.
+static void vcpu_regs_changed(vm_t *vm)
+{
+    if (exit_log)
     {
-        err(1, "VMM: KVM_GET_API_VERSION");
+        exit_log_regs(exit_log, vm->sync_regs ? &vm->run->s.regs.regs : &vm->regs, true);
     }
 
-    if (version != KVM_API_VERSION)
+    if (vm->sync_regs)
     {
-        err(1, "VMM: KVM_GET_API_VERSION %d, expected %d", version, KVM_API_VERSION);
+        vm->run->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+        return;
     }
 
-    vm->vmfd = ioctl(vm->kvmfd, KVM_CREATE_VM, 0);
-
-    if (vm->vmfd < 0)
+    if (ioctl(vm->vcpufd, KVM_SET_REGS, &vm->regs) < 0)
     {
-        err(1, "VMM: KVM_CREATE_VM");
+        err(1, "VMM: KVM_SET_REGS");
     }
+}
 
-    // Make sure we can manage guest physical memory slots
-    check_capability(vm->kvmfd, KVM_CAP_USER_MEMORY, "KVM_CAP_USER_MEMORY");
-
-    // Open the guest binary and find its size in bytes
-    FILE *fp = fopen(guest_binary, "rb");
-
-    fseek(fp, 0L, SEEK_END);
-    int guest_binary_size = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
+// KVM only logs the guest's writes to its memory: snapshots must know about
+// those of the device models too
+static void mark_guest_write(vm_t *vm, uint64_t gpa, uint64_t length)
+{
+    uint8_t *mem = snapshot || vm->dirty_log ? guest_memory(vm, gpa, length) : NULL;
 
-    // copy file content to local buffer
-    unsigned char *binary = (unsigned char *)malloc(guest_binary_size * sizeof(unsigned char));
-    if (fread(binary, sizeof(unsigned char), guest_binary_size, fp) == 0)
+    if (mem && snapshot)
     {
-        err(1, "VMM: reading guest binary");
+        snapshot_mark_dirty(snapshot, mem, length);
     }
 
-    fclose(fp);
-
-    // Allocate 256KB of RAM for the guest
-    vm->guest_mem_size = 4096 * 64;
-    vm->guest_mem = mmap(NULL, vm->guest_mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-
-    if (!vm->guest_mem)
+    if (mem && vm->dirty_log)
     {
-        err(1, "VMM: allocating guest memory");
+        dirty_log_mark(vm->dirty_log, mem, length);
     }
+}
 
-    memcpy(vm->guest_mem, binary, guest_binary_size);
-    free(binary);
+// xorshift64*
+static uint64_t next_random(iterations_t *it)
+{
+    it->rng ^= it->rng >> 12;
+    it->rng ^= it->rng << 25;
+    it->rng ^= it->rng >> 27;
+    return it->rng * 0x2545F4914F6CDD1DULL;
+}
 
-    // Map guest_mem to physical address 0 in the guest address space
-    struct kvm_userspace_memory_region mem_region = {
-        .slot = 0,
-        .guest_phys_addr = 0,
-        .memory_size = vm->guest_mem_size,
-        .userspace_addr = (uint64_t)vm->guest_mem,
-        .flags = KVM_MEM_LOG_DIRTY_PAGES};
+// Input of the next iteration: each -inputs file as it is, then random ones of
+// them with a few bytes or their length changed. Random bytes without -inputs.
+static void next_input(iterations_t *it)
+{
+    uint32_t size = it->buffer_size;
 
-    if (ioctl(vm->vmfd, KVM_SET_USER_MEMORY_REGION, &mem_region) < 0)
+    if (!it->corpus_size)
     {
-        err(1, "VMM: KVM_SET_USER_MEMORY_REGION");
+        it->input_length = next_random(it) % (size + 1);
+        for (uint32_t i = 0; i < it->input_length; i++)
+            it->input[i] = (uint8_t)next_random(it);
+        return;
     }
 
-    // Create a frame buffer for the guest
-    fb_size = VGA_XRES * VGA_YRES * sizeof(uint16_t);
-    fb = mmap(NULL, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    bool as_is = it->done < (uint64_t)it->corpus_size;
+    int index = as_is ? (int)it->done : (int)(next_random(it) % it->corpus_size);
+    uint32_t length = it->corpus_lengths[index] < size ? it->corpus_lengths[index] : size;
+    memcpy(it->input, it->corpus[index], length);
 
-    if (!fb)
+    for (int mutations = as_is ? 0 : 1 + next_random(it) % 4; mutations > 0; mutations--)
     {
-        err(1, "VMM: allocating frame buffer");
+        uint64_t r = next_random(it);
+        uint32_t at = length ? (r >> 8) % length : 0;
+
+        switch (r % 3)
+        {
+        case 0: // flip a bit
+            if (length)
+                it->input[at] ^= 1 << (r >> 40) % 8;
+            break;
+        case 1: // random byte
+            if (length)
+                it->input[at] = (uint8_t)(r >> 40);
+            break;
+        case 2: // up to 64 bytes more or less, padded with random bytes
+        {
+            int64_t delta = (int64_t)((r >> 8) % 129) - 64;
+            uint32_t new_length = (int64_t)length + delta < 0 ? 0 : length + delta;
+            new_length = new_length > size ? size : new_length;
+            for (uint32_t i = length; i < new_length; i++)
+                it->input[i] = (uint8_t)next_random(it);
+            length = new_length;
+            break;
+        }
+        }
     }
 
-    memset(fb, 0, fb_size);
-    printf("local frame buffer created\n");
+    it->input_length = length;
+}
+
+static void save_crash(iterations_t *it, const char *reason)
+{
+    printf("iteration %lu: the guest crashed (%s)\n", it->done, reason);
 
-    // Map framebuffer to physical address VBA_FB_ADDR in the guest address space
-    struct kvm_userspace_memory_region fb_mem_region = {
-        .slot = 1,
-        .guest_phys_addr = VGA_FB_ADDR,
-        .memory_size = 4096,
-        .userspace_addr = (uint64_t)fb,
-        .flags = 0};
+    if (!it->crash_dir)
+        return;
 
-    if (ioctl(vm->vmfd, KVM_SET_USER_MEMORY_REGION, &fb_mem_region) < 0)
+    char *path;
+    if (asprintf(&path, "%s/crash-%lu", it->crash_dir, it->done) < 0)
     {
-        err(1, "VMM: KVM_SET_USER_MEMORY_REGION");
+        err(1, NULL);
     }
 
-    // Create an hypercall buffer for the guest
-    hypercall = mmap(NULL, sizeof(hypercall_t *), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    FILE *fp = fopen(path, "wb");
 
-    if (!hypercall)
+    if (!fp || (it->input_length && fwrite(it->input, it->input_length, 1, fp) != 1))
     {
-        err(1, "VMM: allocating hypercall");
+        warn("VMM: saving the input of a crash to %s", path);
     }
 
-    printf("hypercall buffer created\n");
+    if (fp)
+        fclose(fp);
+    free(path);
+}
 
-    // Map framebuffer to physical address VBA_FB_ADDR in the guest address space
-    struct kvm_userspace_memory_region hypercall_mem_region = {
-        .slot = 2,
-        .guest_phys_addr = HYPERCALL_ADDR,
-        .memory_size = 4096,
-        .userspace_addr = (uint64_t)hypercall,
-        .flags = KVM_MEM_LOG_DIRTY_PAGES};
+static void save_device_state(device_state_t *state)
+{
+    memset(state, 0, sizeof(device_state_t));
 
-    if (ioctl(vm->vmfd, KVM_SET_USER_MEMORY_REGION, &hypercall_mem_region) < 0)
+    for (int i = 0; i < IDE_CHANNELS; i++)
     {
-        err(1, "VMM: KVM_SET_USER_MEMORY_REGION");
+        if (ide_channels[i])
+            ide_save_state(ide_channels[i], &state->ide[i]);
     }
 
-    // Create the vCPU
-    vm->vcpufd = ioctl(vm->vmfd, KVM_CREATE_VCPU, 0);
-    if (vm->vcpufd < 0)
-    {
-        err(1, "VMM: KVM_CREATE_VCPU");
-    }
+    if (serial)
+        serial_save_state(serial, &state->serial);
+    ps2_save_state(ps2, &state->ps2);
+}
 
-    // Setup memory for the vCPU
-    vm->vcpu_mmap_size = ioctl(vm->kvmfd, KVM_GET_VCPU_MMAP_SIZE, NULL);
-    if (vm->vcpu_mmap_size < 0)
+static void restore_device_state(const device_state_t *state)
+{
+    for (int i = 0; i < IDE_CHANNELS; i++)
     {
-        err(1, "VMM: KVM_GET_VCPU_MMAP_SIZE");
+        if (ide_channels[i])
+            ide_restore_state(ide_channels[i], &state->ide[i]);
     }
 
-    if (vm->vcpu_mmap_size < (int)sizeof(struct kvm_run))
+    if (serial)
+        serial_restore_state(serial, &state->serial);
+    ps2_restore_state(ps2, &state->ps2);
+}
+
+// Resets the VM to the snapshot, with the next input in the guest's buffer
+static void start_iteration(void)
+{
+    next_input(iterations);
+    snapshot->state.regs.rax = iterations->input_length;
+    snapshot_restore(snapshot);
+
+    restore_device_state(&iterations->devices);
+
+    for (int i = 0; i < nr_drives; i++)
     {
-        err(1, "VMM: KVM_GET_VCPU_MMAP_SIZE unexpectedly small");
+        scratch_disk_reset(drives[i].disk);
     }
 
-    vm->run = mmap(NULL, (size_t)vm->vcpu_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vm->vcpufd, 0);
+    memcpy(iterations->buffer, iterations->input, iterations->input_length);
+    snapshot_mark_dirty(snapshot, iterations->buffer, iterations->input_length);
+}
 
-    if (!vm->run)
+// The guest memory snapshots have: RAM, the hypercall areas, the frame buffer
+// and boot area
+static void add_snapshot_regions(vm_t *vm)
+{
+    uint64_t low_ram = vm->guest_mem_size < LOW_RAM_END ? vm->guest_mem_size : LOW_RAM_END;
+    snapshot_add_region(snapshot, 0, vm->guest_mem, low_ram);
+    snapshot_add_region(snapshot, 2, (uint8_t *)hypercall, HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE);
+    snapshot_add_region(snapshot, -1, fb, 4096);
+
+    if (vm->guest_mem_size > HIGH_RAM_START)
     {
-        err(1, "VMM: mmap vcpu");
+        snapshot_add_region(snapshot, 5, vm->guest_mem + HIGH_RAM_START, vm->guest_mem_size - HIGH_RAM_START);
     }
 
-    // Initialize CS to point to 0
-    struct kvm_sregs sregs;
-    if (ioctl(vm->vcpufd, KVM_GET_SREGS, &sregs) < 0)
+    if (vm->boot_area)
     {
-        err(1, "VMM: KVM_GET_SREGS");
+        snapshot_add_region(snapshot, -1, vm->boot_area, BOOT_AREA_SIZE);
     }
+}
 
-    sregs.cs.base = 0;
-    sregs.cs.selector = 0;
+// The guest asked for the snapshot: its RAM, the hypercall areas, the frame
+// buffer and boot area, and the state of the vCPU and of the devices
+static void take_snapshot(vm_t *vm, uint32_t gpa, uint32_t size)
+{
+    iterations->buffer = guest_memory(vm, gpa, size);
 
-    if (ioctl(vm->vcpufd, KVM_SET_SREGS, &sregs) < 0)
+    if (!iterations->buffer || !size)
     {
-        err(1, "VMM: KVM_SET_SREGS");
+        errx(1, "VMM: the guest's input buffer at 0x%x (%u bytes) isn't in its memory", gpa, size);
     }
 
-    // Initialize instruction pointer and flags register
-    struct kvm_regs regs;
-    memset(&regs, 0, sizeof(regs));
-    regs.rsp = vm->guest_mem_size; // set stack pointer at the top of the guest's RAM
-    regs.rip = 0;
-    regs.rflags = 0x2; // bit 1 is reserved and should always bet set to 1
+    iterations->buffer_size = size;
+    iterations->input = malloc(size);
 
-    if (ioctl(vm->vcpufd, KVM_SET_REGS, &regs) < 0)
-    {
-        err(1, "VMM: KVM_SET_REGS");
-    }
+    snapshot = create_snapshot(vm->vmfd, vm->vcpufd, vm->run);
+    add_snapshot_regions(vm);
+    snapshot_take(snapshot);
 
-    return vm;
+    save_device_state(&iterations->devices);
+
+    printf("snapshot: %lu iterations with inputs of up to %u bytes\n", iterations->count, size);
+    iterations->start_ns = now_ns();
+    start_iteration();
 }
 
-static void vm_run(vm_t *vm)
+// The fork server's guest is ready to be cloned: only the state of the vCPU
+// and of the in-kernel devices is kept, the clones get the memory and the
+// device models with fork()
+static void reach_ready_point(vm_t *vm)
 {
-    // Runs the VM (guest code) and handles VM exits
-    while (1)
-    {
-        // Runs the vCPU until encoutering a VM_EXIT
-        if (ioctl(vm->vcpufd, KVM_RUN, NULL) < 0)
-        {
-            err(1, "VMM: KVM_RUN");
-        }
-
-        switch (vm->run->exit_reason)
-        {
-        case KVM_EXIT_IO: // encountered an I/O instruction
-            handle_pmio(vm);
-            break;
-        case KVM_EXIT_MMIO: // encountered a MMIO instruction which could not be satisfied
-            handle_mmio(vm);
-            break;
-        case KVM_EXIT_HLT: // encountered "hlt" instruction
-            fprintf(stderr, "VMM: KVM_EXIT_HLT\n");
-            return;
-        case KVM_EXIT_FAIL_ENTRY:
-            fprintf(stderr, "VMM: KVM_EXIT_FAIL_ENTRY: hardware_entry_failure_reason = 0x%llx\n",
-                    (unsigned long long)vm->run->fail_entry.hardware_entry_failure_reason);
-            break;
-        case KVM_EXIT_INTERNAL_ERROR:
-            fprintf(stderr, "VMM: KVM_EXIT_INTERNAL_ERROR: suberror = 0x%x\n", vm->run->internal.suberror);
-            return;
-        case KVM_EXIT_SHUTDOWN:
-            fprintf(stderr, "VMM: KVM_EXIT_SHUTDOWN\n");
-            return;
-        default:
-            fprintf(stderr, "VMM: unhandled exit reason (0x%x)\n", vm->run->exit_reason);
-            return;
-        }
-    }
+    snapshot = create_snapshot(vm->vmfd, vm->vcpufd, vm->run);
+    snapshot_take(snapshot);
+    fork_server->at_ready_point = true;
 }
 
-static void vm_destroy(vm_t *vm)
+// Ends the iteration, crash saying why if the guest crashed, and starts the
+// next one. Returns false when there is none: the VM stops.
+static bool end_iteration(const char *crash)
 {
-    if (vm->guest_mem)
+    if (!iterations || !snapshot)
+        return false;
+
+    iterations->ended = false;
+
+    if (crash)
     {
-        munmap(vm->guest_mem, vm->guest_mem_size);
+        iterations->crashes++;
+        save_crash(iterations, crash);
     }
 
-    if (vm->run)
+    if (++iterations->done < iterations->count)
     {
-        munmap(vm->run, vm->vcpu_mmap_size);
+        start_iteration();
+        return true;
     }
 
-    close(vm->kvmfd);
-    memset(vm, 0, sizeof(vm_t));
-    free(vm);
+    double seconds = (now_ns() - iterations->start_ns) / 1e9;
+    printf("iterations: %lu in %.3f s (%.0f per second), %lu crashes, %lu failures\n", iterations->done, seconds,
+           iterations->done / seconds, iterations->crashes, iterations->failures);
+    return false;
 }
 
-void *t_vm_run(void *p)
+// Periodic checkpoint, see -checkpoint
+static void take_checkpoint(vm_t *vm)
 {
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+    device_state_t devices;
+    save_device_state(&devices);
+    checkpoint_take(checkpoints, vm->vmfd, vm->vcpufd, &devices);
+}
 
-    vm_t *vm = (vm_t *)p;
-    vm_run(vm);
+// Last pass of -migrate, with the vCPU paused: the destination shares the
+// disks, what the guest wrote must be on them before it takes over
+static void finish_migration(vm_t *vm)
+{
+    for (int i = 0; i < nr_drives; i++)
+    {
+        if (drives[i].disk && disk_flush(drives[i].disk) < 0)
+        {
+            err(1, "VMM: flushing %s", drives[i].config.path);
+        }
+    }
 
-    return (void *)0;
+    device_state_t devices;
+    save_device_state(&devices);
+    migration_complete(migration, vm->vmfd, vm->vcpufd, &devices);
 }
 
-char *find_guess_binary(int argc, char **argv)
+// See SNAPSHOT_PORT
+static void handle_snapshot_hypercall(vm_t *vm)
 {
-    for (int i = 1; i < argc - 1; i++)
+    if (vm->run->io.direction != KVM_EXIT_IO_OUT || vm->run->io.size != 4)
+        return;
+
+    struct kvm_regs *regs = vcpu_regs(vm);
+
+    switch (regs->rax)
+    {
+    case SNAPSHOT_TAKE:
     {
-        if (strcmp(argv[i], "-guest") == 0)
+        uint32_t gpa = regs->rbx;
+        uint32_t size = regs->rcx;
+
+        // Without -iterations the guest runs once, with an empty input
+        regs->rax = 0;
+        vcpu_regs_changed(vm);
+
+        if (iterations && !snapshot)
+            take_snapshot(vm, gpa, size);
+        else if (fork_server && !snapshot)
+            reach_ready_point(vm);
+        break;
+    }
+    case SNAPSHOT_DONE:
+        if (iterations && snapshot)
         {
-            return argv[i + 1];
+            iterations->failures += regs->rbx != 0;
+            iterations->ended = true;
         }
+        break;
     }
-
-    return NULL;
 }
 
-int main(int argc, char **argv)
+// See HYPERCALL_REG_PORT
+static void handle_reg_hypercall(vm_t *vm)
 {
-    machine = create_ide_state_machine(argv[4]);
-    hypercall_host = create_hypercall_host(argv[4]);
+    if (vm->run->io.direction != KVM_EXIT_IO_OUT || vm->run->io.size != 4)
+        return;
 
-    char *guest_binary = find_guess_binary(argc, argv);
+    struct kvm_regs *regs = vcpu_regs(vm);
+    uint32_t queue = HYPERCALL_REG_QUEUE(regs->rax);
+    int result = -1;
 
-    if (!guest_binary)
+    if (queue < HYPERCALL_MAX_QUEUES && pv_queues[queue])
     {
-        printf("usage: %s -guest <guest_binary>\n", argv[0]);
-        return EXIT_FAILURE;
+        if (HYPERCALL_REG_OPCODE(regs->rax) == HYPERCALL_READ)
+        {
+            mark_guest_write(vm, regs->rdx, (uint64_t)(uint32_t)regs->rcx * SECTOR_SIZE);
+        }
+
+        result = hypercall_host_reg_request(pv_queues[queue], HYPERCALL_REG_OPCODE(regs->rax), regs->rbx, regs->rcx,
+                                            regs->rdx);
     }
 
-    pthread_t tid;
-    void *status;
+    regs->rax = (uint32_t)result;
+    vcpu_regs_changed(vm);
+}
 
-    window = gfx_create(guest_binary, VGA_XRES * FONT_WIDTH, VGA_YRES * FONT_HEIGHT);
+// See SERIAL_PV_PORT
+static void handle_serial_hypercall(vm_t *vm)
+{
+    if (vm->run->io.direction != KVM_EXIT_IO_OUT || vm->run->io.size != 4)
+        return;
+
+    struct kvm_regs *regs = vcpu_regs(vm);
+    regs->rax = (uint32_t)serial_pv_write(serial, regs->rbx, regs->rcx);
+    vcpu_regs_changed(vm);
+}
+
+static device_t handle_pmio(vm_t *vm)
+{
+    struct kvm_run *run = vm->run;
 
-    if (!window)
+    if (ps2_owns_port(run->io.port))
     {
-        perror("gfx_create failed");
-        return EXIT_FAILURE;
+        ps2_handle_io(ps2, run);
+        return DEVICE_PS2;
     }
 
-    printf("sdl2 window created with width %d and height %d\n", window->width, window->height);
+    if (serial && serial_owns_port(run->io.port))
+    {
+        serial_handle_io(serial, run);
+        return DEVICE_SERIAL;
+    }
 
-    vm_t *vm = vm_create(guest_binary);
+    if (serial && run->io.port == SERIAL_PV_PORT)
+    {
+        handle_serial_hypercall(vm);
+        return DEVICE_SERIAL_PV;
+    }
 
-    if (pthread_create(&tid, NULL, t_vm_run, (void *)vm) != 0)
+    if (run->io.port == HYPERCALL_REG_PORT)
     {
-        perror("pthread_create failed");
-        return EXIT_FAILURE;
+        handle_reg_hypercall(vm);
+        return DEVICE_REG_HYPERCALL;
     }
 
-    printf("vm_run started\n");
+    if (run->io.port == SNAPSHOT_PORT)
+    {
+        handle_snapshot_hypercall(vm);
+        return DEVICE_SNAPSHOT;
+    }
 
-    bool looping = true;
-    while (looping)
+    for (int i = 0; i < HYPERCALL_MAX_QUEUES; i++)
     {
-        gfx_present(window);
-        SDL_KeyCode keypressed = gfx_keypressed();
+        if (pv_queues[i] && run->io.port == pv_queues[i]->port)
+        {
+            hypercall_t *area = pv_area(i);
+            pv_queues[i]->next(pv_queues[i], area, run);
+
+            // The request's status, and the buffer of a zero-copy read
+            mark_guest_write(vm, HYPERCALL_QUEUE_ADDR(i), HYPERCALL_AREA_SIZE);
+            if (*((uint8_t *)run + run->io.data_offset) == HYPERCALL_READ)
+            {
+                mark_guest_write(vm, area->gpa, (uint64_t)(uint32_t)area->sector_count * SECTOR_SIZE);
+            }
+            return DEVICE_PV_QUEUE;
+        }
+    }
 
-        switch (keypressed)
+    for (int i = 0; i < IDE_CHANNELS; i++)
+    {
+        if (ide_channels[i] && ide_owns_port(ide_channels[i], run->io.port))
         {
-        case SDLK_ESCAPE:
-            printf("escape was pressed\n");
-            looping = false;
+            ide_channels[i]->next(ide_channels[i], run);
+            return DEVICE_IDE;
+        }
+    }
+
+    // No device owns the port: the IDE channels abort whatever command they were in
+    for (int i = 0; i < IDE_CHANNELS; i++)
+    {
+        if (ide_channels[i])
+        {
+            ide_channels[i]->next(ide_channels[i], run);
+        }
+    }
+
+    return DEVICE_NONE;
+}
+
+static device_t handle_mmio(vm_t *vm)
+{
+    struct kvm_run *run = vm->run;
+    // Guest wrote to an MMIO address (i.e. a memory slot marked as read-only)
+    if (run->mmio.is_write)
+    {
+        uint32_t value;
+
+        switch (run->mmio.len)
+        {
+        case 1:
+            value = *((uint8_t *)run->mmio.data);
             break;
-        default:
+        case 2:
+            value = *((uint16_t *)run->mmio.data);
+            break;
+        case 4:
+            value = *((uint32_t *)run->mmio.data);
             break;
+        default:
+            fprintf(stderr, "VMM: Unsupported size in KVM_EXIT_MMIO\n");
+            value = 0;
+        }
+
+        printf("VMM: MMIO guest write: len=%d addr=%ld value=%d\n", run->mmio.len, (long int)run->mmio.phys_addr - VGA_FB_ADDR, value);
+    }
+
+    return DEVICE_MMIO;
+}
+
+static device_t handle_device_exit(vm_t *vm)
+{
+    return vm->run->exit_reason == KVM_EXIT_IO ? handle_pmio(vm) : handle_mmio(vm);
+}
+
+// Records what changed in a page of guest memory since the exit log last had it
+static void log_page(uint64_t gpa, uint8_t *mem, uint8_t *shadow)
+{
+    int first = 0;
+    int last = GUEST_PAGE_SIZE;
+
+    while (first < GUEST_PAGE_SIZE && mem[first] == shadow[first])
+        first++;
+
+    if (first == GUEST_PAGE_SIZE)
+        return;
+
+    while (mem[last - 1] == shadow[last - 1])
+        last--;
+
+    memcpy(shadow + first, mem + first, last - first);
+    exit_log_memory(exit_log, gpa + first, mem + first, last - first);
+}
+
+// Records the guest memory the device models can read, RAM and the hypercall
+// areas: all of it at first, then what changed in the pages the guest wrote to
+// since the previous call. Called with the exit log's lock held.
+static void log_guest_memory(vm_t *vm, bool dirty_only)
+{
+    uint64_t low_ram = vm->guest_mem_size < LOW_RAM_END ? vm->guest_mem_size : LOW_RAM_END;
+    uint64_t high_ram = vm->guest_mem_size > HIGH_RAM_START ? vm->guest_mem_size - HIGH_RAM_START : 0;
+
+    const struct
+    {
+        uint32_t slot;
+        uint64_t gpa;
+        uint64_t size;
+        uint8_t *mem;
+        uint8_t *shadow;
+    } regions[] = {
+        {0, 0, low_ram, vm->guest_mem, vm->shadow_mem},
+        {2, HYPERCALL_ADDR, HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE, (uint8_t *)hypercall,
+         vm->shadow_mem + vm->guest_mem_size},
+        {5, HIGH_RAM_START, high_ram, vm->guest_mem + HIGH_RAM_START, vm->shadow_mem + HIGH_RAM_START},
+    };
+
+    for (unsigned i = 0; i < sizeof(regions) / sizeof(regions[0]); i++)
+    {
+        uint64_t pages = regions[i].size / GUEST_PAGE_SIZE;
+
+        if (!pages)
+            continue;
+
+        if (!dirty_only)
+        {
+            for (uint64_t page = 0; page < pages; page++)
+            {
+                uint64_t offset = page * GUEST_PAGE_SIZE;
+                log_page(regions[i].gpa + offset, regions[i].mem + offset, regions[i].shadow + offset);
+            }
+            continue;
+        }
+
+        struct kvm_dirty_log dirty_log = {.slot = regions[i].slot, .dirty_bitmap = vm->dirty_bitmap};
+
+        if (ioctl(vm->vmfd, KVM_GET_DIRTY_LOG, &dirty_log) < 0)
+        {
+            err(1, "VMM: KVM_GET_DIRTY_LOG");
+        }
+
+        for (uint64_t word = 0; word < (pages + 63) / 64; word++)
+        {
+            for (uint64_t bits = vm->dirty_bitmap[word]; bits; bits &= bits - 1)
+            {
+                uint64_t offset = (word * 64 + __builtin_ctzll(bits)) * GUEST_PAGE_SIZE;
+                log_page(regions[i].gpa + offset, regions[i].mem + offset, regions[i].shadow + offset);
+            }
+        }
+    }
+}
+
+// Handles an I/O or MMIO exit. When recording, the exit goes to the log with
+// the guest memory written since the previous one, which the device model may
+// read. When profiling, it is counted with the guest's stack.
+static void handle_exit(vm_t *vm)
+{
+    device_t device;
+
+    if (exit_log)
+    {
+        // The display loop cancels this thread, not in the middle of a record
+        int cancel_state;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+        exit_log_lock(exit_log);
+
+        log_guest_memory(vm, true);
+        exit_log_begin(exit_log, vm->run);
+        device = handle_device_exit(vm);
+        exit_log_end(exit_log, vm->run);
+
+        exit_log_unlock(exit_log);
+        pthread_setcancelstate(cancel_state, NULL);
+    }
+    else
+    {
+        device = handle_device_exit(vm);
+    }
+
+    if (profiler)
+    {
+        profile_exit(profiler, vcpu_regs(vm), vcpu_sregs(vm), device_names[device]);
+    }
+}
+
+// Key event for the guest's keyboard, recorded in order with the exits
+static void send_key(SDL_Scancode scancode, bool pressed)
+{
+    if (!exit_log)
+    {
+        ps2_key_event(ps2, scancode, pressed);
+        return;
+    }
+
+    exit_log_lock(exit_log);
+    ps2_key_event(ps2, scancode, pressed);
+    exit_log_key(exit_log, scancode, pressed);
+    exit_log_unlock(exit_log);
+}
+
+static void check_capability(int kvm, int cap, char *cap_string)
+{
+    if (!ioctl(kvm, KVM_CHECK_EXTENSION, cap))
+    {
+        errx(1, "VMM: Required extension %s not available", cap_string);
+    }
+}
+
+// Shared memory backed by a memfd, which can be passed to other processes.
+// It can't shrink: they would get SIGBUS on what they mapped.
+static void *alloc_shared_mem(const char *name, size_t size, int *fd)
+{
+    *fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (*fd < 0 || ftruncate(*fd, size) < 0 || fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+    {
+        err(1, "VMM: memfd %s", name);
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+
+    if (mem == MAP_FAILED)
+    {
+        err(1, "VMM: mapping %s", name);
+    }
+
+    return mem;
+}
+
+static void set_memory_slot(vm_t *vm, uint32_t slot, uint64_t gpa, uint64_t size, void *mem, uint32_t flags)
+{
+    struct kvm_userspace_memory_region region = {
+        .slot = slot,
+        .guest_phys_addr = gpa,
+        .memory_size = size,
+        .userspace_addr = (uint64_t)mem,
+        .flags = flags};
+
+    if (ioctl(vm->vmfd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
+    {
+        err(1, "VMM: KVM_SET_USER_MEMORY_REGION");
+    }
+}
+
+// The KVM VM running the memory vm_create allocated, and its vCPU. Fork-server
+// clones create theirs again: a KVM VM only works in the process that created it.
+static void vm_create_kvm(vm_t *vm, const cpu_model_t *cpu, bool *gb_pages)
+{
+    vm->vmfd = ioctl(vm->kvmfd, KVM_CREATE_VM, 0);
+
+    if (vm->vmfd < 0)
+    {
+        err(1, "VMM: KVM_CREATE_VM");
+    }
+
+    // Make sure we can manage guest physical memory slots
+    check_capability(vm->kvmfd, KVM_CAP_USER_MEMORY, "KVM_CAP_USER_MEMORY");
+
+    // Map guest_mem to physical address 0 in the guest address space, around
+    // the device area below 1 MB: guest physical addresses are offsets in guest_mem
+    uint64_t low_ram = vm->guest_mem_size < LOW_RAM_END ? vm->guest_mem_size : LOW_RAM_END;
+    set_memory_slot(vm, 0, 0, low_ram, vm->guest_mem, KVM_MEM_LOG_DIRTY_PAGES);
+
+    if (vm->guest_mem_size > HIGH_RAM_START)
+    {
+        set_memory_slot(vm, 5, HIGH_RAM_START, vm->guest_mem_size - HIGH_RAM_START, vm->guest_mem + HIGH_RAM_START,
+                        KVM_MEM_LOG_DIRTY_PAGES);
+    }
+
+    // The frame buffer at VGA_FB_ADDR, the hypercall areas of all the PV
+    // queues at HYPERCALL_ADDR
+    set_memory_slot(vm, 1, VGA_FB_ADDR, 4096, fb, 0);
+    set_memory_slot(vm, 2, HYPERCALL_ADDR, HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE, hypercall,
+                    KVM_MEM_LOG_DIRTY_PAGES);
+    set_memory_slot(vm, 3, PVCLOCK_ADDR, 4096, vm->pvclock, 0);
+
+    if (vm->boot_area)
+    {
+        set_memory_slot(vm, 4, BOOT_AREA_ADDR, BOOT_AREA_SIZE, vm->boot_area, 0);
+    }
+
+    // In-kernel PIC/IOAPIC/LAPIC and PIT: timer interrupts are generated and
+    // delivered by KVM without ever exiting to the VMM.
+    // The irqchip must exist before the vCPU is created.
+    check_capability(vm->kvmfd, KVM_CAP_IRQCHIP, "KVM_CAP_IRQCHIP");
+    check_capability(vm->kvmfd, KVM_CAP_PIT2, "KVM_CAP_PIT2");
+
+    if (ioctl(vm->vmfd, KVM_CREATE_IRQCHIP, 0) < 0)
+    {
+        err(1, "VMM: KVM_CREATE_IRQCHIP");
+    }
+
+    struct kvm_pit_config pit_config = {.flags = KVM_PIT_SPEAKER_DUMMY};
+
+    if (ioctl(vm->vmfd, KVM_CREATE_PIT2, &pit_config) < 0)
+    {
+        err(1, "VMM: KVM_CREATE_PIT2");
+    }
+
+    // Checkpoints and migrations get the pages the guest writes from the
+    // vCPU's dirty ring, which must be enabled before the vCPU is created
+    bool dirty_log = checkpoints || migration;
+    uint32_t ring_entries = dirty_log && dirty_ring ? dirty_ring_enable(vm->vmfd, DIRTY_RING_ENTRIES) : 0;
+
+    // Create the vCPU
+    vm->vcpufd = ioctl(vm->vmfd, KVM_CREATE_VCPU, 0);
+    if (vm->vcpufd < 0)
+    {
+        err(1, "VMM: KVM_CREATE_VCPU");
+    }
+
+    if (dirty_log)
+    {
+        vm->dirty_log = create_dirty_log(vm->vmfd, vm->vcpufd, ring_entries);
+        dirty_log_add_slot(vm->dirty_log, 0, 0, vm->guest_mem, low_ram);
+        dirty_log_add_slot(vm->dirty_log, 2, HYPERCALL_ADDR, (uint8_t *)hypercall,
+                           HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE);
+
+        if (vm->guest_mem_size > HIGH_RAM_START)
+        {
+            dirty_log_add_slot(vm->dirty_log, 5, HIGH_RAM_START, vm->guest_mem + HIGH_RAM_START,
+                               vm->guest_mem_size - HIGH_RAM_START);
+        }
+    }
+
+    // Setup memory for the vCPU
+    vm->vcpu_mmap_size = ioctl(vm->kvmfd, KVM_GET_VCPU_MMAP_SIZE, NULL);
+    if (vm->vcpu_mmap_size < 0)
+    {
+        err(1, "VMM: KVM_GET_VCPU_MMAP_SIZE");
+    }
+
+    if (vm->vcpu_mmap_size < (int)sizeof(struct kvm_run))
+    {
+        err(1, "VMM: KVM_GET_VCPU_MMAP_SIZE unexpectedly small");
+    }
+
+    vm->run = mmap(NULL, (size_t)vm->vcpu_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, vm->vcpufd, 0);
+
+    if (!vm->run)
+    {
+        err(1, "VMM: mmap vcpu");
+    }
+
+    // Have KVM put the registers in kvm_run on every exit, see vcpu_regs()
+    int sync_regs = ioctl(vm->kvmfd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+
+    if (sync_regs > 0 && (sync_regs & (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS)) == (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS))
+    {
+        vm->run->kvm_valid_regs = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS;
+        vm->sync_regs = true;
+    }
+
+    // Long mode needs CPUID, and the guest's entry code enables the vector
+    // units it reports
+    set_cpu_model(vm->kvmfd, vm->vcpufd, cpu, gb_pages);
+}
+
+// A VM without a guest yet: its memory, KVM VM and vCPU, ready to start in
+// boot_mode once vm_load_guest() put a guest in
+static vm_t *vm_alloc(boot_mode_t boot_mode, uint64_t mem_size, const cpu_model_t *cpu)
+{
+    vm_t *vm = malloc(sizeof(vm_t));
+
+    if (!vm)
+    {
+        err(1, NULL);
+    }
+
+    memset(vm, 0, sizeof(vm_t));
+    vm->boot_mode = boot_mode;
+
+    char kvm_dev[] = "/dev/kvm";
+    vm->kvmfd = open(kvm_dev, O_RDWR | O_CLOEXEC);
+
+    if (vm->kvmfd < 0)
+    {
+        err(1, "%s", kvm_dev);
+    }
+
+    // Make sure we have the right version of the API
+    int version = ioctl(vm->kvmfd, KVM_GET_API_VERSION, NULL);
+
+    if (version < 0)
+    {
+        err(1, "VMM: KVM_GET_API_VERSION");
+    }
+
+    if (version != KVM_API_VERSION)
+    {
+        err(1, "VMM: KVM_GET_API_VERSION %d, expected %d", version, KVM_API_VERSION);
+    }
+
+    if (mem_size > LOW_RAM_END && mem_size <= HIGH_RAM_START)
+    {
+        errx(1, "VMM: RAM must be at most %d KB, or more than %d KB", LOW_RAM_END / 1024, HIGH_RAM_START / 1024);
+    }
+
+    // Allocate the guest's RAM (256KB by default)
+    vm->guest_mem_size = mem_size;
+    vm->guest_mem = alloc_shared_mem("guest-ram", vm->guest_mem_size, &vm->guest_memfd);
+
+    printf("guest RAM: %lu KB\n", mem_size / 1024);
+
+    // Create a frame buffer for the guest. Like the rest of its memory, in a
+    // memfd: fork-server clones map it copy-on-write.
+    fb_size = VGA_XRES * VGA_YRES * sizeof(uint16_t);
+    fb = alloc_shared_mem("frame-buffer", fb_size, &fb_fd);
+    printf("local frame buffer created\n");
+
+    // Create the hypercall areas of all the PV queues for the guest
+    hypercall = alloc_shared_mem("hypercall", HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE, &hypercall_fd);
+
+    printf("hypercall buffer created\n");
+
+    // Create the page KVM keeps the guest's paravirtual clock in
+    vm->pvclock = alloc_shared_mem("pvclock", 4096, &vm->pvclock_fd);
+
+    if (boot_mode != BOOT_REAL)
+    {
+        vm->boot_area = alloc_shared_mem("boot-area", BOOT_AREA_SIZE, &vm->boot_area_fd);
+    }
+
+    bool gb_pages;
+    vm_create_kvm(vm, cpu, &gb_pages);
+
+    struct kvm_sregs sregs;
+    if (ioctl(vm->vcpufd, KVM_GET_SREGS, &sregs) < 0)
+    {
+        err(1, "VMM: KVM_GET_SREGS");
+    }
+
+    if (boot_mode == BOOT_REAL)
+    {
+        // Initialize CS to point to 0
+        sregs.cs.base = 0;
+        sregs.cs.selector = 0;
+    }
+    else
+    {
+        // Start right where the guest's trampoline would have gone
+        setup_boot_area(vm->boot_area, boot_mode, mem_size, gb_pages);
+        set_boot_sregs(&sregs, boot_mode);
+    }
+
+    if (ioctl(vm->vcpufd, KVM_SET_SREGS, &sregs) < 0)
+    {
+        err(1, "VMM: KVM_SET_SREGS");
+    }
+
+    // Enable kvmclock on the pvclock page (bit 0 enables it)
+    struct
+    {
+        struct kvm_msrs header;
+        struct kvm_msr_entry entries[1];
+    } msrs = {
+        .header.nmsrs = 1,
+        .entries[0] = {.index = MSR_KVM_SYSTEM_TIME_NEW, .data = PVCLOCK_ADDR | 1}};
+
+    if (ioctl(vm->vcpufd, KVM_SET_MSRS, &msrs) != 1)
+    {
+        err(1, "VMM: KVM_SET_MSRS");
+    }
+
+    return vm;
+}
+
+// Copies the guest binary at the start of RAM and points the vCPU at its entry
+static void vm_load_guest(vm_t *vm, const char *guest_binary)
+{
+    boot_mode_t boot_mode = vm->boot_mode;
+
+    // Open the guest binary and find its size in bytes
+    FILE *fp = fopen(guest_binary, "rb");
+
+    if (!fp)
+    {
+        err(1, "VMM: %s", guest_binary);
+    }
+
+    fseek(fp, 0L, SEEK_END);
+    int guest_binary_size = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+
+    // copy file content to local buffer
+    unsigned char *binary = (unsigned char *)malloc(guest_binary_size * sizeof(unsigned char));
+    if (fread(binary, sizeof(unsigned char), guest_binary_size, fp) == 0)
+    {
+        err(1, "VMM: reading guest binary");
+    }
+
+    fclose(fp);
+
+    boot_header_t header;
+    uint64_t entry = 0;
+
+    if (boot_mode != BOOT_REAL)
+    {
+        uint32_t flag = boot_mode == BOOT_LONG ? BOOT_FLAG_LONG : BOOT_FLAG_PROTECTED;
+
+        if (!find_boot_header(binary, guest_binary_size, &header) || !(header.flags & flag))
+        {
+            errx(1, "VMM: %s has no boot header for %s mode", guest_binary,
+                 boot_mode == BOOT_LONG ? "long" : "protected");
+        }
+
+        entry = boot_mode == BOOT_LONG ? header.entry64 : header.entry32;
+        printf("boot: %s mode, entry point 0x%lx\n", boot_mode == BOOT_LONG ? "long" : "protected", entry);
+    }
+
+    uint64_t low_ram = vm->guest_mem_size < LOW_RAM_END ? vm->guest_mem_size : LOW_RAM_END;
+
+    if ((uint64_t)guest_binary_size > low_ram)
+    {
+        errx(1, "VMM: %s doesn't fit in RAM", guest_binary);
+    }
+
+    memcpy(vm->guest_mem, binary, guest_binary_size);
+    mark_guest_write(vm, 0, guest_binary_size);
+    free(binary);
+
+    // Initialize instruction pointer and flags register
+    struct kvm_regs regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.rsp = vm->guest_mem_size; // set stack pointer at the top of the guest's RAM
+    if (boot_mode != BOOT_LONG && regs.rsp > 0xFFFFFFFF)
+        regs.rsp = 0xFFFFFFF0; // as high as 32-bit code can go
+    regs.rip = entry;
+    regs.rflags = 0x2; // bit 1 is reserved and should always bet set to 1
+
+    if (ioctl(vm->vcpufd, KVM_SET_REGS, &regs) < 0)
+    {
+        err(1, "VMM: KVM_SET_REGS");
+    }
+}
+
+static vm_t *vm_create(const char *guest_binary, boot_mode_t boot_mode, uint64_t mem_size, const cpu_model_t *cpu)
+{
+    vm_t *vm = vm_alloc(boot_mode, mem_size, cpu);
+    vm_load_guest(vm, guest_binary);
+    return vm;
+}
+
+static void vm_run(vm_t *vm)
+{
+    if (profiler)
+    {
+        profile_start(profiler, vm->run);
+    }
+
+    if (checkpoints)
+    {
+        checkpoints_start_timer(checkpoints, vm->run);
+    }
+
+    if (migration)
+    {
+        migration_start(migration, migrate_delay_ms, vm->dirty_log, vm->run);
+    }
+
+    // Runs the VM (guest code) and handles VM exits
+    while (1)
+    {
+        if (profiler)
+            profile_enter_guest(profiler);
+
+        // Runs the vCPU until encoutering a VM_EXIT
+        int ret = ioctl(vm->vcpufd, KVM_RUN, NULL);
+
+        if (profiler)
+            profile_leave_guest(profiler);
+
+        if (ret < 0 && errno == EINTR && job_timed_out)
+        {
+            fprintf(stderr, "VMM: the job timed out\n");
+            vm->stop_reason = "timeout";
+            return;
+        }
+
+        if (ret < 0 && errno == EINTR && migration && migration->due)
+        {
+            // The pre-copy is done: the guest goes on in the destination
+            vm->run->immediate_exit = 0;
+            finish_migration(vm);
+            vm->stop_reason = "migrated";
+            return;
+        }
+
+        if (ret < 0 && errno == EINTR && checkpoints && checkpoints->due)
+        {
+            // Time for a checkpoint: there is no exit being handled
+            vm->run->immediate_exit = 0;
+            take_checkpoint(vm);
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR && profiler)
+        {
+            // The profiler's timer kicked the vCPU out of the guest
+            vm->run->immediate_exit = 0;
+            profile_guest_sample(profiler, vcpu_regs(vm), vcpu_sregs(vm));
+            continue;
+        }
+
+        if (ret < 0)
+        {
+            err(1, "VMM: KVM_RUN");
+        }
+
+        vm->exits++;
+
+        switch (vm->run->exit_reason)
+        {
+        case KVM_EXIT_IO: // encountered an I/O instruction
+            if (guest_halted(vm->run))
+            {
+                if (end_iteration(NULL))
+                    break;
+                fprintf(stderr, "VMM: guest halted\n");
+                vm->stop_reason = "halted";
+                return;
+            }
+            handle_exit(vm);
+            if (iterations && iterations->ended && !end_iteration(NULL))
+            {
+                vm->stop_reason = "iterations done";
+                return;
+            }
+            if (fork_server && fork_server->at_ready_point)
+            {
+                vm->stop_reason = "ready point";
+                return;
+            }
+            break;
+        case KVM_EXIT_MMIO: // encountered a MMIO instruction which could not be satisfied
+            handle_exit(vm);
+            break;
+        case KVM_EXIT_DIRTY_RING_FULL: // the guest waits for the ring to be harvested
+            vm->dirty_log->ring_full++;
+            dirty_log_harvest(vm->dirty_log);
+            break;
+        case KVM_EXIT_HLT: // encountered "hlt" instruction
+            fprintf(stderr, "VMM: KVM_EXIT_HLT\n");
+            vm->stop_reason = "hlt";
+            return;
+        case KVM_EXIT_FAIL_ENTRY:
+            fprintf(stderr, "VMM: KVM_EXIT_FAIL_ENTRY: hardware_entry_failure_reason = 0x%llx\n",
+                    (unsigned long long)vm->run->fail_entry.hardware_entry_failure_reason);
+            break;
+        case KVM_EXIT_INTERNAL_ERROR:
+            fprintf(stderr, "VMM: KVM_EXIT_INTERNAL_ERROR: suberror = 0x%x at rip 0x%llx\n", vm->run->internal.suberror,
+                    vcpu_regs(vm)->rip);
+            if (end_iteration("internal error"))
+                break;
+            vm->stop_reason = "internal error";
+            return;
+        case KVM_EXIT_SHUTDOWN:
+            fprintf(stderr, "VMM: KVM_EXIT_SHUTDOWN\n");
+            if (end_iteration("shutdown"))
+                break;
+            vm->stop_reason = "shutdown";
+            return;
+        default:
+            fprintf(stderr, "VMM: unhandled exit reason (0x%x)\n", vm->run->exit_reason);
+            vm->stop_reason = "unhandled exit";
+            return;
+        }
+    }
+}
+
+static void vm_destroy(vm_t *vm)
+{
+    if (vm->guest_mem)
+    {
+        munmap(vm->guest_mem, vm->guest_mem_size);
+        close(vm->guest_memfd);
+    }
+
+    if (vm->run)
+    {
+        munmap(vm->run, vm->vcpu_mmap_size);
+    }
+
+    if (vm->pvclock)
+    {
+        munmap(vm->pvclock, 4096);
+        close(vm->pvclock_fd);
+    }
+
+    if (vm->boot_area)
+    {
+        munmap(vm->boot_area, BOOT_AREA_SIZE);
+        close(vm->boot_area_fd);
+    }
+
+    if (vm->dirty_log)
+    {
+        destroy_dirty_log(vm->dirty_log);
+    }
+
+    free(vm->dirty_bitmap);
+    free(vm->shadow_mem);
+    close(vm->kvmfd);
+    memset(vm, 0, sizeof(vm_t));
+    free(vm);
+}
+
+void *t_vm_run(void *p)
+{
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+    vm_t *vm = (vm_t *)p;
+    vm_run(vm);
+
+    return (void *)0;
+}
+
+char *find_option(int argc, char **argv, const char *name)
+{
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+        {
+            return argv[i + 1];
+        }
+    }
+
+    return NULL;
+}
+
+static void usage(char *prog)
+{
+    printf("usage: %s -guest <guest_binary> -disk <disk_image> [-drive <drive>...] [options]\n", prog);
+    printf("       %s -disk <disk_image> -make-manifest <manifest>\n", prog);
+    printf("       %s -blk-server <socket> -disk <disk_image> [-verify <manifest>] [options]\n", prog);
+    printf("       %s -replay-exits <log> -disk <disk_image> [-drive <drive>...] [-serial <dest>] [options]\n", prog);
+    printf("       %s -clone <socket>\n", prog);
+    printf("       %s -serve <socket> [-pool <n>] [-boot <mode>] [-mem <size>] [-cpu <model>]\n", prog);
+    printf("       %s -submit <socket> -guest <guest_binary> -disk <disk_image> [-drive <drive>...] [-timeout <ms>]\n",
+           prog);
+    printf("Keys typed in the window go to the guest's PS/2 keyboard, except Escape, which quits.\n");
+    printf("-disk is on the primary IDE channel and PV queue 0. Each -drive is on the next IDE channel\n");
+    printf("(up to 2) or PV queue (up to %d): -drive file=<image>[,if=ide|pv][,verify=<manifest>][,<key>=<value>...]\n",
+           HYPERCALL_MAX_QUEUES);
+    printf("where the keys are the options below without their dash and disk- or io- prefix (format=, burst=, ...).\n");
+    printf("A PV drive with poll=on has a host thread polling its queue, pinned with poll-cpu=<n>: the guest\n");
+    printf("submits requests without exits while it spins.\n");
+    printf("-blk-server serves the disk to the VMMs with a -drive if=pv,socket=<socket>[,poll-cpu=<n>]: the disk's\n");
+    printf("I/O and cache are in the server, which accesses their guest RAM directly. Stopped by SIGINT or SIGTERM,\n");
+    printf("it checks the disk against the -verify manifest.\n");
+    printf("-replay-exits feeds the exits of a log recorded with -record-exits to the device models, without KVM:\n");
+    printf("it checks they answer the same and times them. The drives must be the same as when recording, in the\n");
+    printf("same state.\n");
+    printf("-clone has the -fork-server listening on the socket start a clone of its VM, and shows its output.\n");
+    printf("-serve keeps a pool of n VMs (default 4), each in its own process, running the jobs sent with -submit\n");
+    printf("one at a time, without a window: they are reset to their pristine state after each job. A job has the\n");
+    printf("options below but -boot, -mem and -cpu, which are the pool's, and -serial stdio; -timeout stops its\n");
+    printf("guest after that many milliseconds. -submit shows the job's output and exits with its status.\n");
+    printf("VM options:\n");
+    printf("  -boot <mode>          real (default): start at 0 in real mode; protected or long: start in that mode\n");
+    printf("                        at the entry point of the guest's boot header, with a GDT and page tables\n");
+    printf("  -mem <size>[K|M|G]    guest RAM (default 256K): at most 640K, or more than 1M\n");
+    printf("  -cpu <model>          host (default): every CPUID feature KVM supports; x86-64-v1, v2, v3 or v4:\n");
+    printf("                        only the features of that level (v3 has AVX2, v4 AVX-512)\n");
+    printf("  -serial <dest>        16550 UART on COM1: stdio (output to stdout, input from stdin) or an output file\n");
+    printf("  -record-exits <log>   record the exits the device models handle, see -replay-exits\n");
+    printf("  -profile-guest <file> sample the guest's stacks, and the exits it makes, as folded stacks for flame\n");
+    printf("                        graphs: samples to <file> (the VMM's on top of the exit), exits to <file>.exits\n");
+    printf("  -profile-symbols <f>  guest symbols, from a linker map or ELF file (default: the guest's .map)\n");
+    printf("  -profile-hz <n>       samples per second (default %d)\n", PROFILE_DEFAULT_HZ);
+    printf("  -iterations <n>       snapshot the VM when the guest asks for it, then run it n times from there with\n");
+    printf("                        a new input each time (see shared/snapshot.h); disk writes are dropped after each\n");
+    printf("  -inputs <dir>         the inputs: each file once as it is, then mutated (default: random bytes)\n");
+    printf("  -seed <n>             of the random inputs and mutations (default 1)\n");
+    printf("  -crashes <dir>        save the inputs the guest crashed with to this directory\n");
+    printf("  -fork-server <socket> run the guest up to its ready point (see shared/snapshot.h), without a window,\n");
+    printf("                        then fork a clone of the VM for each connection: its RAM is copy-on-write, its\n");
+    printf("                        disk writes are dropped when it's done, its output goes to the connection\n");
+    printf("  -checkpoint <chain>   write a checkpoint of the VM to this file periodically, with the pages the guest\n");
+    printf("                        wrote since the previous one (see vmm/checkpoint.h); the disks aren't in it\n");
+    printf("  -checkpoint-ms <n>    milliseconds between checkpoints (default 2000)\n");
+    printf("  -checkpoint-keep <n>  checkpoints the chain's compaction leaves restorable (default 8)\n");
+    printf("  -dirty-log <log>      where checkpoints find the pages the guest wrote: ring (default, KVM's dirty ring\n");
+    printf("                        when it has one) or bitmap (the memory slots' dirty bitmaps)\n");
+    printf("  -restore <chain>      start the VM from a checkpoint of the chain, with the disks as they were then\n");
+    printf("  -restore-index <n>    the checkpoint to restore (default: the last one)\n");
+    printf("  -migrate <socket>     move the running VM to the VMM waiting on this socket (see vmm/migrate.h), then exit;\n");
+    printf("                        the dirty pages come from -dirty-log, the disks are shared\n");
+    printf("  -migrate-ms <n>       milliseconds the guest runs before the migration starts (default 1000)\n");
+    printf("  -incoming <socket>    wait on this socket for a VM migrated with -migrate, then run it; the VM options\n");
+    printf("                        and devices must be those of the source\n");
+    printf("options (for -disk, and the defaults of every -drive):\n");
+    printf("  -backing <image>      create the disk as a copy-on-write overlay of this raw image\n");
+    printf("  -disk-clone <image>   create the disk as a copy (reflink when possible) of this image\n");
+    printf("  -dedup-store <dir>    move the disk into this deduplicating chunk store, keeping only its chunk map\n");
+    printf("  -disk-format <fmt>    auto (default: overlay with -backing, dedup with -dedup-store, raw otherwise),\n");
+    printf("                        raw, overlay, dedup, or log: writes to the raw image are appended to a log\n");
+    printf("                        compacted into the image in the background\n");
+    printf("  -cache <mode>         disk cache mode: writeback (default), writethrough, unsafe or none\n");
+    printf("  -cache-extent <bytes> cache extent size: 4096 (default) or 65536\n");
+    printf("  -cache-size <MiB>     cache size (default 16)\n");
+    printf("  -iothread on|off      give the disk its own I/O thread, posting writes in writeback modes (default on)\n");
+    printf("  -iops <n>             limit the disk to n requests per second\n");
+    printf("  -bps <n>              limit the disk to n bytes per second\n");
+    printf("  -io-burst <seconds>   how much I/O an idle disk may do at once, in seconds of its limits (default 1)\n");
+    printf("  -io-group <name>      schedule the disk fairly with the other disks of this throttle group\n");
+    printf("  -io-group-iops <n>    -iops for all the disks of the group together\n");
+    printf("  -io-group-bps <n>     -bps for all the disks of the group together\n");
+    printf("  -verify <manifest>    check the disk against a manifest once the VM is done\n");
+}
+
+// -boot, -mem and -cpu
+static void parse_vm_options(int argc, char **argv, boot_mode_t *boot_mode, uint64_t *mem_size,
+                             const cpu_model_t **cpu)
+{
+    *boot_mode = BOOT_REAL;
+    char *boot = find_option(argc, argv, "-boot");
+
+    if (boot && parse_boot_mode(boot, boot_mode) < 0)
+    {
+        errx(1, "VMM: invalid -boot %s", boot);
+    }
+
+    *mem_size = 4096 * 64;
+    char *mem = find_option(argc, argv, "-mem");
+
+    if (mem && parse_mem_size(mem, mem_size) < 0)
+    {
+        errx(1, "VMM: invalid -mem %s", mem);
+    }
+
+    *cpu = find_cpu_model("host");
+    char *cpu_name = find_option(argc, argv, "-cpu");
+
+    if (cpu_name && !(*cpu = find_cpu_model(cpu_name)))
+    {
+        errx(1, "VMM: unknown -cpu %s", cpu_name);
+    }
+}
+
+// Command line options that set a disk option, and its -drive key
+static const struct
+{
+    const char *flag;
+    char *key;
+} disk_flags[] = {
+    {"-backing", "backing"},
+    {"-disk-clone", "clone"},
+    {"-dedup-store", "dedup-store"},
+    {"-disk-format", "format"},
+    {"-cache", "cache"},
+    {"-cache-extent", "cache-extent"},
+    {"-cache-size", "cache-size"},
+    {"-iothread", "iothread"},
+    {"-iops", "iops"},
+    {"-bps", "bps"},
+    {"-io-burst", "burst"},
+    {"-io-group", "group"},
+    {"-io-group-iops", "group-iops"},
+    {"-io-group-bps", "group-bps"},
+};
+
+static void parse_disk_options(int argc, char **argv, disk_config_t *config)
+{
+    for (unsigned i = 0; i < sizeof(disk_flags) / sizeof(disk_flags[0]); i++)
+    {
+        char *value = find_option(argc, argv, disk_flags[i].flag);
+
+        if (value && disk_config_set(config, disk_flags[i].key, value) < 0)
+        {
+            errx(1, "VMM: invalid %s %s", disk_flags[i].flag, value);
+        }
+    }
+}
+
+// -drive file=<image>,if=ide|pv,verify=<manifest>,<disk option>=<value>,...
+static void parse_drive(char *spec, disk_config_t *defaults, drive_t *drive)
+{
+    char *copy = strdup(spec);
+    char *save;
+
+    memset(drive, 0, sizeof(drive_t));
+    drive->config = *defaults;
+    drive->interface = DRIVE_IF_IDE;
+    drive->poll_cpu = -1;
+
+    for (char *key = strtok_r(copy, ",", &save); key; key = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(key, '=');
+
+        if (!value)
+        {
+            errx(1, "VMM: -drive %s: expected key=value, got %s", spec, key);
+        }
+
+        *value++ = '\0';
+
+        if (strcmp(key, "if") == 0 && strcmp(value, "ide") == 0)
+        {
+            drive->interface = DRIVE_IF_IDE;
+        }
+        else if (strcmp(key, "if") == 0 && strcmp(value, "pv") == 0)
+        {
+            drive->interface = DRIVE_IF_PV;
+        }
+        else if (strcmp(key, "verify") == 0)
+        {
+            drive->verify = value;
+        }
+        else if (strcmp(key, "poll") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+        {
+            drive->poll = strcmp(value, "on") == 0;
+        }
+        else if (strcmp(key, "poll-cpu") == 0)
+        {
+            drive->poll_cpu = atoi(value);
+        }
+        else if (strcmp(key, "socket") == 0)
+        {
+            drive->socket = value;
+        }
+        else if (strcmp(key, "if") == 0 || disk_config_set(&drive->config, key, value) < 0)
+        {
+            errx(1, "VMM: -drive %s: invalid %s=%s", spec, key, value);
+        }
+    }
+
+    if (drive->socket)
+    {
+        // The backend has the disk and always polls the queue
+        if (drive->interface != DRIVE_IF_PV || drive->config.path || drive->verify)
+        {
+            errx(1, "VMM: -drive %s: socket= needs if=pv, and no file= or verify=", spec);
+        }
+        return;
+    }
+
+    if (!drive->config.path)
+    {
+        errx(1, "VMM: -drive %s: missing file=", spec);
+    }
+
+    // The poller uses the disk from its own thread, so it can't share it with IDE
+    if (drive->poll && drive->interface != DRIVE_IF_PV)
+    {
+        errx(1, "VMM: -drive %s: poll=on needs if=pv", spec);
+    }
+}
+
+static void parse_drives(int argc, char **argv, disk_config_t *disk_config, char *manifest)
+{
+    // How images are created is specific to each -drive
+    disk_config_t defaults = *disk_config;
+    defaults.path = NULL;
+    defaults.backing = NULL;
+    defaults.clone = NULL;
+    defaults.dedup_store = NULL;
+
+    if (disk_config->path)
+    {
+        drives[nr_drives].config = *disk_config;
+        drives[nr_drives].interface = DRIVE_IF_ALL;
+        drives[nr_drives].verify = manifest;
+        drives[nr_drives].poll_cpu = -1;
+        nr_drives++;
+    }
+
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-drive") != 0)
+            continue;
+
+        if (nr_drives == MAX_DRIVES)
+        {
+            errx(1, "VMM: too many drives (at most %d)", MAX_DRIVES);
+        }
+
+        parse_drive(argv[++i], &defaults, &drives[nr_drives++]);
+    }
+}
+
+// Every drive gets its own backend stack, on the next free IDE channel or PV queue
+static void attach_drives(void)
+{
+    int ide = 0;
+    int pv = 0;
+
+    for (int i = 0; i < nr_drives; i++)
+    {
+        drive_t *drive = &drives[i];
+        drive->pv_queue = -1;
+
+        if (drive->socket)
+        {
+            if (pv == HYPERCALL_MAX_QUEUES)
+            {
+                errx(1, "VMM: no PV queue left for %s", drive->socket);
+            }
+
+            printf("drive at %s on PV queue %d (port 0x%x)\n", drive->socket, pv, HYPERCALL_QUEUE_PORT(pv));
+            drive->pv_queue = pv++;
+            continue;
+        }
+
+        drive->disk = create_disk(&drive->config);
+
+        // What the guest writes is dropped at every iteration, or kept by
+        // each fork-server clone for itself
+        if (iterations || fork_server)
+        {
+            drive->disk = create_scratch_disk(drive->disk);
+        }
+
+        if (drive->interface != DRIVE_IF_PV)
+        {
+            if (ide == IDE_CHANNELS)
+            {
+                errx(1, "VMM: no IDE channel left for %s", drive->config.path);
+            }
+
+            uint16_t base = ide == 0 ? IDE_PRIMARY_BASE : IDE_SECONDARY_BASE;
+            ide_channels[ide++] = create_ide_state_machine(drive->disk, base);
+            printf("drive %s on the IDE channel at 0x%x\n", drive->config.path, base);
+        }
+
+        if (drive->interface != DRIVE_IF_IDE)
+        {
+            if (pv == HYPERCALL_MAX_QUEUES)
+            {
+                errx(1, "VMM: no PV queue left for %s", drive->config.path);
+            }
+
+            printf("drive %s on PV queue %d (port 0x%x)\n", drive->config.path, pv, HYPERCALL_QUEUE_PORT(pv));
+            pv_queues[pv] = create_hypercall_host(drive->disk, pv);
+            drive->pv_queue = pv++;
+        }
+    }
+}
+
+// Returns false if a drive doesn't match its manifest
+static bool verify_drives(void)
+{
+    bool ok = true;
+
+    for (int i = 0; i < nr_drives; i++)
+    {
+        drive_t *drive = &drives[i];
+
+        if (!drive->verify)
+            continue;
+
+        int64_t differing = verify_disk(drive->disk, drive->verify);
+
+        if (differing < 0)
+        {
+            warn("VMM: verifying %s against %s", drive->config.path, drive->verify);
+            ok = false;
+        }
+        else if (differing > 0)
+        {
+            printf("verify: %ld sectors of %s differ from %s\n", differing, drive->config.path, drive->verify);
+            ok = false;
+        }
+        else
+        {
+            printf("verify: %s matches %s\n", drive->config.path, drive->verify);
+        }
+    }
+
+    return ok;
+}
+
+static int make_manifest(disk_config_t *disk_config, char *manifest_path)
+{
+    disk_config->cache_mode = CACHE_NONE;
+    disk_config->iothread = false;
+    disk_t *disk = create_disk(disk_config);
+
+    if (write_manifest(disk, manifest_path) < 0)
+    {
+        err(1, "VMM: writing manifest %s", manifest_path);
+    }
+
+    printf("manifest %s written\n", manifest_path);
+    destroy_disk(disk);
+    return EXIT_SUCCESS;
+}
+
+// Destroys the device models of the drives, then the drives after checking
+// them against their manifests. Returns the VMM's exit status.
+static int destroy_drives(void)
+{
+    for (int i = 0; i < IDE_CHANNELS; i++)
+    {
+        if (ide_channels[i])
+        {
+            destroy_ide_state_machine(ide_channels[i]);
+        }
+    }
+    printf("ide state machines destroyed\n");
+
+    for (int i = 0; i < HYPERCALL_MAX_QUEUES; i++)
+    {
+        if (pv_queues[i])
+        {
+            destroy_hypercall_host(pv_queues[i]);
+        }
+    }
+    printf("hypercall hosts destroyed\n");
+
+    int exit_status = verify_drives() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (int i = 0; i < nr_drives; i++)
+    {
+        if (drives[i].disk)
+        {
+            destroy_disk(drives[i].disk);
+        }
+        else
+        {
+            close(drives[i].backend); // the block backend flushes the disk
+        }
+    }
+    printf("disks destroyed\n");
+
+    return exit_status;
+}
+
+// The devices of the VM, as an exit log's header has them
+static void get_log_header(vm_t *vm, exit_log_header_t *header)
+{
+    memset(header, 0, sizeof(exit_log_header_t));
+    header->flags = serial ? EXIT_LOG_SERIAL : 0;
+    header->guest_mem_size = vm->guest_mem_size;
+
+    for (int i = 0; i < IDE_CHANNELS; i++)
+    {
+        header->ide_channels |= ide_channels[i] ? 1 << i : 0;
+    }
+
+    for (int i = 0; i < HYPERCALL_MAX_QUEUES; i++)
+    {
+        header->pv_queues |= pv_queues[i] ? 1 << i : 0;
+    }
+}
+
+static void start_recording(vm_t *vm, const char *path)
+{
+    for (int i = 0; i < nr_drives; i++)
+    {
+        // Their requests don't exit
+        if (drives[i].poll || drives[i].socket)
+        {
+            errx(1, "VMM: -record-exits doesn't see the requests of polled or out-of-process PV queues");
+        }
+    }
+
+    if (serial && serial->stdin_rx)
+    {
+        warnx("VMM: what the serial port receives from stdin isn't recorded, replays of guests reading it differ");
+    }
+
+    // Both need the dirty pages KVM logs, which it only gives once
+    if (iterations)
+    {
+        errx(1, "VMM: -record-exits and -iterations can't be used together");
+    }
+
+    if (fork_server)
+    {
+        errx(1, "VMM: -record-exits and -fork-server can't be used together");
+    }
+
+    exit_log_header_t header;
+    get_log_header(vm, &header);
+    exit_log = create_exit_log(path, &header);
+
+    // Bitmap of the largest memory slot, and a copy of the memory the log has,
+    // zeroes to begin with
+    vm->dirty_bitmap = calloc((vm->guest_mem_size / GUEST_PAGE_SIZE + 63) / 64, sizeof(uint64_t));
+    vm->shadow_mem = calloc(1, vm->guest_mem_size + HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE);
+
+    if (!vm->dirty_bitmap || !vm->shadow_mem)
+    {
+        err(1, "VMM: allocating the exit log's copy of guest memory");
+    }
+
+    exit_log_lock(exit_log);
+    log_guest_memory(vm, false);
+    exit_log_unlock(exit_log);
+}
+
+// Reads the files of an -inputs directory, in name order
+static void load_corpus(iterations_t *it, const char *dir)
+{
+    struct dirent **entries;
+    int count = scandir(dir, &entries, NULL, alphasort);
+
+    if (count < 0)
+    {
+        err(1, "VMM: %s", dir);
+    }
+
+    it->corpus = calloc(count, sizeof(uint8_t *));
+    it->corpus_lengths = calloc(count, sizeof(uint32_t));
+
+    for (int i = 0; i < count; i++)
+    {
+        char *path;
+        struct stat st;
+
+        if (asprintf(&path, "%s/%s", dir, entries[i]->d_name) < 0)
+        {
+            err(1, NULL);
+        }
+
+        FILE *fp = stat(path, &st) == 0 && S_ISREG(st.st_mode) ? fopen(path, "rb") : NULL;
+
+        if (fp)
+        {
+            uint8_t *data = malloc(st.st_size + 1);
+
+            if (st.st_size && fread(data, st.st_size, 1, fp) != 1)
+            {
+                err(1, "VMM: reading %s", path);
+            }
+
+            it->corpus[it->corpus_size] = data;
+            it->corpus_lengths[it->corpus_size++] = st.st_size;
+            fclose(fp);
+        }
+
+        free(path);
+        free(entries[i]);
+    }
+
+    free(entries);
+
+    if (!it->corpus_size)
+    {
+        errx(1, "VMM: no inputs in %s", dir);
+    }
+
+    printf("iterations: %d inputs from %s\n", it->corpus_size, dir);
+}
+
+static void create_iterations(const char *count, const char *inputs, const char *seed, char *crash_dir)
+{
+    for (int i = 0; i < nr_drives; i++)
+    {
+        // Their writes don't go through the VMM's scratch disks
+        if (drives[i].poll || drives[i].socket)
+        {
+            errx(1, "VMM: -iterations can't reset polled or out-of-process PV queues");
+        }
+    }
+
+    iterations = calloc(1, sizeof(iterations_t));
+    iterations->count = strtoull(count, NULL, 0);
+    iterations->rng = seed ? strtoull(seed, NULL, 0) : 1;
+    iterations->crash_dir = crash_dir;
+
+    if (!iterations->count || !iterations->rng)
+    {
+        errx(1, "VMM: -iterations and -seed must be positive");
+    }
+
+    if (inputs)
+    {
+        load_corpus(iterations, inputs);
+    }
+
+    if (crash_dir && mkdir(crash_dir, 0755) < 0 && errno != EEXIST)
+    {
+        err(1, "VMM: %s", crash_dir);
+    }
+}
+
+static void destroy_iterations(void)
+{
+    if (snapshot)
+    {
+        destroy_snapshot(snapshot);
+    }
+
+    for (int i = 0; i < iterations->corpus_size; i++)
+    {
+        free(iterations->corpus[i]);
+    }
+
+    free(iterations->corpus);
+    free(iterations->corpus_lengths);
+    free(iterations->input);
+    free(iterations);
+}
+
+// -fork-server
+static void start_fork_server(char *path)
+{
+    if (iterations)
+    {
+        errx(1, "VMM: -fork-server and -iterations can't be used together");
+    }
+
+    for (int i = 0; i < nr_drives; i++)
+    {
+        drive_t *drive = &drives[i];
+
+        if (drive->poll || drive->socket || drive->config.format == DISK_FORMAT_LOG)
+        {
+            errx(1, "VMM: -fork-server can't clone polled or out-of-process PV queues, nor log-structured disks");
+        }
+
+        // Threads don't survive fork(): the clones do their I/O themselves
+        drive->config.iothread = false;
+    }
+
+    fork_server = create_fork_server(path);
+}
+
+// The fork server's VM, cloned by every fork
+static vm_t *clone_vm;
+static const cpu_model_t *clone_cpu;
+
+static void flush_before_fork(void)
+{
+    if (serial)
+        serial_flush(serial);
+}
+
+// In the forked process: its memory becomes copy-on-write and a new KVM VM
+// runs it from the ready point. The device models are already as they were
+// there, fork() copied them.
+static void run_clone(uint64_t start)
+{
+    vm_t *vm = clone_vm;
+
+    // The server's KVM VM, which only works in its process
+    munmap(vm->run, vm->vcpu_mmap_size);
+    close(vm->vcpufd);
+    close(vm->vmfd);
+
+    make_private(vm->guest_mem, vm->guest_mem_size, vm->guest_memfd);
+    make_private(hypercall, HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE, hypercall_fd);
+    make_private(fb, fb_size, fb_fd);
+    make_private(vm->pvclock, 4096, vm->pvclock_fd);
+
+    if (vm->boot_area)
+    {
+        make_private(vm->boot_area, BOOT_AREA_SIZE, vm->boot_area_fd);
+    }
+
+    bool gb_pages;
+    vm_create_kvm(vm, clone_cpu, &gb_pages);
+
+    // Their interrupts go to the new VM
+    ps2->vmfd = vm->vmfd;
+    if (serial)
+        serial->vmfd = vm->vmfd;
+
+    snapshot_set_vm(snapshot, vm->vmfd, vm->vcpufd, vm->run);
+    snapshot_restore(snapshot);
+    fork_server->at_ready_point = false;
+
+    uint64_t run_start = now_ns();
+    printf("clone %lu: started in %.2f ms\n", fork_server->clones, (run_start - start) / 1e6);
+
+    vm_run(vm);
+
+    if (serial)
+    {
+        serial_flush(serial);
+    }
+
+    printf("clone %lu: guest ran for %.2f ms\n", fork_server->clones, (now_ns() - run_start) / 1e6);
+}
+
+static const fork_server_ops_t fork_server_ops = {
+    .flush = &flush_before_fork,
+    .run_clone = &run_clone,
+};
+
+// Runs the guest up to its ready point, then serves clones of it
+static void serve_clones(vm_t *vm, const cpu_model_t *cpu)
+{
+    vm_run(vm);
+
+    if (!fork_server->at_ready_point)
+    {
+        errx(1, "VMM: the guest stopped before its ready point (SNAPSHOT_TAKE)");
+    }
+
+    clone_vm = vm;
+    clone_cpu = cpu;
+    fork_server_serve(fork_server, &fork_server_ops);
+}
+
+// VM pool (-serve), see pool.h. After a job, the worker's VM goes back to its
+// pristine state with a snapshot taken before its first run; the device models
+// and drives are the job's own.
+
+// Options of a pool job that are the pool's, or that don't make sense in it
+static const char *pool_options[] = {"-boot", "-mem", "-cpu", "-iterations", "-fork-server", "-profile-guest",
+                                     "-record-exits", "-replay-exits", "-blk-server", "-make-manifest",
+                                     "-serve", "-submit", "-clone", "-checkpoint", "-restore", "-migrate",
+                                     "-incoming"};
+
+// The workers' VMs, as the -serve options describe them
+static boot_mode_t pool_boot_mode;
+static uint64_t pool_mem_size;
+static const cpu_model_t *pool_cpu;
+
+static vm_t *pool_vm; // of this worker
+static timer_t job_timer;
+
+static void on_job_timeout(int sig)
+{
+    (void)sig;
+    job_timed_out = 1;
+    pool_vm->run->immediate_exit = 1; // in case the vCPU isn't in KVM_RUN yet
+}
+
+// Creates the worker's VM and snapshots it
+static void start_pool_worker(int id)
+{
+    uint64_t start = now_ns();
+    pool_vm = vm_alloc(pool_boot_mode, pool_mem_size, pool_cpu);
+
+    snapshot = create_snapshot(pool_vm->vmfd, pool_vm->vcpufd, pool_vm->run);
+    add_snapshot_regions(pool_vm);
+    snapshot_take(snapshot);
+
+    struct sigaction action = {.sa_handler = &on_job_timeout};
+    sigemptyset(&action.sa_mask);
+    struct sigevent event = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGALRM};
+    event.sigev_notify_thread_id = gettid();
+
+    if (sigaction(SIGALRM, &action, NULL) < 0 || timer_create(CLOCK_MONOTONIC, &event, &job_timer) < 0)
+    {
+        err(1, "VMM: job timer");
+    }
+
+    printf("pool: worker %d ready in %.2f ms\n", id, (now_ns() - start) / 1e6);
+}
+
+// Sets up the job's devices and drives on the pooled VM, runs it, then tears
+// them down. A job with invalid options makes the worker exit, the pool
+// starts another one.
+static int run_job(int argc, char **argv, uint64_t start)
+{
+    vm_t *vm = pool_vm;
+    char *guest_binary = find_option(argc, argv, "-guest");
+    char *disk_path = find_option(argc, argv, "-disk");
+
+    if (!guest_binary || !(disk_path || find_option(argc, argv, "-drive")))
+    {
+        errx(1, "VMM: a job needs a -guest, and a -disk or -drive");
+    }
+
+    for (unsigned i = 0; i < sizeof(pool_options) / sizeof(pool_options[0]); i++)
+    {
+        if (find_option(argc, argv, pool_options[i]))
+        {
+            errx(1, "VMM: %s can't be used in a pool job", pool_options[i]);
+        }
+    }
+
+    disk_config_t disk_config;
+    disk_config_init(&disk_config, disk_path);
+    parse_disk_options(argc, argv, &disk_config);
+    parse_drives(argc, argv, &disk_config, find_option(argc, argv, "-verify"));
+
+    for (int i = 0; i < nr_drives; i++)
+    {
+        // Their ioeventfds would stay on the pooled VM
+        if (drives[i].poll || drives[i].socket)
+        {
+            errx(1, "VMM: pool jobs can't have polled or out-of-process PV queues");
+        }
+    }
+
+    attach_drives();
+
+    for (int i = 0; i < HYPERCALL_MAX_QUEUES; i++)
+    {
+        if (pv_queues[i])
+        {
+            hypercall_host_set_guest_mem(pv_queues[i], vm->guest_mem, vm->guest_mem_size);
+        }
+    }
+
+    ps2 = create_ps2(vm->vmfd);
+
+    char *serial_dest = find_option(argc, argv, "-serial");
+    if (serial_dest)
+    {
+        if (strcmp(serial_dest, "stdio") == 0)
+        {
+            errx(1, "VMM: pool jobs don't have a terminal, use -serial <file>");
+        }
+
+        serial = create_serial(serial_dest, vm->vmfd);
+        serial_set_guest_mem(serial, vm->guest_mem, vm->guest_mem_size);
+    }
+
+    vm_load_guest(vm, guest_binary);
+
+    uint64_t timeout_ms = 0;
+    char *timeout = find_option(argc, argv, "-timeout");
+
+    if (timeout && (timeout_ms = strtoull(timeout, NULL, 10)) == 0)
+    {
+        errx(1, "VMM: invalid -timeout %s", timeout);
+    }
+
+    struct itimerspec spec = {.it_value = {timeout_ms / 1000, timeout_ms % 1000 * 1000000}};
+    job_timed_out = 0;
+    vm->exits = 0;
+    vm->stop_reason = NULL;
+
+    uint64_t run_start = now_ns();
+    if (timeout_ms && timer_settime(job_timer, 0, &spec, NULL) < 0)
+    {
+        err(1, "VMM: timer_settime");
+    }
+
+    vm_run(vm);
+
+    memset(&spec, 0, sizeof(spec));
+    timer_settime(job_timer, 0, &spec, NULL);
+    uint64_t run_ns = now_ns() - run_start;
+
+    if (serial)
+    {
+        destroy_serial(serial);
+        serial = NULL;
+    }
+
+    destroy_ps2(ps2);
+    ps2 = NULL;
+
+    int status = destroy_drives();
+    if (job_timed_out)
+        status = EXIT_FAILURE;
+
+    // The next job's drives are attached from scratch
+    memset(drives, 0, sizeof(drives));
+    nr_drives = 0;
+    memset(ide_channels, 0, sizeof(ide_channels));
+    memset(pv_queues, 0, sizeof(pv_queues));
+
+    printf("job: %s, exit status %d, started in %.0f us, ran %.2f ms, %lu exits\n", vm->stop_reason, status,
+           (run_start - start) / 1e3, run_ns / 1e6, vm->exits);
+    return status;
+}
+
+static void reset_pool_worker(int id, int status)
+{
+    uint64_t pages = snapshot->pages_restored;
+    uint64_t reset_start = now_ns();
+    snapshot_restore(snapshot);
+    printf("pool: worker %d: job done (%s, exit status %d), VM reset in %.0f us, %lu pages\n", id,
+           pool_vm->stop_reason, status, (now_ns() - reset_start) / 1e3, snapshot->pages_restored - pages);
+}
+
+static const pool_worker_ops_t pool_worker_ops = {
+    .start = &start_pool_worker,
+    .run_job = &run_job,
+    .reset = &reset_pool_worker,
+};
+
+// The guest memory checkpoints have: the slots of the dirty log, then the
+// frame buffer and boot area, which are compared with their copy
+static checkpoints_t *add_checkpoint_regions(vm_t *vm, checkpoints_t *cp)
+{
+    uint64_t low_ram = vm->guest_mem_size < LOW_RAM_END ? vm->guest_mem_size : LOW_RAM_END;
+    checkpoints_add_region(cp, 0, 0, vm->guest_mem, low_ram);
+    checkpoints_add_region(cp, 2, HYPERCALL_ADDR, (uint8_t *)hypercall, HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE);
+
+    if (vm->guest_mem_size > HIGH_RAM_START)
+    {
+        checkpoints_add_region(cp, 5, HIGH_RAM_START, vm->guest_mem + HIGH_RAM_START,
+                               vm->guest_mem_size - HIGH_RAM_START);
+    }
+
+    checkpoints_add_region(cp, -1, VGA_FB_ADDR, fb, 4096);
+
+    if (vm->boot_area)
+    {
+        checkpoints_add_region(cp, -1, BOOT_AREA_ADDR, vm->boot_area, BOOT_AREA_SIZE);
+    }
+
+    return cp;
+}
+
+// -checkpoint, once the VM and its devices are created
+static void start_checkpoints(vm_t *vm, const char *path, const char *interval, const char *keep)
+{
+    int interval_ms = interval ? atoi(interval) : 2000;
+    int nr_keep = keep ? atoi(keep) : 8;
+
+    if (interval_ms <= 0 || nr_keep <= 0)
+    {
+        errx(1, "VMM: invalid -checkpoint-ms or -checkpoint-keep");
+    }
+
+    add_checkpoint_regions(vm, checkpoints);
+    checkpoints_start(checkpoints, path, interval_ms, nr_keep, vm->dirty_log, vm->vcpufd);
+}
+
+// -restore: the VM starts where it was at a checkpoint, with the same devices.
+// The disks aren't in checkpoints, they must be as they were then.
+static void restore_checkpoint(vm_t *vm, const char *path, const char *index)
+{
+    checkpoints_t *cp = add_checkpoint_regions(vm, create_checkpoints(sizeof(device_state_t)));
+    vm_state_t state;
+    device_state_t devices;
+
+    checkpoint_restore(cp, path, index ? atoi(index) : -1, &state, &devices);
+    vm_state_restore(&state, vm->vmfd, vm->vcpufd, vm->run);
+    restore_device_state(&devices);
+    destroy_checkpoints(cp);
+}
+
+// The guest memory a migration has: the slots of the dirty log, then the frame
+// buffer and boot area, which are sent with the vCPU paused
+static migration_t *add_migration_regions(vm_t *vm, migration_t *m)
+{
+    uint64_t low_ram = vm->guest_mem_size < LOW_RAM_END ? vm->guest_mem_size : LOW_RAM_END;
+    migration_add_region(m, 0, 0, vm->guest_mem, low_ram);
+    migration_add_region(m, 2, HYPERCALL_ADDR, (uint8_t *)hypercall, HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE);
+
+    if (vm->guest_mem_size > HIGH_RAM_START)
+    {
+        migration_add_region(m, 5, HIGH_RAM_START, vm->guest_mem + HIGH_RAM_START, vm->guest_mem_size - HIGH_RAM_START);
+    }
+
+    migration_add_region(m, -1, VGA_FB_ADDR, fb, 4096);
+
+    if (vm->boot_area)
+    {
+        migration_add_region(m, -1, BOOT_AREA_ADDR, vm->boot_area, BOOT_AREA_SIZE);
+    }
+
+    return m;
+}
+
+// -incoming: the VM starts where the source's was, once it's all here
+static void receive_migration(vm_t *vm, const char *path)
+{
+    int sock = listen_unix_socket(path);
+    printf("migration: waiting on %s\n", path);
+
+    int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0)
+    {
+        err(1, "VMM: accept");
+    }
+
+    close(sock);
+    unlink(path);
+
+    migration_t *m = add_migration_regions(vm, create_migration(conn, vm->guest_mem_size, sizeof(device_state_t)));
+    vm_state_t state;
+    device_state_t devices;
+
+    migration_receive(m, &state, &devices);
+    vm_state_restore(&state, vm->vmfd, vm->vcpufd, vm->run);
+    restore_device_state(&devices);
+    migration_acknowledge(m);
+    destroy_migration(m);
+}
+
+static void start_profiling(vm_t *vm, const char *path, const char *guest_binary, const char *symbols, const char *hz)
+{
+    char *map = NULL;
+
+    // By default, the map file the guest's Makefile writes next to it
+    if (!symbols)
+    {
+        const char *ext = strrchr(guest_binary, '.');
+        int length = ext ? ext - guest_binary : (int)strlen(guest_binary);
+
+        if (asprintf(&map, "%.*s.map", length, guest_binary) < 0)
+        {
+            err(1, NULL);
         }
+        symbols = map;
+    }
+
+    int rate = hz ? atoi(hz) : PROFILE_DEFAULT_HZ;
+
+    if (rate <= 0 || rate > 100000)
+    {
+        errx(1, "VMM: invalid -profile-hz %s", hz);
+    }
+
+    profiler = create_profile(path, symbols, rate);
+    profile_set_guest_mem(profiler, vm->guest_mem, vm->guest_mem_size);
+    free(map);
+}
+
+// Feeds the exits of a log recorded with -record-exits to the device models,
+// without KVM: the guest memory they read is restored from the log, and what
+// they answer is checked against what they answered then. Each device model is
+// timed, to compare it with how long the exits took to handle in the VM.
+static int replay_exits(const char *path, const char *serial_dest)
+{
+    exit_log_header_t header;
+    exit_log_t *log = open_exit_log(path, &header);
+
+    // A VM without KVM, with its memory and a kvm_run to pass the exits in
+    vm_t *vm = calloc(1, sizeof(vm_t));
+    vm->kvmfd = vm->vmfd = vm->vcpufd = -1;
+    vm->sync_regs = true; // exits come with their registers, see vcpu_regs()
+    vm->guest_mem_size = header.guest_mem_size;
+    vm->guest_mem = alloc_shared_mem("guest-ram", vm->guest_mem_size, &vm->guest_memfd);
+    vm->vcpu_mmap_size = 2 * GUEST_PAGE_SIZE; // the data of I/O exits is in the second page
+    vm->run = mmap(NULL, vm->vcpu_mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (vm->run == MAP_FAILED)
+    {
+        err(1, "VMM: allocating kvm_run");
+    }
+
+    hypercall = alloc_shared_mem("hypercall", HYPERCALL_MAX_QUEUES * HYPERCALL_AREA_SIZE, &hypercall_fd);
+
+    exit_log_header_t devices;
+    get_log_header(vm, &devices);
+
+    if (devices.ide_channels != header.ide_channels || devices.pv_queues != header.pv_queues)
+    {
+        errx(1, "VMM: %s was recorded with drives on IDE channels 0x%x and PV queues 0x%x, not 0x%x and 0x%x", path,
+             header.ide_channels, header.pv_queues, devices.ide_channels, devices.pv_queues);
+    }
+
+    ps2 = create_ps2(-1);
+
+    if (header.flags & EXIT_LOG_SERIAL)
+    {
+        serial = create_serial(serial_dest ? serial_dest : "/dev/null", -1);
+        serial_set_guest_mem(serial, vm->guest_mem, vm->guest_mem_size);
+    }
+
+    for (int i = 0; i < HYPERCALL_MAX_QUEUES; i++)
+    {
+        if (pv_queues[i])
+        {
+            hypercall_host_set_guest_mem(pv_queues[i], vm->guest_mem, vm->guest_mem_size);
+        }
+    }
+
+    struct kvm_run *run = vm->run;
+    exit_record_t record;
+    static uint8_t data[EXIT_LOG_MAX_DATA];
+    struct kvm_regs regs_out;
+    uint64_t exits[DEVICE_COUNT] = {0};
+    uint64_t ns[DEVICE_COUNT] = {0};
+    uint64_t recorded_ns[DEVICE_COUNT] = {0};
+    uint64_t differing = 0;
+    uint64_t start = now_ns();
+
+    while (exit_log_read(log, &record, data, &run->s.regs.regs, &regs_out))
+    {
+        if (record.type == EXIT_RECORD_MEMORY)
+        {
+            uint8_t *mem = guest_memory(vm, record.addr, record.count);
+
+            if (!mem)
+            {
+                errx(1, "VMM: %s has guest memory at 0x%lx, which the VM doesn't", path, record.addr);
+            }
+
+            memcpy(mem, data, record.count);
+            continue;
+        }
+
+        if (record.type == EXIT_RECORD_KEY)
+        {
+            ps2_key_event(ps2, record.addr, record.count);
+            continue;
+        }
+
+        uint8_t *exit_data;
+        uint32_t length;
+        bool out;
+
+        if (record.type == EXIT_RECORD_IO)
+        {
+            run->exit_reason = KVM_EXIT_IO;
+            run->io.direction = record.direction;
+            run->io.size = record.size;
+            run->io.port = record.port;
+            run->io.count = record.count;
+            run->io.data_offset = GUEST_PAGE_SIZE;
+            exit_data = (uint8_t *)run + run->io.data_offset;
+            length = (uint32_t)record.size * record.count;
+            out = record.direction == KVM_EXIT_IO_OUT;
+        }
+        else
+        {
+            run->exit_reason = KVM_EXIT_MMIO;
+            run->mmio.phys_addr = record.addr;
+            run->mmio.len = record.size;
+            run->mmio.is_write = record.direction;
+            exit_data = run->mmio.data;
+            length = record.size;
+            out = record.direction;
+        }
+
+        if (out)
+            memcpy(exit_data, data, length);
+        else
+            memset(exit_data, 0, length);
+
+        run->kvm_dirty_regs = 0;
+
+        uint64_t handled = now_ns();
+        device_t device = handle_device_exit(vm);
+        handled = now_ns() - handled;
+
+        exits[device]++;
+        ns[device] += handled;
+        recorded_ns[device] += record.ns;
+
+        // What the guest gets: the data of an IN or MMIO read, and the registers
+        bool same = out || memcmp(exit_data, data, length) == 0;
+        bool regs_changed = run->kvm_dirty_regs & KVM_SYNC_X86_REGS;
+
+        if (record.flags & EXIT_REGS_OUT)
+            same = same && regs_changed && memcmp(&run->s.regs.regs, &regs_out, sizeof(regs_out)) == 0;
+        else
+            same = same && !regs_changed;
+
+        if (!same && differing++ < 10)
+        {
+            printf("replay: exit %lu (%s, port 0x%x, address 0x%lx) answered differently\n", log->exits,
+                   device_names[device], record.port, record.addr);
+        }
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    uint64_t total_exits = 0;
+    uint64_t total_ns = 0;
+
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        total_exits += exits[i];
+        total_ns += ns[i];
+    }
+
+    printf("replay: %lu exits in %.3f s, %.3f s in the device models (%.0f exits/s)\n", total_exits, seconds,
+           total_ns / 1e9, total_ns ? total_exits / (total_ns / 1e9) : 0);
+
+    for (int i = 0; i < DEVICE_COUNT; i++)
+    {
+        if (exits[i])
+        {
+            printf("replay: %-10s %8lu exits, %8.0f ns per exit (%.0f ns when recorded)\n", device_names[i], exits[i],
+                   (double)ns[i] / exits[i], (double)recorded_ns[i] / exits[i]);
+        }
+    }
+
+    printf("replay: %lu exits answered differently\n", differing);
+
+    destroy_exit_log(log);
+
+    if (serial)
+    {
+        destroy_serial(serial);
+    }
+    destroy_ps2(ps2);
+    vm_destroy(vm);
+
+    int exit_status = destroy_drives();
+    return differing ? EXIT_FAILURE : exit_status;
+}
+
+// Runs the VM in its thread, showing its screen in the window until Escape
+static int run_in_window(vm_t *vm)
+{
+    pthread_t tid;
+    void *status;
+
+    if (pthread_create(&tid, NULL, t_vm_run, (void *)vm) != 0)
+    {
+        perror("pthread_create failed");
+        return EXIT_FAILURE;
+    }
+
+    printf("vm_run started\n");
+
+    bool looping = true;
+    while (looping)
+    {
+        gfx_present(window);
 
         uint16_t *_fb = (uint16_t *)fb;
 
@@ -419,7 +2569,34 @@ int main(int argc, char **argv)
             gfx_putchar(window, x, y, character, gfx_colors[fg], gfx_colors[bg]);
         }
 
-        SDL_Delay(16);
+        if (serial)
+        {
+            serial_flush(serial);
+        }
+
+        if (migration && migration->done)
+        {
+            printf("the guest runs in the destination VMM now\n");
+            looping = false;
+        }
+
+        // Until the next frame, keys go to the guest as soon as they come
+        uint32_t next_frame = SDL_GetTicks() + 16;
+        SDL_Scancode scancode;
+        bool pressed;
+
+        while (looping && gfx_wait_key((int32_t)(next_frame - SDL_GetTicks()), &scancode, &pressed))
+        {
+            if (scancode == SDL_SCANCODE_ESCAPE)
+            {
+                printf("escape was pressed\n");
+                looping = false;
+            }
+            else
+            {
+                send_key(scancode, pressed);
+            }
+        }
     }
 
     if (pthread_cancel(tid) == -1)
@@ -437,19 +2614,343 @@ int main(int argc, char **argv)
     }
 
     printf("thread joined\n");
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    char *guest_binary = find_option(argc, argv, "-guest");
+    char *disk_path = find_option(argc, argv, "-disk");
+    char *manifest_out = find_option(argc, argv, "-make-manifest");
+    char *manifest = find_option(argc, argv, "-verify");
+    char *blk_server = find_option(argc, argv, "-blk-server");
+    char *replay = find_option(argc, argv, "-replay-exits");
+    char *clone_socket = find_option(argc, argv, "-clone");
+    char *pool_socket = find_option(argc, argv, "-serve");
+    char *submit_socket = find_option(argc, argv, "-submit");
+
+    if (clone_socket)
+    {
+        return clone_main(clone_socket);
+    }
+
+    if (submit_socket)
+    {
+        return submit_main(submit_socket, argc, argv);
+    }
+
+    if (pool_socket)
+    {
+        boot_mode_t boot_mode;
+        uint64_t mem_size;
+        const cpu_model_t *cpu;
+        parse_vm_options(argc, argv, &boot_mode, &mem_size, &cpu);
+
+        char *pool_size = find_option(argc, argv, "-pool");
+        int size = pool_size ? atoi(pool_size) : 4;
+
+        if (size <= 0)
+        {
+            errx(1, "VMM: invalid -pool %s", pool_size);
+        }
+
+        pool_boot_mode = boot_mode;
+        pool_mem_size = mem_size;
+        pool_cpu = cpu;
+
+        printf("pool: %d VMs of %lu KB serving jobs on %s\n", size, mem_size / 1024, pool_socket);
+        fflush(stdout);
+        return serve_pool(pool_socket, size, &pool_worker_ops);
+    }
+
+    bool has_drives = disk_path || find_option(argc, argv, "-drive");
+    bool run_guest = guest_binary && has_drives;
+    bool serve_disk = !guest_binary && disk_path && (manifest_out || blk_server);
+    bool replay_log = !guest_binary && replay && has_drives;
+
+    if (!run_guest && !serve_disk && !replay_log)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    disk_config_t disk_config;
+    disk_config_init(&disk_config, disk_path);
+    parse_disk_options(argc, argv, &disk_config);
+
+    if (blk_server)
+    {
+        return blk_server_main(blk_server, &disk_config, manifest);
+    }
+
+    if (manifest_out)
+    {
+        return make_manifest(&disk_config, manifest_out);
+    }
+
+    parse_drives(argc, argv, &disk_config, manifest);
+
+    char *nr_iterations = find_option(argc, argv, "-iterations");
+    if (nr_iterations && run_guest)
+    {
+        create_iterations(nr_iterations, find_option(argc, argv, "-inputs"), find_option(argc, argv, "-seed"),
+                          find_option(argc, argv, "-crashes"));
+    }
+
+    char *fork_socket = find_option(argc, argv, "-fork-server");
+    if (fork_socket && run_guest)
+    {
+        start_fork_server(fork_socket);
+    }
+
+    char *checkpoint_path = find_option(argc, argv, "-checkpoint");
+    char *migrate_path = find_option(argc, argv, "-migrate");
+    if ((checkpoint_path || migrate_path) && run_guest)
+    {
+        const char *option = checkpoint_path ? "-checkpoint" : "-migrate";
+
+        if (checkpoint_path && migrate_path)
+        {
+            errx(1, "VMM: -checkpoint and -migrate can't be used together");
+        }
+
+        if (iterations || fork_server || find_option(argc, argv, "-record-exits"))
+        {
+            errx(1, "VMM: %s can't be used with -iterations, -fork-server or -record-exits", option);
+        }
+
+        for (int i = 0; i < nr_drives; i++)
+        {
+            // Their host threads write guest memory behind the dirty log's back
+            if (drives[i].poll || drives[i].socket)
+            {
+                errx(1, "VMM: %s can't be used with polled or out-of-process PV queues", option);
+            }
+        }
+
+        char *dirty_log = find_option(argc, argv, "-dirty-log");
+        if (dirty_log && strcmp(dirty_log, "ring") != 0 && strcmp(dirty_log, "bitmap") != 0)
+        {
+            errx(1, "VMM: invalid -dirty-log %s", dirty_log);
+        }
+
+        dirty_ring = !dirty_log || strcmp(dirty_log, "ring") == 0;
+
+        if (checkpoint_path)
+        {
+            checkpoints = create_checkpoints(sizeof(device_state_t));
+        }
+    }
+
+    // The source flushes its disks before the destination runs the guest, but
+    // the destination opens them at start: only raw images, as they are,
+    // have nothing cached or recreated on its side
+    if ((migrate_path || find_option(argc, argv, "-incoming")) && run_guest)
+    {
+        for (int i = 0; i < nr_drives; i++)
+        {
+            disk_config_t *config = &drives[i].config;
+
+            if (!drives[i].socket && ((config->format != DISK_FORMAT_AUTO && config->format != DISK_FORMAT_RAW) ||
+                                      config->backing || config->clone || config->dedup_store))
+            {
+                errx(1, "VMM: migrated disks must be raw images, without -backing, -disk-clone or -dedup-store");
+            }
+        }
+    }
+
+    attach_drives();
+
+    if (replay_log)
+    {
+        return replay_exits(replay, find_option(argc, argv, "-serial"));
+    }
+
+    if (!fork_server)
+    {
+        window = gfx_create(guest_binary, VGA_XRES * FONT_WIDTH, VGA_YRES * FONT_HEIGHT);
+
+        if (!window)
+        {
+            perror("gfx_create failed");
+            return EXIT_FAILURE;
+        }
+
+        printf("sdl2 window created with width %d and height %d\n", window->width, window->height);
+    }
+
+    boot_mode_t boot_mode;
+    uint64_t mem_size;
+    const cpu_model_t *cpu;
+    parse_vm_options(argc, argv, &boot_mode, &mem_size, &cpu);
+
+    if (migrate_path)
+    {
+        char *delay = find_option(argc, argv, "-migrate-ms");
+        migrate_delay_ms = delay ? atoi(delay) : migrate_delay_ms;
+
+        if (migrate_delay_ms < 0)
+        {
+            errx(1, "VMM: invalid -migrate-ms %s", delay);
+        }
+
+        // The destination listens first
+        migration = create_migration(connect_unix_socket(migrate_path), mem_size, sizeof(device_state_t));
+    }
+
+    vm_t *vm = vm_create(guest_binary, boot_mode, mem_size, cpu);
+
+    ps2 = create_ps2(vm->vmfd);
+
+    char *serial_dest = find_option(argc, argv, "-serial");
+    if (serial_dest)
+    {
+        if (fork_server && strcmp(serial_dest, "stdio") == 0)
+        {
+            errx(1, "VMM: -fork-server clones can't share stdin, use -serial <file>");
+        }
+
+        serial = create_serial(serial_dest, vm->vmfd);
+        serial_set_guest_mem(serial, vm->guest_mem, vm->guest_mem_size);
+    }
+
+    for (int i = 0; i < HYPERCALL_MAX_QUEUES; i++)
+    {
+        if (pv_queues[i])
+        {
+            hypercall_host_set_guest_mem(pv_queues[i], vm->guest_mem, vm->guest_mem_size);
+        }
+    }
+
+    for (int i = 0; i < nr_drives; i++)
+    {
+        drive_t *drive = &drives[i];
+
+        if (drive->socket)
+        {
+            int doorbell = eventfd(0, EFD_CLOEXEC);
+            if (doorbell < 0)
+            {
+                err(1, "VMM: eventfd");
+            }
+
+            register_doorbell(vm, drive->pv_queue, doorbell);
+            drive->backend = connect_blk_backend(drive->socket, drive->pv_queue, drive->poll_cpu, vm->guest_memfd,
+                                                 vm->guest_mem_size, hypercall_fd, doorbell);
+            close(doorbell); // KVM and the backend hold it
+        }
+        else if (drive->poll)
+        {
+            hypercall_host_t *host = pv_queues[drive->pv_queue];
+            hypercall_host_start_polling(host, pv_area(drive->pv_queue), drive->poll_cpu);
+            register_doorbell(vm, drive->pv_queue, host->doorbell);
+        }
+    }
+
+    char *restore_path = find_option(argc, argv, "-restore");
+    if (restore_path)
+    {
+        restore_checkpoint(vm, restore_path, find_option(argc, argv, "-restore-index"));
+    }
+
+    char *incoming_path = find_option(argc, argv, "-incoming");
+    if (incoming_path)
+    {
+        if (restore_path || iterations || fork_server)
+        {
+            errx(1, "VMM: -incoming can't be used with -restore, -iterations or -fork-server");
+        }
+
+        receive_migration(vm, incoming_path);
+    }
+
+    if (migration)
+    {
+        add_migration_regions(vm, migration);
+        printf("migration: to %s in %d ms\n", migrate_path, migrate_delay_ms);
+    }
+
+    if (checkpoints)
+    {
+        start_checkpoints(vm, checkpoint_path, find_option(argc, argv, "-checkpoint-ms"),
+                          find_option(argc, argv, "-checkpoint-keep"));
+    }
+
+    char *profile_path = find_option(argc, argv, "-profile-guest");
+    if (profile_path && fork_server)
+    {
+        errx(1, "VMM: -profile-guest and -fork-server can't be used together");
+    }
+
+    if (profile_path)
+    {
+        start_profiling(vm, profile_path, guest_binary, find_option(argc, argv, "-profile-symbols"),
+                        find_option(argc, argv, "-profile-hz"));
+    }
+
+    char *exit_log_path = find_option(argc, argv, "-record-exits");
+    if (exit_log_path)
+    {
+        start_recording(vm, exit_log_path);
+    }
+
+    if (fork_server)
+    {
+        serve_clones(vm, cpu);
+    }
+    else if (run_in_window(vm) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (exit_log)
+    {
+        destroy_exit_log(exit_log);
+    }
+
+    if (profiler)
+    {
+        destroy_profile(profiler);
+    }
+
+    if (iterations)
+    {
+        destroy_iterations();
+    }
+
+    if (fork_server)
+    {
+        if (snapshot)
+            destroy_snapshot(snapshot);
+
+        destroy_fork_server(fork_server);
+    }
+
+    if (checkpoints)
+    {
+        destroy_checkpoints(checkpoints);
+    }
+
+    if (migration)
+    {
+        destroy_migration(migration);
+    }
 
     vm_destroy(vm);
     printf("vm destroyed\n");
 
-    gfx_destroy(window);
+    if (serial)
+    {
+        destroy_serial(serial);
+    }
+    destroy_ps2(ps2);
+
+    if (window)
+    {
+        gfx_destroy(window);
+    }
     munmap(fb, fb_size);
     printf("gfx destroyed\n");
 
-    destroy_ide_state_machine(machine);
-    printf("ide state machine destroyed\n");
-
-    destroy_hypercall_host(hypercall_host);
-    printf("hypercall host destroyed\n");
-
-    return EXIT_SUCCESS;
+    return destroy_drives();
 }
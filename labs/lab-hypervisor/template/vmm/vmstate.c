@@ -0,0 +1,104 @@
+#include <err.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "vmstate.h"
+
+// MSRs guests may change, kept if KVM has them
+static const uint32_t state_msrs[] = {
+    0x00000010, // TSC
+    0x00000174, // SYSENTER_CS
+    0x00000175, // SYSENTER_ESP
+    0x00000176, // SYSENTER_EIP
+    0xC0000081, // STAR
+    0xC0000082, // LSTAR
+    0xC0000083, // CSTAR
+    0xC0000084, // SFMASK
+    0xC0000102, // KERNEL_GS_BASE
+    0x4B564D01, // KVM_SYSTEM_TIME_NEW
+};
+
+static void vm_state_ioctl(int fd, unsigned long request, void *arg, const char *name)
+{
+    if (ioctl(fd, request, arg) < 0)
+    {
+        err(1, "VMM: %s", name);
+    }
+}
+
+// Finds which of the MSRs KVM has
+void vm_state_init(vm_state_t *state, int vcpufd)
+{
+    memset(state, 0, sizeof(vm_state_t));
+
+    for (unsigned i = 0; i < sizeof(state_msrs) / sizeof(state_msrs[0]); i++)
+    {
+        struct
+        {
+            struct kvm_msrs header;
+            struct kvm_msr_entry entry;
+        } msr = {.header.nmsrs = 1, .entry.index = state_msrs[i]};
+
+        if (ioctl(vcpufd, KVM_GET_MSRS, &msr) == 1)
+        {
+            state->msrs.entries[state->msrs.header.nmsrs++].index = state_msrs[i];
+        }
+    }
+}
+
+// Called with the vCPU out of KVM_RUN, its last exit completed
+void vm_state_save(vm_state_t *state, int vmfd, int vcpufd)
+{
+    vm_state_ioctl(vcpufd, KVM_GET_REGS, &state->regs, "KVM_GET_REGS");
+    vm_state_ioctl(vcpufd, KVM_GET_SREGS, &state->sregs, "KVM_GET_SREGS");
+    save_fpu_state(vcpufd, &state->fpu);
+
+    if (ioctl(vcpufd, KVM_GET_MSRS, &state->msrs) != (int)state->msrs.header.nmsrs)
+    {
+        err(1, "VMM: KVM_GET_MSRS");
+    }
+
+    vm_state_ioctl(vcpufd, KVM_GET_MP_STATE, &state->mp_state, "KVM_GET_MP_STATE");
+    vm_state_ioctl(vcpufd, KVM_GET_LAPIC, &state->lapic, "KVM_GET_LAPIC");
+    vm_state_ioctl(vcpufd, KVM_GET_VCPU_EVENTS, &state->events, "KVM_GET_VCPU_EVENTS");
+    state->events.flags |= KVM_VCPUEVENT_VALID_NMI_PENDING;
+    vm_state_ioctl(vcpufd, KVM_GET_DEBUGREGS, &state->debugregs, "KVM_GET_DEBUGREGS");
+
+    for (int i = 0; i < 3; i++)
+    {
+        state->irqchips[i].chip_id = i;
+        vm_state_ioctl(vmfd, KVM_GET_IRQCHIP, &state->irqchips[i], "KVM_GET_IRQCHIP");
+    }
+
+    vm_state_ioctl(vmfd, KVM_GET_PIT2, &state->pit, "KVM_GET_PIT2");
+    vm_state_ioctl(vmfd, KVM_GET_CLOCK, &state->clock, "KVM_GET_CLOCK");
+    state->clock.flags = 0; // the guest's clock goes back to the saved time
+}
+
+void vm_state_restore(const vm_state_t *state, int vmfd, int vcpufd, struct kvm_run *run)
+{
+    // Interrupt controllers and timer first, like on a migration
+    for (int i = 0; i < 3; i++)
+    {
+        vm_state_ioctl(vmfd, KVM_SET_IRQCHIP, (void *)&state->irqchips[i], "KVM_SET_IRQCHIP");
+    }
+
+    vm_state_ioctl(vmfd, KVM_SET_PIT2, (void *)&state->pit, "KVM_SET_PIT2");
+    vm_state_ioctl(vmfd, KVM_SET_CLOCK, (void *)&state->clock, "KVM_SET_CLOCK");
+
+    // Registers the VMM changed at the last exit would override these
+    run->kvm_dirty_regs = 0;
+
+    vm_state_ioctl(vcpufd, KVM_SET_REGS, (void *)&state->regs, "KVM_SET_REGS");
+    restore_fpu_state(vcpufd, &state->fpu);
+    vm_state_ioctl(vcpufd, KVM_SET_SREGS, (void *)&state->sregs, "KVM_SET_SREGS");
+
+    if (ioctl(vcpufd, KVM_SET_MSRS, &state->msrs) != (int)state->msrs.header.nmsrs)
+    {
+        err(1, "VMM: KVM_SET_MSRS");
+    }
+
+    vm_state_ioctl(vcpufd, KVM_SET_MP_STATE, (void *)&state->mp_state, "KVM_SET_MP_STATE");
+    vm_state_ioctl(vcpufd, KVM_SET_LAPIC, (void *)&state->lapic, "KVM_SET_LAPIC");
+    vm_state_ioctl(vcpufd, KVM_SET_VCPU_EVENTS, (void *)&state->events, "KVM_SET_VCPU_EVENTS");
+    vm_state_ioctl(vcpufd, KVM_SET_DEBUGREGS, (void *)&state->debugregs, "KVM_SET_DEBUGREGS");
+}
@@ -0,0 +1,36 @@
+#ifndef _VMSTATE_H_
+#define _VMSTATE_H_
+
+#include <linux/kvm.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define VM_STATE_MAX_MSRS 16
+
+// State of the vCPU and of the in-kernel interrupt controllers, timer and
+// clock: what a VM is besides its memory and the VMM's device models. It has
+// no pointers, so it can be written to a file and read back by another VMM.
+typedef struct vm_state
+{
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    fpu_state_t fpu;
+    struct
+    {
+        struct kvm_msrs header;
+        struct kvm_msr_entry entries[VM_STATE_MAX_MSRS];
+    } msrs;
+    struct kvm_mp_state mp_state;
+    struct kvm_lapic_state lapic;
+    struct kvm_vcpu_events events;
+    struct kvm_debugregs debugregs;
+    struct kvm_irqchip irqchips[3]; // master PIC, slave PIC, IOAPIC
+    struct kvm_pit_state2 pit;
+    struct kvm_clock_data clock;
+} vm_state_t;
+
+void vm_state_init(vm_state_t *state, int vcpufd);
+void vm_state_save(vm_state_t *state, int vmfd, int vcpufd);
+void vm_state_restore(const vm_state_t *state, int vmfd, int vcpufd, struct kvm_run *run);
+
+#endif